@@ -0,0 +1,21 @@
+
+//
+// bench.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include "bench.h"
+
+/*
+ * Run the benchmarks.
+ */
+
+int
+main(int argc, const char **argv) {
+  bench_dispatch();
+  bench_gc();
+  bench_object();
+  bench_parse();
+  return 0;
+}
@@ -0,0 +1,25 @@
+
+//
+// bench.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_BENCH_H
+#define LUNA_BENCH_H
+
+// protos
+
+void
+bench_dispatch();
+
+void
+bench_gc();
+
+void
+bench_object();
+
+void
+bench_parse();
+
+#endif /* LUNA_BENCH_H */
@@ -0,0 +1,161 @@
+
+//
+// dispatch.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "errors.h"
+#include "lexer.h"
+#include "parser.h"
+#include "infer.h"
+#include "codegen.h"
+#include "bench.h"
+
+/*
+ * Calls made per polymorphic call site.
+ */
+
+#define ITERATIONS 200000
+
+/*
+ * Parameter types of the generated overloads.
+ */
+
+static const char *types[] = { "int", "float", "bool" };
+
+/*
+ * Literals of each type.
+ */
+
+static const char *literals[] = { "1", "1.5", "true" };
+
+#define NTYPES (sizeof(types) / sizeof(*types))
+
+/*
+ * Source buffer.
+ */
+
+static char source[256 * 1024];
+static size_t len;
+
+/*
+ * Append formatted output to the source.
+ */
+
+#define append(...) \
+  (len += snprintf(source + len, sizeof(source) - len, __VA_ARGS__))
+
+/*
+ * Append the argument list for overload `n` of `arity`,
+ * each param typed `types[n % NTYPES]` in turn.
+ */
+
+static void
+signature(int n, int arity, int typed) {
+  for (int i = 0; i < arity; ++i, n /= NTYPES) {
+    if (i) append(", ");
+    append("a%d", i);
+    if (typed) append(":%s", types[n % NTYPES]);
+  }
+}
+
+/*
+ * Append the literals of type tuple `n` of `arity`.
+ */
+
+static void
+args(int n, int arity) {
+  for (int i = 0; i < arity; ++i, n /= NTYPES) {
+    if (i) append(", ");
+    append("%s", literals[n % NTYPES]);
+  }
+}
+
+/*
+ * Generate a program defining `f` overloaded for every
+ * tuple of `arity` types along with an untyped fallback,
+ * and calling it through the untyped `g` for each tuple,
+ * so that the call site in `g` only resolves at runtime.
+ */
+
+static int
+generate(int arity) {
+  int overloads = 1;
+  for (int i = 0; i < arity; ++i) overloads *= NTYPES;
+
+  len = 0;
+  for (int n = 0; n < overloads; ++n) {
+    append("def f(");
+    signature(n, arity, 1);
+    append(")\n  return %d\nend\n", n);
+  }
+
+  append("def f(");
+  signature(0, arity, 0);
+  append(")\n  return -1\nend\n");
+
+  append("def g(");
+  signature(0, arity, 0);
+  append(")\n  return f(");
+  signature(0, arity, 0);
+  append(")\nend\n");
+
+  append("i = 0\nwhile i < %d\n", ITERATIONS);
+  for (int n = 0; n < overloads; ++n) {
+    append("  g(");
+    args(n, arity);
+    append(")\n");
+  }
+  append("  i++\nend\n");
+
+  return overloads;
+}
+
+/*
+ * Compile and run the generated program for `arity`.
+ */
+
+static void
+bench(int arity) {
+  luna_lexer_t lexer;
+  luna_parser_t parser;
+  luna_block_node_t *root;
+
+  int overloads = generate(arity);
+  luna_lexer_init(&lexer, source, "bench");
+  luna_parser_init(&parser, &lexer);
+
+  if (!(root = luna_parse(&parser))) {
+    luna_report_error(&parser);
+    exit(1);
+  }
+
+  luna_infer((luna_node_t *) root);
+  luna_vm_t *vm = luna_gen((luna_node_t *) root);
+
+  clock_t start = clock();
+  luna_eval(vm);
+  double elapsed = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+  double calls = (double) ITERATIONS * overloads;
+  printf("  %d args, %3d overloads: %8.0f ns/call\n", arity, overloads + 1, elapsed * 1e9 / calls);
+  luna_vm_free(vm);
+}
+
+/*
+ * Run the dispatch benchmarks.
+ */
+
+void
+bench_dispatch() {
+  printf("\n  dispatch\n\n");
+  bench(2);
+  bench(3);
+  bench(4);
+  printf("\n");
+}
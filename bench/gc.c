@@ -0,0 +1,117 @@
+
+//
+// gc.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "errors.h"
+#include "lexer.h"
+#include "parser.h"
+#include "infer.h"
+#include "codegen.h"
+#include "bench.h"
+
+/*
+ * Iterations of each allocation loop.
+ */
+
+#define ITERATIONS 1000000
+
+/*
+ * Allocation heavy programs, closures dying young
+ * while a few long lived ones are retained.
+ */
+
+static const char *programs[][2] = {
+  { "closures",
+    "i = 0\n"
+    "while i < %d\n"
+    "  f = :x\n    return x + i\n  end\n"
+    "  f(1)\n"
+    "  i++\n"
+    "end\n" },
+  { "cells",
+    "i = 0\n"
+    "while i < %d\n"
+    "  n = 0\n"
+    "  inc = :\n    n++\n  end\n"
+    "  inc()\n"
+    "  i++\n"
+    "end\n" },
+  { "retained",
+    "a = :\n  return 0\nend\n"
+    "b = a\n"
+    "c = a\n"
+    "i = 0\n"
+    "while i < %d\n"
+    "  f = :\n    return i\n  end\n"
+    "  if i % 1000 == 0\n    c = b\n    b = a\n    a = f\n  end\n"
+    "  i++\n"
+    "end\n" }
+};
+
+/*
+ * Source buffer.
+ */
+
+static char source[4096];
+
+/*
+ * Compile and run `program` with a `nursery` byte
+ * nursery, returning the elapsed seconds.
+ */
+
+static double
+run(const char *program, long nursery, luna_gc_stats_t *stats) {
+  luna_lexer_t lexer;
+  luna_parser_t parser;
+  luna_block_node_t *root;
+
+  snprintf(source, sizeof(source), program, ITERATIONS);
+  luna_lexer_init(&lexer, source, "bench");
+  luna_parser_init(&parser, &lexer);
+
+  if (!(root = luna_parse(&parser))) {
+    luna_report_error(&parser);
+    exit(1);
+  }
+
+  luna_infer((luna_node_t *) root);
+  luna_gen_options_t options = { .nursery = nursery };
+  luna_vm_t *vm = luna_gen_with((luna_node_t *) root, &options);
+
+  clock_t start = clock();
+  luna_eval(vm);
+  double elapsed = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+  *stats = vm->gc.stats;
+  luna_vm_free(vm);
+  return elapsed;
+}
+
+/*
+ * Compare each program with and without a nursery.
+ */
+
+void
+bench_gc() {
+  luna_gc_stats_t marksweep, generational;
+  int n = sizeof(programs) / sizeof(*programs);
+
+  printf("\n  gc\n\n");
+  for (int i = 0; i < n; ++i) {
+    double a = run(programs[i][1], -1, &marksweep);
+    double b = run(programs[i][1], 0, &generational);
+    printf("  %-10s mark-sweep: %6.0f ns/iter %6.3fms paused"
+      "   generational: %6.0f ns/iter %6.3fms paused  (%.2fx)\n",
+      programs[i][0],
+      a * 1e9 / ITERATIONS, marksweep.pause * 1e3,
+      b * 1e9 / ITERATIONS, generational.pause * 1e3,
+      a / b);
+  }
+  printf("\n");
+}
@@ -0,0 +1,86 @@
+
+//
+// object.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "object.h"
+#include "bench.h"
+
+/*
+ * Loads made per field count.
+ */
+
+#define ITERATIONS 10000000
+
+/*
+ * Field names, interned by `bench_object()`.
+ */
+
+static const char *keys[] = {
+  "x", "y", "z", "w", "width", "height", "left", "top",
+  "name", "parent", "next", "prev", "count", "flags", "data", "id"
+};
+
+#define NKEYS (sizeof(keys) / sizeof(*keys))
+
+/*
+ * Sink keeping the loads live.
+ */
+
+static volatile luna_value_t sink;
+
+/*
+ * Compare a hash probe with a cached load of
+ * the last of `n` fields.
+ */
+
+static void
+bench(int n) {
+  luna_shape_t *root = luna_shape_new();
+  luna_object_t *obj = malloc(luna_object_size(n));
+  luna_hash_t *hash = luna_hash_new();
+  luna_cache_t cache = { 0 };
+
+  luna_object_init(obj, root, n);
+  for (int i = 0; i < n; ++i) {
+    *luna_object_put(obj, keys[i], &cache) = luna_value_int(i);
+    luna_hash_set(hash, (char *) keys[i], luna_value_int(i));
+  }
+
+  const char *key = keys[n - 1];
+  luna_cache_t load = { 0 };
+
+  clock_t start = clock();
+  for (int i = 0; i < ITERATIONS; ++i) sink = luna_hash_get(hash, (char *) key);
+  double probe = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+  start = clock();
+  for (int i = 0; i < ITERATIONS; ++i) sink = luna_object_get(obj, key, &load);
+  double cached = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+  printf("  %2d fields  hash: %5.1f ns/load   shape: %5.1f ns/load  (%.2fx)\n",
+    n, probe * 1e9 / ITERATIONS, cached * 1e9 / ITERATIONS, probe / cached);
+
+  luna_hash_destroy(hash);
+  free(obj);
+  luna_shape_free(root);
+}
+
+/*
+ * Run the object benchmarks.
+ */
+
+void
+bench_object() {
+  for (int i = 0; i < NKEYS; ++i) keys[i] = luna_intern(keys[i]);
+  printf("\n  object\n\n");
+  bench(2);
+  bench(8);
+  bench(NKEYS);
+  printf("\n");
+}
@@ -0,0 +1,117 @@
+
+//
+// parse.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include "parser.h"
+#include "errors.h"
+#include "bench.h"
+
+/*
+ * Definitions and calls in the corpus.
+ */
+
+#define DEFINITIONS 8000
+
+/*
+ * Runs, of which the best is reported.
+ */
+
+#define RUNS 10
+
+/*
+ * Definition and call emitted per index.
+ */
+
+static const char *definition =
+  "def fn_%d(a:int, b:int):int\n"
+  "  if a > %d\n"
+  "    return fn_%d(a - b, b)\n"
+  "  end\n"
+  "  return a\n"
+  "end\n"
+  "fn_%d(1, 2)\n";
+
+/*
+ * Generate the corpus, returning its length.
+ */
+
+static char *
+corpus(size_t *len) {
+  size_t size = DEFINITIONS * 128;
+  char *buf = malloc(size);
+  size_t n = 0;
+  for (int i = 0; i < DEFINITIONS; ++i) {
+    n += snprintf(buf + n, size - n, definition, i, i, i ? i - 1 : 0, i);
+  }
+  *len = n;
+  return buf;
+}
+
+/*
+ * Bytes of heap in use.
+ */
+
+static size_t
+heap() {
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
+
+/*
+ * Parse a copy of `source`, as the lexer scans in place,
+ * returning the elapsed seconds and the heap it retains.
+ * The tree is leaked, as there is no way to free it.
+ */
+
+static double
+run(const char *source, size_t len, size_t *retained) {
+  luna_lexer_t lexer;
+  luna_parser_t parser;
+  char *buf = malloc(len + 1);
+  memcpy(buf, source, len + 1);
+
+  size_t before = heap();
+  luna_lexer_init(&lexer, buf, "bench");
+  luna_parser_init(&parser, &lexer);
+
+  clock_t start = clock();
+  luna_block_node_t *root = luna_parse(&parser);
+  double elapsed = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+  if (!root) {
+    luna_report_error(&parser);
+    exit(1);
+  }
+
+  *retained = heap() - before;
+  return elapsed;
+}
+
+/*
+ * Parse the corpus, reporting the best time.
+ */
+
+void
+bench_parse() {
+  size_t len, retained;
+  double best = 0;
+  char *source = corpus(&len);
+
+  printf("\n  parse\n\n");
+  for (int i = 0; i < RUNS; ++i) {
+    double elapsed = run(source, len, &retained);
+    if (!i || elapsed < best) best = elapsed;
+  }
+  printf("  %d definitions, %zuKB: %6.1fms %6.2fMB retained\n",
+    DEFINITIONS, len / 1000, best * 1e3, retained / 1e6);
+  printf("\n");
+  free(source);
+}
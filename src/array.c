@@ -0,0 +1,301 @@
+
+//
+// array.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "array.h"
+
+/*
+ * Initialize columnar array `self` of `length` records of
+ * `layout`, their unboxed fields zero and values nil.
+ * Unboxed columns are left to the allocator to zero,
+ * untouched until used.
+ */
+
+void
+luna_array_init(luna_array_t *self, luna_layout_t *layout, int length) {
+  self->kind = LUNA_ARRAY_COLUMNS;
+  self->length = self->capacity = length;
+  self->layout = layout;
+  for (int i = 0; i < layout->nfields; ++i) {
+    switch (layout->fields[i].kind) {
+      case LUNA_FIELD_INT:
+        self->columns[i] = calloc(length ? length : 1, sizeof(int32_t));
+        break;
+      case LUNA_FIELD_FLOAT:
+        self->columns[i] = calloc(length ? length : 1, sizeof(double));
+        break;
+      default: {
+        luna_value_t *column = malloc((length ? length : 1) * sizeof(luna_value_t));
+        for (int j = 0; j < length; ++j) column[j] = LUNA_VALUE_NIL;
+        self->columns[i] = column;
+      }
+    }
+  }
+}
+
+/*
+ * Initialize `self` as an empty packed array with
+ * room for `capacity` elements, of ints until
+ * it has any.
+ */
+
+void
+luna_array_init_packed(luna_array_t *self, int capacity) {
+  self->kind = LUNA_ARRAY_INTS;
+  self->length = 0;
+  self->capacity = capacity ? capacity : 1;
+  self->layout = NULL;
+  self->columns[0] = malloc(self->capacity * sizeof(int32_t));
+}
+
+/*
+ * Free the columns of `self`.
+ */
+
+void
+luna_array_destroy(luna_array_t *self) {
+  if (!self->layout) {
+    free(self->columns[0]);
+    return;
+  }
+
+  for (int i = 0; i < self->layout->nfields; ++i) {
+    free(self->columns[i]);
+  }
+}
+
+/*
+ * Property `key` of `self`, its `length` or nil.
+ */
+
+luna_value_t
+luna_array_get(luna_array_t *self, const char *key) {
+  if (0 == strcmp("length", key)) return luna_value_int(self->length);
+  return LUNA_VALUE_NIL;
+}
+
+/*
+ * Boxed value of `field` of element `index` of `self`.
+ */
+
+luna_value_t
+luna_array_load(luna_array_t *self, int field, int index) {
+  switch (self->layout->fields[field].kind) {
+    case LUNA_FIELD_INT:
+      return luna_value_int(LUNA_ARRAY_COLUMN(self, int32_t, field)[index]);
+    case LUNA_FIELD_FLOAT:
+      return luna_value_float(LUNA_ARRAY_COLUMN(self, double, field)[index]);
+    default:
+      return __atomic_load_n(&LUNA_ARRAY_COLUMN(self, luna_value_t, field)[index], __ATOMIC_ACQUIRE);
+  }
+}
+
+/*
+ * Store `val` converted to unboxed `field` of element
+ * `index` of `self` and return NULL. The location of
+ * value fields is returned instead, for the caller
+ * to store through its write barrier.
+ */
+
+luna_value_t *
+luna_array_store(luna_array_t *self, int field, int index, luna_value_t val) {
+  switch (self->layout->fields[field].kind) {
+    case LUNA_FIELD_INT:
+      LUNA_ARRAY_COLUMN(self, int32_t, field)[index] = luna_record_int(val);
+      return NULL;
+    case LUNA_FIELD_FLOAT:
+      LUNA_ARRAY_COLUMN(self, double, field)[index] = luna_record_float(val);
+      return NULL;
+    default:
+      return &LUNA_ARRAY_COLUMN(self, luna_value_t, field)[index];
+  }
+}
+
+/*
+ * Value of `field` of `val` when stored as an element of
+ * `self`, that of a record of its layout, otherwise the
+ * zero value of the field.
+ */
+
+luna_value_t
+luna_array_element(luna_array_t *self, int field, luna_value_t val) {
+  luna_field_t *f = &self->layout->fields[field];
+  if (luna_is_record(val) && luna_record_layout((luna_record_t *) luna_as_pointer(val)) == self->layout) {
+    return luna_record_get(luna_as_pointer(val), f);
+  }
+
+  switch (f->kind) {
+    case LUNA_FIELD_INT: return luna_value_int(0);
+    case LUNA_FIELD_FLOAT: return luna_value_float(0);
+    default: return LUNA_VALUE_NIL;
+  }
+}
+
+/*
+ * Initialize `self` as a view of element `index` of `array`.
+ */
+
+void
+luna_view_init(luna_view_t *self, luna_value_t array, int index) {
+  luna_array_t *arr = luna_as_pointer(array);
+  self->layout = (luna_layout_t *) ((uintptr_t) arr->layout | LUNA_RECORD_VIEW);
+  self->array = array;
+  self->index = index;
+}
+
+/*
+ * Return the column of the field at `offset` of view `self`.
+ */
+
+static int
+column(luna_record_t *self, int offset) {
+  luna_layout_t *layout = luna_record_layout(self);
+  int i = 0;
+  while (layout->fields[i].offset != offset) ++i;
+  return i;
+}
+
+/*
+ * Boxed value of the field at `offset` of view `self`.
+ */
+
+luna_value_t
+luna_view_load(luna_record_t *self, int offset) {
+  luna_view_t *view = (luna_view_t *) self;
+  return luna_array_load(luna_as_pointer(view->array), column(self, offset), view->index);
+}
+
+/*
+ * Store `val` to the field at `offset` of view `self`,
+ * as luna_array_store().
+ */
+
+luna_value_t *
+luna_view_store(luna_record_t *self, int offset, luna_value_t val) {
+  luna_view_t *view = (luna_view_t *) self;
+  return luna_array_store(luna_as_pointer(view->array), column(self, offset), view->index, val);
+}
+
+/*
+ * Size of `n` elements of packed `kind`.
+ */
+
+static size_t
+size(luna_array_kind kind, int n) {
+  switch (kind) {
+    case LUNA_ARRAY_INTS: return n * sizeof(int32_t);
+    case LUNA_ARRAY_FLOATS: return n * sizeof(double);
+    case LUNA_ARRAY_BOOLS: return (n + 7) / 8;
+    default: return n * sizeof(luna_value_t);
+  }
+}
+
+/*
+ * Kind of packed array `val` conforms to.
+ */
+
+static luna_array_kind
+conforming(luna_value_t val) {
+  if (luna_is_int(val)) return LUNA_ARRAY_INTS;
+  if (luna_is_float(val)) return LUNA_ARRAY_FLOATS;
+  if (luna_is_bool(val)) return LUNA_ARRAY_BOOLS;
+  return LUNA_ARRAY_VALUES;
+}
+
+/*
+ * Boxed element `index` of packed array `self`,
+ * which must be in range.
+ */
+
+luna_value_t
+luna_array_at(luna_array_t *self, int index) {
+  void *elements = self->columns[0];
+  switch (self->kind) {
+    case LUNA_ARRAY_INTS:
+      return luna_value_int(((int32_t *) elements)[index]);
+    case LUNA_ARRAY_FLOATS:
+      return luna_value_float(((double *) elements)[index]);
+    case LUNA_ARRAY_BOOLS:
+      return luna_value_bool(((uint8_t *) elements)[index / 8] & (1 << index % 8));
+    default:
+      return __atomic_load_n(&((luna_value_t *) elements)[index], __ATOMIC_ACQUIRE);
+  }
+}
+
+/*
+ * Repack the elements of `self` as `kind`
+ * with room for `capacity` of them.
+ */
+
+static void
+repack(luna_array_t *self, luna_array_kind kind, int capacity) {
+  if (kind == self->kind) {
+    self->columns[0] = realloc(self->columns[0], size(kind, capacity));
+    self->capacity = capacity;
+    return;
+  }
+
+  // only arrays of values hold other kinds
+  luna_value_t *elements = malloc(size(kind, capacity));
+  for (int i = 0; i < self->length; ++i) {
+    elements[i] = luna_array_at(self, i);
+  }
+  free(self->columns[0]);
+  self->columns[0] = elements;
+  self->capacity = capacity;
+  self->kind = kind;
+}
+
+/*
+ * Store `val` to element `index` of packed array `self`,
+ * in range or its length to append, and return NULL.
+ * An empty array takes the kind of `val`, otherwise a
+ * non-conforming one turns it into an array of values.
+ * The location of values is returned instead, for
+ * the caller to store through its write barrier.
+ */
+
+luna_value_t *
+luna_array_put(luna_array_t *self, int index, luna_value_t val) {
+  luna_array_kind kind = conforming(val);
+  if (!self->length) {
+    if (kind != self->kind) {
+      free(self->columns[0]);
+      self->columns[0] = malloc(size(kind, self->capacity));
+      self->kind = kind;
+    }
+  } else if (kind != self->kind && LUNA_ARRAY_VALUES != self->kind) {
+    repack(self, LUNA_ARRAY_VALUES, self->capacity);
+  }
+
+  if (index == self->length) {
+    if (index == self->capacity) repack(self, self->kind, self->capacity * 2);
+    if (LUNA_ARRAY_VALUES == self->kind) {
+      ((luna_value_t *) self->columns[0])[index] = LUNA_VALUE_NIL;
+    }
+    ++self->length;
+  }
+
+  void *elements = self->columns[0];
+  switch (self->kind) {
+    case LUNA_ARRAY_INTS:
+      ((int32_t *) elements)[index] = luna_as_int(val);
+      return NULL;
+    case LUNA_ARRAY_FLOATS:
+      ((double *) elements)[index] = luna_as_double(val);
+      return NULL;
+    case LUNA_ARRAY_BOOLS: {
+      uint8_t *byte = &((uint8_t *) elements)[index / 8];
+      if (luna_as_int(val)) *byte |= 1 << index % 8;
+      else *byte &= ~(1 << index % 8);
+      return NULL;
+    }
+    default:
+      return &((luna_value_t *) elements)[index];
+  }
+}
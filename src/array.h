@@ -0,0 +1,232 @@
+
+//
+// array.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_ARRAY_H
+#define LUNA_ARRAY_H
+
+#include "record.h"
+
+/*
+ * Storage of an array.
+ */
+
+typedef enum {
+  LUNA_ARRAY_COLUMNS,
+  LUNA_ARRAY_INTS,
+  LUNA_ARRAY_FLOATS,
+  LUNA_ARRAY_BOOLS,
+  LUNA_ARRAY_VALUES
+} luna_array_kind;
+
+/*
+ * Luna array of `length` elements.
+ *
+ * Columnar arrays hold records of `layout` a field at a
+ * time, each field in a column of its own: a contiguous
+ * vector of unboxed int32s or doubles, or of values, so
+ * that scanning a field reads only its column.
+ *
+ * Other arrays have no layout and pack their elements in
+ * a single column of `capacity`, unboxed while they are
+ * all ints, all floats or all bools, the latter a bit
+ * each. Storing an element of another type turns the
+ * array into one of values for good, so that its kind
+ * only ever changes once it has elements.
+ *
+ * Columns live outside the heap and are freed with
+ * the array.
+ */
+
+typedef struct {
+  luna_array_kind kind;
+  int length;
+  int capacity;
+  luna_layout_t *layout;
+  void *columns[];
+} luna_array_t;
+
+/*
+ * View of element `index` of `array`, a record of its
+ * layout whose fields are stored in the columns.
+ */
+
+typedef struct {
+  luna_layout_t *layout;
+  luna_value_t array;
+  int index;
+} luna_view_t;
+
+/*
+ * Size of an array of records of `layout`.
+ */
+
+#define luna_array_size(layout) (sizeof(luna_array_t) + (layout)->nfields * sizeof(void *))
+
+/*
+ * Size of a packed array.
+ */
+
+#define LUNA_ARRAY_PACKED_SIZE (sizeof(luna_array_t) + sizeof(void *))
+
+/*
+ * Column of field `field` of array `self`, of type `t`.
+ */
+
+#define LUNA_ARRAY_COLUMN(self, t, field) ((t *) (self)->columns[field])
+
+// protos
+
+void
+luna_array_init(luna_array_t *self, luna_layout_t *layout, int length);
+
+void
+luna_array_init_packed(luna_array_t *self, int capacity);
+
+void
+luna_array_destroy(luna_array_t *self);
+
+luna_value_t
+luna_array_get(luna_array_t *self, const char *key);
+
+luna_value_t
+luna_array_load(luna_array_t *self, int field, int index);
+
+luna_value_t *
+luna_array_store(luna_array_t *self, int field, int index, luna_value_t val);
+
+luna_value_t
+luna_array_element(luna_array_t *self, int field, luna_value_t val);
+
+luna_value_t
+luna_array_at(luna_array_t *self, int index);
+
+luna_value_t *
+luna_array_put(luna_array_t *self, int index, luna_value_t val);
+
+void
+luna_view_init(luna_view_t *self, luna_value_t array, int index);
+
+/*
+ * Check `val` is a columnar array of `layout`,
+ * returning nil otherwise.
+ */
+
+static inline luna_value_t
+luna_array_check(luna_value_t val, luna_layout_t *layout) {
+  if (!luna_is_array(val)) return LUNA_VALUE_NIL;
+  return ((luna_array_t *) luna_as_pointer(val))->layout == layout ? val : LUNA_VALUE_NIL;
+}
+
+/*
+ * Index into `arr` of numeric `val`, or -1
+ * when out of range, not a number or nil.
+ */
+
+static inline int
+luna_array_index(luna_value_t arr, luna_value_t val) {
+  luna_array_t *self = luna_as_pointer(arr);
+  if (!self) return -1;
+  if (!luna_is_int(val) && !luna_is_float(val)) return -1;
+  double n = luna_is_int(val) ? luna_as_int(val) : luna_as_double(val);
+  return n >= 0 && n < self->length ? (int) n : -1;
+}
+
+/*
+ * Index into packed `arr` of numeric `val` to store to,
+ * which may be its length to append, or -1 otherwise.
+ */
+
+static inline int
+luna_array_end(luna_value_t arr, luna_value_t val) {
+  luna_array_t *self = luna_as_pointer(arr);
+  if (!luna_is_int(val) && !luna_is_float(val)) return -1;
+  double n = luna_is_int(val) ? luna_as_int(val) : luna_as_double(val);
+  return n >= 0 && n <= self->length ? (int) n : -1;
+}
+
+/*
+ * Loads of column `field` of `arr`, a columnar array of
+ * the layout the field was taken from, or nil, at
+ * `index`. Elements out of range read as zero values.
+ */
+
+static inline luna_value_t
+luna_array_geti(luna_value_t arr, int field, luna_value_t index) {
+  int i = luna_array_index(arr, index);
+  if (i < 0) return luna_value_int(0);
+  return luna_value_int(LUNA_ARRAY_COLUMN((luna_array_t *) luna_as_pointer(arr), int32_t, field)[i]);
+}
+
+static inline luna_value_t
+luna_array_getf(luna_value_t arr, int field, luna_value_t index) {
+  int i = luna_array_index(arr, index);
+  if (i < 0) return luna_value_float(0);
+  return luna_value_float(LUNA_ARRAY_COLUMN((luna_array_t *) luna_as_pointer(arr), double, field)[i]);
+}
+
+static inline luna_value_t
+luna_array_getv(luna_value_t arr, int field, luna_value_t index) {
+  int i = luna_array_index(arr, index);
+  if (i < 0) return LUNA_VALUE_NIL;
+  luna_value_t *column = LUNA_ARRAY_COLUMN((luna_array_t *) luna_as_pointer(arr), luna_value_t, field);
+  return __atomic_load_n(&column[i], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Stores to the unboxed columns of `arr` at `index`,
+ * ignored when out of range.
+ */
+
+static inline void
+luna_array_seti(luna_value_t arr, int field, luna_value_t index, luna_value_t val) {
+  int i = luna_array_index(arr, index);
+  if (i > -1) LUNA_ARRAY_COLUMN((luna_array_t *) luna_as_pointer(arr), int32_t, field)[i] = luna_record_int(val);
+}
+
+static inline void
+luna_array_setf(luna_value_t arr, int field, luna_value_t index, luna_value_t val) {
+  int i = luna_array_index(arr, index);
+  if (i > -1) LUNA_ARRAY_COLUMN((luna_array_t *) luna_as_pointer(arr), double, field)[i] = luna_record_float(val);
+}
+
+/*
+ * Location of value column `field` of `arr` at
+ * `index`, or NULL when out of range.
+ */
+
+static inline luna_value_t *
+luna_array_slot(luna_value_t arr, int field, luna_value_t index) {
+  int i = luna_array_index(arr, index);
+  if (i < 0) return NULL;
+  return &LUNA_ARRAY_COLUMN((luna_array_t *) luna_as_pointer(arr), luna_value_t, field)[i];
+}
+
+/*
+ * Object holding the fields of record `self`,
+ * the array of a view.
+ */
+
+static inline void *
+luna_record_owner(luna_record_t *self) {
+  if (!luna_record_viewed(self)) return self;
+  return luna_as_pointer(((luna_view_t *) self)->array);
+}
+
+/*
+ * Check if records `a` and `b` are views
+ * of the same element.
+ */
+
+static inline int
+luna_view_same(luna_record_t *a, luna_record_t *b) {
+  if (!luna_record_viewed(a) || !luna_record_viewed(b)) return 0;
+  luna_view_t *x = (luna_view_t *) a;
+  luna_view_t *y = (luna_view_t *) b;
+  return x->array == y->array && x->index == y->index;
+}
+
+#endif /* LUNA_ARRAY_H */
@@ -11,16 +11,12 @@
 #include "internal.h"
 
 /*
- * Alloc a luna value and assign the given `node`.
+ * Box the given `node` as a luna value.
  */
 
-luna_object_t *
+luna_value_t
 luna_node(luna_node_t *node) {
-  luna_object_t *self = malloc(sizeof(luna_object_t));
-  if (unlikely(!self)) return NULL;
-  self->type = LUNA_TYPE_NODE;
-  self->value.as_pointer = node;
-  return self;
+  return luna_value_pointer(LUNA_TYPE_NODE, node);
 }
 
 /*
@@ -33,6 +29,8 @@ luna_block_node_new(int lineno) {
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_BLOCK;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->stmts = luna_vec_new();
   return self;
 }
@@ -47,6 +45,8 @@ luna_args_node_new(int lineno) {
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_ARGS;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->vec = luna_vec_new();
   self->hash = luna_hash_new();
   return self;
@@ -62,6 +62,8 @@ luna_int_node_new(int val, int lineno) {
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_INT;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->val = val;
   return self;
 }
@@ -76,6 +78,8 @@ luna_float_node_new(float val, int lineno) {
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_FLOAT;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->val = val;
   return self;
 }
@@ -90,6 +94,8 @@ luna_id_node_new(const char *val, int lineno) {
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_ID;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->val = val;
   return self;
 }
@@ -105,6 +111,8 @@ luna_decl_node_new(luna_vec_t *vec, luna_node_t *type, int lineno) {
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_DECL;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->vec = vec;
   self->type = type;
   return self;
@@ -121,6 +129,8 @@ luna_let_node_new(luna_vec_t *vec, int lineno) {
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_LET;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->vec = vec;
   return self;
 }
@@ -135,6 +145,8 @@ luna_string_node_new(const char *val, int lineno) {
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_STRING;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->val = val;
   return self;
 }
@@ -149,6 +161,8 @@ luna_call_node_new(luna_node_t *expr, int lineno) {
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_CALL;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->expr = expr;
   self->args = luna_args_node_new(lineno);
   if (unlikely(!self->args)) return NULL;
@@ -165,6 +179,8 @@ luna_subscript_node_new(luna_node_t *left, luna_node_t *right, int lineno) {
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_SUBSCRIPT;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->left = left;
   self->right = right;
   return self;
@@ -180,6 +196,8 @@ luna_slot_node_new(luna_node_t *left, luna_node_t *right, int lineno) {
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_SLOT;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->left = left;
   self->right = right;
   return self;
@@ -195,6 +213,8 @@ luna_unary_op_node_new(luna_token op, luna_node_t *expr, int postfix, int lineno
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_UNARY_OP;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->op = op;
   self->expr = expr;
   self->postfix = postfix;
@@ -211,6 +231,8 @@ luna_binary_op_node_new(luna_token op, luna_node_t *left, luna_node_t *right, in
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_BINARY_OP;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->op = op;
   self->left = left;
   self->right = right;
@@ -228,6 +250,8 @@ luna_array_node_new(int lineno) {
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_ARRAY;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->vals = luna_vec_new();
   return self;
 }
@@ -242,6 +266,8 @@ luna_hash_pair_node_new(int lineno) {
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_HASH_PAIR;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->key = NULL;
   self->val = NULL;
   return self;
@@ -257,6 +283,8 @@ luna_hash_node_new(int lineno) {
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_HASH;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->pairs = luna_vec_new();
   return self;
 }
@@ -272,6 +300,8 @@ luna_function_node_new(const char *name, luna_node_t *type, luna_block_node_t *b
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_FUNCTION;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->params = params;
   self->block = block;
   self->type = type;
@@ -290,6 +320,8 @@ luna_function_node_new_from_expr(luna_node_t *expr, luna_vec_t *params, int line
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_FUNCTION;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->params = params;
 
   // block
@@ -313,6 +345,8 @@ luna_type_node_new(const char *name, int lineno) {
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_TYPE;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->name = name;
   self->fields = luna_vec_new();
   return self;
@@ -329,6 +363,8 @@ luna_if_node_new(int negate, luna_node_t *expr, luna_block_node_t *block, int li
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_IF;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->negate = negate;
   self->expr = expr;
   self->block = block;
@@ -348,6 +384,8 @@ luna_while_node_new(int negate, luna_node_t *expr, luna_block_node_t *block, int
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_WHILE;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->negate = negate;
   self->expr = expr;
   self->block = block;
@@ -364,6 +402,8 @@ luna_return_node_new(luna_node_t *expr, int lineno) {
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_RETURN;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->expr = expr;
   return self;
 }
@@ -378,6 +418,8 @@ luna_use_node_new(int lineno) {
   if (unlikely(!self)) return NULL;
   self->base.type = LUNA_NODE_USE;
   self->base.lineno = lineno;
+  self->base.id = 0;
+  self->base.inferred = LUNA_TYPE_ANY;
   self->module = NULL;
   self->alias = NULL;
   return self;
@@ -62,7 +62,9 @@ LUNA_NODE_LIST
 
 typedef struct {
   luna_node_type type;
+  luna_object inferred;
   int lineno;
+  int id; // parse order of profiled nodes, 0 otherwise
 } luna_node_t;
 
 /*
@@ -280,13 +282,13 @@ typedef struct {
 
 typedef struct {
   luna_node_t base;
-  char *module;
-  char *alias;
+  const char *module;
+  const char *alias;
 } luna_use_node_t;
 
 // protos
 
-luna_object_t *
+luna_value_t
 luna_node(luna_node_t *node);
 
 luna_block_node_t *
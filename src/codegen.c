@@ -5,380 +5,2011 @@
 // Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
 //
 
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "ast.h"
 #include "codegen.h"
 #include "internal.h"
 #include "visitor.h"
 #include "opcodes.h"
+#include "dispatch.h"
+
+/*
+ * Int constant `val` as an RK operand.
+ */
 
 // TODO: MSB
-#define CONST(val) \
-  (vm->main->constants[vm->main->nconstants] = val, 32 + vm->main->nconstants++)
+#define CONST(val) constant(gen, luna_value_int(val))
+
+/*
+ * Float constant `val` as an RK operand.
+ */
+
+#define FCONST(val) constant(gen, luna_value_float(val))
+
+/*
+ * String constant `val`, interned, as an RK operand.
+ */
+
+#define SCONST(val) constant(gen, luna_string_new(val))
 
 /*
  * Emit an instruction.
  */
 
-#define emit(op, a, b, c) \
-  *vm->main->code++ = ABC(op, a, b, c);
+#define emit(op, a, b, c) append(gen, ABC(op, a, b, c))
+
+/*
+ * Emit an instruction with a 16 bit operand.
+ */
+
+#define emitx(op, a, bx) append(gen, ABx(op, a, bx))
+
+/*
+ * Current pc.
+ */
+
+#define PC (gen->fn->ncode)
+
+/*
+ * Pending jumps, patched once their target is known.
+ */
+
+typedef kvec_t(int) luna_jumps_t;
+
+/*
+ * Record the line of the instruction about to be emitted.
+ */
+
+static inline void
+mark(luna_codegen_t *gen) {
+  if (gen->lineno) luna_lines_add(&gen->fn->lines, gen->fn->ncode, gen->lineno);
+}
+
+/*
+ * Append instruction `i`, doubling the code
+ * of the function once full.
+ */
+
+static inline void
+append(luna_codegen_t *gen, luna_instruction_t i) {
+  luna_activation_t *fn = gen->fn;
+  mark(gen);
+  if (unlikely(fn->ncode == fn->mcode)) {
+    fn->mcode <<= 1;
+    fn->ip = fn->code = realloc(fn->code, fn->mcode * sizeof(luna_instruction_t));
+  }
+  fn->code[fn->ncode++] = i;
+}
+
+// forward declarations
+
+static void function(luna_codegen_t *parent, luna_function_node_t *node, luna_activation_t *fn);
 
 /*
- * Emit binary operation.
+ * Fail the unit with `err` at the current line, unless it
+ * failed already. The code generated past an error is
+ * never run, only kept within the limits of the vm.
  */
 
 static void
-emit_op(luna_vm_t *vm, luna_binary_op_node_t *node, int l, int r) {
-  switch (node->op) {
+error(luna_codegen_t *gen, const char *err) {
+  if (gen->unit->err) return;
+  gen->unit->err = err;
+  gen->unit->lineno = gen->lineno;
+}
+
+/*
+ * Return the RK index of constant `val`.
+ */
+
+static int
+constant(luna_codegen_t *gen, luna_value_t val) {
+  luna_activation_t *fn = gen->fn;
+  for (int i = 0; i < fn->nconstants; ++i) {
+    // bitwise, so that 0.0 and -0.0 stay distinct
+    if (fn->constants[i] == val) return 32 + i;
+  }
+  if (unlikely(fn->nconstants == 256 - 32)) {
+    error(gen, "too many constants");
+    return 32;
+  }
+  fn->constants[fn->nconstants] = val;
+  return 32 + fn->nconstants++;
+}
+
+/*
+ * Return the RK index of the string constant naming field
+ * `node`, or -1 unless it is a name or string literal.
+ * The function's inline caches are allocated with
+ * the first field it accesses.
+ */
+
+static int
+key(luna_codegen_t *gen, luna_node_t *node) {
+  luna_activation_t *fn = gen->fn;
+  const char *name;
+
+  switch (node->type) {
+    case LUNA_NODE_ID:
+      name = ((luna_id_node_t *) node)->val;
+      break;
+    case LUNA_NODE_STRING:
+      name = ((luna_string_node_t *) node)->val;
+      break;
+    default:
+      return -1;
+  }
+
+  if (!fn->caches) fn->caches = calloc(2 * (256 - 32), sizeof(luna_cache_t));
+  luna_value_t str = luna_string_new(name);
+  for (int i = 0; i < fn->nconstants; ++i) {
+    if (str == fn->constants[i]) return 32 + i;
+  }
+  return constant(gen, str);
+}
+
+/*
+ * Return the object slot or subscript `node` accesses,
+ * populating `k` with the constant of its key, or
+ * NULL unless the key is constant.
+ */
+
+static luna_node_t *
+member(luna_codegen_t *gen, luna_node_t *node, int *k) {
+  // same layout
+  luna_slot_node_t *slot = (luna_slot_node_t *) node;
+  switch (node->type) {
+    case LUNA_NODE_SUBSCRIPT:
+      // a[i] indexes arrays
+      if (LUNA_NODE_STRING != slot->right->type) return NULL;
+      // fall through
+    case LUNA_NODE_SLOT:
+      if ((*k = key(gen, slot->right)) < 0) return NULL;
+      return slot->left;
+  }
+  return NULL;
+}
+
+/*
+ * Allocate a register.
+ */
+
+static int
+alloc(luna_codegen_t *gen) {
+  if (likely(gen->reg < 32)) return gen->reg++;
+  error(gen, "too many variables");
+  return 31;
+}
+
+/*
+ * Release temporaries allocated above `top`.
+ */
+
+static void
+release(luna_codegen_t *gen, int top) {
+  gen->reg = top > gen->nlocals ? top : gen->nlocals;
+}
+
+/*
+ * Return the register assigned to local `name`, or -1.
+ */
+
+static int
+slot(luna_codegen_t *gen, const char *name) {
+  khiter_t k = kh_get(locals, gen->locals, name);
+  return k == kh_end(gen->locals) ? -1 : kh_value(gen->locals, k);
+}
+
+/*
+ * Return the register of the cell holding local `name`, or -1.
+ */
+
+static int
+cell(luna_codegen_t *gen, const char *name) {
+  if (kh_get(scalars, gen->cells, name) == kh_end(gen->cells)) return -1;
+  return slot(gen, name);
+}
+
+/*
+ * Check if `node` is a local living in a cell.
+ */
+
+static int
+boxed(luna_codegen_t *gen, luna_node_t *node) {
+  return LUNA_NODE_ID == node->type && cell(gen, ((luna_id_node_t *) node)->val) > -1;
+}
+
+/*
+ * Return the register holding local `name`, or -1
+ * when undefined or living in a cell.
+ */
+
+static int
+local(luna_codegen_t *gen, const char *name) {
+  if (kh_get(scalars, gen->cells, name) != kh_end(gen->cells)) return -1;
+  return slot(gen, name);
+}
+
+/*
+ * Return the register of local `name`, defining it unless present.
+ */
+
+static int
+define(luna_codegen_t *gen, const char *name) {
+  int ret, reg = slot(gen, name);
+  if (reg > -1) return reg;
+  reg = alloc(gen);
+  gen->nlocals = gen->reg;
+  khiter_t k = kh_put(locals, gen->locals, name, &ret);
+  return kh_value(gen->locals, k) = reg;
+}
+
+/*
+ * Check if local `name` is a scalar-replaced aggregate.
+ */
+
+static int
+scalar(luna_codegen_t *gen, const char *name) {
+  return kh_get(scalars, gen->scalars, name) != kh_end(gen->scalars);
+}
+
+/*
+ * Return the register of field `key` of aggregate `node`, or -1.
+ */
+
+static int
+field(luna_codegen_t *gen, luna_node_t *node, luna_node_t *key) {
+  char buf[256];
+  if (LUNA_NODE_ID != node->type) return -1;
+  if (!luna_field(buf, sizeof(buf), ((luna_id_node_t *) node)->val, key)) return -1;
+  khiter_t k = kh_get(locals, gen->fields, buf);
+  return k == kh_end(gen->fields) ? -1 : kh_value(gen->fields, k);
+}
+
+/*
+ * Return the register of field `key` of aggregate
+ * `name`, defining it unless present.
+ */
+
+static int
+define_field(luna_codegen_t *gen, const char *name, luna_node_t *key) {
+  char buf[256];
+  int ret;
+  luna_field(buf, sizeof(buf), name, key);
+  khiter_t k = kh_get(locals, gen->fields, buf);
+  if (k != kh_end(gen->fields)) return kh_value(gen->fields, k);
+  k = kh_put(locals, gen->fields, strdup(buf), &ret);
+  kh_value(gen->fields, k) = alloc(gen);
+  gen->nlocals = gen->reg;
+  return kh_value(gen->fields, k);
+}
+
+/*
+ * Return the register holding `node` in place, a local
+ * or the field of an aggregate, or -1.
+ */
+
+static int
+place(luna_codegen_t *gen, luna_node_t *node) {
+  switch (node->type) {
+    case LUNA_NODE_ID:
+      return local(gen, ((luna_id_node_t *) node)->val);
+    case LUNA_NODE_SLOT:
+      return field(gen, ((luna_slot_node_t *) node)->left, ((luna_slot_node_t *) node)->right);
+    case LUNA_NODE_SUBSCRIPT:
+      return field(gen, ((luna_subscript_node_t *) node)->left, ((luna_subscript_node_t *) node)->right);
+  }
+  return -1;
+}
+
+/*
+ * Point the jump at `pc` to `target`.
+ */
+
+static void
+set_jump(luna_codegen_t *gen, int pc, int target) {
+  int offset = target - pc - 1;
+  if (unlikely(offset < -LUNA_MAX_SBX || offset > 0xffff - LUNA_MAX_SBX)) error(gen, "jump too long");
+  gen->fn->code[pc] = AsBx(JMP, 0, offset);
+}
+
+/*
+ * Emit a jump to be patched later via `jumps`.
+ */
+
+static void
+jump(luna_codegen_t *gen, luna_jumps_t *jumps) {
+  kv_push(int, *jumps, PC);
+  emit(JMP, 0, 0, 0);
+}
+
+/*
+ * Patch `jumps` to target the current pc.
+ */
+
+static void
+patch(luna_codegen_t *gen, luna_jumps_t *jumps) {
+  for (size_t i = 0; i < kv_size(*jumps); ++i) {
+    set_jump(gen, kv_A(*jumps, i), PC);
+  }
+  kv_destroy(*jumps);
+  kv_init(*jumps);
+}
+
+/*
+ * Add profile key `key` to the probes of the unit, returning its index.
+ */
+
+static int
+probe(luna_codegen_t *gen, uint64_t key) {
+  if (unlikely(kv_size(gen->unit->probes) == 0x10000)) {
+    error(gen, "too many probes");
+    return 0;
+  }
+  kv_push(uint64_t, gen->unit->probes, key);
+  return kv_size(gen->unit->probes) - 1;
+}
+
+/*
+ * Count `kind` of node `id` when instrumenting.
+ */
+
+static void
+count(luna_codegen_t *gen, int kind, int id) {
+  if (!gen->instrument || !id) return;
+  emitx(COUNT, 0, probe(gen, LUNA_PROFILE_KEY(kind, id, 0)));
+}
+
+/*
+ * Return the profiled count of `kind` of node `id`, or 0.
+ */
+
+static uint64_t
+profiled(luna_codegen_t *gen, int kind, int id) {
+  if (!gen->profile || !id) return 0;
+  return luna_profile_count(gen->profile, LUNA_PROFILE_KEY(kind, id, 0));
+}
+
+/*
+ * Check if `op` is a comparison.
+ */
+
+static int
+comparison(luna_token op) {
+  switch (op) {
+    case LUNA_TOKEN_OP_LT:
+    case LUNA_TOKEN_OP_LTE:
+    case LUNA_TOKEN_OP_GT:
+    case LUNA_TOKEN_OP_GTE:
+    case LUNA_TOKEN_OP_EQ:
+    case LUNA_TOKEN_OP_NEQ:
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Check if `op` is an assignment.
+ */
+
+static int
+assignment(luna_token op) {
+  switch (op) {
+    case LUNA_TOKEN_OP_ASSIGN:
+    case LUNA_TOKEN_OP_PLUS_ASSIGN:
+    case LUNA_TOKEN_OP_MINUS_ASSIGN:
+    case LUNA_TOKEN_OP_MUL_ASSIGN:
+    case LUNA_TOKEN_OP_DIV_ASSIGN:
+    case LUNA_TOKEN_OP_AND_ASSIGN:
+    case LUNA_TOKEN_OP_OR_ASSIGN:
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Check if `node` is a logical `&&` or `||` operation.
+ */
+
+static int
+logical(luna_node_t *node) {
+  if (LUNA_NODE_BINARY_OP != node->type) return 0;
+  luna_token op = ((luna_binary_op_node_t *) node)->op;
+  return LUNA_TOKEN_OP_AND == op || LUNA_TOKEN_OP_OR == op;
+}
+
+/*
+ * Check if `node` always produces a bool, in which case it
+ * is compiled as a branch and materialized only once.
+ */
+
+static int
+boolean(luna_node_t *node) {
+  switch (node->type) {
+    case LUNA_NODE_UNARY_OP: {
+      luna_unary_op_node_t *op = (luna_unary_op_node_t *) node;
+      if (LUNA_TOKEN_OP_NOT != op->op && LUNA_TOKEN_OP_LNOT != op->op) return 0;
+      return boolean(op->expr);
+    }
+    case LUNA_NODE_BINARY_OP: {
+      luna_binary_op_node_t *op = (luna_binary_op_node_t *) node;
+      if (comparison(op->op)) return 1;
+      if (logical(node)) return boolean(op->left) && boolean(op->right);
+      return 0;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Check if compiling `node` writes its destination only once
+ * all operands are evaluated, so the destination may be
+ * one of those operands.
+ */
+
+static int
+atomic(luna_node_t *node) {
+  return !logical(node) || boolean(node);
+}
+
+/*
+ * Check if `node` is a constant condition, populating `truthy`.
+ */
+
+static int
+constant_condition(luna_node_t *node, int *truthy) {
+  switch (node->type) {
+    case LUNA_NODE_INT:
+      *truthy = 0 != ((luna_int_node_t *) node)->val;
+      return 1;
+    case LUNA_NODE_ID: {
+      const char *name = ((luna_id_node_t *) node)->val;
+      if (0 == strcmp("true", name)) return *truthy = 1, 1;
+      if (0 == strcmp("false", name)) return *truthy = 0, 1;
+      if (0 == strcmp("nil", name)) return *truthy = 0, 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Compile `node` into register `dst`.
+ */
+
+static void
+compile_node(luna_visitor_t *self, luna_node_t *node, int dst) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  int prev = gen->dst;
+  int line = gen->lineno;
+  gen->dst = dst;
+  if (node->lineno) gen->lineno = node->lineno;
+  visit(node);
+  gen->dst = prev;
+  gen->lineno = line;
+}
+
+/*
+ * Return the role of `node` in value numbering,
+ * populating `r` with the register of its value.
+ */
+
+static luna_cse_role
+numbered(luna_codegen_t *gen, luna_node_t *node, int *r) {
+  int n;
+  luna_cse_role role = luna_cse_lookup(gen->cse, node, &n);
+  if (LUNA_CSE_NONE != role) *r = gen->values + n;
+  return role;
+}
+
+/*
+ * Compile `node` into register `dst`. Values computed
+ * before are moved from their temporary, those computed
+ * again later are saved to theirs.
+ */
+
+static void
+compile(luna_visitor_t *self, luna_node_t *node, int dst) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  int r;
+
+  switch (numbered(gen, node, &r)) {
+    case LUNA_CSE_NONE:
+      compile_node(self, node, dst);
+      break;
+    case LUNA_CSE_SAVE:
+      compile_node(self, node, r);
+      // fall through
+    case LUNA_CSE_REUSE:
+      if (dst > -1 && dst != r) emit(MOVE, dst, r, 0);
+      break;
+  }
+}
+
+/*
+ * Compile `node` into a register and return it,
+ * locals, fields and numbered values are
+ * referenced in place.
+ */
+
+static int
+reg(luna_visitor_t *self, luna_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  int r = place(gen, node);
+  if (r > -1) return r;
+  if (numbered(gen, node, &r)) {
+    compile(self, node, -1);
+    return r;
+  }
+  r = alloc(gen);
+  compile(self, node, r);
+  return r;
+}
+
+/*
+ * Compile `node` as an RK operand, constants
+ * are referenced directly.
+ */
+
+static int
+rk(luna_visitor_t *self, luna_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  switch (node->type) {
+    case LUNA_NODE_INT:
+      return CONST(((luna_int_node_t *) node)->val);
+    case LUNA_NODE_FLOAT:
+      return FCONST(((luna_float_node_t *) node)->val);
+  }
+  return reg(self, node);
+}
+
+/*
+ * Return the object or record slot or subscript `node`
+ * accesses, populating `f` with the field when the layout
+ * of the record is known, otherwise `k` with the constant
+ * of its key, or NULL unless the key is constant. Fields
+ * of the elements of columnar arrays populate `k` with
+ * their column, those of records with -1.
+ */
+
+static luna_node_t *
+record_member(luna_codegen_t *gen, luna_node_t *node, luna_field_t **f, int *k) {
+  luna_node_t *left = ((luna_slot_node_t *) node)->left;
+  if ((*f = luna_records_element(gen->records, node))) {
+    *k = *f - luna_records_of(gen->records, left)->fields;
+    return left;
+  }
+  if ((*f = luna_records_field(gen->records, node))) {
+    *k = -1;
+    return left;
+  }
+  return member(gen, node, k);
+}
+
+/*
+ * Return the register of `object` whose field `f` of
+ * column `k` is accessed, elements of columnar arrays
+ * loaded as their array and index in consecutive
+ * registers.
+ */
+
+static int
+receiver(luna_visitor_t *self, luna_node_t *object, luna_field_t *f, int k) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  if (!f || k < 0) return reg(self, object);
+  luna_subscript_node_t *sub = (luna_subscript_node_t *) object;
+  int r = alloc(gen);
+  alloc(gen);
+  compile(self, sub->left, r);
+  compile(self, sub->right, r + 1);
+  return r;
+}
+
+/*
+ * Return the index of record `layout`.
+ */
+
+#define LAYOUT(layout) luna_layouts_index(gen->layouts, layout)
+
+/*
+ * Load field `f` of record R(obj), or that of key
+ * K(k) of an object when NULL, into R(dst). Fields
+ * of array elements are loaded from column `k`.
+ */
+
+static void
+load(luna_codegen_t *gen, luna_field_t *f, int dst, int obj, int k) {
+  if (!f) {
+    emit(GETFIELD, dst, obj, k);
+    return;
+  }
+
+  // column k of an array element
+  if (k > -1) {
+    switch (f->kind) {
+      case LUNA_FIELD_INT: emit(GETCI, dst, obj, k); break;
+      case LUNA_FIELD_FLOAT: emit(GETCF, dst, obj, k); break;
+      default: emit(GETCV, dst, obj, k);
+    }
+    return;
+  }
+
+  switch (f->kind) {
+    case LUNA_FIELD_INT: emit(GETI, dst, obj, f->offset); break;
+    case LUNA_FIELD_FLOAT: emit(GETF, dst, obj, f->offset); break;
+    default: emit(GETV, dst, obj, f->offset);
+  }
+}
+
+/*
+ * Store RK(val) to field `f` of record R(obj), or to that
+ * of key K(k) of an object when NULL, or to column `k` of
+ * an array element. Record fields hold records of their
+ * layout, so a value not `known` to be one is checked
+ * first, in place.
+ */
+
+static void
+store(luna_codegen_t *gen, luna_field_t *f, int obj, int k, int val, int known) {
+  if (!f) {
+    emit(SETFIELD, obj, k, val);
+    return;
+  }
+
+  if (f->layout && !known) emit(CHECK, val, LAYOUT(f->layout), 0);
+
+  // column k of an array element
+  if (k > -1) {
+    switch (f->kind) {
+      case LUNA_FIELD_INT: emit(SETCI, obj, k, val); break;
+      case LUNA_FIELD_FLOAT: emit(SETCF, obj, k, val); break;
+      default: emit(SETCV, obj, k, val);
+    }
+    return;
+  }
+
+  switch (f->kind) {
+    case LUNA_FIELD_INT: emit(SETI, obj, f->offset, val); break;
+    case LUNA_FIELD_FLOAT: emit(SETF, obj, f->offset, val); break;
+    default: emit(SETV, obj, f->offset, val);
+  }
+}
+
+/*
+ * Return the RK operand of `node` stored to field `f`, checked
+ * in a temporary unless known to be a record of its layout.
+ */
+
+static int
+stored(luna_visitor_t *self, luna_field_t *f, luna_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  if (!f || !f->layout || luna_records_of(gen->records, node) == f->layout) return rk(self, node);
+  int r = alloc(gen);
+  compile(self, node, r);
+  emit(CHECK, r, LAYOUT(f->layout), 0);
+  return r;
+}
+
+/*
+ * Check R(r), assigned `val` or an unknown value when
+ * NULL, against the record or array type local `name`
+ * is declared of, unless known to be one.
+ */
+
+static void
+declared(luna_codegen_t *gen, const char *name, int r, luna_node_t *val) {
+  luna_layout_t *layout = luna_records_declared(gen->records, name);
+  if (layout && (!val || luna_records_of(gen->records, val) != layout)) {
+    emit(CHECK, r, LAYOUT(layout), 0);
+  }
+
+  layout = luna_records_declared_array(gen->records, name);
+  if (layout && (!val || luna_records_array(gen->records, val) != layout)) {
+    emit(CHECKARRAY, r, LAYOUT(layout), 0);
+  }
+}
+
+/*
+ * Type shared by operands `left` and `right` when proven
+ * to be int or float, otherwise LUNA_TYPE_ANY.
+ */
+
+static luna_object
+operands(luna_node_t *left, luna_node_t *right) {
+  luna_object t = left->inferred;
+  if (t != right->inferred) return LUNA_TYPE_ANY;
+  return LUNA_TYPE_INT == t || LUNA_TYPE_FLOAT == t ? t : LUNA_TYPE_ANY;
+}
+
+/*
+ * Type of the operands of arithmetic `node` as operands(),
+ * LUNA_TYPE_ANY unless its result is of the same type, as
+ * for ints divided by anything but constants.
+ */
+
+static luna_object
+arith_operands(luna_binary_op_node_t *node) {
+  luna_object t = operands(node->left, node->right);
+  return t == node->base.inferred ? t : LUNA_TYPE_ANY;
+}
+
+/*
+ * Emit `op`, or its int or float variant
+ * when the operands are of proven `type`.
+ */
+
+#define typed(op, type, a, b, c) \
+  (LUNA_TYPE_INT == (type) ? emit(op##I, a, b, c) \
+    : LUNA_TYPE_FLOAT == (type) ? emit(op##F, a, b, c) \
+    : emit(op, a, b, c))
+
+/*
+ * Emit comparison `op` of `l` and `r` of the given `type`,
+ * skipping the next instruction unless the result equals `when`.
+ */
+
+static void
+compare(luna_codegen_t *gen, luna_token op, luna_object type, int when, int l, int r) {
+  switch (op) {
+    case LUNA_TOKEN_OP_LT:
+      typed(LT, type, when, l, r);
+      break;
+    case LUNA_TOKEN_OP_LTE:
+      typed(LTE, type, when, l, r);
+      break;
+    case LUNA_TOKEN_OP_GT:
+      typed(LT, type, when, r, l);
+      break;
+    case LUNA_TOKEN_OP_GTE:
+      typed(LTE, type, when, r, l);
+      break;
+    case LUNA_TOKEN_OP_EQ:
+      emit(EQ, when, l, r);
+      break;
+    case LUNA_TOKEN_OP_NEQ:
+      emit(EQ, !when, l, r);
+      break;
+  }
+}
+
+/*
+ * Compile `node` as a branch condition, adding jumps taken when
+ * its truthiness equals `when` to `jumps`, and falling through
+ * otherwise. `&&`, `||` and `not` never materialize a bool.
+ */
+
+static void
+branch(luna_visitor_t *self, luna_node_t *node, int when, luna_jumps_t *jumps) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  int top = gen->reg;
+  int truthy;
+
+  switch (node->type) {
+    // not
+    case LUNA_NODE_UNARY_OP: {
+      luna_unary_op_node_t *op = (luna_unary_op_node_t *) node;
+      if (LUNA_TOKEN_OP_NOT == op->op || LUNA_TOKEN_OP_LNOT == op->op) {
+        branch(self, op->expr, !when, jumps);
+        return;
+      }
+      break;
+    }
+
+    case LUNA_NODE_BINARY_OP: {
+      luna_binary_op_node_t *op = (luna_binary_op_node_t *) node;
+
+      // && ||
+      if (logical(node)) {
+        // left-hand truthiness deciding the result
+        int decides = LUNA_TOKEN_OP_OR == op->op;
+        if (decides == when) {
+          branch(self, op->left, when, jumps);
+          branch(self, op->right, when, jumps);
+        } else {
+          luna_jumps_t skip;
+          kv_init(skip);
+          branch(self, op->left, decides, &skip);
+          branch(self, op->right, when, jumps);
+          patch(gen, &skip);
+        }
+        return;
+      }
+
+      // < <= > >= == !=
+      if (comparison(op->op)) {
+        int l = rk(self, op->left);
+        int r = rk(self, op->right);
+        compare(gen, op->op, operands(op->left, op->right), when, l, r);
+        jump(gen, jumps);
+        release(gen, top);
+        return;
+      }
+      break;
+    }
+  }
+
+  // constant
+  if (constant_condition(node, &truthy)) {
+    if (truthy == when) jump(gen, jumps);
+    return;
+  }
+
+  int r = reg(self, node);
+  emit(TEST, r, 0, when);
+  jump(gen, jumps);
+  release(gen, top);
+}
+
+/*
+ * Materialize the bool `node` into `dst`.
+ */
+
+static void
+materialize(luna_visitor_t *self, luna_node_t *node, int dst) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  luna_jumps_t falsy;
+  kv_init(falsy);
+  branch(self, node, 0, &falsy);
+  emit(LOADB, dst, 1, 1);
+  patch(gen, &falsy);
+  emit(LOADB, dst, 0, 0);
+}
+
+/*
+ * Emit arithmetic or bitwise `op` on operands of the given `type`.
+ */
+
+static void
+emit_op(luna_codegen_t *gen, luna_token op, luna_object type, int dst, int l, int r) {
+  switch (op) {
     case LUNA_TOKEN_OP_PLUS:
-      emit(ADD, 0, l, r);
+    case LUNA_TOKEN_OP_PLUS_ASSIGN:
+      typed(ADD, type, dst, l, r);
       break;
     case LUNA_TOKEN_OP_MINUS:
-      emit(SUB, 0, l, r);
+    case LUNA_TOKEN_OP_MINUS_ASSIGN:
+      typed(SUB, type, dst, l, r);
       break;
     case LUNA_TOKEN_OP_DIV:
-      emit(DIV, 0, l, r);
+    case LUNA_TOKEN_OP_DIV_ASSIGN:
+      typed(DIV, type, dst, l, r);
       break;
     case LUNA_TOKEN_OP_MUL:
-      emit(MUL, 0, l, r);
+    case LUNA_TOKEN_OP_MUL_ASSIGN:
+      typed(MUL, type, dst, l, r);
+      break;
+    case LUNA_TOKEN_OP_MOD:
+      typed(MOD, type, dst, l, r);
+      break;
+    case LUNA_TOKEN_OP_POW:
+      emit(POW, dst, l, r);
+      break;
+    case LUNA_TOKEN_OP_BIT_SHL:
+      emit(BIT_SHL, dst, l, r);
+      break;
+    case LUNA_TOKEN_OP_BIT_SHR:
+      emit(BIT_SHR, dst, l, r);
+      break;
+    case LUNA_TOKEN_OP_BIT_AND:
+      emit(BIT_AND, dst, l, r);
+      break;
+    case LUNA_TOKEN_OP_BIT_OR:
+      emit(BIT_OR, dst, l, r);
+      break;
+    case LUNA_TOKEN_OP_BIT_XOR:
+      emit(BIT_XOR, dst, l, r);
+      break;
+  }
+}
+
+/*
+ * Compile the fields of aggregate `node` into
+ * registers of their own, replacing local `name`.
+ */
+
+static void
+scalarize(luna_visitor_t *self, const char *name, luna_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+
+  // array
+  if (LUNA_NODE_ARRAY == node->type) {
+    luna_int_node_t index;
+    index.base.type = LUNA_NODE_INT;
+    luna_vec_each(((luna_array_node_t *) node)->vals, {
+      index.val = i;
+      compile(self, (luna_node_t *) luna_as_pointer(val), define_field(gen, name, (luna_node_t *) &index));
+    });
+    return;
+  }
+
+  // hash
+  luna_vec_each(((luna_hash_node_t *) node)->pairs, {
+    luna_hash_pair_node_t *pair = (luna_hash_pair_node_t *) luna_as_pointer(val);
+    compile(self, pair->val, define_field(gen, name, pair->key));
+  });
+}
+
+/*
+ * Visit array `node`, a packed array its elements are
+ * appended to. It is built in a temporary unless the
+ * destination is one, as the elements may read the
+ * local it replaces.
+ */
+
+static void
+visit_array(luna_visitor_t *self, luna_array_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  int top = gen->reg;
+  int dst = gen->dst;
+  int arr = dst > -1 && dst >= gen->nlocals ? dst : alloc(gen);
+  int capacity = luna_vec_length(node->vals);
+
+  emit(NEWLIST, arr, capacity < 255 ? capacity : 255, 0);
+  int vals = gen->reg;
+  luna_vec_each(node->vals, {
+    emit(APPEND, arr, rk(self, (luna_node_t *) luna_as_pointer(val)), 0);
+    release(gen, vals);
+  });
+
+  if (dst > -1 && dst != arr) emit(MOVE, dst, arr, 0);
+  release(gen, top);
+}
+
+/*
+ * Visit hash `node`, an object with slots for its pairs
+ * and those added later. It is built in a temporary unless
+ * the destination is one, as the values may read the local
+ * it replaces. Pairs of computed keys are evaluated
+ * for their side-effects.
+ */
+
+static void
+visit_hash(luna_visitor_t *self, luna_hash_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  int top = gen->reg;
+  int dst = gen->dst;
+  int obj = dst > -1 && dst >= gen->nlocals ? dst : alloc(gen);
+  int capacity = luna_vec_length(node->pairs) + LUNA_OBJECT_SLACK;
+
+  emit(NEWOBJECT, obj, capacity < LUNA_SHAPE_SLOTS ? capacity : LUNA_SHAPE_SLOTS, 0);
+  int pairs = gen->reg;
+  luna_vec_each(node->pairs, {
+    luna_hash_pair_node_t *pair = (luna_hash_pair_node_t *) luna_as_pointer(val);
+    int k = key(gen, pair->key);
+    if (k > -1) {
+      emit(SETFIELD, obj, k, rk(self, pair->val));
+    } else {
+      reg(self, pair->key);
+      reg(self, pair->val);
+    }
+    release(gen, pairs);
+  });
+
+  if (dst > -1 && dst != obj) emit(MOVE, dst, obj, 0);
+  release(gen, top);
+}
+
+/*
+ * Visit slot `node`, fields of scalar-replaced
+ * aggregates are plain registers, those of records
+ * of a known layout unboxed loads, and those of
+ * objects loaded through their cache.
+ */
+
+static void
+visit_slot(luna_visitor_t *self, luna_slot_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  int top = gen->reg;
+  int r = field(gen, node->left, node->right);
+  int k;
+
+  if (r > -1) {
+    if (r != gen->dst) emit(MOVE, gen->dst, r, 0);
+    return;
+  }
+
+  luna_field_t *f;
+  luna_node_t *obj = record_member(gen, (luna_node_t *) node, &f, &k);
+  r = obj ? receiver(self, obj, f, k) : reg(self, node->left);
+  release(gen, top);
+  if (obj) {
+    load(gen, f, gen->dst, r, k);
+  } else {
+    emit(LOADNIL, gen->dst, 0, 0);
+  }
+}
+
+/*
+ * Visit subscript `node`, fields of scalar-replaced
+ * aggregates are plain registers, string keys
+ * of objects and records loaded as slots, and
+ * other keys index arrays.
+ */
+
+static void
+visit_subscript(luna_visitor_t *self, luna_subscript_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  int top = gen->reg;
+  int r = field(gen, node->left, node->right);
+  int k;
+
+  if (r > -1) {
+    if (r != gen->dst) emit(MOVE, gen->dst, r, 0);
+    return;
+  }
+
+  luna_field_t *f;
+  luna_node_t *obj = record_member(gen, (luna_node_t *) node, &f, &k);
+  if (obj) {
+    r = receiver(self, obj, f, k);
+    release(gen, top);
+    load(gen, f, gen->dst, r, k);
+    return;
+  }
+
+  // T[n] allocates a columnar array
+  luna_layout_t *layout = luna_layouts_array(gen->layouts, node);
+  if (layout) {
+    int n = rk(self, node->right);
+    release(gen, top);
+    emit(NEWARRAY, gen->dst, LAYOUT(layout), n);
+    return;
+  }
+
+  r = reg(self, node->left);
+  int index = rk(self, node->right);
+  release(gen, top);
+  emit(GETINDEX, gen->dst, r, index);
+}
+
+/*
+ * Check if `node` is an expression.
+ */
+
+static int
+expression(luna_node_t *node) {
+  switch (node->type) {
+    case LUNA_NODE_IF:
+    case LUNA_NODE_WHILE:
+    case LUNA_NODE_RETURN:
+    case LUNA_NODE_FUNCTION:
+    case LUNA_NODE_TYPE:
+    case LUNA_NODE_USE:
+    case LUNA_NODE_LET:
+    case LUNA_NODE_BLOCK:
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * Visit block `node`. The value of the last
+ * expression statement is kept in `gen->last`.
+ */
+
+static void
+visit_block(luna_visitor_t *self, luna_block_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  int line = gen->lineno;
+  luna_vec_each(node->stmts, {
+    luna_node_t *stmt = (luna_node_t *) luna_as_pointer(val);
+    release(gen, 0);
+    gen->last = -1;
+    if (stmt->lineno) gen->lineno = stmt->lineno;
+
+    if (!expression(stmt)) {
+      visit(stmt);
+      gen->last = -1;
+      continue;
+    }
+
+    // assignments need no destination, unless stored in a cell
+    luna_binary_op_node_t *op = (luna_binary_op_node_t *) stmt;
+    if (LUNA_NODE_BINARY_OP == stmt->type && assignment(op->op) && !boxed(gen, op->left)) {
+      compile(self, stmt, -1);
+      if (LUNA_NODE_ID == op->left->type) {
+        gen->last = local(gen, ((luna_id_node_t *) op->left)->val);
+      }
+      continue;
+    }
+
+    gen->last = reg(self, stmt);
+  });
+  gen->lineno = line;
+}
+
+/*
+ * Visit int `node`.
+ */
+
+static void
+visit_int(luna_visitor_t *self, luna_int_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  emit(LOADK, gen->dst, CONST(node->val), 0);
+}
+
+/*
+ * Visit float `node`.
+ */
+
+static void
+visit_float(luna_visitor_t *self, luna_float_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  emit(LOADK, gen->dst, FCONST(node->val), 0);
+}
+
+/*
+ * Visit string `node`.
+ */
+
+static void
+visit_string(luna_visitor_t *self, luna_string_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  emit(LOADK, gen->dst, SCONST(node->val), 0);
+}
+
+/*
+ * Visit id `node`.
+ */
+
+static void
+visit_id(luna_visitor_t *self, luna_id_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  int r = local(gen, node->val);
+
+  // local
+  if (r > -1) {
+    if (r != gen->dst) emit(MOVE, gen->dst, r, 0);
+    return;
+  }
+
+  // captured and mutated
+  if ((r = cell(gen, node->val)) > -1) {
+    emit(GETCELL, gen->dst, r, 0);
+    return;
+  }
+
+  // true | false | nil
+  if (0 == strcmp("true", node->val)) {
+    emit(LOADB, gen->dst, 1, 0);
+  } else if (0 == strcmp("false", node->val)) {
+    emit(LOADB, gen->dst, 0, 0);
+  } else {
+    emit(LOADNIL, gen->dst, 0, 0);
+  }
+}
+
+/*
+ * Visit let `node`, defining its locals. Those declared
+ * of a record type or an array of one are checked to
+ * hold one of its layout.
+ */
+
+static void
+visit_let(luna_visitor_t *self, luna_let_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  luna_vec_each(node->vec, {
+    luna_binary_op_node_t *bin = (luna_binary_op_node_t *) luna_as_pointer(val);
+    luna_decl_node_t *decl = (luna_decl_node_t *) bin->left;
+    int first = -1;
+
+    luna_vec_each(decl->vec, {
+      luna_id_node_t *id = (luna_id_node_t *) luna_as_pointer(val);
+
+      if (scalar(gen, id->val)) {
+        scalarize(self, id->val, bin->right);
+        continue;
+      }
+
+      int c = cell(gen, id->val);
+      int r = c > -1 ? alloc(gen) : define(gen, id->val);
+      if (first > -1) {
+        emit(MOVE, r, first, 0);
+      } else if (bin->right) {
+        compile(self, bin->right, r);
+        declared(gen, id->val, r, bin->right);
+      } else {
+        emit(LOADNIL, r, 0, 0);
+      }
+      if (c > -1) emit(SETCELL, c, r, 0);
+      first = r;
+    });
+  });
+}
+
+/*
+ * Visit unary op `node`.
+ */
+
+static void
+visit_unary_op(luna_visitor_t *self, luna_unary_op_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  int top = gen->reg;
+  int dst = gen->dst;
+
+  switch (node->op) {
+    // -
+    case LUNA_TOKEN_OP_MINUS:
+      if (LUNA_NODE_INT == node->expr->type) {
+        emit(LOADK, dst, CONST(-((luna_int_node_t *) node->expr)->val), 0);
+      } else if (LUNA_NODE_FLOAT == node->expr->type) {
+        emit(LOADK, dst, FCONST(-((luna_float_node_t *) node->expr)->val), 0);
+      } else {
+        emit(NEGATE, dst, reg(self, node->expr), 0);
+      }
       break;
-    case LUNA_TOKEN_OP_MOD:
-      emit(MOD, 0, l, r);
+
+    // +
+    case LUNA_TOKEN_OP_PLUS:
+      compile(self, node->expr, dst);
       break;
-    case LUNA_TOKEN_OP_LT:
-      emit(LT, 0, l, r);
-      emit(JMP, 0, 1, 0);
-      emit(LOADB, 0, CONST(1), 1);
-      emit(LOADB, 0, CONST(0), 0);
+
+    // ~
+    case LUNA_TOKEN_OP_BIT_NOT:
+      emit(BIT_XOR, dst, rk(self, node->expr), CONST(-1));
       break;
-    case LUNA_TOKEN_OP_LTE:
-      emit(LTE, 0, l, r);
-      emit(JMP, 0, 1, 0);
-      emit(LOADB, 0, CONST(1), 1);
-      emit(LOADB, 0, CONST(0), 0);
+
+    // ! not
+    case LUNA_TOKEN_OP_NOT:
+    case LUNA_TOKEN_OP_LNOT:
+      if (boolean(node->expr)) {
+        materialize(self, (luna_node_t *) node, dst);
+      } else {
+        emit(NOT, dst, reg(self, node->expr), 0);
+      }
       break;
-  }
-}
 
+    // ++ --
+    case LUNA_TOKEN_OP_INCR:
+    case LUNA_TOKEN_OP_DECR: {
+      int r = place(gen, node->expr);
 
-/*
+      // captured and mutated
+      if (boxed(gen, node->expr)) {
+        int c = cell(gen, ((luna_id_node_t *) node->expr)->val);
+        r = alloc(gen);
+        emit(GETCELL, r, c, 0);
+        if (node->postfix) emit(MOVE, dst, r, 0);
+        if (LUNA_TOKEN_OP_INCR == node->op) {
+          emit(ADD, r, r, CONST(1));
+        } else {
+          emit(SUB, r, r, CONST(1));
+        }
+        emit(SETCELL, c, r, 0);
+        if (!node->postfix) emit(MOVE, dst, r, 0);
+        break;
+      }
+
+      // field of an object or record
+      int k;
+      luna_field_t *f;
+      luna_node_t *object = r < 0 ? record_member(gen, node->expr, &f, &k) : NULL;
+      if (object) {
+        int obj = receiver(self, object, f, k);
+        r = alloc(gen);
+        load(gen, f, r, obj, k);
+        if (node->postfix) emit(MOVE, dst, r, 0);
+        if (LUNA_TOKEN_OP_INCR == node->op) {
+          emit(ADD, r, r, CONST(1));
+        } else {
+          emit(SUB, r, r, CONST(1));
+        }
+        store(gen, f, obj, k, r, 0);
+        if (!node->postfix) emit(MOVE, dst, r, 0);
+        break;
+      }
+
+      if (r < 0) {
+        emit(LOADNIL, dst, 0, 0);
+        break;
+      }
 
-0: lt 5 2;
- : false1:
- : ...
- : ...
- : true1:
- : ...
- : ...
- : endif1:
- : ...
- : ...
- : ...
-*/
+      if (node->postfix && dst != r) emit(MOVE, dst, r, 0);
+      // ints only, floats mixed with the int constant are promoted
+      luna_object type = LUNA_TYPE_INT == node->expr->inferred
+        ? LUNA_TYPE_INT
+        : LUNA_TYPE_ANY;
 
+      if (LUNA_TOKEN_OP_INCR == node->op) {
+        typed(ADD, type, r, r, CONST(1));
+      } else {
+        typed(SUB, type, r, r, CONST(1));
+      }
+      if (LUNA_NODE_ID == node->expr->type) declared(gen, ((luna_id_node_t *) node->expr)->val, r, NULL);
+      if (!node->postfix && dst != r) emit(MOVE, dst, r, 0);
+      break;
+    }
+  }
+
+  release(gen, top);
+}
 
 /*
- * Visit block `node`.
+ * Visit assignment `node`.
  */
 
 static void
-visit_block(luna_visitor_t *self, luna_block_node_t *node) {
-  luna_vec_each(node->stmts, {
-    visit((luna_node_t *) val->value.as_pointer);
-  });
+visit_assign(luna_visitor_t *self, luna_binary_op_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  int top = gen->reg;
+  int dst = gen->dst;
+
+  // aggregate
+  if (LUNA_NODE_ID == node->left->type) {
+    const char *name = ((luna_id_node_t *) node->left)->val;
+    if (scalar(gen, name)) {
+      scalarize(self, name, node->right);
+      return;
+    }
+  }
+
+  // captured and mutated, updated through a temporary
+  int c = boxed(gen, node->left)
+    ? cell(gen, ((luna_id_node_t *) node->left)->val)
+    : -1;
+
+  int r = c > -1 ? alloc(gen)
+    : LUNA_NODE_ID == node->left->type ? define(gen, ((luna_id_node_t *) node->left)->val)
+    : place(gen, node->left);
+
+  if (c > -1 && LUNA_TOKEN_OP_ASSIGN != node->op) emit(GETCELL, r, c, 0);
+
+  // field of an object or record, updated through a temporary
+  int k, obj = -1;
+  luna_field_t *f = NULL;
+  luna_node_t *object = r < 0 ? record_member(gen, node->left, &f, &k) : NULL;
+  if (object) {
+    obj = receiver(self, object, f, k);
+    if (LUNA_TOKEN_OP_ASSIGN == node->op && dst < 0) {
+      store(gen, f, obj, k, stored(self, f, node->right), 1);
+      release(gen, top);
+      return;
+    }
+    r = alloc(gen);
+    if (LUNA_TOKEN_OP_ASSIGN != node->op) load(gen, f, r, obj, k);
+  }
+
+  // element of an array, replaced a field at a time
+  if (r < 0 && LUNA_NODE_SUBSCRIPT == node->left->type && LUNA_TOKEN_OP_ASSIGN == node->op) {
+    luna_subscript_node_t *sub = (luna_subscript_node_t *) node->left;
+    int arr = reg(self, sub->left);
+    int index = rk(self, sub->right);
+    int val = dst > -1 ? reg(self, node->right) : rk(self, node->right);
+    emit(SETINDEX, arr, index, val);
+    if (dst > -1 && dst != val) emit(MOVE, dst, val, 0);
+    release(gen, top);
+    return;
+  }
+
+  if (r < 0) {
+    if (dst > -1) {
+      compile(self, node->right, dst);
+    } else {
+      reg(self, node->right);
+    }
+    release(gen, top);
+    return;
+  }
+
+  switch (node->op) {
+    // =
+    case LUNA_TOKEN_OP_ASSIGN:
+      if (atomic(node->right)) {
+        compile(self, node->right, r);
+      } else {
+        emit(MOVE, r, reg(self, node->right), 0);
+      }
+      break;
+
+    // &&= ||=
+    case LUNA_TOKEN_OP_AND_ASSIGN:
+    case LUNA_TOKEN_OP_OR_ASSIGN: {
+      luna_jumps_t done;
+      kv_init(done);
+      emit(TEST, r, 0, LUNA_TOKEN_OP_OR_ASSIGN == node->op);
+      jump(gen, &done);
+      if (atomic(node->right)) {
+        compile(self, node->right, r);
+      } else {
+        emit(MOVE, r, reg(self, node->right), 0);
+      }
+      patch(gen, &done);
+      break;
+    }
+
+    // += -= *= /=
+    default:
+      emit_op(gen, node->op, arith_operands(node), r, r, rk(self, node->right));
+  }
+
+  // locals declared of a record type or an array of one
+  int assigned = LUNA_TOKEN_OP_ASSIGN == node->op;
+  if (c < 0 && LUNA_NODE_ID == node->left->type) {
+    declared(gen, ((luna_id_node_t *) node->left)->val, r, assigned ? node->right : NULL);
+  }
+
+  if (c > -1) emit(SETCELL, c, r, 0);
+  if (obj > -1) store(gen, f, obj, k, r, assigned && f && luna_records_of(gen->records, node->right) == f->layout);
+  if (dst > -1 && dst != r) emit(MOVE, dst, r, 0);
+  release(gen, top);
 }
 
 /*
- * Visit int `node`.
+ * Visit logical `node` in value context. The right-hand
+ * side is skipped when the left decides the result.
  */
 
 static void
-visit_int(luna_visitor_t *self, luna_int_node_t *node) {
-  // printf("(int %d)", node->val);
+visit_logical(luna_visitor_t *self, luna_binary_op_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  int top = gen->reg;
+  int dst = gen->dst;
+  int decides = LUNA_TOKEN_OP_OR == node->op;
+  luna_jumps_t done;
+  kv_init(done);
+
+  // left-hand local is tested and copied in one instruction
+  int l = LUNA_NODE_ID == node->left->type
+    ? local(gen, ((luna_id_node_t *) node->left)->val)
+    : -1;
+
+  if (l > -1 && l != dst) {
+    emit(TESTSET, dst, l, decides);
+  } else {
+    compile(self, node->left, dst);
+    emit(TEST, dst, 0, decides);
+  }
+
+  jump(gen, &done);
+  compile(self, node->right, dst);
+  patch(gen, &done);
+  release(gen, top);
 }
 
 /*
- * Visit float `node`.
+ * Visit binary op `node`.
  */
 
 static void
-visit_float(luna_visitor_t *self, luna_float_node_t *node) {
-  luna_vm_t *vm = (luna_vm_t *) self->data;
+visit_binary_op(luna_visitor_t *self, luna_binary_op_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  int top = gen->reg;
+
+  // = += -= *= /= &&= ||=
+  if (assignment(node->op)) {
+    visit_assign(self, node);
+    return;
+  }
+
+  // bools are materialized once
+  if (boolean((luna_node_t *) node)) {
+    materialize(self, (luna_node_t *) node, gen->dst);
+    return;
+  }
+
+  // && ||
+  if (logical((luna_node_t *) node)) {
+    visit_logical(self, node);
+    return;
+  }
+
+  int l = rk(self, node->left);
+  int r = rk(self, node->right);
+  emit_op(gen, node->op, arith_operands(node), gen->dst, l, r);
+  release(gen, top);
 }
 
 /*
- * Visit id `node`.
+ * Check if `node` is free of side-effects and only refers
+ * to the `n` parameters in `params`.
  */
 
-static void
-visit_id(luna_visitor_t *self, luna_id_node_t *node) {
-  // printf("(id %s)", node->val);
+static int
+pure(luna_node_t *node, luna_param_t *params, int n) {
+  switch (node->type) {
+    case LUNA_NODE_INT:
+    case LUNA_NODE_FLOAT:
+      return 1;
+    case LUNA_NODE_ID: {
+      const char *name = ((luna_id_node_t *) node)->val;
+      if (0 == strcmp("true", name)) return 1;
+      if (0 == strcmp("false", name)) return 1;
+      if (0 == strcmp("nil", name)) return 1;
+      for (int i = 0; i < n; ++i) {
+        if (0 == strcmp(params[i].name, name)) return 1;
+      }
+      return 0;
+    }
+    case LUNA_NODE_UNARY_OP: {
+      luna_unary_op_node_t *op = (luna_unary_op_node_t *) node;
+      if (LUNA_TOKEN_OP_INCR == op->op || LUNA_TOKEN_OP_DECR == op->op) return 0;
+      return pure(op->expr, params, n);
+    }
+    case LUNA_NODE_BINARY_OP: {
+      luna_binary_op_node_t *op = (luna_binary_op_node_t *) node;
+      if (assignment(op->op)) return 0;
+      return pure(op->left, params, n) && pure(op->right, params, n);
+    }
+  }
+  return 0;
 }
 
 /*
- * Visit decl `node`.
+ * Compile the call of `fn` with the `nargs` arguments following
+ * `base` in place, when the profile shows it is hot and its body
+ * returns a pure expression of all of its parameters. They are
+ * bound to the argument registers while it is compiled.
+ * Returns 0 when `fn` is not inlined.
  */
 
-static void
-visit_decl(luna_visitor_t *self, luna_decl_node_t *node) {
-  // printf("(decl %s:%s", node->name, node->type ? node->type : "");
-  // if (node->val) visit(node->val);
-  // printf(")");
+static int
+inlined(luna_visitor_t *self, luna_function_node_t *fn, int base, int nargs) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  luna_param_t params[LUNA_MAX_PARAMS];
+  int prev[LUNA_MAX_PARAMS];
+  int ret, n = luna_params(fn, params);
+
+  if (n != nargs) return 0;
+  if (profiled(gen, LUNA_PROFILE_ENTRY, fn->base.id) < LUNA_PROFILE_HOT) return 0;
+  if (1 != luna_vec_length(fn->block->stmts)) return 0;
+
+  luna_node_t *stmt = (luna_node_t *) luna_as_pointer(luna_vec_at(fn->block->stmts, 0));
+  if (LUNA_NODE_RETURN != stmt->type) return 0;
+  luna_node_t *expr = ((luna_return_node_t *) stmt)->expr;
+  if (!expr || !pure(expr, params, n)) return 0;
+
+  // names the caller keeps in cells or fields
+  for (int i = 0; i < n; ++i) {
+    if (kh_get(scalars, gen->cells, params[i].name) != kh_end(gen->cells)) return 0;
+    if (scalar(gen, params[i].name)) return 0;
+  }
+
+  for (int i = 0; i < n; ++i) {
+    prev[i] = slot(gen, params[i].name);
+    khiter_t k = kh_put(locals, gen->locals, params[i].name, &ret);
+    kh_value(gen->locals, k) = base + 1 + i;
+  }
+
+  compile(self, expr, base);
+
+  for (int i = n - 1; i >= 0; --i) {
+    khiter_t k = kh_get(locals, gen->locals, params[i].name);
+    if (prev[i] > -1) {
+      kh_value(gen->locals, k) = prev[i];
+    } else {
+      kh_del(locals, gen->locals, k);
+    }
+  }
+
+  return 1;
 }
 
 /*
- * Visit string `node`.
+ * Call `fn` with the `nargs` arguments following `base`.
  */
 
 static void
-visit_string(luna_visitor_t *self, luna_string_node_t *node) {
-  // printf("(string '%s')", inspect(node->val));
+invoke(luna_visitor_t *self, luna_function_node_t *fn, int base, int nargs) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  if (inlined(self, fn, base, nargs)) return;
+  emit(CALL, base, luna_overloads_index(gen->overloads, fn), nargs);
 }
 
 /*
- * Visit unary op `node`.
+ * Check if `fn` is selected for arguments of type `tuple`.
  */
 
-static void
-visit_unary_op(luna_visitor_t *self, luna_unary_op_node_t *node) {
-  luna_vm_t *vm = (luna_vm_t *) self->data;
-  visit(node->expr);
-  emit(NEGATE, 0, 0, 0);
+static int
+selects(luna_function_node_t *fn, uint32_t tuple) {
+  luna_param_t params[LUNA_MAX_PARAMS];
+  int n = luna_params(fn, params);
+  int nargs = tuple & 0xf;
+
+  if (nargs > n) return 0;
+  for (int i = nargs; i < n; ++i) {
+    if (!params[i].value) return 0;
+  }
+
+  for (int i = 0; i < nargs; ++i) {
+    luna_object type = tuple >> (4 * (i + 1)) & 0xf;
+    if (LUNA_TYPE_ANY != params[i].type && type != params[i].type) return 0;
+  }
+
+  return 1;
 }
 
 /*
- * Visit binary op `node`.
+ * Return the candidate selected by the type tuple dominating
+ * the profile of hot polymorphic call `node`, populating
+ * `tuple`, or NULL. Candidates are in the order the vm
+ * checks them, so the first accepting the tuple wins.
  */
 
-static void
-visit_binary_op(luna_visitor_t *self, luna_binary_op_node_t *node) {
-  luna_vm_t *vm = (luna_vm_t *) self->data;
-  if (LUNA_NODE_BINARY_OP == node->left->type) {
-    visit(node->left);
-    int r = CONST(((luna_float_node_t *) node->right)->val);
-    emit_op(vm, node, 0, r);
-  } else {
-    int l = CONST(((luna_float_node_t *) node->left)->val);
-    int r = CONST(((luna_float_node_t *) node->right)->val);
-    emit_op(vm, node, l, r);
+static luna_function_node_t *
+monomorphic(luna_codegen_t *gen, luna_call_node_t *node, luna_functions_t *candidates, uint32_t *tuple) {
+  uint64_t total;
+  if (!gen->profile || !node->base.id) return NULL;
+
+  uint64_t n = luna_profile_dominant(gen->profile, LUNA_PROFILE_SITE, node->base.id, tuple, &total);
+  if (total < LUNA_PROFILE_HOT || 10 * n < 9 * total) return NULL;
+
+  for (int i = 0; i < kv_size(*candidates); ++i) {
+    luna_function_node_t *fn = kv_A(*candidates, i);
+    if (selects(fn, *tuple)) return fn;
   }
+
+  return NULL;
 }
 
 /*
- * Visit array `node`.
+ * Construct a record of `layout` from the arguments of call
+ * `node`, positional in field order or named, those left out
+ * are zero or nil. It is built in a temporary unless the
+ * destination is one, as the arguments may read the local
+ * it replaces. Extra arguments are evaluated for
+ * their side-effects.
  */
 
 static void
-visit_array(luna_visitor_t *self, luna_array_node_t *node) {
-  // printf("(array\n");
-  // ++indents;
-  // luna_vec_each(node->vals, {
-  //   INDENT;
-  //   visit((luna_node_t *) val->value.as_pointer);
-  //   if (i != len - 1) printf("\n");
-  // });
-  // --indents;
-  // printf(")");
+construct(luna_visitor_t *self, luna_layout_t *layout, luna_call_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  int top = gen->reg;
+  int dst = gen->dst;
+  int rec = dst > -1 && dst >= gen->nlocals ? dst : alloc(gen);
+
+  emit(NEWRECORD, rec, LAYOUT(layout), 0);
+  int args = gen->reg;
+  luna_vec_each(node->args->vec, {
+    luna_node_t *arg = (luna_node_t *) luna_as_pointer(val);
+    if (i < layout->nfields) {
+      luna_field_t *f = &layout->fields[i];
+      store(gen, f, rec, -1, stored(self, f, arg), 1);
+    } else {
+      reg(self, arg);
+    }
+    release(gen, args);
+  });
+
+  luna_hash_each(node->args->hash, {
+    luna_node_t *arg = (luna_node_t *) luna_as_pointer(val);
+    luna_field_t *f = luna_layout_field(layout, slot);
+    if (f) {
+      store(gen, f, rec, -1, stored(self, f, arg), 1);
+    } else {
+      reg(self, arg);
+    }
+    release(gen, args);
+  });
+
+  if (dst > -1 && dst != rec) emit(MOVE, dst, rec, 0);
+  release(gen, top);
 }
 
 /*
- * Visit hash `node`.
+ * Visit call `node`. Calls of a type name construct a
+ * record of its layout. Calls whose overload is known from the
+ * inferred argument types bind directly to it, only genuinely
+ * polymorphic sites dispatch on the argument tags at runtime,
+ * each through a call site cache of its own. Sites a profile
+ * shows to be monomorphic test the tags of their arguments
+ * against the tuple observed and call its overload directly.
  */
 
 static void
-visit_hash(luna_visitor_t *self, luna_hash_node_t *node) {
-  // printf("(hash\n");
-  // ++indents;
-  // luna_hash_each(node->vals, {
-  //   INDENT;
-  //   printf("%s: ", slot);
-  //   visit((luna_node_t *) val->value.as_pointer);
-  //   printf("\n");
-  // });
-  // --indents;
-  // printf(")");
+visit_call(luna_visitor_t *self, luna_call_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  int top = gen->reg;
+  int dst = gen->dst;
+  luna_functions_t candidates;
+  kv_init(candidates);
+
+  // constructor
+  luna_layout_t *layout = luna_layouts_constructs(gen->layouts, node);
+  if (layout) {
+    construct(self, layout, node);
+    return;
+  }
+
+  // function value
+  if (LUNA_NODE_ID != node->expr->type || slot(gen, ((luna_id_node_t *) node->expr)->val) > -1) {
+    int base = alloc(gen);
+    compile(self, node->expr, base);
+    luna_vec_each(node->args->vec, {
+      compile(self, (luna_node_t *) luna_as_pointer(val), alloc(gen));
+    });
+    luna_hash_each_val(node->args->hash, {
+      int args = gen->reg;
+      reg(self, (luna_node_t *) luna_as_pointer(val));
+      release(gen, args);
+    });
+    emit(APPLY, base, 0, luna_vec_length(node->args->vec));
+    if (dst != base) emit(MOVE, dst, base, 0);
+    release(gen, top);
+    return;
+  }
+
+  luna_dispatch dispatch = luna_resolve(gen->overloads, node, &candidates);
+
+  // no such function, arguments are evaluated for their side-effects
+  if (LUNA_DISPATCH_NONE == dispatch) {
+    luna_vec_each(node->args->vec, {
+      reg(self, (luna_node_t *) luna_as_pointer(val));
+      release(gen, top);
+    });
+    luna_hash_each_val(node->args->hash, {
+      reg(self, (luna_node_t *) luna_as_pointer(val));
+      release(gen, top);
+    });
+    emit(LOADNIL, dst, 0, 0);
+    kv_destroy(candidates);
+    return;
+  }
+
+  // arguments follow the result register
+  int base = alloc(gen);
+  int nargs = luna_vec_length(node->args->vec);
+  luna_vec_each(node->args->vec, {
+    int r = alloc(gen);
+    compile(self, (luna_node_t *) luna_as_pointer(val), r);
+  });
+
+  if (LUNA_DISPATCH_STATIC == dispatch) {
+    invoke(self, kv_A(candidates, 0), base, nargs);
+  } else {
+    const char *name = ((luna_id_node_t *) node->expr)->val;
+    int generic = kh_value(gen->generics, kh_get(locals, gen->generics, name));
+    luna_site_t site = { .generic = generic, .nargs = nargs };
+    kv_push(luna_site_t, gen->unit->sites, site);
+    int index = kv_size(gen->unit->sites) - 1;
+    uint32_t tuple;
+
+    // type feedback, the probe's tuple holding the argument count
+    if (gen->instrument && node->base.id && nargs <= LUNA_PROFILE_ARGS) {
+      emitx(FEEDBACK, base, probe(gen, LUNA_PROFILE_KEY(LUNA_PROFILE_SITE, node->base.id, nargs)));
+    }
+
+    // guarded by the dominant tuple, dispatching otherwise
+    luna_function_node_t *fn = monomorphic(gen, node, &candidates, &tuple);
+    if (fn) {
+      luna_jumps_t slow, done;
+      kv_init(slow);
+      kv_init(done);
+      emit(GUARD, base, CONST(tuple), nargs);
+      jump(gen, &slow);
+      invoke(self, fn, base, nargs);
+      jump(gen, &done);
+      patch(gen, &slow);
+      emitx(DISPATCH, base, index);
+      patch(gen, &done);
+    } else {
+      emitx(DISPATCH, base, index);
+    }
+  }
+
+  if (dst != base) emit(MOVE, dst, base, 0);
+  release(gen, top);
+  kv_destroy(candidates);
 }
 
 /*
- * Visit subscript `node`.
+ * Visit function `node`. Anonymous functions are compiled on
+ * their own and evaluate to a closure of the locals they
+ * capture, named functions are global.
  */
 
 static void
-visit_subscript(luna_visitor_t *self, luna_subscript_node_t *node) {
+visit_function(luna_visitor_t *self, luna_function_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  if (node->name || gen->dst < 0) return;
+
+  luna_activation_t *fn = luna_activation_new();
+  kv_push(luna_activation_t *, gen->unit->closures, fn);
+  int index = kv_size(gen->unit->closures) - 1;
+  function(gen, node, fn);
+
+  // locals captured before their definition are nil
+  luna_captures_t *captures = luna_upvalues_captures(gen->upvalues, node);
+  int n = captures ? kv_size(*captures) : 0;
+  for (int i = 0; i < n; ++i) {
+    const char *name = kv_A(*captures, i).name;
+    if (slot(gen, name) < 0) emit(LOADNIL, define(gen, name), 0, 0);
+  }
 
+  // captures follow as moves from their registers
+  emitx(CLOSURE, gen->dst, index);
+  for (int i = 0; i < n; ++i) {
+    emit(MOVE, 0, slot(gen, kv_A(*captures, i).name), 0);
+  }
 }
 
 /*
- * Visit slot `node`.
+ * Visit `while` node.
  */
 
 static void
-visit_slot(luna_visitor_t *self, luna_slot_node_t *node) {
-  // printf("(slot\n");
-  // ++indents;
-  // INDENT;
-  // visit(node->left);
-  // printf("\n");
-  // INDENT;
-  // visit(node->right);
-  // --indents;
-  // printf(")");
+visit_while(luna_visitor_t *self, luna_while_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  luna_jumps_t done;
+  kv_init(done);
+
+  int top = PC;
+  branch(self, node->expr, node->negate, &done);
+  visit((luna_node_t *) node->block);
+  emit(JMP, 0, 0, 0);
+  set_jump(gen, PC - 1, top);
+  patch(gen, &done);
 }
 
 /*
- * Visit call `node`.
+ * Visit `return` node.
  */
 
 static void
-visit_call(luna_visitor_t *self, luna_call_node_t * node) {
-  // printf("(call\n");
-  // ++indents;
-  // INDENT;
-  // visit((luna_node_t *) node->expr);
-  // if (luna_vec_length(node->args->vec)) {
-  //   printf("\n");
-  //   INDENT;
-  //   luna_vec_each(node->args->vec, {
-  //     visit((luna_node_t *) val->value.as_pointer);
-  //     if (i != len - 1) printf(" ");
-  //   });
+visit_return(luna_visitor_t *self, luna_return_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  int r;
+
+  if (node->expr) {
+    r = reg(self, node->expr);
+  } else {
+    emit(LOADNIL, r = alloc(gen), 0, 0);
+  }
 
-  //   luna_hash_each(node->args->hash, {
-  //     printf(" %s: ", slot);
-  //     visit((luna_node_t *) val->value.as_pointer);
-  //   });
-  // }
-  // --indents;
-  // printf(")");
+  emit(RETURN, r, 0, 0);
 }
 
 /*
- * Visit function `node`.
+ * Check if the block of if `node` was entered on
+ * less than half of the hot evaluations of its condition.
  */
 
-static void
-visit_function(luna_visitor_t *self, luna_function_node_t * node) {
-  // printf("(function %s -> %s", node->name, node->type ? node->type : "");
-  // ++indents;
-  // luna_vec_each(node->params, {
-  //   printf("\n");
-  //   INDENT;
-  //   visit((luna_node_t *) val->value.as_pointer);
-  // });
-  // --indents;
-  // printf("\n");
-  // ++indents;
-  // visit((luna_node_t *) node->block);
-  // --indents;
-  // printf(")");
+static int
+cold(luna_codegen_t *gen, luna_if_node_t *node) {
+  uint64_t evaluated = profiled(gen, LUNA_PROFILE_BRANCH, node->base.id);
+  uint64_t taken = profiled(gen, LUNA_PROFILE_TAKEN, node->base.id);
+  return evaluated >= LUNA_PROFILE_HOT && 2 * taken < evaluated;
 }
 
 /*
- * Visit `while` node.
+ * Visit if `node`. The else block of an if / else is laid
+ * out first when the profile shows it is the hot path,
+ * so that it falls through from the condition.
  */
 
 static void
-visit_while(luna_visitor_t *self, luna_while_node_t *node) {
-  // // while | until
-  // printf("(%s ", node->negate ? "until" : "while");
-  // visit((luna_node_t *) node->expr);
-  // ++indents;
-  // printf("\n");
-  // visit((luna_node_t *) node->block);
-  // --indents;
-  // printf(")\n");
+visit_if(luna_visitor_t *self, luna_if_node_t *node) {
+  luna_codegen_t *gen = (luna_codegen_t *) self->data;
+  luna_jumps_t next, done;
+  kv_init(next);
+  kv_init(done);
+
+  // hot else
+  if (node->else_block && !luna_vec_length(node->else_ifs) && cold(gen, node)) {
+    count(gen, LUNA_PROFILE_BRANCH, node->base.id);
+    branch(self, node->expr, !node->negate, &next);
+    visit((luna_node_t *) node->else_block);
+    jump(gen, &done);
+    patch(gen, &next);
+    count(gen, LUNA_PROFILE_TAKEN, node->base.id);
+    visit((luna_node_t *) node->block);
+    patch(gen, &done);
+    return;
+  }
+
+  // if
+  count(gen, LUNA_PROFILE_BRANCH, node->base.id);
+  branch(self, node->expr, node->negate, &next);
+  count(gen, LUNA_PROFILE_TAKEN, node->base.id);
+  visit((luna_node_t *) node->block);
+
+  // else ifs
+  luna_vec_each(node->else_ifs, {
+    luna_if_node_t *else_if = (luna_if_node_t *) luna_as_pointer(val);
+    jump(gen, &done);
+    patch(gen, &next);
+    count(gen, LUNA_PROFILE_BRANCH, else_if->base.id);
+    branch(self, else_if->expr, 0, &next);
+    count(gen, LUNA_PROFILE_TAKEN, else_if->base.id);
+    visit((luna_node_t *) else_if->block);
+  });
+
+  // else
+  if (node->else_block) {
+    jump(gen, &done);
+    patch(gen, &next);
+    visit((luna_node_t *) node->else_block);
+  }
+
+  patch(gen, &next);
+  patch(gen, &done);
 }
 
 /*
- * Visit `return` node.
+ * Initialize code generator `gen` for body `node` of
+ * `fn`, sharing the program state of `parent`.
  */
 
 static void
-visit_return(luna_visitor_t *self, luna_return_node_t *node) {
-  // printf("(return");
-  // if (node->expr) {
-  //   ++indents;
-  //   printf("\n");
-  //   INDENT;
-  //   visit((luna_node_t *) node->expr);
-  //   --indents;
-  // }
-  // printf(")");
+init(luna_codegen_t *gen, luna_codegen_t *parent, luna_activation_t *fn, luna_node_t *node) {
+  gen->unit = parent->unit;
+  gen->overloads = parent->overloads;
+  gen->generics = parent->generics;
+  gen->upvalues = parent->upvalues;
+  gen->layouts = parent->layouts;
+  gen->records = NULL;
+  gen->profile = parent->profile;
+  gen->instrument = parent->instrument;
+  gen->fn = fn;
+  gen->reg = 0;
+  gen->nlocals = 0;
+  gen->dst = -1;
+  gen->last = -1;
+  gen->lineno = node->lineno;
+  gen->locals = kh_init(locals);
+  gen->fields = kh_init(locals);
+  gen->scalars = luna_escape(node);
+  gen->cells = kh_init(scalars);
+  gen->cse = NULL;
+  gen->values = -1;
 }
 
 /*
- * Visit if `node`.
+ * Free the state of code generator `gen`.
  */
 
 static void
-visit_if(luna_visitor_t *self, luna_if_node_t *node) {
-  // // if
-  // printf("(%s ", node->negate ? "unless" : "if");
-  // visit((luna_node_t *) node->expr);
-  // ++indents;
-  // printf("\n");
-  // visit((luna_node_t *) node->block);
-  // --indents;
-  // printf(")");
-
-  // // else ifs
-  // luna_vec_each(node->else_ifs, {
-  //   luna_if_node_t *else_if = (luna_if_node_t *) val->value.as_pointer;
-  //   printf("\n");
-  //   INDENT;
-  //   printf("(else if ");
-  //   visit((luna_node_t *) else_if->expr);
-  //   ++indents;
-  //   printf("\n");
-  //   visit((luna_node_t *) else_if->block);
-  //   --indents;
-  //   printf(")");
-  // });
+destroy(luna_codegen_t *gen) {
+  for (khiter_t k = kh_begin(gen->fields); k != kh_end(gen->fields); ++k) {
+    if (kh_exist(gen->fields, k)) free((char *) kh_key(gen->fields, k));
+  }
 
-  // // else
-  // if (node->else_block) {
-  //   printf("\n");
-  //   INDENT;
-  //   printf("(else\n");
-  //   ++indents;
-  //   visit((luna_node_t *) node->else_block);
-  //   --indents;
-  //   printf(")");
-  // }
+  kh_destroy(locals, gen->locals);
+  kh_destroy(locals, gen->fields);
+  kh_destroy(scalars, gen->scalars);
+  kh_destroy(scalars, gen->cells);
+  if (gen->cse) luna_cse_free(gen->cse);
+  if (gen->records) luna_records_free(gen->records);
 }
 
 /*
- * Visit `type` node.
+ * Move the captured locals of `body` into cells of their own.
  */
 
 static void
-visit_type(luna_visitor_t *self, luna_type_node_t *node) {
+box(luna_codegen_t *gen, void *body) {
+  luna_captures_t *cells = luna_upvalues_cells(gen->upvalues, body);
+  if (!cells) return;
 
+  for (int i = 0; i < kv_size(*cells); ++i) {
+    int ret;
+    const char *name = kv_A(*cells, i).name;
+    emit(BOX, define(gen, name), 0, 0);
+    kh_put(scalars, gen->cells, name, &ret);
+  }
 }
 
 /*
- * Visit use `node`.
+ * Number the values of `body`, reserving
+ * a temporary for each of those reused.
  */
 
 static void
-visit_use(luna_visitor_t *self, luna_use_node_t *node) {
-
+number(luna_codegen_t *gen, luna_node_t *body) {
+  gen->cse = luna_cse(body, gen->cells);
+  gen->values = gen->reg;
+  for (int i = 0; i < gen->cse->nvalues; ++i) alloc(gen);
+  gen->nlocals = gen->reg;
 }
 
 /*
- * Generate code for the given `node`.
+ * Generate code for `node` with `gen`.
  */
 
-luna_vm_t *
-luna_gen(luna_node_t *node) {
-  luna_vm_t *vm = malloc(sizeof(luna_vm_t));
-  if (!vm) return NULL;
-  vm->main = malloc(sizeof(luna_activation_t));
-  vm->main->nconstants = 0;
-  vm->main->constants = malloc(1024 * sizeof(int)); // TODO: vec / objects
-  vm->main->ip = vm->main->code = malloc(64 * 1024);
-
+static void
+generate(luna_codegen_t *gen, luna_node_t *node) {
   luna_visitor_t visitor = {
-    .data = (void *) vm,
+    .data = (void *) gen,
     .visit_if = visit_if,
     .visit_id = visit_id,
     .visit_int = visit_int,
@@ -388,22 +2019,341 @@ luna_gen(luna_node_t *node) {
     .visit_array = visit_array,
     .visit_while = visit_while,
     .visit_block = visit_block,
-    .visit_decl = visit_decl,
+    .visit_let = visit_let,
     .visit_float = visit_float,
     .visit_string = visit_string,
     .visit_return = visit_return,
     .visit_function = visit_function,
     .visit_unary_op = visit_unary_op,
     .visit_binary_op = visit_binary_op,
-    .visit_subscript = visit_subscript,
-    .visit_type = visit_type,
-    .visit_use = visit_use
+    .visit_subscript = visit_subscript
   };
 
   luna_visit(&visitor, node);
-  emit(HALT, 0, 0, 0);
-  
-  // Reset code so we can free it later
-  vm->main->code = vm->main->ip;
+}
+
+/*
+ * Generate function `node` into `fn`. Parameters occupy the
+ * first registers, followed by the captures of its closure,
+ * omitted parameters are assigned their default. Those
+ * declared of a record type are checked for its layout.
+ */
+
+static void
+function(luna_codegen_t *parent, luna_function_node_t *node, luna_activation_t *fn) {
+  luna_codegen_t codegen;
+  luna_codegen_t *gen = &codegen;
+  luna_param_t params[LUNA_MAX_PARAMS];
+  init(gen, parent, fn, (luna_node_t *) node->block);
+  gen->records = luna_records_new(gen->layouts, gen->upvalues, node, (luna_node_t *) node->block);
+  gen->lineno = node->base.lineno;
+
+  fn->nparams = luna_params(node, params);
+  fn->params = malloc(fn->nparams * sizeof(luna_object));
+  for (int i = 0; i < fn->nparams; ++i) {
+    fn->params[i] = params[i].type;
+    if (!params[i].value) fn->nrequired = i + 1;
+    define(gen, params[i].name);
+  }
+
+  luna_captures_t *captures = luna_upvalues_captures(gen->upvalues, node);
+  if (captures) {
+    for (int i = 0; i < kv_size(*captures); ++i) {
+      int ret;
+      luna_capture_t capture = kv_A(*captures, i);
+      define(gen, capture.name);
+      if (capture.cell) kh_put(scalars, gen->cells, capture.name, &ret);
+    }
+    fn->nupvalues = kv_size(*captures);
+  } else {
+    fn->closure = malloc(sizeof(luna_closure_t));
+    fn->closure->fn = fn;
+  }
+
+  count(gen, LUNA_PROFILE_ENTRY, node->base.id);
+
+  for (int i = 0; i < fn->nparams; ++i) {
+    if (!params[i].value) continue;
+    luna_jumps_t passed;
+    kv_init(passed);
+    emit(ARGC, 0, i, 0);
+    jump(gen, &passed);
+    gen->dst = i;
+    generate(gen, params[i].value);
+    gen->dst = -1;
+    patch(gen, &passed);
+  }
+
+  // dispatch only checks the tag of records and arrays
+  for (int i = 0; i < fn->nparams; ++i) {
+    declared(gen, params[i].name, slot(gen, params[i].name), NULL);
+  }
+
+  box(gen, node);
+  number(gen, (luna_node_t *) node->block);
+  generate(gen, (luna_node_t *) node->block);
+
+  // ran off the end
+  int r = alloc(gen);
+  emit(LOADNIL, r, 0, 0);
+  emit(RETURN, r, 0, 0);
+  destroy(gen);
+}
+
+/*
+ * Compile `unit`, a named function or the main body.
+ */
+
+static void
+compile_unit(luna_codegen_t *program, luna_unit_t *unit) {
+  luna_codegen_t codegen;
+  luna_codegen_t *gen = &codegen;
+  program->unit = unit;
+
+  if (LUNA_NODE_FUNCTION == unit->node->type) {
+    function(program, (luna_function_node_t *) unit->node, unit->fn);
+    return;
+  }
+
+  init(gen, program, unit->fn, unit->node);
+  gen->records = luna_records_new(gen->layouts, gen->upvalues, NULL, unit->node);
+  box(gen, unit->node);
+  number(gen, unit->node);
+  generate(gen, unit->node);
+
+  // the program's value
+  int r = gen->last;
+  if (r < 0) emit(LOADNIL, r = alloc(gen), 0, 0);
+  emit(HALT, r, 0, 0);
+  destroy(gen);
+}
+
+/*
+ * Relocate the closures, call sites and probes of `fn`
+ * by `functions`, `sites` and `probes` respectively.
+ */
+
+static void
+relocate(luna_activation_t *fn, int functions, int sites, int probes) {
+  for (int j = 0; j < fn->ncode; ++j) {
+    luna_instruction_t i = fn->code[j];
+    switch (OP(i)) {
+      case LUNA_OP_CLOSURE:
+        fn->code[j] = ABx(CLOSURE, A(i), BX(i) + functions);
+        break;
+      case LUNA_OP_DISPATCH:
+        fn->code[j] = ABx(DISPATCH, A(i), BX(i) + sites);
+        break;
+      case LUNA_OP_FEEDBACK:
+        fn->code[j] = ABx(FEEDBACK, A(i), BX(i) + probes);
+        break;
+      case LUNA_OP_COUNT:
+        fn->code[j] = ABx(COUNT, A(i), BX(i) + probes);
+        break;
+    }
+  }
+}
+
+/*
+ * Link `unit` into `vm`, appending its closures,
+ * call sites and probes.
+ */
+
+static void
+link_unit(luna_vm_t *vm, luna_unit_t *unit) {
+  int functions = kv_size(vm->functions);
+  int sites = kv_size(vm->sites);
+  int probes = kv_size(vm->probes);
+
+  for (int i = 0; i < kv_size(unit->closures); ++i) {
+    kv_push(luna_activation_t *, vm->functions, kv_A(unit->closures, i));
+  }
+
+  for (int i = 0; i < kv_size(unit->sites); ++i) {
+    luna_site_t site = kv_A(unit->sites, i);
+    luna_site_new(vm, site.generic, site.nargs);
+  }
+
+  for (int i = 0; i < kv_size(unit->probes); ++i) {
+    kv_push(uint64_t, vm->probes, kv_A(unit->probes, i));
+  }
+
+  // referred to by 16 bit operands
+  if (kv_size(vm->functions) > 0x10000 && !vm->err) vm->err = "too many functions";
+  if (kv_size(vm->sites) > 0x10000 && !vm->err) vm->err = "too many call sites";
+  if (kv_size(vm->probes) > 0x10000 && !vm->err) vm->err = "too many probes";
+
+  relocate(unit->fn, functions, sites, probes);
+  for (int i = 0; i < kv_size(unit->closures); ++i) {
+    relocate(kv_A(unit->closures, i), functions, sites, probes);
+  }
+
+  kv_destroy(unit->closures);
+  kv_destroy(unit->sites);
+  kv_destroy(unit->probes);
+}
+
+/*
+ * Work queue of the units left to compile.
+ */
+
+typedef struct {
+  luna_codegen_t *program;
+  luna_unit_t *units;
+  int nunits;
+  int next;
+  pthread_mutex_t lock;
+} queue_t;
+
+/*
+ * Compile units from `data` until none are left.
+ */
+
+static void *
+worker(void *data) {
+  queue_t *queue = (queue_t *) data;
+  luna_codegen_t program = *queue->program;
+
+  for (;;) {
+    pthread_mutex_lock(&queue->lock);
+    int i = queue->next++;
+    pthread_mutex_unlock(&queue->lock);
+    if (i >= queue->nunits) return NULL;
+    compile_unit(&program, &queue->units[i]);
+  }
+}
+
+/*
+ * Number of processors online.
+ */
+
+static int
+cpus() {
+#ifdef _SC_NPROCESSORS_ONLN
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > 0) return n;
+#endif
+  return 1;
+}
+
+/*
+ * Generate code for the given `node`, compiling
+ * on as many threads as there are processors.
+ */
+
+luna_vm_t *
+luna_gen(luna_node_t *node) {
+  return luna_gen_threads(node, cpus());
+}
+
+/*
+ * Generate code for the given `node` on up to `nthreads` threads.
+ */
+
+luna_vm_t *
+luna_gen_threads(luna_node_t *node, int nthreads) {
+  luna_gen_options_t options = { .threads = nthreads };
+  return luna_gen_with(node, &options);
+}
+
+/*
+ * Generate code for the given `node` with `options`, on as
+ * many threads as there are processors unless given. Each
+ * named function and the main body are compiled as units of
+ * their own, which only read the analyses and profile shared
+ * between them, and are linked in definition order so that
+ * the output does not depend on the number of threads.
+ * Programs exceeding the limits of the vm compile to a vm
+ * failing with `err`, which must not be evaluated.
+ */
+
+luna_vm_t *
+luna_gen_with(luna_node_t *node, luna_gen_options_t *options) {
+  int nthreads = options->threads > 0 ? options->threads : cpus();
+  luna_vm_t *vm = malloc(sizeof(luna_vm_t));
+  if (!vm) return NULL;
+  vm->main = luna_activation_new();
+  kv_init(vm->functions);
+  kv_init(vm->generics);
+  kv_init(vm->sites);
+  long nursery = options->nursery ? options->nursery : LUNA_GC_NURSERY;
+  long budget = options->budget ? options->budget : LUNA_GC_BUDGET;
+  luna_gc_init(&vm->gc, nursery > 0 ? nursery : 0, budget > 0 ? budget : 0, options->concurrent);
+  vm->shapes = luna_shape_new();
+  vm->layouts = luna_layouts_new(node);
+  vm->frame = NULL;
+  kv_init(vm->probes);
+  vm->profile = options->instrument ? luna_profile_new() : NULL;
+  vm->err = NULL;
+  vm->lineno = 0;
+
+  // functions are indexed in definition order
+  luna_overloads_t *overloads = luna_overloads_new(node);
+  int ndefs = kv_size(overloads->defs);
+  if (ndefs > 256) vm->err = "too many functions";
+  for (int i = 0; i < ndefs; ++i) {
+    kv_push(luna_activation_t *, vm->functions, luna_activation_new());
+  }
+
+  luna_codegen_t program = {
+    .overloads = overloads,
+    .generics = kh_init(locals),
+    .upvalues = luna_upvalues_new(node),
+    .layouts = vm->layouts,
+    .profile = options->profile,
+    .instrument = options->instrument
+  };
+
+  // one generic function per name
+  for (int i = 0; i < ndefs; ++i) {
+    int ret;
+    khiter_t k = kh_put(locals, program.generics, kv_A(overloads->defs, i)->name, &ret);
+    if (ret) kh_value(program.generics, k) = luna_generic_new(vm);
+  }
+
+  // the main body is the last unit
+  int nunits = ndefs + 1;
+  luna_unit_t *units = malloc(nunits * sizeof(luna_unit_t));
+  for (int i = 0; i < nunits; ++i) {
+    units[i].node = i < ndefs ? (luna_node_t *) kv_A(overloads->defs, i) : node;
+    units[i].fn = i < ndefs ? kv_A(vm->functions, i) : vm->main;
+    kv_init(units[i].closures);
+    kv_init(units[i].sites);
+    kv_init(units[i].probes);
+    units[i].err = NULL;
+    units[i].lineno = 0;
+  }
+
+  queue_t queue = { .program = &program, .units = units, .nunits = nunits, .next = 0 };
+  pthread_mutex_init(&queue.lock, NULL);
+
+  if (nthreads > nunits) nthreads = nunits;
+  if (nthreads > LUNA_MAX_THREADS) nthreads = LUNA_MAX_THREADS;
+
+  pthread_t threads[LUNA_MAX_THREADS];
+  int nstarted = 0;
+  while (nstarted < nthreads - 1
+    && !pthread_create(&threads[nstarted], NULL, worker, &queue)) ++nstarted;
+  worker(&queue);
+  for (int i = 0; i < nstarted; ++i) pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&queue.lock);
+
+  for (int i = 0; i < ndefs; ++i) {
+    khiter_t k = kh_get(locals, program.generics, kv_A(overloads->defs, i)->name);
+    luna_generic_define(vm, kh_value(program.generics, k), i);
+  }
+
+  // the first unit failing fails the program
+  for (int i = 0; i < nunits && !vm->err; ++i) {
+    vm->err = units[i].err;
+    vm->lineno = units[i].lineno;
+  }
+
+  for (int i = 0; i < nunits; ++i) link_unit(vm, &units[i]);
+
+  free(units);
+  kh_destroy(locals, program.generics);
+  luna_upvalues_free(program.upvalues);
+  luna_overloads_free(overloads);
   return vm;
 }
@@ -10,10 +10,99 @@
 
 #include "ast.h"
 #include "vm.h"
+#include "khash.h"
+#include "escape.h"
+#include "cse.h"
+#include "dispatch.h"
+#include "upvalues.h"
+#include "layouts.h"
+#include "profile.h"
+
+/*
+ * Maximum number of compiler threads.
+ */
+
+#define LUNA_MAX_THREADS 16
+
+// local registers
+
+KHASH_MAP_INIT_STR(locals, int);
+
+/*
+ * Compilation unit, a named function or the main body
+ * compiled independently of the others. The closures and
+ * call sites and probes it creates are numbered from zero
+ * and relocated when the unit is linked into the vm. Units
+ * exceeding the limits of the vm fail with `err`, at
+ * line `lineno`.
+ */
+
+typedef struct {
+  luna_node_t *node;
+  luna_activation_t *fn;
+  kvec_t(luna_activation_t *) closures;
+  kvec_t(luna_site_t) sites;
+  kvec_t(uint64_t) probes;
+  const char *err;
+  int lineno;
+} luna_unit_t;
+
+/*
+ * Code generation options. Instrumented code counts function
+ * entries, branch directions and the type tuples of polymorphic
+ * sites into the vm's profile, code generated with a `profile`
+ * is laid out and specialized for the behaviour it recorded.
+ * The vm's nursery is `nursery` bytes and it marks `budget`
+ * bytes per incremental step, LUNA_GC_NURSERY and LUNA_GC_BUDGET
+ * when 0, negative for no nursery and marking all at once.
+ * A `concurrent` vm marks on a collector thread instead.
+ */
+
+typedef struct {
+  int threads;
+  int instrument;
+  luna_profile_t *profile;
+  long nursery;
+  long budget;
+  int concurrent;
+} luna_gen_options_t;
+
+/*
+ * Code generator.
+ */
+
+typedef struct {
+  luna_unit_t *unit;
+  luna_activation_t *fn;
+  luna_overloads_t *overloads;
+  khash_t(locals) *generics;
+  luna_upvalues_t *upvalues;
+  luna_layouts_t *layouts;
+  luna_records_t *records;
+  luna_profile_t *profile;
+  int instrument;
+  int reg;
+  int nlocals;
+  int dst;
+  int last;
+  int lineno;
+  khash_t(locals) *locals;
+  khash_t(locals) *fields;
+  khash_t(scalars) *scalars;
+  khash_t(scalars) *cells;
+  luna_cse_t *cse;
+  int values;
+} luna_codegen_t;
 
 // protos
 
 luna_vm_t *
 luna_gen(luna_node_t *node);
 
+luna_vm_t *
+luna_gen_threads(luna_node_t *node, int nthreads);
+
+luna_vm_t *
+luna_gen_with(luna_node_t *node, luna_gen_options_t *options);
+
 #endif /* LUNA_CODE_H */
@@ -0,0 +1,712 @@
+
+//
+// cse.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cse.h"
+#include "vec.h"
+#include "visitor.h"
+#include "internal.h"
+
+// value index by key
+
+KHASH_MAP_INIT_STR(keys, int);
+
+/*
+ * Pure value, the locals it reads, whether it reads fields
+ * of aggregates, and the nodes computing it. Its number
+ * is assigned once it is first reused.
+ */
+
+typedef struct {
+  char *key;
+  kvec_t(const char *) names;
+  int fields;
+  int number;
+  kvec_t(luna_node_t *) nodes;
+} value_t;
+
+/*
+ * Indices of the values available at a point.
+ */
+
+typedef kvec_t(int) available_t;
+
+/*
+ * Value numbering state. While `probing` a loop for what it
+ * changes, values are neither saved nor reused and the
+ * locals killed are recorded in `kills`, NULL standing
+ * for calls.
+ */
+
+typedef struct {
+  kvec_t(value_t *) values;
+  khash_t(keys) *keys;
+  khash_t(scalars) *cells;
+  available_t available;
+  int dead;
+  int probing;
+  kvec_t(const char *) kills;
+  luna_cse_t *result;
+} cse_t;
+
+/*
+ * Node of the given `val`.
+ */
+
+#define NODE(val) ((luna_node_t *) luna_as_pointer(val))
+
+/*
+ * Value numbering state of the visitor.
+ */
+
+#define STATE ((cse_t *) self->data)
+
+/*
+ * Check if `op` is arithmetic or bitwise.
+ */
+
+static int
+arithmetic(luna_token op) {
+  switch (op) {
+    case LUNA_TOKEN_OP_PLUS:
+    case LUNA_TOKEN_OP_MINUS:
+    case LUNA_TOKEN_OP_MUL:
+    case LUNA_TOKEN_OP_DIV:
+    case LUNA_TOKEN_OP_MOD:
+    case LUNA_TOKEN_OP_POW:
+    case LUNA_TOKEN_OP_BIT_SHL:
+    case LUNA_TOKEN_OP_BIT_SHR:
+    case LUNA_TOKEN_OP_BIT_AND:
+    case LUNA_TOKEN_OP_BIT_OR:
+    case LUNA_TOKEN_OP_BIT_XOR:
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Check if the operands of `op` commute.
+ */
+
+static int
+commutative(luna_token op) {
+  switch (op) {
+    case LUNA_TOKEN_OP_PLUS:
+    case LUNA_TOKEN_OP_MUL:
+    case LUNA_TOKEN_OP_BIT_AND:
+    case LUNA_TOKEN_OP_BIT_OR:
+    case LUNA_TOKEN_OP_BIT_XOR:
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Check if `op` is an assignment.
+ */
+
+static int
+assignment(luna_token op) {
+  switch (op) {
+    case LUNA_TOKEN_OP_ASSIGN:
+    case LUNA_TOKEN_OP_PLUS_ASSIGN:
+    case LUNA_TOKEN_OP_MINUS_ASSIGN:
+    case LUNA_TOKEN_OP_MUL_ASSIGN:
+    case LUNA_TOKEN_OP_DIV_ASSIGN:
+    case LUNA_TOKEN_OP_AND_ASSIGN:
+    case LUNA_TOKEN_OP_OR_ASSIGN:
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Write the key of `node` to `buf`, adding the locals it reads
+ * to `val`. Operands of commutative operations are ordered, so
+ * that `a * b` and `b * a` share a key. Returns 0 unless `node`
+ * is pure: constants, locals, constant fields of locals, and
+ * arithmetic on those.
+ */
+
+static int
+describe(luna_node_t *node, char *buf, size_t len, value_t *val) {
+  char a[256], b[256];
+
+  switch (node->type) {
+    case LUNA_NODE_INT:
+      return snprintf(buf, len, "%d", ((luna_int_node_t *) node)->val) < len;
+    case LUNA_NODE_FLOAT:
+      return snprintf(buf, len, "%a", ((luna_float_node_t *) node)->val) < len;
+    case LUNA_NODE_ID: {
+      const char *name = ((luna_id_node_t *) node)->val;
+      kv_push(const char *, val->names, name);
+      return snprintf(buf, len, "$%s", name) < len;
+    }
+    case LUNA_NODE_SLOT:
+    case LUNA_NODE_SUBSCRIPT: {
+      // same layout
+      luna_slot_node_t *slot = (luna_slot_node_t *) node;
+      if (LUNA_NODE_ID != slot->left->type) return 0;
+      // a[i] is keyed by the value of i
+      if (LUNA_NODE_SUBSCRIPT == node->type && LUNA_NODE_ID == slot->right->type) return 0;
+      const char *name = ((luna_id_node_t *) slot->left)->val;
+      if (!luna_field(a, sizeof(a), name, slot->right)) return 0;
+      kv_push(const char *, val->names, name);
+      val->fields = 1;
+      return snprintf(buf, len, "@%s", a) < len;
+    }
+    case LUNA_NODE_UNARY_OP: {
+      luna_unary_op_node_t *op = (luna_unary_op_node_t *) node;
+      if (LUNA_TOKEN_OP_MINUS != op->op && LUNA_TOKEN_OP_BIT_NOT != op->op) return 0;
+      if (!describe(op->expr, a, sizeof(a), val)) return 0;
+      return snprintf(buf, len, "(u%d %s)", op->op, a) < len;
+    }
+    case LUNA_NODE_BINARY_OP: {
+      luna_binary_op_node_t *op = (luna_binary_op_node_t *) node;
+      if (!arithmetic(op->op)) return 0;
+      if (!describe(op->left, a, sizeof(a), val)) return 0;
+      if (!describe(op->right, b, sizeof(b), val)) return 0;
+      if (commutative(op->op) && strcmp(a, b) > 0) {
+        return snprintf(buf, len, "(%d %s %s)", op->op, b, a) < len;
+      }
+      return snprintf(buf, len, "(%d %s %s)", op->op, a, b) < len;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Return the index of the value `node` computes, or -1 unless pure.
+ */
+
+static int
+intern(cse_t *state, luna_node_t *node) {
+  char buf[256];
+  value_t tmp = { .fields = 0, .number = -1 };
+  int ret;
+
+  kv_init(tmp.names);
+  if (!describe(node, buf, sizeof(buf), &tmp)) {
+    kv_destroy(tmp.names);
+    return -1;
+  }
+
+  khiter_t k = kh_get(keys, state->keys, buf);
+  if (k != kh_end(state->keys)) {
+    kv_destroy(tmp.names);
+    return kh_value(state->keys, k);
+  }
+
+  value_t *val = malloc(sizeof(value_t));
+  *val = tmp;
+  val->key = strdup(buf);
+  kv_init(val->nodes);
+  kv_push(value_t *, state->values, val);
+  k = kh_put(keys, state->keys, val->key, &ret);
+  return kh_value(state->keys, k) = kv_size(state->values) - 1;
+}
+
+/*
+ * Check if value `index` is available.
+ */
+
+static int
+available(cse_t *state, int index) {
+  for (int i = 0; i < kv_size(state->available); ++i) {
+    if (index == kv_A(state->available, i)) return 1;
+  }
+  return 0;
+}
+
+/*
+ * Record the `role` of `node` for value `number`.
+ */
+
+static void
+mark(cse_t *state, luna_node_t *node, int number, luna_cse_role role) {
+  int ret;
+  khiter_t k = kh_put(numbers, state->result->nodes, (uintptr_t) node, &ret);
+  kh_value(state->result->nodes, k) = number << 2 | role;
+}
+
+/*
+ * Make value `index` computed by `node` available.
+ */
+
+static void
+generate(cse_t *state, int index, luna_node_t *node) {
+  value_t *val = kv_A(state->values, index);
+  if (!state->probing) {
+    kv_push(luna_node_t *, val->nodes, node);
+    if (val->number > -1) mark(state, node, val->number, LUNA_CSE_SAVE);
+  }
+  if (!available(state, index)) kv_push(int, state->available, index);
+}
+
+/*
+ * Reuse available value `index` for `node`, numbering it and
+ * saving it at each node computing it when first reused.
+ * Returns 0 when out of temporaries.
+ */
+
+static int
+reuse(cse_t *state, int index, luna_node_t *node) {
+  value_t *val = kv_A(state->values, index);
+  if (state->probing) return 1;
+
+  if (val->number < 0) {
+    if (LUNA_CSE_VALUES == state->result->nvalues) return 0;
+    val->number = state->result->nvalues++;
+    for (int i = 0; i < kv_size(val->nodes); ++i) {
+      mark(state, kv_A(val->nodes, i), val->number, LUNA_CSE_SAVE);
+    }
+  }
+
+  mark(state, node, val->number, LUNA_CSE_REUSE);
+  return 1;
+}
+
+/*
+ * Check if a store to local `name` kills `val`, NULL
+ * standing for calls, which may store to fields
+ * and to locals living in cells.
+ */
+
+static int
+killed(cse_t *state, value_t *val, const char *name) {
+  if (!name && val->fields) return 1;
+  for (int i = 0; i < kv_size(val->names); ++i) {
+    const char *other = kv_A(val->names, i);
+    if (name && 0 == strcmp(name, other)) return 1;
+    if (!name && state->cells && kh_get(scalars, state->cells, other) != kh_end(state->cells)) return 1;
+  }
+  return 0;
+}
+
+/*
+ * Make the values killed by a store to `name` unavailable.
+ */
+
+static void
+forget(cse_t *state, const char *name) {
+  int n = 0;
+  for (int i = 0; i < kv_size(state->available); ++i) {
+    int index = kv_A(state->available, i);
+    if (killed(state, kv_A(state->values, index), name)) continue;
+    kv_A(state->available, n++) = index;
+  }
+  state->available.n = n;
+}
+
+/*
+ * Store to `name`, or call when NULL.
+ */
+
+static void
+kill(cse_t *state, const char *name) {
+  if (state->probing) kv_push(const char *, state->kills, name);
+  forget(state, name);
+}
+
+/*
+ * Return a copy of `available`.
+ */
+
+static available_t
+copy(available_t *available) {
+  available_t ret;
+  kv_init(ret);
+  if (kv_size(*available)) kv_copy(int, ret, *available);
+  return ret;
+}
+
+/*
+ * Continue from `available`, reachable.
+ */
+
+static void
+restore(cse_t *state, available_t *available) {
+  kv_destroy(state->available);
+  state->available = copy(available);
+  state->dead = 0;
+}
+
+/*
+ * Join the current path into `out`, keeping the values
+ * available on every path reaching the join.
+ */
+
+static void
+join(cse_t *state, available_t *out, int *reached) {
+  if (state->dead) return;
+
+  if (!*reached) {
+    *out = copy(&state->available);
+    *reached = 1;
+    return;
+  }
+
+  int n = 0;
+  for (int i = 0; i < kv_size(*out); ++i) {
+    int index = kv_A(*out, i);
+    if (available(state, index)) kv_A(*out, n++) = index;
+  }
+  out->n = n;
+}
+
+/*
+ * Visit `node`, evaluated only on some paths.
+ */
+
+static void
+conditional(luna_visitor_t *self, luna_node_t *node) {
+  cse_t *state = STATE;
+  available_t saved = copy(&state->available);
+  int dead = state->dead;
+  visit(node);
+  kv_destroy(state->available);
+  state->available = saved;
+  state->dead = dead;
+}
+
+/*
+ * Kill the location assigned by `node`.
+ */
+
+static void
+store(luna_visitor_t *self, luna_node_t *node) {
+  cse_t *state = STATE;
+
+  switch (node->type) {
+    case LUNA_NODE_ID:
+      kill(state, ((luna_id_node_t *) node)->val);
+      break;
+    case LUNA_NODE_SLOT:
+    case LUNA_NODE_SUBSCRIPT: {
+      luna_slot_node_t *slot = (luna_slot_node_t *) node;
+      if (LUNA_NODE_SUBSCRIPT == node->type) visit(slot->right);
+      if (LUNA_NODE_ID != slot->left->type) visit(slot->left);
+      // the aggregate may be aliased
+      kill(state, NULL);
+      break;
+    }
+  }
+}
+
+/*
+ * Visit block `node`, statements following
+ * a `return` are unreachable.
+ */
+
+static void
+visit_block(luna_visitor_t *self, luna_block_node_t *node) {
+  luna_vec_each(node->stmts, {
+    if (STATE->dead) break;
+    visit(NODE(val));
+  });
+}
+
+/*
+ * Reuse the value of `node` when available, otherwise visit
+ * its operands `left` and `right` and make it available.
+ */
+
+static void
+value(luna_visitor_t *self, luna_node_t *node, luna_node_t *left, luna_node_t *right) {
+  cse_t *state = STATE;
+  int index = intern(state, node);
+  if (index > -1 && available(state, index) && reuse(state, index, node)) return;
+  visit(left);
+  if (right) visit(right);
+  if (index > -1) generate(state, index, node);
+}
+
+/*
+ * Visit slot `node`, loads of constant fields are pure.
+ */
+
+static void
+visit_slot(luna_visitor_t *self, luna_slot_node_t *node) {
+  if (LUNA_NODE_ID != node->left->type) {
+    visit(node->left);
+    return;
+  }
+  value(self, (luna_node_t *) node, node->left, NULL);
+}
+
+/*
+ * Visit subscript `node`, loads of constant keys are pure.
+ */
+
+static void
+visit_subscript(luna_visitor_t *self, luna_subscript_node_t *node) {
+  if (LUNA_NODE_ID != node->left->type) {
+    visit(node->left);
+    visit(node->right);
+    return;
+  }
+  value(self, (luna_node_t *) node, node->left, node->right);
+}
+
+/*
+ * Visit call `node`, which may store to fields and cells.
+ */
+
+static void
+visit_call(luna_visitor_t *self, luna_call_node_t *node) {
+  if (LUNA_NODE_ID != node->expr->type) visit(node->expr);
+  luna_vec_each(node->args->vec, visit(NODE(val)));
+  luna_hash_each_val(node->args->hash, visit(NODE(val)));
+  kill(STATE, NULL);
+}
+
+/*
+ * Visit array `node`.
+ */
+
+static void
+visit_array(luna_visitor_t *self, luna_array_node_t *node) {
+  luna_vec_each(node->vals, visit(NODE(val)));
+}
+
+/*
+ * Visit hash `node`, id keys are names not references.
+ */
+
+static void
+visit_hash(luna_visitor_t *self, luna_hash_node_t *node) {
+  luna_vec_each(node->pairs, {
+    luna_hash_pair_node_t *pair = (luna_hash_pair_node_t *) NODE(val);
+    if (LUNA_NODE_ID != pair->key->type) visit(pair->key);
+    visit(pair->val);
+  });
+}
+
+/*
+ * Visit unary op `node`.
+ */
+
+static void
+visit_unary_op(luna_visitor_t *self, luna_unary_op_node_t *node) {
+  if (LUNA_TOKEN_OP_INCR == node->op || LUNA_TOKEN_OP_DECR == node->op) {
+    store(self, node->expr);
+  } else {
+    visit(node->expr);
+  }
+}
+
+/*
+ * Visit binary op `node`. Pure values already available are
+ * reused, their operands are not evaluated again.
+ */
+
+static void
+visit_binary_op(luna_visitor_t *self, luna_binary_op_node_t *node) {
+  // = += -= *= /= &&= ||=
+  if (assignment(node->op)) {
+    if (LUNA_TOKEN_OP_AND_ASSIGN == node->op || LUNA_TOKEN_OP_OR_ASSIGN == node->op) {
+      conditional(self, node->right);
+    } else {
+      visit(node->right);
+    }
+    store(self, node->left);
+    return;
+  }
+
+  // && ||
+  if (LUNA_TOKEN_OP_AND == node->op || LUNA_TOKEN_OP_OR == node->op) {
+    visit(node->left);
+    conditional(self, node->right);
+    return;
+  }
+
+  if (arithmetic(node->op)) {
+    value(self, (luna_node_t *) node, node->left, node->right);
+    return;
+  }
+
+  visit(node->left);
+  visit(node->right);
+}
+
+/*
+ * Visit let `node`.
+ */
+
+static void
+visit_let(luna_visitor_t *self, luna_let_node_t *node) {
+  luna_vec_each(node->vec, {
+    luna_binary_op_node_t *bin = (luna_binary_op_node_t *) NODE(val);
+    luna_decl_node_t *decl = (luna_decl_node_t *) bin->left;
+    if (bin->right) visit(bin->right);
+    luna_vec_each(decl->vec, store(self, NODE(val)));
+  });
+}
+
+/*
+ * Visit `return` node.
+ */
+
+static void
+visit_return(luna_visitor_t *self, luna_return_node_t *node) {
+  if (node->expr) visit(node->expr);
+  STATE->dead = 1;
+}
+
+/*
+ * Visit `while` node. The values killed anywhere in the loop
+ * are unavailable from its first iteration, those computed
+ * by the body do not survive it.
+ */
+
+static void
+visit_while(luna_visitor_t *self, luna_while_node_t *node) {
+  cse_t *state = STATE;
+  int start = kv_size(state->kills);
+  available_t entry = copy(&state->available);
+
+  // kills
+  state->probing++;
+  visit(node->expr);
+  visit((luna_node_t *) node->block);
+  state->probing--;
+
+  restore(state, &entry);
+  kv_destroy(entry);
+  int end = kv_size(state->kills);
+  for (int i = start; i < end; ++i) forget(state, kv_A(state->kills, i));
+  if (!state->probing) state->kills.n = start;
+
+  visit(node->expr);
+  available_t exit = copy(&state->available);
+  visit((luna_node_t *) node->block);
+  restore(state, &exit);
+  kv_destroy(exit);
+}
+
+/*
+ * Visit if `node`, the values available after it
+ * are those available at the end of every branch.
+ */
+
+static void
+visit_if(luna_visitor_t *self, luna_if_node_t *node) {
+  cse_t *state = STATE;
+  available_t out;
+  int reached = 0;
+
+  visit(node->expr);
+  available_t in = copy(&state->available);
+  visit((luna_node_t *) node->block);
+  join(state, &out, &reached);
+
+  luna_vec_each(node->else_ifs, {
+    luna_if_node_t *else_if = (luna_if_node_t *) NODE(val);
+    restore(state, &in);
+    visit(else_if->expr);
+    kv_destroy(in);
+    in = copy(&state->available);
+    visit((luna_node_t *) else_if->block);
+    join(state, &out, &reached);
+  });
+
+  restore(state, &in);
+  if (node->else_block) visit((luna_node_t *) node->else_block);
+  join(state, &out, &reached);
+  kv_destroy(in);
+
+  kv_destroy(state->available);
+  if (reached) {
+    state->available = out;
+  } else {
+    kv_init(state->available);
+    state->dead = 1;
+  }
+}
+
+/*
+ * Number the pure values of body `node`, where `cells` are the
+ * locals living in cells, which calls may store to. A value is
+ * reused along every path it is available on: computed before,
+ * and not killed since by a store to a local it reads, or, for
+ * fields, to the aggregate. Functions nested within are
+ * numbered with their own bodies.
+ */
+
+luna_cse_t *
+luna_cse(luna_node_t *node, khash_t(scalars) *cells) {
+  luna_cse_t *self = malloc(sizeof(luna_cse_t));
+  self->nodes = kh_init(numbers);
+  self->nvalues = 0;
+
+  cse_t state = {
+    .keys = kh_init(keys),
+    .cells = cells,
+    .dead = 0,
+    .probing = 0,
+    .result = self
+  };
+  kv_init(state.values);
+  kv_init(state.available);
+  kv_init(state.kills);
+
+  luna_visitor_t visitor = {
+    .data = (void *) &state,
+    .visit_if = visit_if,
+    .visit_let = visit_let,
+    .visit_slot = visit_slot,
+    .visit_call = visit_call,
+    .visit_hash = visit_hash,
+    .visit_array = visit_array,
+    .visit_while = visit_while,
+    .visit_block = visit_block,
+    .visit_return = visit_return,
+    .visit_unary_op = visit_unary_op,
+    .visit_binary_op = visit_binary_op,
+    .visit_subscript = visit_subscript
+  };
+
+  luna_visit(&visitor, node);
+
+  for (int i = 0; i < kv_size(state.values); ++i) {
+    value_t *val = kv_A(state.values, i);
+    kv_destroy(val->names);
+    kv_destroy(val->nodes);
+    free(val->key);
+    free(val);
+  }
+  kv_destroy(state.values);
+  kv_destroy(state.available);
+  kv_destroy(state.kills);
+  kh_destroy(keys, state.keys);
+  return self;
+}
+
+/*
+ * Return the role of `node`, populating `value` with its number.
+ */
+
+luna_cse_role
+luna_cse_lookup(luna_cse_t *self, luna_node_t *node, int *value) {
+  if (!self) return LUNA_CSE_NONE;
+  khiter_t k = kh_get(numbers, self->nodes, (uintptr_t) node);
+  if (k == kh_end(self->nodes)) return LUNA_CSE_NONE;
+  *value = kh_value(self->nodes, k) >> 2;
+  return kh_value(self->nodes, k) & 3;
+}
+
+/*
+ * Free the value numbering.
+ */
+
+void
+luna_cse_free(luna_cse_t *self) {
+  kh_destroy(numbers, self->nodes);
+  free(self);
+}
@@ -0,0 +1,60 @@
+
+//
+// cse.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_CSE_H
+#define LUNA_CSE_H
+
+#include <stdint.h>
+#include "ast.h"
+#include "khash.h"
+#include "escape.h"
+
+/*
+ * Maximum values kept in temporaries per body,
+ * each of them occupies a register.
+ */
+
+#define LUNA_CSE_VALUES 8
+
+/*
+ * Role of a node in value numbering.
+ */
+
+typedef enum {
+  LUNA_CSE_NONE,
+  LUNA_CSE_SAVE,
+  LUNA_CSE_REUSE
+} luna_cse_role;
+
+// value number and role by node
+
+KHASH_MAP_INIT_INT64(numbers, int);
+
+/*
+ * Value numbering of a body, the pure values computed
+ * more than once along some path. Nodes computing such
+ * a value save it in the temporary of its number, those
+ * it is available to reuse it.
+ */
+
+typedef struct {
+  khash_t(numbers) *nodes;
+  int nvalues;
+} luna_cse_t;
+
+// protos
+
+luna_cse_t *
+luna_cse(luna_node_t *node, khash_t(scalars) *cells);
+
+luna_cse_role
+luna_cse_lookup(luna_cse_t *self, luna_node_t *node, int *value);
+
+void
+luna_cse_free(luna_cse_t *self);
+
+#endif /* LUNA_CSE_H */
@@ -0,0 +1,683 @@
+
+//
+// dce.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <string.h>
+#include "dce.h"
+#include "vec.h"
+#include "visitor.h"
+#include "internal.h"
+
+// referenced identifiers
+
+KHASH_SET_INIT_STR(refs);
+
+/*
+ * Elimination state.
+ */
+
+typedef struct {
+  luna_block_node_t *root;
+  khash_t(refs) *refs;
+  luna_dce_stats_t *stats;
+} dce_t;
+
+/*
+ * Node of the given `val`.
+ */
+
+#define NODE(val) ((luna_node_t *) luna_as_pointer(val))
+
+/*
+ * Count the current node.
+ */
+
+#define COUNT (((luna_dce_stats_t *) self->data)->nodes++)
+
+/*
+ * Measure block `node`, each statement counts
+ * towards the eliminated statements.
+ */
+
+static void
+measure_block(luna_visitor_t *self, luna_block_node_t *node) {
+  COUNT;
+  ((luna_dce_stats_t *) self->data)->stmts += luna_vec_length(node->stmts);
+  luna_vec_each(node->stmts, visit(NODE(val)));
+}
+
+/*
+ * Measure leaf nodes.
+ */
+
+#define LEAF(type) \
+  static void \
+  measure_##type(luna_visitor_t *self, luna_##type##_node_t *node) { \
+    COUNT; \
+  }
+
+LEAF(id)
+LEAF(int)
+LEAF(float)
+LEAF(string)
+LEAF(use)
+
+static void
+measure_slot(luna_visitor_t *self, luna_slot_node_t *node) {
+  COUNT;
+  visit(node->left);
+  visit(node->right);
+}
+
+static void
+measure_subscript(luna_visitor_t *self, luna_subscript_node_t *node) {
+  COUNT;
+  visit(node->left);
+  visit(node->right);
+}
+
+static void
+measure_call(luna_visitor_t *self, luna_call_node_t *node) {
+  COUNT;
+  visit(node->expr);
+  luna_vec_each(node->args->vec, visit(NODE(val)));
+  luna_hash_each_val(node->args->hash, visit(NODE(val)));
+}
+
+static void
+measure_unary_op(luna_visitor_t *self, luna_unary_op_node_t *node) {
+  COUNT;
+  visit(node->expr);
+}
+
+static void
+measure_binary_op(luna_visitor_t *self, luna_binary_op_node_t *node) {
+  COUNT;
+  visit(node->left);
+  if (node->right) visit(node->right);
+}
+
+static void
+measure_array(luna_visitor_t *self, luna_array_node_t *node) {
+  COUNT;
+  luna_vec_each(node->vals, visit(NODE(val)));
+}
+
+static void
+measure_hash(luna_visitor_t *self, luna_hash_node_t *node) {
+  COUNT;
+  luna_vec_each(node->pairs, {
+    luna_hash_pair_node_t *pair = (luna_hash_pair_node_t *) NODE(val);
+    COUNT;
+    visit(pair->key);
+    visit(pair->val);
+  });
+}
+
+static void
+measure_decl(luna_visitor_t *self, luna_decl_node_t *node) {
+  COUNT;
+  luna_vec_each(node->vec, visit(NODE(val)));
+  if (node->type) visit(node->type);
+}
+
+static void
+measure_let(luna_visitor_t *self, luna_let_node_t *node) {
+  COUNT;
+  luna_vec_each(node->vec, visit(NODE(val)));
+}
+
+static void
+measure_return(luna_visitor_t *self, luna_return_node_t *node) {
+  COUNT;
+  if (node->expr) visit(node->expr);
+}
+
+static void
+measure_while(luna_visitor_t *self, luna_while_node_t *node) {
+  COUNT;
+  visit(node->expr);
+  visit((luna_node_t *) node->block);
+}
+
+static void
+measure_if(luna_visitor_t *self, luna_if_node_t *node) {
+  COUNT;
+  visit(node->expr);
+  visit((luna_node_t *) node->block);
+  luna_vec_each(node->else_ifs, visit(NODE(val)));
+  if (node->else_block) visit((luna_node_t *) node->else_block);
+}
+
+static void
+measure_function(luna_visitor_t *self, luna_function_node_t *node) {
+  COUNT;
+  luna_vec_each(node->params, visit(NODE(val)));
+  visit((luna_node_t *) node->block);
+}
+
+static void
+measure_type(luna_visitor_t *self, luna_type_node_t *node) {
+  COUNT;
+  luna_vec_each(node->fields, visit(NODE(val)));
+}
+
+/*
+ * Add the size of `node` to `stats`.
+ */
+
+static void
+measure(luna_node_t *node, luna_dce_stats_t *stats) {
+  luna_visitor_t visitor = {
+    .data = (void *) stats,
+    .visit_if = measure_if,
+    .visit_id = measure_id,
+    .visit_int = measure_int,
+    .visit_slot = measure_slot,
+    .visit_call = measure_call,
+    .visit_hash = measure_hash,
+    .visit_array = measure_array,
+    .visit_while = measure_while,
+    .visit_block = measure_block,
+    .visit_decl = measure_decl,
+    .visit_let = measure_let,
+    .visit_float = measure_float,
+    .visit_string = measure_string,
+    .visit_return = measure_return,
+    .visit_function = measure_function,
+    .visit_unary_op = measure_unary_op,
+    .visit_binary_op = measure_binary_op,
+    .visit_subscript = measure_subscript,
+    .visit_type = measure_type,
+    .visit_use = measure_use
+  };
+
+  luna_visit(&visitor, node);
+}
+
+/*
+ * Measure statement `node`, including itself.
+ */
+
+static luna_dce_stats_t
+measure_stmt(luna_node_t *node) {
+  luna_dce_stats_t stats = { .stmts = 1, .nodes = 0 };
+  measure(node, &stats);
+  return stats;
+}
+
+/*
+ * Record `node`, removed from its block, as eliminated.
+ */
+
+static void
+eliminate(dce_t *dce, luna_node_t *node) {
+  luna_dce_stats_t size = measure_stmt(node);
+  dce->stats->stmts += size.stmts;
+  dce->stats->nodes += size.nodes;
+}
+
+/*
+ * Collect referenced identifiers. Declarations,
+ * type annotations and slot names are not references.
+ */
+
+static void
+refs_block(luna_visitor_t *self, luna_block_node_t *node) {
+  luna_vec_each(node->stmts, visit(NODE(val)));
+}
+
+static void
+refs_id(luna_visitor_t *self, luna_id_node_t *node) {
+  int ret;
+  kh_put(refs, (khash_t(refs) *) self->data, node->val, &ret);
+}
+
+static void
+refs_slot(luna_visitor_t *self, luna_slot_node_t *node) {
+  visit(node->left);
+}
+
+static void
+refs_subscript(luna_visitor_t *self, luna_subscript_node_t *node) {
+  visit(node->left);
+  visit(node->right);
+}
+
+static void
+refs_call(luna_visitor_t *self, luna_call_node_t *node) {
+  visit(node->expr);
+  luna_vec_each(node->args->vec, visit(NODE(val)));
+  luna_hash_each_val(node->args->hash, visit(NODE(val)));
+}
+
+static void
+refs_unary_op(luna_visitor_t *self, luna_unary_op_node_t *node) {
+  visit(node->expr);
+}
+
+static void
+refs_binary_op(luna_visitor_t *self, luna_binary_op_node_t *node) {
+  visit(node->left);
+  if (node->right) visit(node->right);
+}
+
+static void
+refs_array(luna_visitor_t *self, luna_array_node_t *node) {
+  luna_vec_each(node->vals, visit(NODE(val)));
+}
+
+static void
+refs_hash(luna_visitor_t *self, luna_hash_node_t *node) {
+  luna_vec_each(node->pairs, {
+    luna_hash_pair_node_t *pair = (luna_hash_pair_node_t *) NODE(val);
+    visit(pair->key);
+    visit(pair->val);
+  });
+}
+
+static void
+refs_let(luna_visitor_t *self, luna_let_node_t *node) {
+  luna_vec_each(node->vec, {
+    luna_binary_op_node_t *bin = (luna_binary_op_node_t *) NODE(val);
+    if (bin->right) visit(bin->right);
+  });
+}
+
+static void
+refs_return(luna_visitor_t *self, luna_return_node_t *node) {
+  if (node->expr) visit(node->expr);
+}
+
+static void
+refs_while(luna_visitor_t *self, luna_while_node_t *node) {
+  visit(node->expr);
+  visit((luna_node_t *) node->block);
+}
+
+static void
+refs_if(luna_visitor_t *self, luna_if_node_t *node) {
+  visit(node->expr);
+  visit((luna_node_t *) node->block);
+  luna_vec_each(node->else_ifs, visit(NODE(val)));
+  if (node->else_block) visit((luna_node_t *) node->else_block);
+}
+
+static void
+refs_function(luna_visitor_t *self, luna_function_node_t *node) {
+  luna_vec_each(node->params, visit(NODE(val)));
+  visit((luna_node_t *) node->block);
+}
+
+/*
+ * Return a set of identifiers referenced in `node`.
+ */
+
+static khash_t(refs) *
+references(luna_node_t *node) {
+  luna_visitor_t visitor = {
+    .data = (void *) kh_init(refs),
+    .visit_if = refs_if,
+    .visit_id = refs_id,
+    .visit_slot = refs_slot,
+    .visit_call = refs_call,
+    .visit_hash = refs_hash,
+    .visit_array = refs_array,
+    .visit_while = refs_while,
+    .visit_block = refs_block,
+    .visit_let = refs_let,
+    .visit_return = refs_return,
+    .visit_function = refs_function,
+    .visit_unary_op = refs_unary_op,
+    .visit_binary_op = refs_binary_op,
+    .visit_subscript = refs_subscript
+  };
+
+  luna_visit(&visitor, node);
+  return (khash_t(refs) *) visitor.data;
+}
+
+/*
+ * Check if `node` is free of side-effects. Luna has no
+ * getters so slot and subscript reads are pure.
+ */
+
+static int
+pure(luna_node_t *node) {
+  switch (node->type) {
+    case LUNA_NODE_ID:
+    case LUNA_NODE_INT:
+    case LUNA_NODE_FLOAT:
+    case LUNA_NODE_STRING:
+      return 1;
+    case LUNA_NODE_SLOT:
+      return pure(((luna_slot_node_t *) node)->left);
+    case LUNA_NODE_SUBSCRIPT: {
+      luna_subscript_node_t *sub = (luna_subscript_node_t *) node;
+      return pure(sub->left) && pure(sub->right);
+    }
+    case LUNA_NODE_UNARY_OP: {
+      luna_unary_op_node_t *op = (luna_unary_op_node_t *) node;
+      if (LUNA_TOKEN_OP_INCR == op->op || LUNA_TOKEN_OP_DECR == op->op) return 0;
+      return pure(op->expr);
+    }
+    case LUNA_NODE_BINARY_OP: {
+      luna_binary_op_node_t *op = (luna_binary_op_node_t *) node;
+      switch (op->op) {
+        case LUNA_TOKEN_OP_ASSIGN:
+        case LUNA_TOKEN_OP_PLUS_ASSIGN:
+        case LUNA_TOKEN_OP_MINUS_ASSIGN:
+        case LUNA_TOKEN_OP_MUL_ASSIGN:
+        case LUNA_TOKEN_OP_DIV_ASSIGN:
+        case LUNA_TOKEN_OP_AND_ASSIGN:
+        case LUNA_TOKEN_OP_OR_ASSIGN:
+          return 0;
+      }
+      return pure(op->left) && (!op->right || pure(op->right));
+    }
+    case LUNA_NODE_ARRAY:
+      luna_vec_each(((luna_array_node_t *) node)->vals, {
+        if (!pure(NODE(val))) return 0;
+      });
+      return 1;
+    case LUNA_NODE_HASH:
+      luna_vec_each(((luna_hash_node_t *) node)->pairs, {
+        luna_hash_pair_node_t *pair = (luna_hash_pair_node_t *) NODE(val);
+        if (!pure(pair->key) || !pure(pair->val)) return 0;
+      });
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Check if `node` is a constant condition, populating `truthy`.
+ */
+
+static int
+constant(luna_node_t *node, int *truthy) {
+  switch (node->type) {
+    case LUNA_NODE_INT:
+      *truthy = 0 != ((luna_int_node_t *) node)->val;
+      return 1;
+    case LUNA_NODE_FLOAT:
+      *truthy = 0 != ((luna_float_node_t *) node)->val;
+      return 1;
+    case LUNA_NODE_STRING:
+      *truthy = 1;
+      return 1;
+    case LUNA_NODE_ID: {
+      const char *name = ((luna_id_node_t *) node)->val;
+      if (0 == strcmp("true", name)) return *truthy = 1, 1;
+      if (0 == strcmp("false", name)) return *truthy = 0, 1;
+      if (0 == strcmp("nil", name)) return *truthy = 0, 1;
+      return 0;
+    }
+    case LUNA_NODE_UNARY_OP: {
+      luna_unary_op_node_t *op = (luna_unary_op_node_t *) node;
+      if (LUNA_TOKEN_OP_NOT != op->op && LUNA_TOKEN_OP_LNOT != op->op) return 0;
+      if (!constant(op->expr, truthy)) return 0;
+      *truthy = !*truthy;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Check if `node` is a statement rather than an expression.
+ */
+
+static int
+statement(luna_node_t *node) {
+  switch (node->type) {
+    case LUNA_NODE_IF:
+    case LUNA_NODE_WHILE:
+    case LUNA_NODE_RETURN:
+    case LUNA_NODE_FUNCTION:
+    case LUNA_NODE_TYPE:
+    case LUNA_NODE_USE:
+    case LUNA_NODE_LET:
+    case LUNA_NODE_BLOCK:
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Push the statements of `block` into `out`, returning
+ * 1 when one of them is a `return`.
+ */
+
+static int
+splice(luna_vec_t *out, luna_block_node_t *block, luna_dce_stats_t *kept) {
+  int returned = 0;
+  luna_vec_each(block->stmts, {
+    luna_dce_stats_t size = measure_stmt(NODE(val));
+    kept->stmts += size.stmts;
+    kept->nodes += size.nodes;
+    if (LUNA_NODE_RETURN == NODE(val)->type) returned = 1;
+    luna_vec_push(out, val);
+  });
+  return returned;
+}
+
+/*
+ * Fold if `node` with constant conditions into `out`,
+ * returning 1 when a `return` was spliced in.
+ */
+
+static int
+fold_if(dce_t *dce, luna_vec_t *out, luna_value_t obj) {
+  luna_if_node_t *node = (luna_if_node_t *) NODE(obj);
+  luna_dce_stats_t before = measure_stmt((luna_node_t *) node);
+  luna_dce_stats_t kept = { 0, 0 };
+  int truthy, returned = 0;
+
+  // else ifs
+  luna_vec_t *else_ifs = luna_vec_new();
+  luna_vec_each(node->else_ifs, {
+    luna_if_node_t *else_if = (luna_if_node_t *) NODE(val);
+    if (!constant(else_if->expr, &truthy)) {
+      luna_vec_push(else_ifs, val);
+      continue;
+    }
+
+    // always taken, the rest is unreachable
+    if (truthy) {
+      node->else_block = else_if->block;
+      break;
+    }
+  });
+  luna_vec_free(node->else_ifs);
+  node->else_ifs = else_ifs;
+
+  // if
+  while (constant(node->expr, &truthy)) {
+    if (node->negate) truthy = !truthy;
+
+    // always taken
+    if (truthy) {
+      returned = splice(out, node->block, &kept);
+      goto done;
+    }
+
+    // never taken, promote the first else if
+    if (luna_vec_length(node->else_ifs)) {
+      luna_if_node_t *else_if = (luna_if_node_t *) NODE(luna_vec_at(node->else_ifs, 0));
+      luna_vec_t *rest = luna_vec_new();
+      luna_vec_each(node->else_ifs, {
+        if (i) luna_vec_push(rest, val);
+      });
+      node->negate = 0;
+      node->expr = else_if->expr;
+      node->block = else_if->block;
+      luna_vec_free(node->else_ifs);
+      node->else_ifs = rest;
+      continue;
+    }
+
+    // never taken
+    if (node->else_block) returned = splice(out, node->else_block, &kept);
+    goto done;
+  }
+
+  kept = measure_stmt((luna_node_t *) node);
+  luna_vec_push(out, obj);
+
+done:
+  dce->stats->stmts += before.stmts - kept.stmts;
+  dce->stats->nodes += before.nodes - kept.nodes;
+  return returned;
+}
+
+/*
+ * Prune unused bindings with pure initializers
+ * from let `node` into `out`.
+ */
+
+static void
+prune_let(dce_t *dce, luna_vec_t *out, luna_value_t obj) {
+  luna_let_node_t *node = (luna_let_node_t *) NODE(obj);
+  luna_dce_stats_t before = measure_stmt((luna_node_t *) node);
+  luna_vec_t *vec = luna_vec_new();
+
+  luna_vec_each(node->vec, {
+    luna_binary_op_node_t *bin = (luna_binary_op_node_t *) NODE(val);
+    luna_decl_node_t *decl = (luna_decl_node_t *) bin->left;
+    int used = bin->right && !pure(bin->right);
+
+    luna_vec_each(decl->vec, {
+      const char *name = ((luna_id_node_t *) NODE(val))->val;
+      if (kh_get(refs, dce->refs, name) != kh_end(dce->refs)) used = 1;
+    });
+
+    if (used) luna_vec_push(vec, val);
+  });
+
+  if (luna_vec_length(vec) == luna_vec_length(node->vec)) {
+    luna_vec_push(out, obj);
+    return;
+  }
+
+  node->vec = vec;
+  if (luna_vec_length(vec)) {
+    luna_dce_stats_t after = measure_stmt((luna_node_t *) node);
+    dce->stats->stmts += before.stmts - after.stmts;
+    dce->stats->nodes += before.nodes - after.nodes;
+    luna_vec_push(out, obj);
+  } else {
+    dce->stats->stmts += before.stmts;
+    dce->stats->nodes += before.nodes;
+  }
+}
+
+/*
+ * Sweep block `node`, removing unreachable statements
+ * and unused pure computations.
+ */
+
+static void
+sweep_block(luna_visitor_t *self, luna_block_node_t *node) {
+  dce_t *dce = (dce_t *) self->data;
+  luna_vec_t *stmts = luna_vec_new();
+  int returned = 0;
+
+  luna_vec_each(node->stmts, {
+    luna_node_t *stmt = NODE(val);
+
+    // unreachable
+    if (returned) {
+      eliminate(dce, stmt);
+      continue;
+    }
+
+    visit(stmt);
+
+    switch (stmt->type) {
+      case LUNA_NODE_RETURN:
+        returned = 1;
+        luna_vec_push(stmts, val);
+        break;
+      case LUNA_NODE_IF:
+        returned = fold_if(dce, stmts, val);
+        break;
+      case LUNA_NODE_LET:
+        prune_let(dce, stmts, val);
+        break;
+      case LUNA_NODE_WHILE: {
+        luna_while_node_t *loop = (luna_while_node_t *) stmt;
+        int truthy;
+        if (constant(loop->expr, &truthy) && truthy == loop->negate) {
+          eliminate(dce, stmt);
+        } else {
+          luna_vec_push(stmts, val);
+        }
+        break;
+      }
+      default: {
+        // the last expression is the program's value
+        int last = node == dce->root && i == len - 1;
+        if (!statement(stmt) && !last && pure(stmt)) {
+          eliminate(dce, stmt);
+        } else {
+          luna_vec_push(stmts, val);
+        }
+      }
+    }
+  });
+
+  luna_vec_free(node->stmts);
+  node->stmts = stmts;
+}
+
+static void
+sweep_while(luna_visitor_t *self, luna_while_node_t *node) {
+  visit((luna_node_t *) node->block);
+}
+
+static void
+sweep_if(luna_visitor_t *self, luna_if_node_t *node) {
+  visit((luna_node_t *) node->block);
+  luna_vec_each(node->else_ifs, visit(NODE(val)));
+  if (node->else_block) visit((luna_node_t *) node->else_block);
+}
+
+static void
+sweep_function(luna_visitor_t *self, luna_function_node_t *node) {
+  visit((luna_node_t *) node->block);
+}
+
+/*
+ * Eliminate dead code in `node` until no more is found,
+ * adding the eliminated sizes to `stats`.
+ */
+
+void
+luna_dce(luna_node_t *node, luna_dce_stats_t *stats) {
+  dce_t dce = {
+    .root = LUNA_NODE_BLOCK == node->type
+      ? (luna_block_node_t *) node
+      : NULL,
+    .stats = stats
+  };
+
+  luna_visitor_t visitor = {
+    .data = (void *) &dce,
+    .visit_if = sweep_if,
+    .visit_while = sweep_while,
+    .visit_block = sweep_block,
+    .visit_function = sweep_function
+  };
+
+  // removing a binding may leave others unused
+  for (int nodes = -1; nodes != stats->nodes;) {
+    nodes = stats->nodes;
+    dce.refs = references(node);
+    luna_visit(&visitor, node);
+    kh_destroy(refs, dce.refs);
+  }
+}
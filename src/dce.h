@@ -0,0 +1,27 @@
+
+//
+// dce.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_DCE_H
+#define LUNA_DCE_H
+
+#include "ast.h"
+
+/*
+ * Dead code elimination stats.
+ */
+
+typedef struct {
+  int stmts;
+  int nodes;
+} luna_dce_stats_t;
+
+// protos
+
+void
+luna_dce(luna_node_t *node, luna_dce_stats_t *stats);
+
+#endif /* LUNA_DCE_H */
@@ -13,50 +13,233 @@
 #include "vm.h"
 
 /*
- * Dump disassembled program to stdout.
- *
- * TODO: return a string
+ * Print constant `val`.
  */
 
-void
-luna_dump(luna_vm_t *vm) {
-  luna_instruction_t *ip = vm->main->ip;
+static void
+luna_dump_constant(luna_value_t val) {
+  switch (luna_value_type(val)) {
+    case LUNA_TYPE_INT:
+      printf("%d", luna_as_int(val));
+      break;
+    case LUNA_TYPE_FLOAT:
+      printf("%g", luna_as_float(val));
+      break;
+    case LUNA_TYPE_STRING:
+      printf("\"%s\"", (char *) luna_as_pointer(val));
+      break;
+    default:
+      printf("?");
+  }
+}
+
+/*
+ * Print RK operand `n`, "-" for registers.
+ */
+
+static void
+luna_dump_rk(luna_activation_t *fn, int n) {
+  printf(" ");
+  if (n < 32) {
+    printf("-");
+  } else {
+    luna_dump_constant(K(n));
+  }
+}
+
+/*
+ * Dump disassembled activation `fn` to stdout,
+ * along with the line of each new source line.
+ */
+
+static void
+luna_dump_activation(luna_activation_t *fn) {
+  luna_instruction_t *ip = fn->ip;
+  luna_instruction_t *end = ip + fn->ncode;
   luna_instruction_t i;
-  int registers[32] = {0};
+  int line = 0;
 
-  for (;;) {
+  while (ip < end) {
+    int at = luna_lines_lookup(&fn->lines, ip - fn->ip);
     i = *ip++;
+    if (at != line) printf("%4d", line = at);
+    else printf("    ");
     printf("%10s ", luna_op_strings[OP(i)]);
     switch (OP(i)) {
-      // -
+      // op : R(A)
       case LUNA_OP_HALT:
-        printf("\n");
-        return;
+      case LUNA_OP_RETURN:
+      case LUNA_OP_LOADNIL:
+      case LUNA_OP_BOX:
+        printf("%d\n", A(i));
+        break;
 
       // op : sBx
       case LUNA_OP_JMP:
-        printf("%d\n", B(i));
+        printf("%d\n", SBX(i));
         break;
 
-      // op : R(A) RK(B)
+      // op : R(A) Bx
+      case LUNA_OP_DISPATCH:
+      case LUNA_OP_FEEDBACK:
+      case LUNA_OP_CLOSURE:
+        printf("%d %d\n", A(i), BX(i));
+        break;
+
+      // op : Bx
+      case LUNA_OP_COUNT:
+        printf("%d\n", BX(i));
+        break;
+
+      // op : R(A) K(B) C
+      case LUNA_OP_GUARD:
+        printf("%d %d %d;", A(i), B(i), C(i));
+        luna_dump_rk(fn, B(i));
+        printf("\n");
+        break;
+
+      // op : R(A) K(B)
       case LUNA_OP_LOADK:
+        printf("%d %d;", A(i), B(i));
+        luna_dump_rk(fn, B(i));
+        printf("\n");
+        break;
+
+      // op : R(A) B
+      case LUNA_OP_ARGC:
+      case LUNA_OP_NEWOBJECT:
+      case LUNA_OP_NEWRECORD:
+      case LUNA_OP_CHECK:
+      case LUNA_OP_CHECKARRAY:
+      case LUNA_OP_NEWLIST:
+        printf("%d %d\n", A(i), B(i));
+        break;
+
+      // op : R(A) RK(B)
+      case LUNA_OP_APPEND:
+        printf("%d %d;", A(i), B(i));
+        luna_dump_rk(fn, B(i));
+        printf("\n");
+        break;
+
+      // op : R(A) B C
       case LUNA_OP_LOADB:
-        printf("%d %d; %d\n", A(i), B(i), K(B(i)));
+      case LUNA_OP_CALL:
+        printf("%d %d %d\n", A(i), B(i), C(i));
+        break;
+
+      // op : R(A) R(B)
+      case LUNA_OP_MOVE:
+      case LUNA_OP_GETCELL:
+      case LUNA_OP_SETCELL:
+      case LUNA_OP_NEGATE:
+      case LUNA_OP_NOT:
+        printf("%d %d\n", A(i), B(i));
+        break;
+
+      // op : R(A) C
+      case LUNA_OP_TEST:
+      case LUNA_OP_APPLY:
+        printf("%d %d\n", A(i), C(i));
+        break;
+
+      // op : R(A) R(B) C
+      case LUNA_OP_TESTSET:
+      case LUNA_OP_GETI:
+      case LUNA_OP_GETF:
+      case LUNA_OP_GETV:
+      case LUNA_OP_GETCI:
+      case LUNA_OP_GETCF:
+      case LUNA_OP_GETCV:
+        printf("%d %d %d\n", A(i), B(i), C(i));
+        break;
+
+      // op : R(A) B RK(C)
+      case LUNA_OP_SETI:
+      case LUNA_OP_SETF:
+      case LUNA_OP_SETV:
+      case LUNA_OP_SETCI:
+      case LUNA_OP_SETCF:
+      case LUNA_OP_SETCV:
+      case LUNA_OP_NEWARRAY:
+        printf("%d %d %d;", A(i), B(i), C(i));
+        luna_dump_rk(fn, C(i));
+        printf("\n");
+        break;
+
+      // op : R(A) R(B) RK(C)
+      case LUNA_OP_GETFIELD:
+      case LUNA_OP_GETINDEX:
+        printf("%d %d %d;", A(i), B(i), C(i));
+        luna_dump_rk(fn, C(i));
+        printf("\n");
+        break;
+
+      // op : R(A) K(B) RK(C)
+      case LUNA_OP_SETFIELD:
+        printf("%d %d %d;", A(i), B(i), C(i));
+        luna_dump_rk(fn, B(i));
+        luna_dump_rk(fn, C(i));
+        printf("\n");
         break;
 
       // op : R(A) RK(B) RK(C)
+      case LUNA_OP_SETINDEX:
       case LUNA_OP_ADD:
       case LUNA_OP_SUB:
       case LUNA_OP_DIV:
       case LUNA_OP_MUL:
       case LUNA_OP_MOD:
       case LUNA_OP_POW:
+      case LUNA_OP_BIT_SHL:
+      case LUNA_OP_BIT_SHR:
+      case LUNA_OP_BIT_AND:
+      case LUNA_OP_BIT_OR:
+      case LUNA_OP_BIT_XOR:
+      case LUNA_OP_EQ:
       case LUNA_OP_LT:
       case LUNA_OP_LTE:
-        printf("%d %d %d; %d %d\n", A(i), B(i), C(i), RK(B(i)), RK(C(i)));
+      case LUNA_OP_ADDI:
+      case LUNA_OP_SUBI:
+      case LUNA_OP_DIVI:
+      case LUNA_OP_MULI:
+      case LUNA_OP_MODI:
+      case LUNA_OP_ADDF:
+      case LUNA_OP_SUBF:
+      case LUNA_OP_DIVF:
+      case LUNA_OP_MULF:
+      case LUNA_OP_MODF:
+      case LUNA_OP_LTI:
+      case LUNA_OP_LTEI:
+      case LUNA_OP_LTF:
+      case LUNA_OP_LTEF:
+        printf("%d %d %d;", A(i), B(i), C(i));
+        luna_dump_rk(fn, B(i));
+        luna_dump_rk(fn, C(i));
+        printf("\n");
         break;
+
+      default:
+        printf("\n");
     }
   }
 }
 
+/*
+ * Dump disassembled program to stdout.
+ *
+ * TODO: return a string
+ */
+
+void
+luna_dump(luna_vm_t *vm) {
+  for (int i = 0; i < kv_size(vm->functions); ++i) {
+    printf("\nfunction %d:\n", i);
+    luna_dump_activation(kv_A(vm->functions, i));
+  }
+
+  if (kv_size(vm->functions)) printf("\nmain:\n");
+  luna_dump_activation(vm->main);
+}
+
 #endif
@@ -0,0 +1,274 @@
+
+//
+// dispatch.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <assert.h>
+#include <string.h>
+#include "dispatch.h"
+#include "vec.h"
+#include "visitor.h"
+#include "internal.h"
+
+/*
+ * Node of the given `val`.
+ */
+
+#define NODE(val) ((luna_node_t *) luna_as_pointer(val))
+
+/*
+ * Argument matches.
+ */
+
+enum {
+  MISMATCH,
+  MAYBE,
+  DEFINITE
+};
+
+/*
+ * Return the type named by type annotation `type`,
+ * LUNA_TYPE_ANY when absent or not a builtin.
+ */
+
+luna_object
+luna_named_type(luna_node_t *type) {
+  if (!type) return LUNA_TYPE_ANY;
+  if (LUNA_TYPE_RECORD == type->inferred) return LUNA_TYPE_RECORD;
+  if (LUNA_TYPE_ARRAY == type->inferred) return LUNA_TYPE_ARRAY;
+  const char *name = ((luna_id_node_t *) type)->val;
+  if (0 == strcmp("int", name)) return LUNA_TYPE_INT;
+  if (0 == strcmp("float", name)) return LUNA_TYPE_FLOAT;
+  if (0 == strcmp("bool", name)) return LUNA_TYPE_BOOL;
+  if (0 == strcmp("string", name)) return LUNA_TYPE_STRING;
+  if (0 == strcmp("array", name)) return LUNA_TYPE_ARRAY;
+  if (0 == strcmp("function", name)) return LUNA_TYPE_FUNCTION;
+  return LUNA_TYPE_ANY;
+}
+
+/*
+ * Populate `params` with the flattened parameters
+ * of `fn` and return their count.
+ */
+
+int
+luna_params(luna_function_node_t *fn, luna_param_t *params) {
+  int n = 0;
+  luna_vec_each(fn->params, {
+    luna_node_t *param = NODE(val);
+    luna_node_t *value = NULL;
+
+    // default
+    if (LUNA_NODE_BINARY_OP == param->type) {
+      value = ((luna_binary_op_node_t *) param)->right;
+      param = ((luna_binary_op_node_t *) param)->left;
+    }
+
+    luna_decl_node_t *decl = (luna_decl_node_t *) param;
+    luna_vec_each(decl->vec, {
+      assert(n < LUNA_MAX_PARAMS && "too many parameters");
+      params[n].name = ((luna_id_node_t *) NODE(val))->val;
+      params[n].type = luna_named_type(decl->type);
+      params[n].value = value;
+      ++n;
+    });
+  });
+  return n;
+}
+
+/*
+ * Collect named function definitions.
+ */
+
+static void
+visit_function(luna_visitor_t *self, luna_function_node_t *node) {
+  luna_overloads_t *overloads = (luna_overloads_t *) self->data;
+  int ret;
+
+  if (node->name) {
+    khiter_t k = kh_put(overloads, overloads->names, node->name, &ret);
+    if (ret) kv_init(kh_value(overloads->names, k));
+    kv_push(luna_function_node_t *, kh_value(overloads->names, k), node);
+    kv_push(luna_function_node_t *, overloads->defs, node);
+  }
+
+  visit((luna_node_t *) node->block);
+}
+
+static void
+visit_block(luna_visitor_t *self, luna_block_node_t *node) {
+  luna_vec_each(node->stmts, visit(NODE(val)));
+}
+
+static void
+visit_if(luna_visitor_t *self, luna_if_node_t *node) {
+  visit((luna_node_t *) node->block);
+  luna_vec_each(node->else_ifs, visit(NODE(val)));
+  if (node->else_block) visit((luna_node_t *) node->else_block);
+}
+
+static void
+visit_while(luna_visitor_t *self, luna_while_node_t *node) {
+  visit((luna_node_t *) node->block);
+}
+
+/*
+ * Collect the named functions defined in `node`.
+ */
+
+luna_overloads_t *
+luna_overloads_new(luna_node_t *node) {
+  luna_overloads_t *self = malloc(sizeof(luna_overloads_t));
+  if (unlikely(!self)) return NULL;
+  kv_init(self->defs);
+  self->names = kh_init(overloads);
+
+  luna_visitor_t visitor = {
+    .data = (void *) self,
+    .visit_if = visit_if,
+    .visit_while = visit_while,
+    .visit_block = visit_block,
+    .visit_function = visit_function
+  };
+
+  luna_visit(&visitor, node);
+  return self;
+}
+
+/*
+ * Return the index of `fn` in definition order.
+ */
+
+int
+luna_overloads_index(luna_overloads_t *self, luna_function_node_t *fn) {
+  for (int i = 0; i < kv_size(self->defs); ++i) {
+    if (fn == kv_A(self->defs, i)) return i;
+  }
+  return -1;
+}
+
+/*
+ * Match the arguments of `call` against `fn`.
+ */
+
+static int
+match(luna_function_node_t *fn, luna_call_node_t *call) {
+  luna_param_t params[LUNA_MAX_PARAMS];
+  int n = luna_params(fn, params);
+  int nargs = luna_vec_length(call->args->vec);
+  int ret = DEFINITE;
+
+  // arity, omitted parameters need defaults
+  if (nargs > n) return MISMATCH;
+  for (int j = nargs; j < n; ++j) {
+    if (!params[j].value) return MISMATCH;
+  }
+
+  luna_vec_each(call->args->vec, {
+    luna_object type = NODE(val)->inferred;
+    if (LUNA_TYPE_ANY == params[i].type || type == params[i].type) continue;
+    if (LUNA_TYPE_ANY != type) return MISMATCH;
+    ret = MAYBE;
+  });
+
+  return ret;
+}
+
+/*
+ * Number of typed parameters of `fn`.
+ */
+
+static int
+specificity(luna_function_node_t *fn) {
+  luna_param_t params[LUNA_MAX_PARAMS];
+  int n = luna_params(fn, params);
+  int typed = 0;
+  for (int i = 0; i < n; ++i) {
+    if (LUNA_TYPE_ANY != params[i].type) ++typed;
+  }
+  return typed;
+}
+
+/*
+ * Check if `a` and `b` have the same signature.
+ */
+
+static int
+same_signature(luna_function_node_t *a, luna_function_node_t *b) {
+  luna_param_t x[LUNA_MAX_PARAMS], y[LUNA_MAX_PARAMS];
+  int n = luna_params(a, x);
+  if (n != luna_params(b, y)) return 0;
+  for (int i = 0; i < n; ++i) {
+    if (x[i].type != y[i].type) return 0;
+  }
+  return 1;
+}
+
+/*
+ * Resolve the overloads `call` may invoke into `candidates`,
+ * most specific first; a later definition of the same
+ * signature replaces earlier ones.
+ *
+ * The call binds statically when the first candidate is
+ * known to match from the inferred argument types, as it
+ * would always win at runtime, otherwise `candidates` are
+ * checked in order against the argument tags.
+ */
+
+luna_dispatch
+luna_resolve(luna_overloads_t *self, luna_call_node_t *call, luna_functions_t *candidates) {
+  candidates->n = 0;
+
+  if (LUNA_NODE_ID != call->expr->type) return LUNA_DISPATCH_NONE;
+  if (kh_size(call->args->hash)) return LUNA_DISPATCH_NONE;
+
+  const char *name = ((luna_id_node_t *) call->expr)->val;
+  khiter_t k = kh_get(overloads, self->names, name);
+  if (k == kh_end(self->names)) return LUNA_DISPATCH_NONE;
+
+  luna_functions_t *fns = &kh_value(self->names, k);
+  for (int i = kv_size(*fns) - 1; i >= 0; --i) {
+    luna_function_node_t *fn = kv_A(*fns, i);
+    int shadowed = 0;
+
+    for (int j = i + 1; j < kv_size(*fns); ++j) {
+      if (same_signature(fn, kv_A(*fns, j))) shadowed = 1;
+    }
+
+    if (shadowed || MISMATCH == match(fn, call)) continue;
+
+    // insert by specificity
+    int j = kv_size(*candidates);
+    kv_push(luna_function_node_t *, *candidates, fn);
+    while (j > 0 && specificity(kv_A(*candidates, j - 1)) < specificity(fn)) {
+      kv_A(*candidates, j) = kv_A(*candidates, j - 1);
+      --j;
+    }
+    kv_A(*candidates, j) = fn;
+  }
+
+  if (!kv_size(*candidates)) return LUNA_DISPATCH_NONE;
+
+  if (DEFINITE == match(kv_A(*candidates, 0), call)) {
+    candidates->n = 1;
+    return LUNA_DISPATCH_STATIC;
+  }
+
+  return LUNA_DISPATCH_DYNAMIC;
+}
+
+/*
+ * Free the overloads.
+ */
+
+void
+luna_overloads_free(luna_overloads_t *self) {
+  for (khiter_t k = kh_begin(self->names); k != kh_end(self->names); ++k) {
+    if (kh_exist(self->names, k)) kv_destroy(kh_value(self->names, k));
+  }
+  kh_destroy(overloads, self->names);
+  kv_destroy(self->defs);
+  free(self);
+}
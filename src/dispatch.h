@@ -0,0 +1,79 @@
+
+//
+// dispatch.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_DISPATCH_H
+#define LUNA_DISPATCH_H
+
+#include "ast.h"
+#include "khash.h"
+
+/*
+ * Maximum function parameters.
+ */
+
+#define LUNA_MAX_PARAMS 16
+
+/*
+ * Function parameter.
+ */
+
+typedef struct {
+  const char *name;
+  luna_object type;
+  luna_node_t *value;
+} luna_param_t;
+
+/*
+ * Functions.
+ */
+
+typedef kvec_t(luna_function_node_t *) luna_functions_t;
+
+// functions by name
+
+KHASH_MAP_INIT_STR(overloads, luna_functions_t);
+
+/*
+ * Named functions of a program, in definition order.
+ */
+
+typedef struct {
+  luna_functions_t defs;
+  khash_t(overloads) *names;
+} luna_overloads_t;
+
+/*
+ * Call site resolution.
+ */
+
+typedef enum {
+  LUNA_DISPATCH_NONE,
+  LUNA_DISPATCH_STATIC,
+  LUNA_DISPATCH_DYNAMIC
+} luna_dispatch;
+
+// protos
+
+luna_object
+luna_named_type(luna_node_t *type);
+
+int
+luna_params(luna_function_node_t *fn, luna_param_t *params);
+
+luna_overloads_t *
+luna_overloads_new(luna_node_t *node);
+
+int
+luna_overloads_index(luna_overloads_t *self, luna_function_node_t *fn);
+
+luna_dispatch
+luna_resolve(luna_overloads_t *self, luna_call_node_t *call, luna_functions_t *candidates);
+
+void
+luna_overloads_free(luna_overloads_t *self);
+
+#endif /* LUNA_DISPATCH_H */
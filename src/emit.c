@@ -0,0 +1,630 @@
+
+//
+// emit.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdlib.h>
+#include "emit.h"
+#include "luna.h"
+#include "opcodes.h"
+
+/*
+ * Output to `out`.
+ */
+
+#define print(...) fprintf(out, __VA_ARGS__)
+
+/*
+ * Type names, as spelled in C.
+ */
+
+static const char *types[] = {
+  [LUNA_TYPE_NULL] = "LUNA_TYPE_NULL",
+  [LUNA_TYPE_NODE] = "LUNA_TYPE_NODE",
+  [LUNA_TYPE_BOOL] = "LUNA_TYPE_BOOL",
+  [LUNA_TYPE_INT] = "LUNA_TYPE_INT",
+  [LUNA_TYPE_FLOAT] = "LUNA_TYPE_FLOAT",
+  [LUNA_TYPE_STRING] = "LUNA_TYPE_STRING",
+  [LUNA_TYPE_OBJECT] = "LUNA_TYPE_OBJECT",
+  [LUNA_TYPE_ARRAY] = "LUNA_TYPE_ARRAY",
+  [LUNA_TYPE_LIST] = "LUNA_TYPE_LIST",
+  [LUNA_TYPE_FUNCTION] = "LUNA_TYPE_FUNCTION",
+  [LUNA_TYPE_CELL] = "LUNA_TYPE_CELL",
+  [LUNA_TYPE_RECORD] = "LUNA_TYPE_RECORD",
+  [LUNA_TYPE_ANY] = "LUNA_TYPE_ANY"
+};
+
+/*
+ * Name of the function compiled from activation `j`,
+ * -1 being the main body.
+ */
+
+static void
+name(FILE *out, int j) {
+  if (j < 0) print("f_main");
+  else print("f%d", j);
+}
+
+/*
+ * Print RK operand `n` of activation `j`.
+ */
+
+static void
+rk(FILE *out, int j, int n) {
+  if (n < 32) {
+    print("r[%d]", n);
+  } else {
+    print("k");
+    if (j < 0) print("_main");
+    else print("%d", j);
+    print("[%d]", n - 32);
+  }
+}
+
+/*
+ * Print constant `val` as an initializer, floats
+ * by their bits so that they are reproduced exactly.
+ * Strings are nil until interned by `strings()`.
+ */
+
+static void
+constant(FILE *out, luna_value_t val) {
+  switch (luna_value_type(val)) {
+    case LUNA_TYPE_INT:
+      print("luna_value_int(%d)", luna_as_int(val));
+      break;
+    case LUNA_TYPE_FLOAT:
+      print("0x%016llxull /* %a */", (unsigned long long) val, luna_as_double(val));
+      break;
+    case LUNA_TYPE_BOOL:
+      print("luna_value_bool(%d)", luna_as_int(val));
+      break;
+    default:
+      print("LUNA_VALUE_NIL");
+  }
+}
+
+/*
+ * Print string constant `val` as a C string literal.
+ */
+
+static void
+string(FILE *out, luna_value_t val) {
+  print("\"");
+  for (const char *str = luna_as_pointer(val); *str; ++str) {
+    if ('"' == *str || '\\' == *str) print("\\%c", *str);
+    else if (*str < ' ' || *str > '~') print("\\%03o", (unsigned char) *str);
+    else print("%c", *str);
+  }
+  print("\"");
+}
+
+/*
+ * Print the statements interning the string
+ * constants of activation `j`.
+ */
+
+static void
+strings(FILE *out, luna_activation_t *fn, int j) {
+  for (int i = 0; i < fn->nconstants; ++i) {
+    if (LUNA_TYPE_STRING != luna_value_type(fn->constants[i])) continue;
+    print("  ");
+    rk(out, j, 32 + i);
+    print(" = luna_string_new(");
+    string(out, fn->constants[i]);
+    print(");\n");
+  }
+}
+
+/*
+ * Open the block of a field access, declaring its inline
+ * cache `c` and `key`, the string constant `val` interned
+ * on first use.
+ */
+
+static void
+key(FILE *out, luna_value_t val) {
+  print("{ static luna_cache_t c; static const char *key; if (!key) key = luna_intern(");
+  string(out, val);
+  print(");");
+}
+
+/*
+ * Print record `layouts` as static data, declared
+ * first as fields may refer to any of them.
+ */
+
+static void
+layouts(FILE *out, luna_layouts_t *layouts) {
+  static const char *kinds[] = {
+    [LUNA_FIELD_INT] = "LUNA_FIELD_INT",
+    [LUNA_FIELD_FLOAT] = "LUNA_FIELD_FLOAT",
+    [LUNA_FIELD_VALUE] = "LUNA_FIELD_VALUE"
+  };
+
+  int n = kv_size(layouts->defs);
+  for (int j = 0; j < n; ++j) print("static luna_layout_t layout%d;\n", j);
+  if (n) print("\n");
+
+  for (int j = 0; j < n; ++j) {
+    luna_layout_t *layout = kv_A(layouts->defs, j);
+    print("static luna_field_t fields%d[] = {\n", j);
+    for (int i = 0; i < layout->nfields; ++i) {
+      luna_field_t *field = &layout->fields[i];
+      print("  { \"%s\", %s, ", field->name, kinds[field->kind]);
+      if (field->layout) print("&layout%d", luna_layouts_index(layouts, field->layout));
+      else print("NULL");
+      print(", %d },\n", field->offset);
+    }
+    print("};\n\n");
+    print("static luna_layout_t layout%d = { \"%s\", %d, %d, fields%d };\n\n",
+      j, layout->name, layout->size, layout->nfields, j);
+  }
+}
+
+/*
+ * Print the data of activation `j`: its constants and, when
+ * it is instantiated as a closure, its parameter types and
+ * the descriptor its closures refer to.
+ */
+
+static void
+data(FILE *out, luna_activation_t *fn, int j, int closure) {
+  if (fn->nconstants) {
+    print("static luna_value_t k");
+    if (j < 0) print("_main");
+    else print("%d", j);
+    print("[] = {\n");
+    for (int i = 0; i < fn->nconstants; ++i) {
+      print("  ");
+      constant(out, fn->constants[i]);
+      print(i + 1 < fn->nconstants ? ",\n" : "\n");
+    }
+    print("};\n\n");
+  }
+
+  if (!closure) return;
+
+  if (fn->nparams) {
+    print("static luna_object params%d[] = { ", j);
+    for (int i = 0; i < fn->nparams; ++i) {
+      print("%s%s", i ? ", " : "", types[fn->params[i]]);
+    }
+    print(" };\n");
+  }
+
+  print("static luna_function_t fn%d = { f%d, %d, %d, ", j, j, fn->nparams, fn->nrequired);
+  if (fn->nparams) print("params%d };\n", j);
+  else print("NULL };\n");
+
+  // closures capturing nothing are shared
+  if (fn->closure) print("static luna_native_closure_t closure%d = { &fn%d, LUNA_NATIVE_SHARED };\n", j, j);
+  print("\n");
+}
+
+/*
+ * Print the call of the overload `site` selects for the arguments
+ * following register `a`, testing the tags of each candidate in
+ * the order the vm would scan them.
+ */
+
+static void
+dispatch(FILE *out, luna_vm_t *vm, luna_site_t *site, int a) {
+  luna_generic_t *generic = &kv_A(vm->generics, site->generic);
+  int n = 0;
+
+  for (int i = 0; i < kv_size(generic->overloads); ++i) {
+    int index = kv_A(generic->overloads, i);
+    luna_activation_t *fn = kv_A(vm->functions, index);
+    if (site->nargs > fn->nparams || site->nargs < fn->nrequired) continue;
+
+    int typed = 0;
+    for (int k = 0; k < site->nargs; ++k) {
+      if (LUNA_TYPE_ANY == fn->params[k]) continue;
+      print(typed++ ? " && " : n++ ? "\n  else if (" : "if (");
+      print("luna_value_type(r[%d]) == %s", a + 1 + k, types[fn->params[k]]);
+    }
+
+    if (typed) print(") ");
+    else if (n) print("\n  else ");
+    print("r[%d] = f%d(&r[%d], %d, NULL);", a, index, a + 1, site->nargs);
+    if (!typed) return;
+  }
+
+  if (n) print("\n  else ");
+  print("LUNA_NIL(r[%d]);", a);
+}
+
+/*
+ * Print generic binary `macro` of RK(B) and RK(C) into R(A).
+ */
+
+static void
+binary(FILE *out, int j, const char *macro, luna_instruction_t i, const char *op) {
+  print("%s(r[%d], ", macro, A(i));
+  rk(out, j, B(i));
+  print(", ");
+  rk(out, j, C(i));
+  print(", %s);", op);
+}
+
+/*
+ * Print `op` of RK(B) and RK(C) unboxed by `unbox`,
+ * typed by inference, into R(A) of `type`.
+ */
+
+static void
+typed(FILE *out, int j, const char *type, const char *unbox, luna_instruction_t i, const char *op) {
+  print("LUNA_%s(r[%d], %s(", type, A(i), unbox);
+  rk(out, j, B(i));
+  print(") %s %s(", op, unbox);
+  rk(out, j, C(i));
+  print("));");
+}
+
+/*
+ * Print comparison `op` of RK(B) and RK(C), generic unless
+ * typed and unboxed by `unbox`, skipping the next instruction
+ * at `pc` unless the result equals A.
+ */
+
+static void
+compare(FILE *out, int j, const char *unbox, luna_instruction_t i, const char *op, int pc) {
+  if (unbox) {
+    print("if ((%s(", unbox);
+    rk(out, j, B(i));
+    print(") %s %s(", op, unbox);
+    rk(out, j, C(i));
+    print("))");
+  } else {
+    print("if (LUNA_COMPARE(");
+    rk(out, j, B(i));
+    print(", ");
+    rk(out, j, C(i));
+    print(", %s)", op);
+  }
+  print(" != %d) goto L%d;", A(i), pc + 2);
+}
+
+/*
+ * Print the body of activation `j`, each instruction
+ * labelled when it is the target of a jump.
+ */
+
+static void
+body(FILE *out, luna_vm_t *vm, luna_activation_t *fn, int j) {
+  luna_instruction_t *code = fn->code;
+  char *target = calloc(fn->ncode + 2, 1);
+
+  for (int pc = 0; pc < fn->ncode; ++pc) {
+    luna_instruction_t i = code[pc];
+    switch (OP(i)) {
+      case LUNA_OP_JMP:
+        target[pc + 1 + SBX(i)] = 1;
+        break;
+      case LUNA_OP_LOADB:
+        if (C(i)) target[pc + 2] = 1;
+        break;
+      case LUNA_OP_EQ:
+      case LUNA_OP_LT:
+      case LUNA_OP_LTE:
+      case LUNA_OP_LTI:
+      case LUNA_OP_LTEI:
+      case LUNA_OP_LTF:
+      case LUNA_OP_LTEF:
+      case LUNA_OP_TEST:
+      case LUNA_OP_TESTSET:
+      case LUNA_OP_ARGC:
+      case LUNA_OP_GUARD:
+        target[pc + 2] = 1;
+        break;
+      case LUNA_OP_CLOSURE:
+        pc += kv_A(vm->functions, BX(i))->nupvalues;
+        break;
+    }
+  }
+
+  print("static luna_value_t\n");
+  name(out, j);
+  print("(luna_value_t *args, int nargs, luna_value_t *upvalues) {\n");
+  print("  luna_value_t r[32];\n");
+  print("  for (int i = 0; i < 32; ++i) r[i] = LUNA_VALUE_NIL;\n");
+  print("  if (nargs) memcpy(r, args, nargs * sizeof(luna_value_t));\n");
+  if (fn->nupvalues) {
+    print("  memcpy(r + %d, upvalues, %d * sizeof(luna_value_t));\n", fn->nparams, fn->nupvalues);
+  }
+  print("  LUNA_NATIVE_ENTER(r);\n");
+
+  for (int pc = 0; pc < fn->ncode; ++pc) {
+    luna_instruction_t i = code[pc];
+    if (target[pc]) print("L%d:\n", pc);
+    print("  ");
+
+    switch (OP(i)) {
+      case LUNA_OP_LOADK:
+        print("r[%d] = ", A(i));
+        rk(out, j, B(i));
+        print(";");
+        break;
+      case LUNA_OP_LOADB:
+        print("LUNA_BOOL(r[%d], %d);", A(i), B(i));
+        if (C(i)) print(" goto L%d;", pc + 2);
+        break;
+      case LUNA_OP_LOADNIL:
+        print("LUNA_NIL(r[%d]);", A(i));
+        break;
+      case LUNA_OP_MOVE:
+        print("r[%d] = r[%d];", A(i), B(i));
+        break;
+      case LUNA_OP_ADD: binary(out, j, "LUNA_ARITH", i, "+"); break;
+      case LUNA_OP_SUB: binary(out, j, "LUNA_ARITH", i, "-"); break;
+      case LUNA_OP_MUL: binary(out, j, "LUNA_ARITH", i, "*"); break;
+      case LUNA_OP_BIT_SHL: binary(out, j, "LUNA_BITWISE", i, "<<"); break;
+      case LUNA_OP_BIT_SHR: binary(out, j, "LUNA_BITWISE", i, ">>"); break;
+      case LUNA_OP_BIT_AND: binary(out, j, "LUNA_BITWISE", i, "&"); break;
+      case LUNA_OP_BIT_OR: binary(out, j, "LUNA_BITWISE", i, "|"); break;
+      case LUNA_OP_BIT_XOR: binary(out, j, "LUNA_BITWISE", i, "^"); break;
+      case LUNA_OP_ADDI: typed(out, j, "INT", "luna_as_wrapping", i, "+"); break;
+      case LUNA_OP_SUBI: typed(out, j, "INT", "luna_as_wrapping", i, "-"); break;
+      case LUNA_OP_DIVI: typed(out, j, "INT", "luna_as_int", i, "/"); break;
+      case LUNA_OP_MULI: typed(out, j, "INT", "luna_as_wrapping", i, "*"); break;
+      case LUNA_OP_MODI: typed(out, j, "INT", "luna_as_int", i, "%"); break;
+      case LUNA_OP_ADDF: typed(out, j, "FLOAT", "luna_as_float", i, "+"); break;
+      case LUNA_OP_SUBF: typed(out, j, "FLOAT", "luna_as_float", i, "-"); break;
+      case LUNA_OP_DIVF: typed(out, j, "FLOAT", "luna_as_float", i, "/"); break;
+      case LUNA_OP_MULF: typed(out, j, "FLOAT", "luna_as_float", i, "*"); break;
+      case LUNA_OP_DIV:
+      case LUNA_OP_MOD:
+      case LUNA_OP_POW:
+        print("r[%d] = luna_%s(", A(i), LUNA_OP_DIV == OP(i) ? "div" : LUNA_OP_MOD == OP(i) ? "mod" : "pow");
+        rk(out, j, B(i));
+        print(", ");
+        rk(out, j, C(i));
+        print(");");
+        break;
+      case LUNA_OP_MODF:
+        print("LUNA_FLOAT(r[%d], fmodf(luna_as_float(", A(i));
+        rk(out, j, B(i));
+        print("), luna_as_float(");
+        rk(out, j, C(i));
+        print(")));");
+        break;
+      case LUNA_OP_NEGATE:
+        print("r[%d] = luna_negate(r[%d]);", A(i), B(i));
+        break;
+      case LUNA_OP_NOT:
+        print("LUNA_BOOL(r[%d], !luna_truthy(r[%d]));", A(i), B(i));
+        break;
+      case LUNA_OP_EQ:
+        print("if (luna_equal(");
+        rk(out, j, B(i));
+        print(", ");
+        rk(out, j, C(i));
+        print(") != %d) goto L%d;", A(i), pc + 2);
+        break;
+      case LUNA_OP_LT: compare(out, j, NULL, i, "<", pc); break;
+      case LUNA_OP_LTE: compare(out, j, NULL, i, "<=", pc); break;
+      case LUNA_OP_LTI: compare(out, j, "luna_as_int", i, "<", pc); break;
+      case LUNA_OP_LTEI: compare(out, j, "luna_as_int", i, "<=", pc); break;
+      case LUNA_OP_LTF: compare(out, j, "luna_as_float", i, "<", pc); break;
+      case LUNA_OP_LTEF: compare(out, j, "luna_as_float", i, "<=", pc); break;
+      case LUNA_OP_TEST:
+        print("if (luna_truthy(r[%d]) != %d) goto L%d;", A(i), C(i), pc + 2);
+        break;
+      case LUNA_OP_TESTSET:
+        print("if (luna_truthy(r[%d]) == %d) r[%d] = r[%d]; else goto L%d;", B(i), C(i), A(i), B(i), pc + 2);
+        break;
+      case LUNA_OP_JMP:
+        print("goto L%d;", pc + 1 + SBX(i));
+        break;
+      case LUNA_OP_CALL:
+        print("r[%d] = f%d(&r[%d], %d, NULL);", A(i), B(i), A(i) + 1, C(i));
+        break;
+      case LUNA_OP_DISPATCH:
+        dispatch(out, vm, &kv_A(vm->sites, BX(i)), A(i));
+        break;
+      case LUNA_OP_GUARD:
+        print("if ((uint32_t) luna_tuple(&r[%d], %d) == (uint32_t) luna_as_int(", A(i) + 1, C(i));
+        rk(out, j, B(i));
+        print(")) goto L%d;", pc + 2);
+        break;
+      // profiles are only recorded by the interpreter
+      case LUNA_OP_FEEDBACK:
+      case LUNA_OP_COUNT:
+        print(";");
+        break;
+      case LUNA_OP_ARGC:
+        print("if (nargs <= %d) goto L%d;", B(i), pc + 2);
+        break;
+      case LUNA_OP_CLOSURE: {
+        int index = BX(i);
+        luna_activation_t *callee = kv_A(vm->functions, index);
+        if (callee->closure) {
+          print("r[%d] = luna_value_pointer(LUNA_TYPE_FUNCTION, &closure%d);", A(i), index);
+          break;
+        }
+
+        // captures follow as moves from their registers, the
+        // closure is stored last as allocating may collect
+        print("{\n    luna_native_closure_t *closure = luna_native_closure(&fn%d, %d);\n", index, callee->nupvalues);
+        for (int k = 0; k < callee->nupvalues; ++k) {
+          print("    closure->upvalues[%d] = r[%d];\n", k, B(code[++pc]));
+        }
+        print("    r[%d] = luna_value_pointer(LUNA_TYPE_FUNCTION, closure);\n  }", A(i));
+        break;
+      }
+      case LUNA_OP_APPLY:
+        print("r[%d] = luna_native_apply(&r[%d], %d);", A(i), A(i), C(i));
+        break;
+      case LUNA_OP_BOX:
+        print("luna_native_box(&r[%d]);", A(i));
+        break;
+      case LUNA_OP_GETCELL:
+        print("r[%d] = *(luna_value_t *) luna_as_pointer(r[%d]);", A(i), B(i));
+        break;
+      case LUNA_OP_SETCELL:
+        print("*(luna_value_t *) luna_as_pointer(r[%d]) = r[%d];", A(i), B(i));
+        break;
+      case LUNA_OP_NEWOBJECT:
+        print("r[%d] = luna_native_object(%d);", A(i), B(i));
+        break;
+      // each access has an inline cache of its own
+      case LUNA_OP_GETFIELD:
+        key(out, K(C(i)));
+        print(" r[%d] = luna_native_get(r[%d], key, &c); }", A(i), B(i));
+        break;
+      case LUNA_OP_SETFIELD:
+        key(out, K(B(i)));
+        print(" luna_native_set(r[%d], key, &c, ", A(i));
+        rk(out, j, C(i));
+        print("); }");
+        break;
+      case LUNA_OP_NEWRECORD:
+        print("r[%d] = luna_native_record(&layout%d);", A(i), B(i));
+        break;
+      case LUNA_OP_CHECK:
+        print("r[%d] = luna_record_check(r[%d], &layout%d);", A(i), A(i), B(i));
+        break;
+      case LUNA_OP_GETI:
+        print("r[%d] = luna_record_geti(r[%d], %d);", A(i), B(i), C(i));
+        break;
+      case LUNA_OP_GETF:
+        print("r[%d] = luna_record_getf(r[%d], %d);", A(i), B(i), C(i));
+        break;
+      case LUNA_OP_GETV:
+        print("r[%d] = luna_record_getv(r[%d], %d);", A(i), B(i), C(i));
+        break;
+      case LUNA_OP_SETI:
+        print("luna_record_seti(r[%d], %d, ", A(i), B(i));
+        rk(out, j, C(i));
+        print(");");
+        break;
+      case LUNA_OP_SETF:
+        print("luna_record_setf(r[%d], %d, ", A(i), B(i));
+        rk(out, j, C(i));
+        print(");");
+        break;
+      case LUNA_OP_SETV:
+        print("{ luna_value_t *v = luna_record_slot(r[%d], %d); if (v) *v = ", A(i), B(i));
+        rk(out, j, C(i));
+        print("; }");
+        break;
+      case LUNA_OP_NEWARRAY:
+        print("r[%d] = luna_native_array(&layout%d, ", A(i), B(i));
+        rk(out, j, C(i));
+        print(");");
+        break;
+      case LUNA_OP_CHECKARRAY:
+        print("r[%d] = luna_array_check(r[%d], &layout%d);", A(i), A(i), B(i));
+        break;
+      case LUNA_OP_GETINDEX:
+        print("r[%d] = luna_native_index(r[%d], ", A(i), B(i));
+        rk(out, j, C(i));
+        print(");");
+        break;
+      case LUNA_OP_SETINDEX:
+        print("luna_native_put(r[%d], ", A(i));
+        rk(out, j, B(i));
+        print(", ");
+        rk(out, j, C(i));
+        print(");");
+        break;
+      case LUNA_OP_GETCI:
+        print("r[%d] = luna_array_geti(r[%d], %d, r[%d]);", A(i), B(i), C(i), B(i) + 1);
+        break;
+      case LUNA_OP_GETCF:
+        print("r[%d] = luna_array_getf(r[%d], %d, r[%d]);", A(i), B(i), C(i), B(i) + 1);
+        break;
+      case LUNA_OP_GETCV:
+        print("r[%d] = luna_array_getv(r[%d], %d, r[%d]);", A(i), B(i), C(i), B(i) + 1);
+        break;
+      case LUNA_OP_SETCI:
+        print("luna_array_seti(r[%d], %d, r[%d], ", A(i), B(i), A(i) + 1);
+        rk(out, j, C(i));
+        print(");");
+        break;
+      case LUNA_OP_SETCF:
+        print("luna_array_setf(r[%d], %d, r[%d], ", A(i), B(i), A(i) + 1);
+        rk(out, j, C(i));
+        print(");");
+        break;
+      case LUNA_OP_SETCV:
+        print("{ luna_value_t *v = luna_array_slot(r[%d], %d, r[%d]); if (v) *v = ", A(i), B(i), A(i) + 1);
+        rk(out, j, C(i));
+        print("; }");
+        break;
+      case LUNA_OP_NEWLIST:
+        print("r[%d] = luna_native_list(%d);", A(i), B(i));
+        break;
+      case LUNA_OP_APPEND:
+        print("luna_native_append(r[%d], ", A(i));
+        rk(out, j, B(i));
+        print(");");
+        break;
+      case LUNA_OP_RETURN:
+      case LUNA_OP_HALT:
+        print("LUNA_NATIVE_RETURN(r[%d]);", A(i));
+        break;
+    }
+
+    print("\n");
+  }
+
+  // skipped past the end
+  if (target[fn->ncode] || target[fn->ncode + 1]) print("L%d:\nL%d:\n  LUNA_NATIVE_RETURN(r[0]);\n", fn->ncode, fn->ncode + 1);
+  print("}\n\n");
+  free(target);
+}
+
+/*
+ * Emit `vm` as a C99 program to `out`. Each activation becomes
+ * a function with its registers held in a local array, pushed
+ * as a frame for the runtime to collect garbage from, and its
+ * jumps lowered to gotos, polymorphic call sites test the tags
+ * of their arguments inline. String constants are interned
+ * on startup. The program links against the runtime
+ * library, and prints its value as luna would.
+ */
+
+void
+luna_emit_c(luna_vm_t *vm, FILE *out) {
+  int n = kv_size(vm->functions);
+  char *closures = calloc(n + 1, 1);
+
+  // functions instantiated as closures
+  for (int j = -1; j < n; ++j) {
+    luna_activation_t *fn = j < 0 ? vm->main : kv_A(vm->functions, j);
+    for (int pc = 0; pc < fn->ncode; ++pc) {
+      luna_instruction_t i = fn->code[pc];
+      if (LUNA_OP_CLOSURE != OP(i)) continue;
+      closures[BX(i)] = 1;
+      pc += kv_A(vm->functions, BX(i))->nupvalues;
+    }
+  }
+
+  print("\n//\n// generated by luna %s\n//\n\n", LUNA_VERSION);
+  print("#include <string.h>\n");
+  print("#include \"runtime.h\"\n\n");
+
+  for (int j = 0; j < n; ++j) {
+    print("static luna_value_t f%d(luna_value_t *args, int nargs, luna_value_t *upvalues);\n", j);
+  }
+  if (n) print("\n");
+
+  layouts(out, vm->layouts);
+  for (int j = 0; j < n; ++j) data(out, kv_A(vm->functions, j), j, closures[j]);
+  data(out, vm->main, -1, 0);
+  free(closures);
+
+  for (int j = 0; j < n; ++j) body(out, vm, kv_A(vm->functions, j), j);
+  body(out, vm, vm->main, -1);
+
+  print("int\nmain(void) {\n");
+  for (int j = 0; j < n; ++j) strings(out, kv_A(vm->functions, j), j);
+  strings(out, vm->main, -1);
+  print("  luna_value_inspect(luna_result(f_main(NULL, 0, NULL)));\n");
+  print("  return 0;\n");
+  print("}\n");
+}
@@ -0,0 +1,19 @@
+
+//
+// emit.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_EMIT_H
+#define LUNA_EMIT_H
+
+#include <stdio.h>
+#include "vm.h"
+
+// protos
+
+void
+luna_emit_c(luna_vm_t *vm, FILE *out);
+
+#endif /* LUNA_EMIT_H */
@@ -38,3 +38,16 @@ luna_report_error(luna_parser_t *parser) {
     parser->ctx,
     err);
 }
+
+/*
+ * Report compile error.
+ */
+
+void
+luna_report_gen_error(luna_vm_t *vm, const char *filename) {
+  fprintf(stderr,
+    "luna(%s:%d). compile error, %s.\n",
+    filename,
+    vm->lineno,
+    vm->err);
+}
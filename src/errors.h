@@ -9,10 +9,14 @@
 #define LUNA_ERRORS_H
 
 #include "parser.h"
+#include "vm.h"
 
 // protos
 
 void
 luna_report_error(luna_parser_t *parser);
 
+void
+luna_report_gen_error(luna_vm_t *vm, const char *filename);
+
 #endif /* LUNA_ERRORS_H */
\ No newline at end of file
@@ -0,0 +1,382 @@
+
+//
+// escape.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdio.h>
+#include <string.h>
+#include "escape.h"
+#include "vec.h"
+#include "visitor.h"
+#include "internal.h"
+
+// aggregate literals by local
+
+KHASH_MAP_INIT_STR(literals, luna_node_t *);
+
+/*
+ * Escape analysis state.
+ */
+
+typedef struct {
+  khash_t(literals) *literals;
+  khash_t(scalars) *escaped;
+} escape_t;
+
+/*
+ * Node of the given `val`.
+ */
+
+#define NODE(val) ((luna_node_t *) luna_as_pointer(val))
+
+/*
+ * Escape analysis state of the visitor.
+ */
+
+#define STATE ((escape_t *) self->data)
+
+/*
+ * Write the name of field `key` of local `name` to `buf`,
+ * returning 0 unless `key` is a constant.
+ */
+
+int
+luna_field(char *buf, size_t len, const char *name, luna_node_t *key) {
+  switch (key->type) {
+    case LUNA_NODE_INT:
+      return snprintf(buf, len, "%s.%d", name, ((luna_int_node_t *) key)->val) < len;
+    case LUNA_NODE_ID:
+      return snprintf(buf, len, "%s.%s", name, ((luna_id_node_t *) key)->val) < len;
+    case LUNA_NODE_STRING:
+      return snprintf(buf, len, "%s.%s", name, ((luna_string_node_t *) key)->val) < len;
+  }
+  return 0;
+}
+
+/*
+ * Check if `node` is an aggregate literal whose fields
+ * are all known, a candidate for scalar replacement.
+ */
+
+static int
+literal(luna_node_t *node) {
+  char a[256], b[256];
+
+  if (LUNA_NODE_ARRAY == node->type) return 1;
+  if (LUNA_NODE_HASH != node->type) return 0;
+
+  luna_vec_t *pairs = ((luna_hash_node_t *) node)->pairs;
+  luna_vec_each(pairs, {
+    luna_node_t *key = ((luna_hash_pair_node_t *) NODE(val))->key;
+    if (!luna_field(a, sizeof(a), "", key)) return 0;
+
+    // duplicate keys
+    for (int j = 0; j < i; ++j) {
+      luna_node_t *other = ((luna_hash_pair_node_t *) NODE(luna_vec_at(pairs, j)))->key;
+      luna_field(b, sizeof(b), "", other);
+      if (0 == strcmp(a, b)) return 0;
+    }
+  });
+
+  return 1;
+}
+
+/*
+ * Check if aggregate `node` has field `key`.
+ */
+
+static int
+has_field(luna_node_t *node, luna_node_t *key) {
+  char a[256], b[256];
+
+  if (LUNA_NODE_ARRAY == node->type) {
+    if (LUNA_NODE_INT != key->type) return 0;
+    int n = ((luna_int_node_t *) key)->val;
+    return n >= 0 && n < luna_vec_length(((luna_array_node_t *) node)->vals);
+  }
+
+  if (!luna_field(a, sizeof(a), "", key)) return 0;
+  luna_vec_each(((luna_hash_node_t *) node)->pairs, {
+    luna_field(b, sizeof(b), "", ((luna_hash_pair_node_t *) NODE(val))->key);
+    if (0 == strcmp(a, b)) return 1;
+  });
+
+  return 0;
+}
+
+/*
+ * Mark local `name` as escaping.
+ */
+
+static void
+escape(escape_t *state, const char *name) {
+  int ret;
+  kh_put(scalars, state->escaped, name, &ret);
+}
+
+/*
+ * Define local `name` as aggregate literal `node`,
+ * aggregates assigned more than once escape.
+ */
+
+static void
+define(escape_t *state, const char *name, luna_node_t *node) {
+  int ret;
+  khiter_t k = kh_put(literals, state->literals, name, &ret);
+  if (!ret) escape(state, name);
+  kh_value(state->literals, k) = node;
+}
+
+/*
+ * Access field `key` of `name`, fields unknown
+ * at the point of access escape.
+ */
+
+static void
+use(escape_t *state, const char *name, luna_node_t *key) {
+  khiter_t k = kh_get(literals, state->literals, name);
+  if (k == kh_end(state->literals) || !has_field(kh_value(state->literals, k), key)) {
+    escape(state, name);
+  }
+}
+
+/*
+ * Visit block `node`. Aggregates only stay local when
+ * assigned as a statement, never as part of an expression.
+ */
+
+static void
+visit_block(luna_visitor_t *self, luna_block_node_t *node) {
+  luna_vec_each(node->stmts, {
+    luna_node_t *stmt = NODE(val);
+    luna_binary_op_node_t *op = (luna_binary_op_node_t *) stmt;
+
+    if (LUNA_NODE_BINARY_OP == stmt->type
+      && LUNA_TOKEN_OP_ASSIGN == op->op
+      && LUNA_NODE_ID == op->left->type
+      && literal(op->right)) {
+      visit(op->right);
+      define(STATE, ((luna_id_node_t *) op->left)->val, op->right);
+      continue;
+    }
+
+    visit(stmt);
+  });
+}
+
+/*
+ * Visit id `node`, any reference to an
+ * aggregate other than a field access escapes.
+ */
+
+static void
+visit_id(luna_visitor_t *self, luna_id_node_t *node) {
+  escape(STATE, node->val);
+}
+
+/*
+ * Visit slot `node`.
+ */
+
+static void
+visit_slot(luna_visitor_t *self, luna_slot_node_t *node) {
+  if (LUNA_NODE_ID == node->left->type) {
+    use(STATE, ((luna_id_node_t *) node->left)->val, node->right);
+  } else {
+    visit(node->left);
+  }
+}
+
+/*
+ * Visit subscript `node`.
+ */
+
+static void
+visit_subscript(luna_visitor_t *self, luna_subscript_node_t *node) {
+  char buf[256];
+  if (LUNA_NODE_ID == node->left->type && luna_field(buf, sizeof(buf), "", node->right)) {
+    use(STATE, ((luna_id_node_t *) node->left)->val, node->right);
+  } else {
+    visit(node->left);
+    visit(node->right);
+  }
+}
+
+/*
+ * Visit call `node`, arguments escape.
+ */
+
+static void
+visit_call(luna_visitor_t *self, luna_call_node_t *node) {
+  visit(node->expr);
+  luna_vec_each(node->args->vec, visit(NODE(val)));
+  luna_hash_each_val(node->args->hash, visit(NODE(val)));
+}
+
+/*
+ * Visit array `node`.
+ */
+
+static void
+visit_array(luna_visitor_t *self, luna_array_node_t *node) {
+  luna_vec_each(node->vals, visit(NODE(val)));
+}
+
+/*
+ * Visit hash `node`, id keys are names not references.
+ */
+
+static void
+visit_hash(luna_visitor_t *self, luna_hash_node_t *node) {
+  luna_vec_each(node->pairs, {
+    luna_hash_pair_node_t *pair = (luna_hash_pair_node_t *) NODE(val);
+    if (LUNA_NODE_ID != pair->key->type) visit(pair->key);
+    visit(pair->val);
+  });
+}
+
+/*
+ * Visit unary op `node`.
+ */
+
+static void
+visit_unary_op(luna_visitor_t *self, luna_unary_op_node_t *node) {
+  visit(node->expr);
+}
+
+/*
+ * Visit binary op `node`.
+ */
+
+static void
+visit_binary_op(luna_visitor_t *self, luna_binary_op_node_t *node) {
+  visit(node->left);
+  if (node->right) visit(node->right);
+}
+
+/*
+ * Visit let `node`.
+ */
+
+static void
+visit_let(luna_visitor_t *self, luna_let_node_t *node) {
+  luna_vec_each(node->vec, {
+    luna_binary_op_node_t *bin = (luna_binary_op_node_t *) NODE(val);
+    luna_decl_node_t *decl = (luna_decl_node_t *) bin->left;
+    int aggregate = bin->right && literal(bin->right) && 1 == luna_vec_length(decl->vec);
+
+    if (bin->right) visit(bin->right);
+
+    luna_vec_each(decl->vec, {
+      luna_id_node_t *id = (luna_id_node_t *) NODE(val);
+      if (aggregate) {
+        define(STATE, id->val, bin->right);
+      } else {
+        escape(STATE, id->val);
+      }
+    });
+  });
+}
+
+/*
+ * Visit `return` node.
+ */
+
+static void
+visit_return(luna_visitor_t *self, luna_return_node_t *node) {
+  if (node->expr) visit(node->expr);
+}
+
+/*
+ * Visit `while` node.
+ */
+
+static void
+visit_while(luna_visitor_t *self, luna_while_node_t *node) {
+  visit(node->expr);
+  visit((luna_node_t *) node->block);
+}
+
+/*
+ * Visit if `node`.
+ */
+
+static void
+visit_if(luna_visitor_t *self, luna_if_node_t *node) {
+  visit(node->expr);
+  visit((luna_node_t *) node->block);
+  luna_vec_each(node->else_ifs, visit(NODE(val)));
+  if (node->else_block) visit((luna_node_t *) node->else_block);
+}
+
+/*
+ * Visit function `node`, its own aggregates are analyzed
+ * with its body, references from within escape.
+ */
+
+static void
+visit_function(luna_visitor_t *self, luna_function_node_t *node) {
+  khash_t(literals) *outer = STATE->literals;
+  STATE->literals = kh_init(literals);
+
+  luna_vec_each(node->params, {
+    luna_node_t *param = NODE(val);
+    if (LUNA_NODE_BINARY_OP == param->type) {
+      visit(((luna_binary_op_node_t *) param)->right);
+    }
+  });
+  visit((luna_node_t *) node->block);
+
+  kh_destroy(literals, STATE->literals);
+  STATE->literals = outer;
+}
+
+/*
+ * Return the set of locals in body `node` holding array or
+ * hash literals which never escape it: they are only ever
+ * accessed through constant fields known from the literal,
+ * and are never passed, returned, aliased or reassigned.
+ */
+
+khash_t(scalars) *
+luna_escape(luna_node_t *node) {
+  escape_t state = {
+    .literals = kh_init(literals),
+    .escaped = kh_init(scalars)
+  };
+
+  luna_visitor_t visitor = {
+    .data = (void *) &state,
+    .visit_if = visit_if,
+    .visit_id = visit_id,
+    .visit_let = visit_let,
+    .visit_slot = visit_slot,
+    .visit_call = visit_call,
+    .visit_hash = visit_hash,
+    .visit_array = visit_array,
+    .visit_while = visit_while,
+    .visit_block = visit_block,
+    .visit_return = visit_return,
+    .visit_function = visit_function,
+    .visit_unary_op = visit_unary_op,
+    .visit_binary_op = visit_binary_op,
+    .visit_subscript = visit_subscript
+  };
+
+  luna_visit(&visitor, node);
+
+  khash_t(scalars) *scalars = kh_init(scalars);
+  for (khiter_t k = kh_begin(state.literals); k != kh_end(state.literals); ++k) {
+    if (!kh_exist(state.literals, k)) continue;
+    const char *name = kh_key(state.literals, k);
+    if (kh_get(scalars, state.escaped, name) != kh_end(state.escaped)) continue;
+    int ret;
+    kh_put(scalars, scalars, name, &ret);
+  }
+
+  kh_destroy(literals, state.literals);
+  kh_destroy(scalars, state.escaped);
+  return scalars;
+}
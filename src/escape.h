@@ -0,0 +1,27 @@
+
+//
+// escape.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_ESCAPE_H
+#define LUNA_ESCAPE_H
+
+#include <stddef.h>
+#include "ast.h"
+#include "khash.h"
+
+// non-escaping aggregates
+
+KHASH_SET_INIT_STR(scalars);
+
+// protos
+
+khash_t(scalars) *
+luna_escape(luna_node_t *node);
+
+int
+luna_field(char *buf, size_t len, const char *name, luna_node_t *key);
+
+#endif /* LUNA_ESCAPE_H */
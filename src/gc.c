@@ -0,0 +1,768 @@
+
+//
+// gc.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <string.h>
+#include "gc.h"
+#include "vm.h"
+#include "object.h"
+#include "array.h"
+#include "slab.h"
+#include "internal.h"
+
+/*
+ * Header of object `ptr`.
+ */
+
+#define HEADER(ptr) ((luna_gc_object_t *) (ptr) - 1)
+
+/*
+ * Fields and marks read by the collector thread
+ * while the mutator writes them.
+ */
+
+#define LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define STORE(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+
+/*
+ * Initialize an empty heap with a `nursery` byte
+ * nursery, allocating every object old when 0,
+ * marking `budget` bytes per step, all at once
+ * when 0, or on a thread when `concurrent`.
+ */
+
+void
+luna_gc_init(luna_gc_t *self, size_t nursery, size_t budget, int concurrent) {
+  self->objects = NULL;
+  self->live = 0;
+  self->threshold = LUNA_GC_THRESHOLD;
+  self->budget = budget;
+  self->marking = 0;
+  self->copied = 0;
+  self->nursery = self->top = self->end = NULL;
+  if (nursery && (self->nursery = malloc(nursery))) {
+    self->top = self->nursery;
+    self->end = self->nursery + nursery;
+  }
+  kv_init(self->gray);
+  kv_init(self->scan);
+  kv_init(self->remembered);
+  kv_init(self->owners);
+  memset(&self->stats, 0, sizeof(luna_gc_stats_t));
+
+  self->collector = NULL;
+  if (concurrent && (self->collector = calloc(1, sizeof(luna_gc_collector_t)))) {
+    pthread_mutex_init(&self->collector->lock, NULL);
+    pthread_cond_init(&self->collector->cond, NULL);
+    self->collector->phase = LUNA_GC_IDLE;
+    kv_init(self->collector->satb);
+    kv_init(self->collector->deferred);
+  }
+}
+
+/*
+ * Allocate a `size` byte object of `type` in the nursery,
+ * or return NULL when it is full.
+ */
+
+void *
+luna_gc_alloc(luna_gc_t *self, luna_object type, size_t size) {
+  size += sizeof(luna_gc_object_t);
+  size = (size + 7) & ~(size_t) 7;
+  if (unlikely((size_t) (self->end - self->top) < size)) return NULL;
+  luna_gc_object_t *obj = (luna_gc_object_t *) self->top;
+  self->top += size;
+  obj->next = NULL;
+  obj->size = size;
+  obj->type = type;
+  obj->marked = obj->dirty = 0;
+  self->stats.allocated += size;
+  return obj + 1;
+}
+
+/*
+ * Link `obj` into the old generation, black
+ * while marking concurrently.
+ */
+
+static void
+join(luna_gc_t *self, luna_gc_object_t *obj) {
+  obj->next = self->objects;
+  obj->marked = self->marking && self->collector;
+  obj->dirty = 0;
+  self->objects = obj;
+  self->live += obj->size;
+}
+
+/*
+ * Allocate a `size` byte object of `type` in the old
+ * generation, it is reclaimed once unreachable.
+ */
+
+void *
+luna_gc_tenure(luna_gc_t *self, luna_object type, size_t size) {
+  size += sizeof(luna_gc_object_t);
+  luna_gc_object_t *obj = luna_slab_alloc(size);
+  if (unlikely(!obj)) return NULL;
+  obj->size = size;
+  obj->type = type;
+  join(self, obj);
+  self->stats.allocated += size;
+  return obj + 1;
+}
+
+/*
+ * Remember old object `ptr` as referencing the nursery.
+ */
+
+void
+luna_gc_remember(luna_gc_t *self, void *ptr) {
+  luna_gc_object_t *obj = HEADER(ptr);
+  if (obj->dirty) return;
+  obj->dirty = 1;
+  kv_push(luna_gc_object_t *, self->remembered, obj);
+}
+
+/*
+ * Register young object `ptr` as owning memory outside
+ * the heap, released by the scavenge unless promoted.
+ * Old objects release it once swept.
+ */
+
+void
+luna_gc_own(luna_gc_t *self, void *ptr) {
+  if (!luna_gc_young(self, ptr)) return;
+  kv_push(luna_gc_object_t *, self->owners, HEADER(ptr));
+}
+
+/*
+ * Check if `ptr` of `val` is a closure shared by its
+ * activation, which is never collected.
+ */
+
+static inline int
+shared(luna_value_t val, void *ptr) {
+  return LUNA_TYPE_FUNCTION == luna_value_type(val)
+    && ((luna_closure_t *) ptr)->fn->closure == ptr;
+}
+
+/*
+ * Shade old value `val` for the collector, unless marked.
+ */
+
+static void
+shade(luna_gc_t *self, luna_value_t val) {
+  if (!luna_gc_collected(val)) return;
+  void *ptr = luna_as_pointer(val);
+  if (luna_gc_young(self, ptr) || shared(val, ptr)) return;
+
+  luna_gc_object_t *obj = HEADER(ptr);
+  if (LOAD(&obj->marked)) return;
+  luna_gc_collector_t *collector = self->collector;
+  pthread_mutex_lock(&collector->lock);
+  kv_push(luna_gc_object_t *, collector->satb, obj);
+  pthread_mutex_unlock(&collector->lock);
+}
+
+/*
+ * Write barrier for storing `val` into field `ptr` of `obj`,
+ * remembering old objects which now reference the nursery.
+ * While marking the value overwritten is shaded when
+ * concurrent, otherwise the value written.
+ */
+
+void
+luna_gc_write(luna_gc_t *self, void *obj, luna_value_t *ptr, luna_value_t val) {
+  if (self->marking && self->collector) shade(self, *ptr);
+  if (!luna_gc_collected(val)) return;
+
+  if (luna_gc_young(self, luna_as_pointer(val))) {
+    if (!luna_gc_young(self, obj)) luna_gc_remember(self, obj);
+  } else if (self->marking && !self->collector) {
+    luna_gc_mark(self, &val, 1);
+  }
+}
+
+/*
+ * Promote the nursery objects referenced by the `n` values
+ * of `vals`, updating them to the copies. The copies are
+ * queued to promote what they reference in turn, and
+ * gray while marking incrementally.
+ */
+
+void
+luna_gc_evacuate(luna_gc_t *self, luna_value_t *vals, int n) {
+  for (int i = 0; i < n; ++i) {
+    if (!luna_gc_collected(vals[i])) continue;
+    void *ptr = luna_as_pointer(vals[i]);
+    if (!luna_gc_young(self, ptr)) continue;
+
+    luna_gc_object_t *obj = HEADER(ptr);
+    if (!obj->next) {
+      luna_gc_object_t *copy = luna_slab_alloc(obj->size);
+      memcpy(copy, obj, obj->size);
+      join(self, copy);
+      self->copied += obj->size;
+      kv_push(luna_gc_object_t *, self->scan, copy);
+      if (self->marking && !self->collector) {
+        copy->marked = 1;
+        kv_push(luna_gc_object_t *, self->gray, copy);
+      }
+      obj->next = copy;
+    }
+
+    STORE(&vals[i], luna_value_pointer(obj->type, obj->next + 1));
+  }
+}
+
+/*
+ * Evacuate the references of `obj`. Objects turned into
+ * dictionaries only reference the values of `dict`.
+ */
+
+static void
+evacuate_object(luna_gc_t *self, luna_gc_object_t *obj) {
+  switch (obj->type) {
+    case LUNA_TYPE_FUNCTION: {
+      luna_closure_t *closure = (luna_closure_t *) (obj + 1);
+      luna_gc_evacuate(self, closure->upvalues, closure->fn->nupvalues);
+      break;
+    }
+    case LUNA_TYPE_CELL:
+      luna_gc_evacuate(self, (luna_value_t *) (obj + 1), 1);
+      break;
+    case LUNA_TYPE_OBJECT: {
+      luna_object_t *object = (luna_object_t *) (obj + 1);
+      luna_hash_t *dict = object->dict;
+      if (!dict) {
+        luna_gc_evacuate(self, object->slots, object->capacity);
+        break;
+      }
+      for (khiter_t k = kh_begin(dict); k < kh_end(dict); ++k) {
+        if (kh_exist(dict, k)) luna_gc_evacuate(self, &kh_value(dict, k), 1);
+      }
+      break;
+    }
+    case LUNA_TYPE_RECORD: {
+      luna_record_t *rec = (luna_record_t *) (obj + 1);
+      if (luna_record_viewed(rec)) {
+        luna_gc_evacuate(self, &((luna_view_t *) rec)->array, 1);
+        break;
+      }
+      luna_layout_t *layout = rec->layout;
+      for (int i = 0; i < layout->nfields; ++i) {
+        luna_field_t *field = &layout->fields[i];
+        if (LUNA_FIELD_VALUE != field->kind) continue;
+        luna_gc_evacuate(self, &LUNA_RECORD_FIELD(rec, luna_value_t, field->offset), 1);
+      }
+      break;
+    }
+    case LUNA_TYPE_ARRAY: {
+      luna_array_t *arr = (luna_array_t *) (obj + 1);
+      if (!arr->layout) {
+        if (LUNA_ARRAY_VALUES == arr->kind) luna_gc_evacuate(self, arr->columns[0], arr->length);
+        break;
+      }
+      for (int i = 0; i < arr->layout->nfields; ++i) {
+        if (LUNA_FIELD_VALUE != arr->layout->fields[i].kind) continue;
+        luna_gc_evacuate(self, LUNA_ARRAY_COLUMN(arr, luna_value_t, i), arr->length);
+      }
+      break;
+    }
+  }
+}
+
+/*
+ * Release the memory `obj` owns outside the heap.
+ */
+
+static void
+finalize(luna_gc_object_t *obj) {
+  switch (obj->type) {
+    case LUNA_TYPE_OBJECT:
+      luna_hash_destroy(((luna_object_t *) (obj + 1))->dict);
+      break;
+    case LUNA_TYPE_ARRAY:
+      luna_array_destroy((luna_array_t *) (obj + 1));
+      break;
+  }
+}
+
+/*
+ * Finish a scavenge once the roots are evacuated, promoting
+ * what the remembered old objects and the promoted ones
+ * reference, then empty the nursery.
+ */
+
+void
+luna_gc_scavenge(luna_gc_t *self) {
+  for (int i = 0; i < kv_size(self->remembered); ++i) {
+    luna_gc_object_t *obj = kv_A(self->remembered, i);
+    obj->dirty = 0;
+    evacuate_object(self, obj);
+  }
+  kv_size(self->remembered) = 0;
+
+  while (kv_size(self->scan)) {
+    evacuate_object(self, kv_pop(self->scan));
+  }
+
+  // copies own what their originals did
+  for (int i = 0; i < kv_size(self->owners); ++i) {
+    luna_gc_object_t *obj = kv_A(self->owners, i);
+    if (!obj->next) finalize(obj);
+  }
+  kv_size(self->owners) = 0;
+
+  self->stats.promoted += self->copied;
+  self->stats.reclaimed += self->top - self->nursery - self->copied;
+  self->copied = 0;
+  self->top = self->nursery;
+  self->stats.scavenges++;
+}
+
+/*
+ * Mark the old objects referenced by the `n` values of
+ * `vals` gray, deferring their references to a step.
+ * Young objects are left to be grayed once promoted.
+ */
+
+void
+luna_gc_mark(luna_gc_t *self, luna_value_t *vals, int n) {
+  for (int i = 0; i < n; ++i) {
+    luna_value_t val = LOAD(&vals[i]);
+    if (!luna_gc_collected(val)) continue;
+    void *ptr = luna_as_pointer(val);
+    if (luna_gc_young(self, ptr) || shared(val, ptr)) continue;
+
+    luna_gc_object_t *obj = HEADER(ptr);
+    if (LOAD(&obj->marked)) continue;
+    STORE(&obj->marked, 1);
+    kv_push(luna_gc_object_t *, self->gray, obj);
+  }
+}
+
+/*
+ * Mark the references of gray object `obj`. Dictionaries
+ * and packed arrays are deferred to the remark instead
+ * when `defer` is set, as the mutator may be rehashing
+ * or repacking them.
+ */
+
+static void
+blacken(luna_gc_t *self, luna_gc_object_t *obj, int defer) {
+  switch (obj->type) {
+    case LUNA_TYPE_FUNCTION: {
+      luna_closure_t *closure = (luna_closure_t *) (obj + 1);
+      luna_gc_mark(self, closure->upvalues, closure->fn->nupvalues);
+      break;
+    }
+    case LUNA_TYPE_CELL:
+      luna_gc_mark(self, (luna_value_t *) (obj + 1), 1);
+      break;
+    case LUNA_TYPE_OBJECT: {
+      luna_object_t *object = (luna_object_t *) (obj + 1);
+      luna_hash_t *dict = LOAD(&object->dict);
+      if (!dict) {
+        luna_gc_mark(self, object->slots, object->capacity);
+      } else if (defer) {
+        kv_push(luna_gc_object_t *, self->collector->deferred, obj);
+      } else {
+        luna_hash_each_val(dict, luna_gc_mark(self, &val, 1));
+      }
+      break;
+    }
+    case LUNA_TYPE_RECORD: {
+      luna_record_t *rec = (luna_record_t *) (obj + 1);
+      if (luna_record_viewed(rec)) {
+        luna_gc_mark(self, &((luna_view_t *) rec)->array, 1);
+        break;
+      }
+      luna_layout_t *layout = rec->layout;
+      for (int i = 0; i < layout->nfields; ++i) {
+        luna_field_t *field = &layout->fields[i];
+        if (LUNA_FIELD_VALUE != field->kind) continue;
+        luna_gc_mark(self, &LUNA_RECORD_FIELD(rec, luna_value_t, field->offset), 1);
+      }
+      break;
+    }
+    case LUNA_TYPE_ARRAY: {
+      luna_array_t *arr = (luna_array_t *) (obj + 1);
+      if (!arr->layout) {
+        if (defer) {
+          kv_push(luna_gc_object_t *, self->collector->deferred, obj);
+        } else if (LUNA_ARRAY_VALUES == arr->kind) {
+          luna_gc_mark(self, arr->columns[0], arr->length);
+        }
+        break;
+      }
+      for (int i = 0; i < arr->layout->nfields; ++i) {
+        if (LUNA_FIELD_VALUE != arr->layout->fields[i].kind) continue;
+        luna_gc_mark(self, LUNA_ARRAY_COLUMN(arr, luna_value_t, i), arr->length);
+      }
+      break;
+    }
+  }
+}
+
+/*
+ * Blacken gray objects until `budget` bytes of them are
+ * traced, deferring dictionaries when `concurrent`,
+ * and return whether none are left.
+ */
+
+static int
+advance(luna_gc_t *self, size_t budget, int concurrent) {
+  size_t traced = 0;
+  while (kv_size(self->gray) && traced < budget) {
+    luna_gc_object_t *obj = kv_pop(self->gray);
+    traced += obj->size;
+    blacken(self, obj, concurrent);
+  }
+  return !kv_size(self->gray);
+}
+
+/*
+ * Blacken gray objects until `budget` bytes of them are
+ * traced, returning whether none are left.
+ */
+
+int
+luna_gc_step(luna_gc_t *self, size_t budget) {
+  return advance(self, budget, 0);
+}
+
+/*
+ * Mark everything reachable from the gray objects.
+ */
+
+void
+luna_gc_trace(luna_gc_t *self) {
+  luna_gc_step(self, SIZE_MAX);
+}
+
+/*
+ * Move the unmarked objects of list `link` to `garbage`,
+ * clearing the marks of the rest, and return the bytes
+ * moved. `tail` is set to the last object left.
+ */
+
+static size_t
+sweep(luna_gc_object_t **link, luna_gc_object_t **garbage, luna_gc_object_t **tail) {
+  size_t reclaimed = 0;
+  *tail = NULL;
+
+  while (*link) {
+    luna_gc_object_t *obj = *link;
+    if (LOAD(&obj->marked)) {
+      STORE(&obj->marked, 0);
+      *tail = obj;
+      link = &obj->next;
+    } else {
+      *link = obj->next;
+      obj->next = *garbage;
+      *garbage = obj;
+      reclaimed += obj->size;
+    }
+  }
+
+  return reclaimed;
+}
+
+/*
+ * Free the objects of list `obj`.
+ */
+
+static void
+release(luna_gc_object_t *obj) {
+  while (obj) {
+    luna_gc_object_t *next = obj->next;
+    finalize(obj);
+    luna_slab_free(obj, obj->size);
+    obj = next;
+  }
+}
+
+/*
+ * Account for `reclaimed` bytes, ending the marking. The
+ * next collection is due once the old generation grows
+ * by LUNA_GC_GROWTH.
+ */
+
+static void
+settle(luna_gc_t *self, size_t reclaimed) {
+  self->marking = 0;
+  self->live -= reclaimed;
+  self->threshold = self->live * LUNA_GC_GROWTH;
+  if (self->threshold < LUNA_GC_THRESHOLD) self->threshold = LUNA_GC_THRESHOLD;
+  self->stats.reclaimed += reclaimed;
+}
+
+/*
+ * Free unmarked old objects, clearing the marks of the
+ * rest, and return the bytes reclaimed.
+ */
+
+size_t
+luna_gc_sweep(luna_gc_t *self) {
+  luna_gc_object_t *garbage = NULL, *tail;
+  size_t reclaimed = sweep(&self->objects, &garbage, &tail);
+  release(garbage);
+  settle(self, reclaimed);
+  return reclaimed;
+}
+
+/*
+ * Set the collector's `phase`, waking the other side.
+ */
+
+static void
+enter(luna_gc_collector_t *self, luna_gc_phase phase) {
+  pthread_mutex_lock(&self->lock);
+  self->phase = phase;
+  pthread_cond_broadcast(&self->cond);
+  pthread_mutex_unlock(&self->lock);
+}
+
+/*
+ * Gray the objects shaded by the mutator, returning
+ * whether there were any. Called with the lock held.
+ */
+
+static int
+drain(luna_gc_t *self) {
+  luna_gc_collector_t *collector = self->collector;
+  int n = kv_size(collector->satb);
+  for (int i = 0; i < n; ++i) {
+    luna_gc_object_t *obj = kv_A(collector->satb, i);
+    if (LOAD(&obj->marked)) continue;
+    STORE(&obj->marked, 1);
+    kv_push(luna_gc_object_t *, self->gray, obj);
+  }
+  kv_size(collector->satb) = 0;
+  return n;
+}
+
+/*
+ * Sweep the old generation detached by the remark.
+ */
+
+static void
+sweep_detached(luna_gc_collector_t *self) {
+  self->garbage = NULL;
+  self->survivors = self->sweep;
+  self->reclaimed = sweep(&self->survivors, &self->garbage, &self->tail);
+}
+
+/*
+ * Collector thread, marking until no gray or shaded
+ * objects are left, and sweeping once remarked.
+ */
+
+static void *
+run(void *data) {
+  luna_gc_t *self = data;
+  luna_gc_collector_t *collector = self->collector;
+
+  pthread_mutex_lock(&collector->lock);
+  for (;;) {
+    switch (collector->phase) {
+      case LUNA_GC_MARKING:
+        pthread_mutex_unlock(&collector->lock);
+        advance(self, SIZE_MAX, 1);
+        pthread_mutex_lock(&collector->lock);
+        if (!drain(self)) {
+          collector->phase = LUNA_GC_MARKED;
+          pthread_cond_broadcast(&collector->cond);
+        }
+        break;
+      case LUNA_GC_SWEEPING:
+        pthread_mutex_unlock(&collector->lock);
+        sweep_detached(collector);
+        pthread_mutex_lock(&collector->lock);
+        collector->phase = LUNA_GC_SWEPT;
+        pthread_cond_broadcast(&collector->cond);
+        break;
+      case LUNA_GC_EXIT:
+        pthread_mutex_unlock(&collector->lock);
+        return NULL;
+      default:
+        pthread_cond_wait(&collector->cond, &collector->lock);
+    }
+  }
+}
+
+/*
+ * Hand the gray roots to the collector thread, starting
+ * it on the first collection. Should that fail they
+ * are marked at once.
+ */
+
+void
+luna_gc_start(luna_gc_t *self) {
+  luna_gc_collector_t *collector = self->collector;
+  if (!collector->started) {
+    collector->started = !pthread_create(&collector->thread, NULL, run, self);
+  }
+
+  if (collector->started) {
+    enter(collector, LUNA_GC_MARKING);
+  } else {
+    luna_gc_trace(self);
+    enter(collector, LUNA_GC_MARKED);
+  }
+}
+
+/*
+ * Current phase of the collector.
+ */
+
+luna_gc_phase
+luna_gc_poll(luna_gc_t *self) {
+  luna_gc_collector_t *collector = self->collector;
+  pthread_mutex_lock(&collector->lock);
+  luna_gc_phase phase = collector->phase;
+  pthread_mutex_unlock(&collector->lock);
+  return phase;
+}
+
+/*
+ * Wait for the collector to finish marking or
+ * sweeping, returning the phase it is left in.
+ */
+
+luna_gc_phase
+luna_gc_wait(luna_gc_t *self) {
+  luna_gc_collector_t *collector = self->collector;
+  pthread_mutex_lock(&collector->lock);
+  while (LUNA_GC_MARKING == collector->phase || LUNA_GC_SWEEPING == collector->phase) {
+    pthread_cond_wait(&collector->cond, &collector->lock);
+  }
+  luna_gc_phase phase = collector->phase;
+  pthread_mutex_unlock(&collector->lock);
+  return phase;
+}
+
+/*
+ * Finish marking once the collector is done, graying what
+ * was shaded since and tracing the objects it deferred,
+ * and hand it the old generation to sweep. The nursery
+ * must be empty.
+ */
+
+void
+luna_gc_remark(luna_gc_t *self) {
+  luna_gc_collector_t *collector = self->collector;
+  pthread_mutex_lock(&collector->lock);
+  drain(self);
+  pthread_mutex_unlock(&collector->lock);
+  for (int i = 0; i < kv_size(collector->deferred); ++i) {
+    blacken(self, kv_A(collector->deferred, i), 0);
+  }
+  kv_size(collector->deferred) = 0;
+  luna_gc_trace(self);
+
+  self->marking = 0;
+  collector->sweep = self->objects;
+  self->objects = NULL;
+
+  if (collector->started) {
+    enter(collector, LUNA_GC_SWEEPING);
+  } else {
+    sweep_detached(collector);
+    enter(collector, LUNA_GC_SWEPT);
+  }
+}
+
+/*
+ * Take back the survivors of a sweep, freeing the
+ * garbage, and return the bytes reclaimed.
+ */
+
+size_t
+luna_gc_reclaim(luna_gc_t *self) {
+  luna_gc_collector_t *collector = self->collector;
+  if (collector->tail) {
+    collector->tail->next = self->objects;
+    self->objects = collector->survivors;
+  }
+  release(collector->garbage);
+  collector->survivors = collector->tail = collector->garbage = NULL;
+
+  size_t reclaimed = collector->reclaimed;
+  settle(self, reclaimed);
+  self->stats.collections++;
+  enter(collector, LUNA_GC_IDLE);
+  return reclaimed;
+}
+
+/*
+ * Record a `pause` in `stats`.
+ */
+
+void
+luna_gc_pause(luna_gc_stats_t *stats, double pause) {
+  int i = 0;
+  double us = pause * 1e6;
+  while (i < LUNA_GC_BUCKETS - 1 && us >= (double) (1 << i)) ++i;
+  stats->pauses[i]++;
+  stats->pause += pause;
+  if (pause > stats->max_pause) stats->max_pause = pause;
+}
+
+/*
+ * Upper bound in seconds of the `p` percentile pause,
+ * the bound of the first bucket reaching it.
+ */
+
+double
+luna_gc_percentile(luna_gc_stats_t *stats, double p) {
+  unsigned total = 0, seen = 0;
+  for (int i = 0; i < LUNA_GC_BUCKETS; ++i) total += stats->pauses[i];
+  if (!total) return 0;
+
+  int i = 0;
+  for (; i < LUNA_GC_BUCKETS - 1; ++i) {
+    seen += stats->pauses[i];
+    if (seen >= p * total) break;
+  }
+  return (1 << i) / 1e6;
+}
+
+/*
+ * Free every object of the heap.
+ */
+
+void
+luna_gc_free(luna_gc_t *self) {
+  luna_gc_collector_t *collector = self->collector;
+  if (collector) {
+    luna_gc_phase phase = luna_gc_wait(self);
+    enter(collector, LUNA_GC_EXIT);
+    if (collector->started) pthread_join(collector->thread, NULL);
+    if (LUNA_GC_SWEPT == phase) {
+      release(collector->survivors);
+      release(collector->garbage);
+    }
+    pthread_mutex_destroy(&collector->lock);
+    pthread_cond_destroy(&collector->cond);
+    kv_destroy(collector->satb);
+    kv_destroy(collector->deferred);
+    free(collector);
+    self->collector = NULL;
+  }
+
+  release(self->objects);
+  for (int i = 0; i < kv_size(self->owners); ++i) finalize(kv_A(self->owners, i));
+  free(self->nursery);
+  self->objects = NULL;
+  self->nursery = self->top = self->end = NULL;
+  self->live = 0;
+  kv_destroy(self->gray);
+  kv_destroy(self->scan);
+  kv_destroy(self->remembered);
+  kv_destroy(self->owners);
+}
@@ -0,0 +1,258 @@
+
+//
+// gc.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_GC_H
+#define LUNA_GC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "value.h"
+#include "kvec.h"
+
+/*
+ * Bytes allocated before the first collection,
+ * and the least allowed between any two.
+ */
+
+#define LUNA_GC_THRESHOLD (256 * 1024)
+
+/*
+ * Factor the heap may grow by over the bytes
+ * surviving a collection before the next one.
+ */
+
+#define LUNA_GC_GROWTH 2
+
+/*
+ * Default nursery size.
+ */
+
+#define LUNA_GC_NURSERY (256 * 1024)
+
+/*
+ * Default bytes marked per incremental step.
+ */
+
+#define LUNA_GC_BUDGET (16 * 1024)
+
+/*
+ * Pause histogram buckets, bucket `i` counting
+ * pauses under 2^i microseconds.
+ */
+
+#define LUNA_GC_BUCKETS 24
+
+/*
+ * Header preceding every collected object, linking it
+ * into the old generation. Objects in the nursery link
+ * to their copy once promoted instead. `dirty` is set
+ * for old objects remembered as referencing the nursery.
+ */
+
+typedef struct luna_gc_object {
+  struct luna_gc_object *next;
+  uint32_t size;
+  uint8_t type;
+  uint8_t marked;
+  uint8_t dirty;
+} luna_gc_object_t;
+
+/*
+ * Phase of a concurrent collection.
+ */
+
+typedef enum {
+  LUNA_GC_IDLE,
+  LUNA_GC_MARKING,
+  LUNA_GC_MARKED,
+  LUNA_GC_SWEEPING,
+  LUNA_GC_SWEPT,
+  LUNA_GC_EXIT
+} luna_gc_phase;
+
+/*
+ * Collector thread, marking and sweeping the old generation
+ * while the mutator runs. The mutator hands it the gray
+ * roots, values overwritten since are shaded into `satb`
+ * until the remark, after which it sweeps the detached
+ * `sweep` list into `survivors` and `garbage` for the
+ * mutator to take back. Dictionaries and packed arrays
+ * the mutator may be rehashing or repacking are
+ * `deferred` to the remark. `phase` is guarded
+ * by `lock`.
+ */
+
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int started;
+  luna_gc_phase phase;
+  kvec_t(struct luna_gc_object *) satb;
+  kvec_t(struct luna_gc_object *) deferred;
+  struct luna_gc_object *sweep;
+  struct luna_gc_object *survivors;
+  struct luna_gc_object *tail;
+  struct luna_gc_object *garbage;
+  size_t reclaimed;
+} luna_gc_collector_t;
+
+/*
+ * Collection stats, pauses in seconds.
+ */
+
+typedef struct {
+  int collections;
+  int scavenges;
+  int steps;
+  size_t allocated;
+  size_t promoted;
+  size_t reclaimed;
+  double pause;
+  double max_pause;
+  unsigned pauses[LUNA_GC_BUCKETS];
+} luna_gc_stats_t;
+
+/*
+ * Generational heap of closures, cells, objects, records
+ * and arrays.
+ *
+ * Objects are bump allocated in the nursery, and those
+ * surviving a scavenge are copied to the old generation,
+ * which is marked and swept. A collection is due once
+ * `live` old bytes exceed `threshold`.
+ *
+ * Marking is incremental, `budget` bytes of gray objects
+ * traced at a time, while `marking` stores shade the
+ * values written. Objects promoted meanwhile are gray.
+ * `copied` counts the bytes promoted by a scavenge.
+ * Young objects owning memory outside the heap are
+ * kept in `owners` to release unless promoted.
+ *
+ * With a `collector` marking is concurrent instead, from
+ * a snapshot of the heap at its start: stores shade the
+ * values overwritten, and objects promoted or allocated
+ * old meanwhile are black.
+ */
+
+typedef struct {
+  luna_gc_object_t *objects;
+  size_t live;
+  size_t threshold;
+  size_t budget;
+  int marking;
+  size_t copied;
+  char *nursery;
+  char *top;
+  char *end;
+  kvec_t(luna_gc_object_t *) gray;
+  kvec_t(luna_gc_object_t *) scan;
+  kvec_t(luna_gc_object_t *) remembered;
+  kvec_t(luna_gc_object_t *) owners;
+  luna_gc_collector_t *collector;
+  luna_gc_stats_t stats;
+} luna_gc_t;
+
+/*
+ * Check if allocating `size` more old bytes is due a collection.
+ */
+
+#define luna_gc_due(self, size) \
+  ((self)->live + sizeof(luna_gc_object_t) + (size) > (self)->threshold)
+
+/*
+ * Check if `val` references a collected type.
+ */
+
+#define luna_gc_collected(val) \
+  (LUNA_TYPE_FUNCTION == luna_value_type(val) \
+    || LUNA_TYPE_CELL == luna_value_type(val) \
+    || LUNA_TYPE_OBJECT == luna_value_type(val) \
+    || LUNA_TYPE_RECORD == luna_value_type(val) \
+    || LUNA_TYPE_ARRAY == luna_value_type(val))
+
+/*
+ * Check if `ptr` lies in the nursery.
+ */
+
+#define luna_gc_young(self, ptr) \
+  ((char *) (ptr) >= (self)->nursery && (char *) (ptr) < (self)->end)
+
+/*
+ * Write barrier for storing `val` into field `ptr`
+ * of `obj`, a cell, an object, a record or an array.
+ */
+
+#define luna_gc_barrier(self, obj, ptr, val) do { \
+  if ((self)->marking \
+    || (!luna_gc_young(self, obj) && luna_gc_collected(val))) luna_gc_write(self, obj, ptr, val); \
+} while (0)
+
+// protos
+
+void
+luna_gc_init(luna_gc_t *self, size_t nursery, size_t budget, int concurrent);
+
+void *
+luna_gc_alloc(luna_gc_t *self, luna_object type, size_t size);
+
+void *
+luna_gc_tenure(luna_gc_t *self, luna_object type, size_t size);
+
+void
+luna_gc_remember(luna_gc_t *self, void *ptr);
+
+void
+luna_gc_own(luna_gc_t *self, void *ptr);
+
+void
+luna_gc_write(luna_gc_t *self, void *obj, luna_value_t *ptr, luna_value_t val);
+
+void
+luna_gc_evacuate(luna_gc_t *self, luna_value_t *vals, int n);
+
+void
+luna_gc_scavenge(luna_gc_t *self);
+
+void
+luna_gc_mark(luna_gc_t *self, luna_value_t *vals, int n);
+
+int
+luna_gc_step(luna_gc_t *self, size_t budget);
+
+void
+luna_gc_trace(luna_gc_t *self);
+
+size_t
+luna_gc_sweep(luna_gc_t *self);
+
+void
+luna_gc_start(luna_gc_t *self);
+
+luna_gc_phase
+luna_gc_poll(luna_gc_t *self);
+
+luna_gc_phase
+luna_gc_wait(luna_gc_t *self);
+
+void
+luna_gc_remark(luna_gc_t *self);
+
+size_t
+luna_gc_reclaim(luna_gc_t *self);
+
+void
+luna_gc_pause(luna_gc_stats_t *stats, double pause);
+
+double
+luna_gc_percentile(luna_gc_stats_t *stats, double p);
+
+void
+luna_gc_free(luna_gc_t *self);
+
+#endif /* LUNA_GC_H */
@@ -6,44 +6,74 @@
 //
 
 #include "hash.h"
+#include "slab.h"
 
 /*
- * Set hash `key` to `val`.
+ * Allocate a new hash.
+ */
+
+khash_t(value) *
+luna_hash_new() {
+  khash_t(value) *self = luna_slab_alloc(sizeof(khash_t(value)));
+  if (self) memset(self, 0, sizeof(khash_t(value)));
+  return self;
+}
+
+/*
+ * Destroy the hash, its buckets are
+ * grown by khash with realloc().
+ */
+
+void
+luna_hash_destroy(khash_t(value) *self) {
+  if (!self) return;
+  free(self->keys);
+  free(self->flags);
+  free(self->vals);
+  luna_slab_free(self, sizeof(khash_t(value)));
+}
+
+/*
+ * Set hash interned `key` to `val`.
  */
 
 inline void
-luna_hash_set(khash_t(value) *self, char *key, luna_object_t *val) {
+luna_hash_set(khash_t(value) *self, const char *key, luna_value_t val) {
   int ret;
+  luna_assert_interned(key);
   khiter_t k = kh_put(value, self, key, &ret);
   kh_value(self, k) = val;
 }
 
 /*
- * Get hash `key`, or NULL.
+ * Get hash interned `key`, or nil.
  */
 
-inline luna_object_t *
-luna_hash_get(khash_t(value) *self, char *key) {
+inline luna_value_t
+luna_hash_get(khash_t(value) *self, const char *key) {
+  luna_assert_interned(key);
   khiter_t k = kh_get(value, self, key);
-  return k == kh_end(self) ? NULL : kh_value(self, k);
+  return k == kh_end(self) ? LUNA_VALUE_NIL : kh_value(self, k);
 }
 
 /*
- * Check if hash `key` exists.
+ * Check if hash interned `key` exists.
  */
 
 inline int
-luna_hash_has(khash_t(value) *self, char *key) {
+luna_hash_has(khash_t(value) *self, const char *key) {
+  luna_assert_interned(key);
   khiter_t k = kh_get(value, self, key);
   return kh_exist(self, k);
 }
 
 /*
- * Remove hash `key`.
+ * Remove hash interned `key`.
  */
 
 void
-luna_hash_remove(khash_t(value) *self, char *key) {
+luna_hash_remove(khash_t(value) *self, const char *key) {
+  luna_assert_interned(key);
   khiter_t k = kh_get(value, self, key);
   kh_del(value, self, k);
 }
\ No newline at end of file
@@ -9,33 +9,20 @@
 #define LUNA_HASH_H
 
 #include "khash.h"
-
-// luna object
-
-typedef struct luna_object_struct luna_object_t;
+#include "value.h"
+#include "intern.h"
 
 // value hash
 
-KHASH_MAP_INIT_STR(value, luna_object_t *);
+KHASH_MAP_INIT_INTERNED(value, luna_value_t);
 
 /*
- * Luna hash.
+ * Luna hash, of string keys. Keys must be interned,
+ * see luna_assert_interned().
  */
 
 typedef khash_t(value) luna_hash_t;
 
-/*
- * Allocate a new hash.
- */
-
-#define luna_hash_new() kh_init(value)
-
-/*
- * Destroy the hash.
- */
-
-#define luna_hash_destroy(self) kh_destroy(value, self)
-
 /*
  * Hash size.
  */
@@ -49,7 +36,7 @@ typedef khash_t(value) luna_hash_t;
 
 #define luna_hash_each(self, block) { \
    const char *slot; \
-   luna_object_t *val; \
+   luna_value_t val; \
     for (khiter_t k = kh_begin(self); k < kh_end(self); ++k) { \
       if (!kh_exist(self, k)) continue; \
       slot = kh_key(self, k); \
@@ -76,7 +63,7 @@ typedef khash_t(value) luna_hash_t;
  */
 
 #define luna_hash_each_val(self, block) { \
-    luna_object_t *val; \
+    luna_value_t val; \
     for (khiter_t k = kh_begin(self); k < kh_end(self); ++k) { \
       if (!kh_exist(self, k)) continue; \
       val = kh_value(self, k); \
@@ -86,16 +73,22 @@ typedef khash_t(value) luna_hash_t;
 
 // protos
 
+khash_t(value) *
+luna_hash_new();
+
+void
+luna_hash_destroy(khash_t(value) *self);
+
 void
-luna_hash_set(khash_t(value) *self, char *key, luna_object_t *val);
+luna_hash_set(khash_t(value) *self, const char *key, luna_value_t val);
 
-luna_object_t *
-luna_hash_get(khash_t(value) *self, char *key);
+luna_value_t
+luna_hash_get(khash_t(value) *self, const char *key);
 
 int
-luna_hash_has(khash_t(value) *self, char *key);
+luna_hash_has(khash_t(value) *self, const char *key);
 
 void
-luna_hash_remove(khash_t(value) *self, char *key);
+luna_hash_remove(khash_t(value) *self, const char *key);
 
 #endif /* LUNA_HASH_H */
\ No newline at end of file
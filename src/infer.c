@@ -0,0 +1,713 @@
+
+//
+// infer.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <string.h>
+#include "infer.h"
+#include "dispatch.h"
+#include "upvalues.h"
+#include "layouts.h"
+#include "vec.h"
+#include "visitor.h"
+#include "internal.h"
+
+/*
+ * Maximum rounds inferring function return types.
+ */
+
+#define LUNA_INFER_ROUNDS 16
+
+// local types
+
+KHASH_MAP_INIT_STR(types, int);
+
+// locals defined in the current pass
+
+KHASH_SET_INIT_STR(seen);
+
+/*
+ * Inference state.
+ *
+ * Local types are the join of every value assigned
+ * to them, and only widen, so passes are repeated until
+ * nothing changes. Like codegen, a local referenced before
+ * its definition is nil.
+ *
+ * Function return types start out unknown and narrow as
+ * the types of their callees are found, so the whole
+ * program is inferred again until none narrows, or they
+ * are frozen unknown if that takes too many rounds.
+ */
+
+typedef struct {
+  khash_t(types) *types;
+  khash_t(seen) *seen;
+  luna_overloads_t *overloads;
+  luna_upvalues_t *upvalues;
+  luna_layouts_t *layouts;
+  luna_records_t *records;
+  luna_object *captured;
+  luna_object ret;
+  int returns;
+  int changed;
+  int narrowed;
+  int frozen;
+} infer_t;
+
+/*
+ * Node of the given `val`.
+ */
+
+#define NODE(val) ((luna_node_t *) luna_as_pointer(val))
+
+/*
+ * Set the inferred type of the current node.
+ */
+
+#define TYPE(t) (node->base.inferred = (t))
+
+/*
+ * Check if `t` is int or float.
+ */
+
+#define numeric(t) (LUNA_TYPE_INT == (t) || LUNA_TYPE_FLOAT == (t))
+
+/*
+ * Join of types `a` and `b`.
+ */
+
+static luna_object
+join(luna_object a, luna_object b) {
+  return a == b ? a : LUNA_TYPE_ANY;
+}
+
+/*
+ * Result of arithmetic on `a` and `b`, ints
+ * are promoted when mixed with floats.
+ */
+
+static luna_object
+arith(luna_object a, luna_object b) {
+  if (!numeric(a) || !numeric(b)) return LUNA_TYPE_ANY;
+  return a == b ? a : LUNA_TYPE_FLOAT;
+}
+
+/*
+ * Type of ints or floats `a` and `b` divided by `divisor`.
+ * Ints are only divided into an int by constants other
+ * than 0 and -1, others may turn the quotient into
+ * a float.
+ */
+
+static luna_object
+quotient(luna_object a, luna_object b, luna_node_t *divisor) {
+  luna_object type = arith(a, b);
+  if (LUNA_TYPE_INT != type) return type;
+  if (LUNA_NODE_INT != divisor->type) return LUNA_TYPE_ANY;
+  int val = ((luna_int_node_t *) divisor)->val;
+  return val && -1 != val ? type : LUNA_TYPE_ANY;
+}
+
+/*
+ * Infer `node` and return its type.
+ */
+
+static luna_object
+infer(luna_visitor_t *self, luna_node_t *node) {
+  visit(node);
+  return node->inferred;
+}
+
+/*
+ * Return the type of local `name`, or nil
+ * when it is not defined yet.
+ */
+
+static luna_object
+lookup(infer_t *state, const char *name) {
+  if (kh_get(seen, state->seen, name) == kh_end(state->seen)) return LUNA_TYPE_NULL;
+  return kh_value(state->types, kh_get(types, state->types, name));
+}
+
+/*
+ * Assign a value of type `t` to local `name`,
+ * returning the widened type of the local.
+ */
+
+static luna_object
+assign(infer_t *state, const char *name, luna_object t) {
+  int ret;
+  kh_put(seen, state->seen, name, &ret);
+
+  khiter_t k = kh_get(types, state->types, name);
+  if (k == kh_end(state->types)) {
+    k = kh_put(types, state->types, name, &ret);
+    state->changed = 1;
+    return kh_value(state->types, k) = t;
+  }
+
+  luna_object prev = kh_value(state->types, k);
+  if (prev == (t = join(prev, t))) return t;
+  state->changed = 1;
+  return kh_value(state->types, k) = t;
+}
+
+/*
+ * Define the ids of `decl`, assigned a value of type `t`.
+ */
+
+static void
+declare(infer_t *state, luna_decl_node_t *decl, luna_object t) {
+  luna_vec_each(decl->vec, {
+    luna_id_node_t *id = (luna_id_node_t *) NODE(val);
+    if (decl->type) assign(state, id->val, luna_named_type(decl->type));
+    id->base.inferred = assign(state, id->val, t);
+  });
+}
+
+/*
+ * Infer `block` in a scope of its own, defining the
+ * parameters of `fn` first when present. Parameters are of
+ * their declared type, as dispatch guarantees it, or of
+ * their default's when omitted. Captured locals are of the
+ * types in `captured`, and locals living in cells are
+ * unknown, as closures may assign them. The layouts of
+ * its record locals type their fields.
+ */
+
+static void
+scope(luna_visitor_t *self, luna_node_t *block, luna_function_node_t *fn, luna_object *captured) {
+  infer_t *state = (infer_t *) self->data;
+  infer_t outer = *state;
+  luna_param_t params[LUNA_MAX_PARAMS];
+  int nparams = fn ? luna_params(fn, params) : 0;
+  luna_captures_t *captures = fn ? luna_upvalues_captures(state->upvalues, fn) : NULL;
+  luna_captures_t *cells = luna_upvalues_cells(state->upvalues, fn ? (void *) fn : block);
+  state->types = kh_init(types);
+  state->records = luna_records_new(state->layouts, state->upvalues, fn, block);
+
+  do {
+    state->seen = kh_init(seen);
+    state->changed = 0;
+    state->returns = 0;
+
+    for (int i = 0; i < nparams; ++i) {
+      luna_object t = params[i].type;
+      if (params[i].value) t = join(t, infer(self, params[i].value));
+      assign(state, params[i].name, t);
+    }
+
+    for (int i = 0; captures && i < kv_size(*captures); ++i) {
+      assign(state, kv_A(*captures, i).name, captured[i]);
+    }
+
+    for (int i = 0; cells && i < kv_size(*cells); ++i) {
+      assign(state, kv_A(*cells, i).name, LUNA_TYPE_ANY);
+    }
+
+    visit(block);
+    kh_destroy(seen, state->seen);
+  } while (state->changed);
+
+  kh_destroy(types, state->types);
+  luna_records_free(state->records);
+  outer.narrowed = state->narrowed;
+  outer.ret = state->ret;
+  outer.returns = state->returns;
+  *state = outer;
+}
+
+/*
+ * Visit block `node`.
+ */
+
+static void
+visit_block(luna_visitor_t *self, luna_block_node_t *node) {
+  luna_vec_each(node->stmts, visit(NODE(val)));
+}
+
+/*
+ * Visit int `node`.
+ */
+
+static void
+visit_int(luna_visitor_t *self, luna_int_node_t *node) {
+  TYPE(LUNA_TYPE_INT);
+}
+
+/*
+ * Visit float `node`.
+ */
+
+static void
+visit_float(luna_visitor_t *self, luna_float_node_t *node) {
+  TYPE(LUNA_TYPE_FLOAT);
+}
+
+/*
+ * Visit string `node`.
+ */
+
+static void
+visit_string(luna_visitor_t *self, luna_string_node_t *node) {
+  TYPE(LUNA_TYPE_STRING);
+}
+
+/*
+ * Visit id `node`.
+ */
+
+static void
+visit_id(luna_visitor_t *self, luna_id_node_t *node) {
+  infer_t *state = (infer_t *) self->data;
+
+  // local
+  if (kh_get(seen, state->seen, node->val) != kh_end(state->seen)) {
+    TYPE(lookup(state, node->val));
+    return;
+  }
+
+  // true | false | nil
+  if (0 == strcmp("true", node->val) || 0 == strcmp("false", node->val)) {
+    TYPE(LUNA_TYPE_BOOL);
+  } else {
+    TYPE(LUNA_TYPE_NULL);
+  }
+}
+
+/*
+ * Visit let `node`.
+ */
+
+static void
+visit_let(luna_visitor_t *self, luna_let_node_t *node) {
+  infer_t *state = (infer_t *) self->data;
+  luna_vec_each(node->vec, {
+    luna_binary_op_node_t *bin = (luna_binary_op_node_t *) NODE(val);
+    luna_object t = bin->right ? infer(self, bin->right) : LUNA_TYPE_NULL;
+    declare(state, (luna_decl_node_t *) bin->left, t);
+  });
+}
+
+/*
+ * Visit unary op `node`.
+ */
+
+static void
+visit_unary_op(luna_visitor_t *self, luna_unary_op_node_t *node) {
+  infer_t *state = (infer_t *) self->data;
+  luna_object t = infer(self, node->expr);
+
+  switch (node->op) {
+    // - +
+    case LUNA_TOKEN_OP_MINUS:
+    case LUNA_TOKEN_OP_PLUS:
+      TYPE(numeric(t) ? t : LUNA_TYPE_ANY);
+      break;
+
+    // ~
+    case LUNA_TOKEN_OP_BIT_NOT:
+      TYPE(numeric(t) ? LUNA_TYPE_INT : LUNA_TYPE_ANY);
+      break;
+
+    // ! not
+    case LUNA_TOKEN_OP_NOT:
+    case LUNA_TOKEN_OP_LNOT:
+      TYPE(LUNA_TYPE_BOOL);
+      break;
+
+    // ++ --
+    case LUNA_TOKEN_OP_INCR:
+    case LUNA_TOKEN_OP_DECR:
+      if (LUNA_NODE_ID != node->expr->type) {
+        TYPE(LUNA_TYPE_ANY);
+        break;
+      }
+
+      const char *name = ((luna_id_node_t *) node->expr)->val;
+      if (kh_get(seen, state->seen, name) != kh_end(state->seen)) {
+        TYPE(node->expr->inferred = assign(state, name, arith(t, LUNA_TYPE_INT)));
+      } else {
+        TYPE(LUNA_TYPE_NULL);
+      }
+      break;
+
+    default:
+      TYPE(LUNA_TYPE_ANY);
+  }
+}
+
+/*
+ * Visit assignment `node`.
+ */
+
+static void
+visit_assign(luna_visitor_t *self, luna_binary_op_node_t *node) {
+  infer_t *state = (infer_t *) self->data;
+  luna_object r = infer(self, node->right);
+
+  // TODO: slot and subscript assignment
+  if (LUNA_NODE_ID != node->left->type) {
+    TYPE(r);
+    return;
+  }
+
+  const char *name = ((luna_id_node_t *) node->left)->val;
+  luna_object l = lookup(state, name);
+
+  switch (node->op) {
+    // =
+    case LUNA_TOKEN_OP_ASSIGN:
+      l = assign(state, name, r);
+      break;
+
+    // &&= ||=
+    case LUNA_TOKEN_OP_AND_ASSIGN:
+    case LUNA_TOKEN_OP_OR_ASSIGN:
+      l = assign(state, name, join(l, r));
+      break;
+
+    // /=
+    case LUNA_TOKEN_OP_DIV_ASSIGN:
+      l = assign(state, name, quotient(l, r, node->right));
+      break;
+
+    // += -= *=
+    default:
+      l = assign(state, name, arith(l, r));
+  }
+
+  TYPE(node->left->inferred = l);
+}
+
+/*
+ * Visit binary op `node`.
+ */
+
+static void
+visit_binary_op(luna_visitor_t *self, luna_binary_op_node_t *node) {
+  switch (node->op) {
+    case LUNA_TOKEN_OP_ASSIGN:
+    case LUNA_TOKEN_OP_PLUS_ASSIGN:
+    case LUNA_TOKEN_OP_MINUS_ASSIGN:
+    case LUNA_TOKEN_OP_MUL_ASSIGN:
+    case LUNA_TOKEN_OP_DIV_ASSIGN:
+    case LUNA_TOKEN_OP_AND_ASSIGN:
+    case LUNA_TOKEN_OP_OR_ASSIGN:
+      visit_assign(self, node);
+      return;
+  }
+
+  luna_object l = infer(self, node->left);
+  luna_object r = infer(self, node->right);
+
+  switch (node->op) {
+    // + - * **
+    case LUNA_TOKEN_OP_PLUS:
+    case LUNA_TOKEN_OP_MINUS:
+    case LUNA_TOKEN_OP_MUL:
+    case LUNA_TOKEN_OP_POW:
+      TYPE(arith(l, r));
+      break;
+
+    // / %
+    case LUNA_TOKEN_OP_DIV:
+    case LUNA_TOKEN_OP_MOD:
+      TYPE(quotient(l, r, node->right));
+      break;
+
+    // << >> and | ^
+    case LUNA_TOKEN_OP_BIT_SHL:
+    case LUNA_TOKEN_OP_BIT_SHR:
+    case LUNA_TOKEN_OP_BIT_AND:
+    case LUNA_TOKEN_OP_BIT_OR:
+    case LUNA_TOKEN_OP_BIT_XOR:
+      TYPE(numeric(l) && numeric(r) ? LUNA_TYPE_INT : LUNA_TYPE_ANY);
+      break;
+
+    // < <= > >= == !=
+    case LUNA_TOKEN_OP_LT:
+    case LUNA_TOKEN_OP_LTE:
+    case LUNA_TOKEN_OP_GT:
+    case LUNA_TOKEN_OP_GTE:
+    case LUNA_TOKEN_OP_EQ:
+    case LUNA_TOKEN_OP_NEQ:
+      TYPE(LUNA_TYPE_BOOL);
+      break;
+
+    // && ||
+    case LUNA_TOKEN_OP_AND:
+    case LUNA_TOKEN_OP_OR:
+      TYPE(join(l, r));
+      break;
+
+    default:
+      TYPE(LUNA_TYPE_ANY);
+  }
+}
+
+/*
+ * Visit array `node`.
+ */
+
+static void
+visit_array(luna_visitor_t *self, luna_array_node_t *node) {
+  luna_vec_each(node->vals, visit(NODE(val)));
+  TYPE(LUNA_TYPE_ARRAY);
+}
+
+/*
+ * Visit hash `node`, id keys are names not references.
+ */
+
+static void
+visit_hash(luna_visitor_t *self, luna_hash_node_t *node) {
+  luna_vec_each(node->pairs, {
+    luna_hash_pair_node_t *pair = (luna_hash_pair_node_t *) NODE(val);
+    if (LUNA_NODE_ID != pair->key->type) visit(pair->key);
+    visit(pair->val);
+  });
+  TYPE(LUNA_TYPE_OBJECT);
+}
+
+/*
+ * Type of the record field accessed by `node`,
+ * unknown unless its layout is.
+ */
+
+static luna_object
+field(infer_t *state, luna_node_t *node) {
+  luna_field_t *field = luna_records_field(state->records, node);
+  if (!field) return LUNA_TYPE_ANY;
+  switch (field->kind) {
+    case LUNA_FIELD_INT: return LUNA_TYPE_INT;
+    case LUNA_FIELD_FLOAT: return LUNA_TYPE_FLOAT;
+    default: return field->layout ? LUNA_TYPE_RECORD : LUNA_TYPE_ANY;
+  }
+}
+
+/*
+ * Visit slot `node`.
+ */
+
+static void
+visit_slot(luna_visitor_t *self, luna_slot_node_t *node) {
+  visit(node->left);
+  TYPE(field((infer_t *) self->data, (luna_node_t *) node));
+}
+
+/*
+ * Visit subscript `node`, `T[n]` of a type
+ * name allocates an array.
+ */
+
+static void
+visit_subscript(luna_visitor_t *self, luna_subscript_node_t *node) {
+  infer_t *state = (infer_t *) self->data;
+  int array = !!luna_layouts_array(state->layouts, node);
+  if (!array) visit(node->left);
+  visit(node->right);
+  TYPE(array ? LUNA_TYPE_ARRAY : field(state, (luna_node_t *) node));
+}
+
+/*
+ * Visit if `node`.
+ */
+
+static void
+visit_if(luna_visitor_t *self, luna_if_node_t *node) {
+  visit(node->expr);
+  visit((luna_node_t *) node->block);
+
+  luna_vec_each(node->else_ifs, {
+    luna_if_node_t *else_if = (luna_if_node_t *) NODE(val);
+    visit(else_if->expr);
+    visit((luna_node_t *) else_if->block);
+  });
+
+  if (node->else_block) visit((luna_node_t *) node->else_block);
+}
+
+/*
+ * Visit `while` node.
+ */
+
+static void
+visit_while(luna_visitor_t *self, luna_while_node_t *node) {
+  visit(node->expr);
+  visit((luna_node_t *) node->block);
+}
+
+/*
+ * Visit `return` node, joining its type
+ * with the function's return type.
+ */
+
+static void
+visit_return(luna_visitor_t *self, luna_return_node_t *node) {
+  infer_t *state = (infer_t *) self->data;
+  luna_object t = node->expr ? infer(self, node->expr) : LUNA_TYPE_NULL;
+  state->ret = state->returns++ ? join(state->ret, t) : t;
+}
+
+/*
+ * Visit call `node`, typed by the overloads it may
+ * invoke, or a record when it names a type.
+ */
+
+static void
+visit_call(luna_visitor_t *self, luna_call_node_t *node) {
+  infer_t *state = (infer_t *) self->data;
+  luna_functions_t candidates;
+  kv_init(candidates);
+
+  if (LUNA_NODE_ID != node->expr->type) visit(node->expr);
+  luna_vec_each(node->args->vec, visit(NODE(val)));
+  luna_hash_each_val(node->args->hash, visit(NODE(val)));
+
+  // constructor
+  if (luna_layouts_constructs(state->layouts, node)) {
+    TYPE(LUNA_TYPE_RECORD);
+    kv_destroy(candidates);
+    return;
+  }
+
+  // function value
+  if (LUNA_NODE_ID != node->expr->type
+    || kh_get(seen, state->seen, ((luna_id_node_t *) node->expr)->val) != kh_end(state->seen)) {
+    TYPE(LUNA_TYPE_ANY);
+    kv_destroy(candidates);
+    return;
+  }
+
+  switch (luna_resolve(state->overloads, node, &candidates)) {
+    case LUNA_DISPATCH_NONE:
+      TYPE(LUNA_TYPE_NULL);
+      break;
+    default:
+      TYPE(kv_A(candidates, 0)->base.inferred);
+      for (int i = 1; i < kv_size(candidates); ++i) {
+        TYPE(join(node->base.inferred, kv_A(candidates, i)->base.inferred));
+      }
+  }
+
+  kv_destroy(candidates);
+}
+
+/*
+ * Visit anonymous function `node` in a scope of its own, its
+ * captures are of the type of the locals they copy, which
+ * are never assigned once captured, or unknown when shared.
+ */
+
+static void
+visit_closure(luna_visitor_t *self, luna_function_node_t *node) {
+  infer_t *state = (infer_t *) self->data;
+  luna_captures_t *captures = luna_upvalues_captures(state->upvalues, node);
+  int n = captures ? kv_size(*captures) : 0;
+  luna_object captured[n ? n : 1];
+
+  for (int i = 0; i < n; ++i) {
+    luna_capture_t capture = kv_A(*captures, i);
+    captured[i] = capture.cell ? LUNA_TYPE_ANY : lookup(state, capture.name);
+  }
+
+  // returns belong to the closure
+  luna_object ret = state->ret;
+  int returns = state->returns;
+  scope(self, (luna_node_t *) node->block, node, captured);
+  state->ret = ret;
+  state->returns = returns;
+
+  TYPE(LUNA_TYPE_FUNCTION);
+}
+
+/*
+ * Visit function `node` in a scope of its own, its type
+ * is the join of the values it returns, nil when it
+ * may run off the end.
+ */
+
+static void
+visit_function(luna_visitor_t *self, luna_function_node_t *node) {
+  infer_t *state = (infer_t *) self->data;
+  luna_vec_t *stmts = node->block->stmts;
+  luna_node_t *last = luna_vec_length(stmts)
+    ? NODE(luna_vec_at(stmts, luna_vec_length(stmts) - 1))
+    : NULL;
+
+  if (!node->name) {
+    visit_closure(self, node);
+    return;
+  }
+
+  scope(self, (luna_node_t *) node->block, node, NULL);
+
+  luna_object t = state->ret;
+  if (!state->returns) t = LUNA_TYPE_NULL;
+  else if (!last || LUNA_NODE_RETURN != last->type) t = join(t, LUNA_TYPE_NULL);
+  if (node->type) t = join(t, luna_named_type(node->type));
+
+  if (!state->frozen && t != node->base.inferred) {
+    node->base.inferred = t;
+    state->narrowed = 1;
+  }
+}
+
+/*
+ * Infer the type of every expression in `node`. Nodes whose
+ * type cannot be proven are left as LUNA_TYPE_ANY.
+ */
+
+void
+luna_infer(luna_node_t *node) {
+  infer_t state = {
+    .layouts = luna_layouts_new(node),
+    .overloads = luna_overloads_new(node),
+    .upvalues = luna_upvalues_new(node),
+    .narrowed = 0,
+    .frozen = 0
+  };
+
+  luna_visitor_t visitor = {
+    .data = (void *) &state,
+    .visit_if = visit_if,
+    .visit_id = visit_id,
+    .visit_int = visit_int,
+    .visit_let = visit_let,
+    .visit_slot = visit_slot,
+    .visit_call = visit_call,
+    .visit_hash = visit_hash,
+    .visit_array = visit_array,
+    .visit_while = visit_while,
+    .visit_block = visit_block,
+    .visit_float = visit_float,
+    .visit_string = visit_string,
+    .visit_return = visit_return,
+    .visit_function = visit_function,
+    .visit_unary_op = visit_unary_op,
+    .visit_binary_op = visit_binary_op,
+    .visit_subscript = visit_subscript
+  };
+
+  int rounds = 0;
+  do {
+    state.narrowed = 0;
+    scope(&visitor, node, NULL, NULL);
+  } while (state.narrowed && ++rounds < LUNA_INFER_ROUNDS);
+
+  if (state.narrowed) {
+    state.frozen = 1;
+    for (int i = 0; i < kv_size(state.overloads->defs); ++i) {
+      kv_A(state.overloads->defs, i)->base.inferred = LUNA_TYPE_ANY;
+    }
+    scope(&visitor, node, NULL, NULL);
+  }
+
+  luna_upvalues_free(state.upvalues);
+  luna_overloads_free(state.overloads);
+  luna_layouts_free(state.layouts);
+}
@@ -0,0 +1,18 @@
+
+//
+// infer.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_INFER_H
+#define LUNA_INFER_H
+
+#include "ast.h"
+
+// protos
+
+void
+luna_infer(luna_node_t *node);
+
+#endif /* LUNA_INFER_H */
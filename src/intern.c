@@ -0,0 +1,138 @@
+
+//
+// intern.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "intern.h"
+#include "internal.h"
+
+/*
+ * Initial buckets of the table.
+ */
+
+#define INITIAL_SIZE 256
+
+/*
+ * Interned strings, an open addressed table of
+ * a power of two buckets probed linearly, kept
+ * under three quarters full.
+ */
+
+static struct {
+  luna_string_t **buckets;
+  uint32_t size;
+  uint32_t count;
+} table;
+
+/*
+ * Lock of the table, strings are interned by the
+ * compiler and runtime of any thread.
+ */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * X31 hash of the `len` characters of `val`, that
+ * of khash for strings without NUL characters.
+ */
+
+static uint32_t
+hash(const char *val, size_t len) {
+  uint32_t h = 0;
+  for (size_t i = 0; i < len; ++i) h = (h << 5) - h + (unsigned char) val[i];
+  return h;
+}
+
+/*
+ * Double the buckets of the table, or initialize it.
+ */
+
+static int
+grow() {
+  uint32_t size = table.size ? table.size * 2 : INITIAL_SIZE;
+  luna_string_t **buckets = calloc(size, sizeof(luna_string_t *));
+  if (unlikely(!buckets)) return -1;
+
+  for (uint32_t i = 0; i < table.size; ++i) {
+    luna_string_t *str = table.buckets[i];
+    if (!str) continue;
+    uint32_t j = str->hash & (size - 1);
+    while (buckets[j]) j = (j + 1) & (size - 1);
+    buckets[j] = str;
+  }
+
+  free(table.buckets);
+  table.buckets = buckets;
+  table.size = size;
+  return 0;
+}
+
+/*
+ * Return the interned copy of the `len` characters
+ * of `val`, interning them unless present, or NULL
+ * on failure.
+ */
+
+const char *
+luna_intern_len(const char *val, size_t len) {
+  uint32_t h = hash(val, len);
+  luna_string_t *str = NULL;
+
+  pthread_mutex_lock(&lock);
+  if (unlikely(4 * (table.count + 1) > 3 * table.size) && grow()) goto done;
+
+  // exists
+  uint32_t i = h & (table.size - 1);
+  for (; (str = table.buckets[i]); i = (i + 1) & (table.size - 1)) {
+    if (str->hash == h && str->len == len && 0 == memcmp(str->val, val, len)) goto done;
+  }
+
+  // alloc
+  if (unlikely(!(str = malloc(sizeof(luna_string_t) + len + 1)))) goto done;
+  str->hash = h;
+  str->len = len;
+  memcpy(str->val, val, len);
+  str->val[len] = 0;
+  table.buckets[i] = str;
+  ++table.count;
+
+done:
+  pthread_mutex_unlock(&lock);
+  return str ? str->val : NULL;
+}
+
+/*
+ * Return the interned copy of `val`.
+ */
+
+const char *
+luna_intern(const char *val) {
+  return luna_intern_len(val, strlen(val));
+}
+
+/*
+ * Check if `str` is interned, rather than
+ * a copy of an interned string.
+ */
+
+int
+luna_interned(const char *str) {
+  uint32_t h = hash(str, strlen(str));
+  luna_string_t *s;
+  int ret = 0;
+
+  pthread_mutex_lock(&lock);
+  for (uint32_t i = h & (table.size - 1); table.size && (s = table.buckets[i]); i = (i + 1) & (table.size - 1)) {
+    if (s->val == str) {
+      ret = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return ret;
+}
@@ -0,0 +1,88 @@
+
+//
+// intern.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_INTERN_H
+#define LUNA_INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "khash.h"
+
+#ifdef EBUG_INTERN
+#include <assert.h>
+#endif
+
+/*
+ * Interned string, its characters preceded by their
+ * hash and length. There is a single copy of each
+ * string, so that strings compare equal by pointer.
+ *
+ * Interned strings are handed out as pointers to `val`,
+ * usable as any other C string, and live as long as
+ * the program.
+ */
+
+typedef struct {
+  uint32_t hash;
+  uint32_t len;
+  char val[];
+} luna_string_t;
+
+/*
+ * Return the luna_string_t of interned `str`.
+ */
+
+#define luna_string(str) \
+  ((luna_string_t *) ((char *) (str) - offsetof(luna_string_t, val)))
+
+/*
+ * Hash of interned `str`.
+ */
+
+#define luna_string_hash(str) (luna_string(str)->hash)
+
+/*
+ * Length of interned `str`.
+ */
+
+#define luna_string_len(str) (luna_string(str)->len)
+
+/*
+ * Assert `str` is interned. The keys of hashes, maps, objects
+ * and shapes must be, their hash is read from the header and
+ * they compare by pointer, so that passing a plain C string
+ * is undefined. Checked in builds with -DEBUG_INTERN.
+ */
+
+#ifdef EBUG_INTERN
+#define luna_assert_interned(str) assert(luna_interned(str) && "key not interned")
+#else
+#define luna_assert_interned(str)
+#endif
+
+/*
+ * Khash map of interned string keys, hashed by
+ * their cached hash and compared by pointer.
+ */
+
+#define luna_string_hash_equal(a, b) ((a) == (b))
+
+#define KHASH_MAP_INIT_INTERNED(name, khval_t) \
+  KHASH_INIT(name, kh_cstr_t, khval_t, 1, luna_string_hash, luna_string_hash_equal)
+
+// protos
+
+const char *
+luna_intern(const char *val);
+
+const char *
+luna_intern_len(const char *val, size_t len);
+
+int
+luna_interned(const char *str);
+
+#endif /* LUNA_INTERN_H */
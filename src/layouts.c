@@ -0,0 +1,724 @@
+
+//
+// layouts.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "layouts.h"
+#include "dispatch.h"
+#include "vec.h"
+#include "visitor.h"
+
+/*
+ * Assignment of local `name` to `val`, NULL
+ * when the value is unknown.
+ */
+
+typedef struct {
+  const char *name;
+  luna_node_t *val;
+} assign_t;
+
+/*
+ * Walk state. Declarations are collected and annotated
+ * in a first walk of the whole program, the records
+ * of a body in a walk not entering its closures.
+ */
+
+typedef struct {
+  luna_layouts_t *layouts;
+  luna_records_t *records;
+  kvec_t(luna_type_node_t *) types;
+  kvec_t(assign_t) assigns;
+  khash_t(scalars) *excluded;
+  khash_t(scalars) *dropped;
+  int annotate;
+} walk_t;
+
+/*
+ * Node of the given `val`.
+ */
+
+#define NODE(val) ((luna_node_t *) luna_as_pointer(val))
+
+/*
+ * Walk state of the visitor.
+ */
+
+#define STATE ((walk_t *) self->data)
+
+/*
+ * Add `name` to `set`.
+ */
+
+static void
+add(khash_t(scalars) *set, const char *name) {
+  int ret;
+  kh_put(scalars, set, name, &ret);
+}
+
+/*
+ * Check if `set` contains `name`.
+ */
+
+static int
+has(khash_t(scalars) *set, const char *name) {
+  return kh_get(scalars, set, name) != kh_end(set);
+}
+
+/*
+ * Return the layout named by annotation `type`, or NULL.
+ */
+
+static luna_layout_t *
+named(luna_layouts_t *self, luna_node_t *type) {
+  if (!type) return NULL;
+  return luna_layouts_get(self, ((luna_id_node_t *) type)->val);
+}
+
+/*
+ * Return the layout of the columnar arrays named
+ * by annotation `type`, `T[]`, or NULL.
+ */
+
+static luna_layout_t *
+named_array(luna_layouts_t *self, luna_node_t *type) {
+  char buf[256];
+  if (!type) return NULL;
+  const char *name = ((luna_id_node_t *) type)->val;
+  size_t len = strlen(name);
+  if (len < 3 || len >= sizeof(buf) || strcmp("[]", name + len - 2)) return NULL;
+  memcpy(buf, name, len - 2);
+  buf[len - 2] = 0;
+  return luna_layouts_get(self, buf);
+}
+
+/*
+ * Mark annotation `type` when it names a
+ * record type or an array of one.
+ */
+
+static void
+annotate(walk_t *state, luna_node_t *type) {
+  if (named(state->layouts, type)) type->inferred = LUNA_TYPE_RECORD;
+  else if (named_array(state->layouts, type)) type->inferred = LUNA_TYPE_ARRAY;
+}
+
+/*
+ * Record the declaration of `decl` in the body being
+ * walked, when a record type or an array of one.
+ */
+
+static void
+declare(walk_t *state, luna_decl_node_t *decl) {
+  luna_layout_t *layout = named(state->layouts, decl->type);
+  luna_layout_t *array = named_array(state->layouts, decl->type);
+  if (!(layout || array) || !state->records) return;
+
+  luna_records_t *records = state->records;
+  khash_t(records) *known = layout ? records->locals : records->arrays;
+  khash_t(records) *other = layout ? records->arrays : records->locals;
+  if (!layout) layout = array;
+
+  luna_vec_each(decl->vec, {
+    const char *name = ((luna_id_node_t *) NODE(val))->val;
+    int ret;
+    khiter_t k = kh_put(records, known, name, &ret);
+    if (!ret && kh_value(known, k) != layout) add(state->dropped, name);
+    if (kh_get(records, other, name) != kh_end(other)) add(state->dropped, name);
+    kh_value(known, k) = layout;
+    add(records->declared, name);
+  });
+}
+
+/*
+ * Note the assignment of `name` to `val`.
+ */
+
+static void
+assign(walk_t *state, const char *name, luna_node_t *val) {
+  if (state->annotate) return;
+  assign_t a = { .name = name, .val = val };
+  kv_push(assign_t, state->assigns, a);
+}
+
+static void
+walk_block(luna_visitor_t *self, luna_block_node_t *node) {
+  luna_vec_each(node->stmts, visit(NODE(val)));
+}
+
+static void
+walk_if(luna_visitor_t *self, luna_if_node_t *node) {
+  visit(node->expr);
+  visit((luna_node_t *) node->block);
+  luna_vec_each(node->else_ifs, visit(NODE(val)));
+  if (node->else_block) visit((luna_node_t *) node->else_block);
+}
+
+static void
+walk_while(luna_visitor_t *self, luna_while_node_t *node) {
+  visit(node->expr);
+  visit((luna_node_t *) node->block);
+}
+
+static void
+walk_decl(luna_visitor_t *self, luna_decl_node_t *node) {
+  if (STATE->annotate) annotate(STATE, node->type);
+}
+
+static void
+walk_let(luna_visitor_t *self, luna_let_node_t *node) {
+  luna_vec_each(node->vec, {
+    luna_binary_op_node_t *bin = (luna_binary_op_node_t *) NODE(val);
+    luna_decl_node_t *decl = (luna_decl_node_t *) bin->left;
+    if (bin->right) visit(bin->right);
+
+    if (STATE->annotate) {
+      annotate(STATE, decl->type);
+    } else if (named(STATE->layouts, decl->type) || named_array(STATE->layouts, decl->type)) {
+      declare(STATE, decl);
+    } else if (bin->right) {
+      luna_vec_each(decl->vec, assign(STATE, ((luna_id_node_t *) NODE(val))->val, bin->right));
+    }
+  });
+}
+
+static void
+walk_unary_op(luna_visitor_t *self, luna_unary_op_node_t *node) {
+  int mutates = LUNA_TOKEN_OP_INCR == node->op || LUNA_TOKEN_OP_DECR == node->op;
+  if (mutates && LUNA_NODE_ID == node->expr->type) {
+    assign(STATE, ((luna_id_node_t *) node->expr)->val, NULL);
+  } else {
+    visit(node->expr);
+  }
+}
+
+static void
+walk_binary_op(luna_visitor_t *self, luna_binary_op_node_t *node) {
+  switch (node->op) {
+    case LUNA_TOKEN_OP_ASSIGN:
+    case LUNA_TOKEN_OP_PLUS_ASSIGN:
+    case LUNA_TOKEN_OP_MINUS_ASSIGN:
+    case LUNA_TOKEN_OP_MUL_ASSIGN:
+    case LUNA_TOKEN_OP_DIV_ASSIGN:
+    case LUNA_TOKEN_OP_AND_ASSIGN:
+    case LUNA_TOKEN_OP_OR_ASSIGN:
+      if (LUNA_NODE_ID == node->left->type) {
+        visit(node->right);
+        assign(STATE, ((luna_id_node_t *) node->left)->val,
+          LUNA_TOKEN_OP_ASSIGN == node->op ? node->right : NULL);
+        return;
+      }
+  }
+
+  visit(node->left);
+  if (node->right) visit(node->right);
+}
+
+static void
+walk_call(luna_visitor_t *self, luna_call_node_t *node) {
+  visit(node->expr);
+  luna_vec_each(node->args->vec, visit(NODE(val)));
+  luna_hash_each_val(node->args->hash, visit(NODE(val)));
+}
+
+static void
+walk_array(luna_visitor_t *self, luna_array_node_t *node) {
+  luna_vec_each(node->vals, visit(NODE(val)));
+}
+
+static void
+walk_hash(luna_visitor_t *self, luna_hash_node_t *node) {
+  luna_vec_each(node->pairs, visit(((luna_hash_pair_node_t *) NODE(val))->val));
+}
+
+static void
+walk_slot(luna_visitor_t *self, luna_slot_node_t *node) {
+  visit(node->left);
+}
+
+static void
+walk_subscript(luna_visitor_t *self, luna_subscript_node_t *node) {
+  visit(node->left);
+  visit(node->right);
+}
+
+static void
+walk_return(luna_visitor_t *self, luna_return_node_t *node) {
+  if (node->expr) visit(node->expr);
+}
+
+static void
+walk_type(luna_visitor_t *self, luna_type_node_t *node) {
+  if (STATE->annotate) {
+    luna_vec_each(node->fields, annotate(STATE, ((luna_decl_node_t *) NODE(val))->type));
+  } else {
+    kv_push(luna_type_node_t *, STATE->types, node);
+  }
+}
+
+/*
+ * Functions are entered by the program walks only.
+ */
+
+static void
+walk_function(luna_visitor_t *self, luna_function_node_t *node) {
+  if (STATE->records) return;
+  if (STATE->annotate) annotate(STATE, node->type);
+  luna_vec_each(node->params, {
+    luna_node_t *param = NODE(val);
+    if (LUNA_NODE_BINARY_OP == param->type) {
+      visit(((luna_binary_op_node_t *) param)->right);
+      param = ((luna_binary_op_node_t *) param)->left;
+    }
+    visit(param);
+  });
+  visit((luna_node_t *) node->block);
+}
+
+/*
+ * Walk `node` with `state`.
+ */
+
+static void
+walk(walk_t *state, luna_node_t *node) {
+  luna_visitor_t visitor = {
+    .data = (void *) state,
+    .visit_if = walk_if,
+    .visit_let = walk_let,
+    .visit_decl = walk_decl,
+    .visit_slot = walk_slot,
+    .visit_call = walk_call,
+    .visit_hash = walk_hash,
+    .visit_type = walk_type,
+    .visit_array = walk_array,
+    .visit_while = walk_while,
+    .visit_block = walk_block,
+    .visit_return = walk_return,
+    .visit_function = walk_function,
+    .visit_unary_op = walk_unary_op,
+    .visit_binary_op = walk_binary_op,
+    .visit_subscript = walk_subscript
+  };
+
+  luna_visit(&visitor, node);
+}
+
+/*
+ * Align `n` to `size`.
+ */
+
+static int
+align(int n, int size) {
+  return (n + size - 1) / size * size;
+}
+
+/*
+ * Lay out the fields of type `node` in order, each
+ * aligned to its size.
+ */
+
+static luna_layout_t *
+layout(luna_type_node_t *node) {
+  int n = 0;
+  luna_vec_each(node->fields, n += luna_vec_length(((luna_decl_node_t *) NODE(val))->vec));
+
+  luna_layout_t *self = malloc(sizeof(luna_layout_t));
+  self->name = node->name;
+  self->nfields = n;
+  self->fields = malloc(n * sizeof(luna_field_t));
+
+  int nth = 0;
+  int offset = 0;
+  luna_vec_each(node->fields, {
+    luna_decl_node_t *decl = (luna_decl_node_t *) NODE(val);
+    luna_object type = luna_named_type(decl->type);
+    luna_field_kind kind = LUNA_TYPE_INT == type
+      ? LUNA_FIELD_INT
+      : LUNA_TYPE_FLOAT == type
+        ? LUNA_FIELD_FLOAT
+        : LUNA_FIELD_VALUE;
+    int size = LUNA_FIELD_INT == kind ? sizeof(int32_t) : 8;
+
+    luna_vec_each(decl->vec, {
+      offset = align(offset, size);
+      assert(offset < 256 && "record too large");
+      luna_field_t *field = &self->fields[nth++];
+      field->name = ((luna_id_node_t *) NODE(val))->val;
+      field->kind = kind;
+      field->layout = NULL;
+      field->offset = offset;
+      offset += size;
+    });
+  });
+
+  self->size = align(offset, 8);
+  return self;
+}
+
+/*
+ * Collect the layouts of the `type` declarations of
+ * program `node`, and mark the annotations naming them.
+ */
+
+luna_layouts_t *
+luna_layouts_new(luna_node_t *node) {
+  luna_layouts_t *self = malloc(sizeof(luna_layouts_t));
+  kv_init(self->defs);
+  self->names = kh_init(layouts);
+
+  walk_t state = { .layouts = self, .records = NULL, .annotate = 0 };
+  kv_init(state.types);
+  kv_init(state.assigns);
+  walk(&state, node);
+
+  // later definitions replace earlier ones
+  for (int i = 0; i < kv_size(state.types); ++i) {
+    luna_type_node_t *type = kv_A(state.types, i);
+    int ret;
+    khiter_t k = kh_put(layouts, self->names, type->name, &ret);
+    kh_value(self->names, k) = kv_size(self->defs);
+    kv_push(luna_layout_t *, self->defs, layout(type));
+  }
+
+  // nested records
+  for (int i = 0; i < kv_size(state.types); ++i) {
+    luna_type_node_t *type = kv_A(state.types, i);
+    luna_layout_t *layout = kv_A(self->defs, i);
+    int j = 0;
+    luna_vec_each(type->fields, {
+      luna_decl_node_t *decl = (luna_decl_node_t *) NODE(val);
+      luna_layout_t *nested = named(self, decl->type);
+      luna_vec_each(decl->vec, layout->fields[j++].layout = nested);
+    });
+  }
+
+  state.annotate = 1;
+  walk(&state, node);
+
+  kv_destroy(state.types);
+  kv_destroy(state.assigns);
+  return self;
+}
+
+/*
+ * Return the layout of type `name`, or NULL.
+ */
+
+luna_layout_t *
+luna_layouts_get(luna_layouts_t *self, const char *name) {
+  khiter_t k = kh_get(layouts, self->names, name);
+  if (k == kh_end(self->names)) return NULL;
+  return kv_A(self->defs, kh_value(self->names, k));
+}
+
+/*
+ * Return the index of `layout`.
+ */
+
+int
+luna_layouts_index(luna_layouts_t *self, luna_layout_t *layout) {
+  for (int i = 0; i < kv_size(self->defs); ++i) {
+    if (kv_A(self->defs, i) == layout) return i;
+  }
+  assert(0 && "unknown layout");
+  return -1;
+}
+
+/*
+ * Return the layout constructed by `call`, or
+ * NULL when not a call to a type name.
+ */
+
+luna_layout_t *
+luna_layouts_constructs(luna_layouts_t *self, luna_call_node_t *call) {
+  if (LUNA_NODE_ID != call->expr->type) return NULL;
+  return luna_layouts_get(self, ((luna_id_node_t *) call->expr)->val);
+}
+
+/*
+ * Return the layout of the columnar array allocated
+ * by `node`, `T[n]`, or NULL when not a type name.
+ */
+
+luna_layout_t *
+luna_layouts_array(luna_layouts_t *self, luna_subscript_node_t *node) {
+  if (LUNA_NODE_ID != node->left->type) return NULL;
+  if (LUNA_NODE_STRING == node->right->type) return NULL;
+  return luna_layouts_get(self, ((luna_id_node_t *) node->left)->val);
+}
+
+/*
+ * Free the layouts.
+ */
+
+void
+luna_layouts_free(luna_layouts_t *self) {
+  for (int i = 0; i < kv_size(self->defs); ++i) {
+    luna_layout_t *layout = kv_A(self->defs, i);
+    free(layout->fields);
+    free(layout);
+  }
+  kv_destroy(self->defs);
+  kh_destroy(layouts, self->names);
+  free(self);
+}
+
+/*
+ * Add to `known` the locals of `state` only ever assigned
+ * values `of` the same layout, those declared excepted,
+ * and return whether any were added.
+ */
+
+static int
+assigned(walk_t *state, khash_t(records) *known, luna_layout_t *(*of)(luna_records_t *, luna_node_t *)) {
+  luna_records_t *self = state->records;
+  khash_t(records) *seen = kh_init(records);
+  int changed = 0;
+
+  for (int i = 0; i < kv_size(state->assigns); ++i) {
+    assign_t a = kv_A(state->assigns, i);
+    if (has(state->excluded, a.name) || has(self->declared, a.name)) continue;
+    luna_layout_t *layout = a.val ? of(self, a.val) : NULL;
+    int ret;
+    khiter_t k = kh_put(records, seen, a.name, &ret);
+    if (ret) kh_value(seen, k) = layout;
+    else if (kh_value(seen, k) != layout) kh_value(seen, k) = NULL;
+  }
+
+  for (khiter_t k = kh_begin(seen); k != kh_end(seen); ++k) {
+    if (!kh_exist(seen, k) || !kh_value(seen, k)) continue;
+    if (has(state->dropped, kh_key(seen, k))) continue;
+    int ret;
+    khiter_t r = kh_put(records, known, kh_key(seen, k), &ret);
+    if (ret) kh_value(known, r) = kh_value(seen, k), changed = 1;
+  }
+
+  kh_destroy(records, seen);
+  return changed;
+}
+
+/*
+ * Remove `name` from `known` if present.
+ */
+
+static void
+forget(khash_t(records) *known, const char *name) {
+  khiter_t k = kh_get(records, known, name);
+  if (k != kh_end(known)) kh_del(records, known, k);
+}
+
+/*
+ * Find the record and array locals of `body`, that of
+ * function `fn` when given. Locals declared of a record
+ * type or an array of one are known, as are those only
+ * ever assigned values of the same layout, found
+ * optimistically as a local assigned another may be
+ * known. Parameters and captures are only known when
+ * declared, locals in cells or declared twice never are.
+ */
+
+luna_records_t *
+luna_records_new(luna_layouts_t *layouts, luna_upvalues_t *upvalues, luna_function_node_t *fn, luna_node_t *body) {
+  luna_records_t *self = malloc(sizeof(luna_records_t));
+  self->layouts = layouts;
+  self->locals = kh_init(records);
+  self->arrays = kh_init(records);
+  self->declared = kh_init(scalars);
+
+  walk_t state = { .layouts = layouts, .records = self, .annotate = 0 };
+  kv_init(state.types);
+  kv_init(state.assigns);
+  state.excluded = kh_init(scalars);
+  state.dropped = kh_init(scalars);
+
+  luna_captures_t *cells = luna_upvalues_cells(upvalues, fn ? (void *) fn : body);
+  if (cells) {
+    for (int i = 0; i < kv_size(*cells); ++i) add(state.dropped, kv_A(*cells, i).name);
+  }
+
+  if (fn) {
+    luna_vec_each(fn->params, {
+      luna_node_t *param = NODE(val);
+      if (LUNA_NODE_BINARY_OP == param->type) param = ((luna_binary_op_node_t *) param)->left;
+      luna_decl_node_t *decl = (luna_decl_node_t *) param;
+      declare(&state, decl);
+      luna_vec_each(decl->vec, add(state.excluded, ((luna_id_node_t *) NODE(val))->val));
+    });
+
+    luna_captures_t *captures = luna_upvalues_captures(upvalues, fn);
+    if (captures) {
+      for (int i = 0; i < kv_size(*captures); ++i) add(state.excluded, kv_A(*captures, i).name);
+    }
+  }
+
+  walk(&state, fn ? (luna_node_t *) fn->block : body);
+
+  // assigned records and arrays
+  while (assigned(&state, self->locals, luna_records_of) | assigned(&state, self->arrays, luna_records_array));
+
+  for (khiter_t k = kh_begin(state.dropped); k != kh_end(state.dropped); ++k) {
+    if (!kh_exist(state.dropped, k)) continue;
+    const char *name = kh_key(state.dropped, k);
+    forget(self->locals, name);
+    forget(self->arrays, name);
+    khiter_t r = kh_get(scalars, self->declared, name);
+    if (r != kh_end(self->declared)) kh_del(scalars, self->declared, r);
+  }
+
+  kv_destroy(state.types);
+  kv_destroy(state.assigns);
+  kh_destroy(scalars, state.excluded);
+  kh_destroy(scalars, state.dropped);
+  return self;
+}
+
+/*
+ * Return the layout of the elements of a known columnar
+ * array indexed by subscript `node`, or NULL.
+ */
+
+static luna_layout_t *
+element(luna_records_t *self, luna_node_t *node) {
+  if (LUNA_NODE_SUBSCRIPT != node->type) return NULL;
+  luna_subscript_node_t *sub = (luna_subscript_node_t *) node;
+  if (LUNA_NODE_STRING == sub->right->type) return NULL;
+  return luna_records_array(self, sub->left);
+}
+
+/*
+ * Return the layout of the records `node` evaluates
+ * to, elements of arrays included, or NULL when
+ * not known statically.
+ */
+
+luna_layout_t *
+luna_records_of(luna_records_t *self, luna_node_t *node) {
+  switch (node->type) {
+    case LUNA_NODE_CALL:
+      return luna_layouts_constructs(self->layouts, (luna_call_node_t *) node);
+    case LUNA_NODE_ID: {
+      khiter_t k = kh_get(records, self->locals, ((luna_id_node_t *) node)->val);
+      return k == kh_end(self->locals) ? NULL : kh_value(self->locals, k);
+    }
+    case LUNA_NODE_SUBSCRIPT: {
+      luna_layout_t *layout = element(self, node);
+      if (layout) return layout;
+    }
+    // fall through
+    case LUNA_NODE_SLOT: {
+      luna_field_t *field = luna_records_field(self, node);
+      return field ? field->layout : NULL;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Return the field accessed by slot or subscript `node`
+ * of a known record, or NULL.
+ */
+
+luna_field_t *
+luna_records_field(luna_records_t *self, luna_node_t *node) {
+  luna_node_t *left;
+  luna_node_t *right;
+
+  switch (node->type) {
+    case LUNA_NODE_SLOT:
+      left = ((luna_slot_node_t *) node)->left;
+      right = ((luna_slot_node_t *) node)->right;
+      break;
+    case LUNA_NODE_SUBSCRIPT:
+      left = ((luna_subscript_node_t *) node)->left;
+      right = ((luna_subscript_node_t *) node)->right;
+      break;
+    default:
+      return NULL;
+  }
+
+  const char *name;
+  switch (right->type) {
+    case LUNA_NODE_ID: name = ((luna_id_node_t *) right)->val; break;
+    case LUNA_NODE_STRING: name = ((luna_string_node_t *) right)->val; break;
+    default: return NULL;
+  }
+
+  // only slots name fields by id
+  if (LUNA_NODE_ID == right->type && LUNA_NODE_SLOT != node->type) return NULL;
+
+  luna_layout_t *layout = luna_records_of(self, left);
+  return layout ? luna_layout_field(layout, name) : NULL;
+}
+
+/*
+ * Return the layout of the columnar array `node`
+ * evaluates to, or NULL when not known statically.
+ */
+
+luna_layout_t *
+luna_records_array(luna_records_t *self, luna_node_t *node) {
+  switch (node->type) {
+    case LUNA_NODE_SUBSCRIPT:
+      return luna_layouts_array(self->layouts, (luna_subscript_node_t *) node);
+    case LUNA_NODE_ID: {
+      khiter_t k = kh_get(records, self->arrays, ((luna_id_node_t *) node)->val);
+      return k == kh_end(self->arrays) ? NULL : kh_value(self->arrays, k);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Return the field accessed by slot or subscript `node`
+ * of an element of a known columnar array, `a[i].f`,
+ * or NULL.
+ */
+
+luna_field_t *
+luna_records_element(luna_records_t *self, luna_node_t *node) {
+  if (LUNA_NODE_SLOT != node->type && LUNA_NODE_SUBSCRIPT != node->type) return NULL;
+  // same layout
+  if (!element(self, ((luna_slot_node_t *) node)->left)) return NULL;
+  return luna_records_field(self, node);
+}
+
+/*
+ * Return the record layout local `name` is declared of,
+ * or NULL.
+ */
+
+luna_layout_t *
+luna_records_declared(luna_records_t *self, const char *name) {
+  if (!has(self->declared, name)) return NULL;
+  khiter_t k = kh_get(records, self->locals, name);
+  return k == kh_end(self->locals) ? NULL : kh_value(self->locals, k);
+}
+
+/*
+ * Return the layout of the columnar arrays local `name`
+ * is declared of, or NULL.
+ */
+
+luna_layout_t *
+luna_records_declared_array(luna_records_t *self, const char *name) {
+  if (!has(self->declared, name)) return NULL;
+  khiter_t k = kh_get(records, self->arrays, name);
+  return k == kh_end(self->arrays) ? NULL : kh_value(self->arrays, k);
+}
+
+/*
+ * Free the records.
+ */
+
+void
+luna_records_free(luna_records_t *self) {
+  kh_destroy(records, self->locals);
+  kh_destroy(records, self->arrays);
+  kh_destroy(scalars, self->declared);
+  free(self);
+}
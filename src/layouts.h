@@ -0,0 +1,95 @@
+
+//
+// layouts.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_LAYOUTS_H
+#define LUNA_LAYOUTS_H
+
+#include "ast.h"
+#include "khash.h"
+#include "escape.h"
+#include "record.h"
+#include "upvalues.h"
+
+// layout index by type name
+
+KHASH_MAP_INIT_STR(layouts, int);
+
+// layout by local
+
+KHASH_MAP_INIT_STR(records, luna_layout_t *);
+
+/*
+ * Layouts of the `type` declarations of a program,
+ * indexed in definition order.
+ */
+
+typedef struct {
+  kvec_t(luna_layout_t *) defs;
+  khash_t(layouts) *names;
+} luna_layouts_t;
+
+/*
+ * Locals of a body known to hold records of a layout, or
+ * nil, and `arrays` those known to hold columnar arrays of
+ * one. Those `declared` of a record or array type are
+ * checked against it when assigned a value which is not
+ * known to be one, the others are only ever assigned
+ * values of their layout. Locals in cells are unknown.
+ */
+
+typedef struct {
+  luna_layouts_t *layouts;
+  khash_t(records) *locals;
+  khash_t(records) *arrays;
+  khash_t(scalars) *declared;
+} luna_records_t;
+
+// protos
+
+luna_layouts_t *
+luna_layouts_new(luna_node_t *node);
+
+luna_layout_t *
+luna_layouts_get(luna_layouts_t *self, const char *name);
+
+int
+luna_layouts_index(luna_layouts_t *self, luna_layout_t *layout);
+
+luna_layout_t *
+luna_layouts_constructs(luna_layouts_t *self, luna_call_node_t *call);
+
+luna_layout_t *
+luna_layouts_array(luna_layouts_t *self, luna_subscript_node_t *node);
+
+void
+luna_layouts_free(luna_layouts_t *self);
+
+luna_records_t *
+luna_records_new(luna_layouts_t *layouts, luna_upvalues_t *upvalues, luna_function_node_t *fn, luna_node_t *body);
+
+luna_layout_t *
+luna_records_of(luna_records_t *self, luna_node_t *node);
+
+luna_field_t *
+luna_records_field(luna_records_t *self, luna_node_t *node);
+
+luna_layout_t *
+luna_records_array(luna_records_t *self, luna_node_t *node);
+
+luna_field_t *
+luna_records_element(luna_records_t *self, luna_node_t *node);
+
+luna_layout_t *
+luna_records_declared(luna_records_t *self, const char *name);
+
+luna_layout_t *
+luna_records_declared_array(luna_records_t *self, const char *name);
+
+void
+luna_records_free(luna_records_t *self);
+
+#endif /* LUNA_LAYOUTS_H */
@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "lexer.h"
+#include "intern.h"
 
 /*
  * Next char in the array.
@@ -67,6 +68,7 @@ luna_lexer_init(luna_lexer_t *self, char *source, const char *filename) {
   self->filename = filename;
   self->lineno = 1;
   self->offset = 0;
+  self->tok.type = LUNA_TOKEN_EOS;
 }
 
 /*
@@ -125,7 +127,7 @@ scan_ident(luna_lexer_t *self, int c) {
       if (0 == strcmp("unless", buf)) return token(UNLESS);
   }
 
-  self->tok.value.as_string = strdup(buf);
+  self->tok.value.as_string = luna_intern(buf);
   return 1;
 }
 
@@ -174,8 +176,7 @@ scan_string(luna_lexer_t *self, int quote) {
     buf[len++] = c;
   }
 
-  buf[len++] = 0;
-  self->tok.value.as_string = strdup(buf); // TODO: remove
+  self->tok.value.as_string = luna_intern_len(buf, len);
   return 1;
 }
 
@@ -0,0 +1,131 @@
+
+//
+// lines.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include "lines.h"
+
+/*
+ * Initialize line table `self`.
+ */
+
+void
+luna_lines_init(luna_lines_t *self) {
+  kv_init(self->deltas);
+  kv_init(self->checkpoints);
+  self->nentries = 0;
+  self->pc = 0;
+  self->line = 0;
+}
+
+/*
+ * Append an entry of `dpc` and `dline`.
+ */
+
+static void
+entry(luna_lines_t *self, int dpc, int dline) {
+  if (0 == self->nentries++ % LUNA_LINES_SPAN) {
+    luna_lines_checkpoint_t checkpoint = { self->pc, self->line, kv_size(self->deltas) };
+    kv_push(luna_lines_checkpoint_t, self->checkpoints, checkpoint);
+  }
+
+  if (dpc < 16 && dline >= -8 && dline < 8) {
+    kv_push(uint8_t, self->deltas, dpc << 4 | (dline & 0xf));
+  } else {
+    kv_push(uint8_t, self->deltas, 0);
+    kv_push(uint8_t, self->deltas, dpc);
+    kv_push(uint8_t, self->deltas, (uint8_t) (int8_t) dline);
+  }
+
+  self->pc += dpc;
+  self->line += dline;
+}
+
+/*
+ * Record that instructions from `pc` onwards originate
+ * from `line`, until the next entry. Pcs must not decrease.
+ */
+
+void
+luna_lines_add(luna_lines_t *self, int pc, int line) {
+  if (line == self->line) return;
+
+  int dpc = pc - self->pc;
+  int dline = line - self->line;
+
+  while (dpc > UINT8_MAX) {
+    entry(self, UINT8_MAX, 0);
+    dpc -= UINT8_MAX;
+  }
+
+  while (dline > INT8_MAX || dline < INT8_MIN) {
+    int step = dline > 0 ? INT8_MAX : INT8_MIN;
+    entry(self, dpc, step);
+    dline -= step;
+    dpc = 0;
+  }
+
+  entry(self, dpc, dline);
+}
+
+/*
+ * Return the line of the instruction at `pc`,
+ * or 0 when unknown.
+ */
+
+int
+luna_lines_lookup(luna_lines_t *self, int pc) {
+  int lo = 0;
+  int hi = kv_size(self->checkpoints) - 1;
+  if (hi < 0) return 0;
+
+  // last checkpoint at or before pc
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (kv_A(self->checkpoints, mid).pc <= pc) lo = mid;
+    else hi = mid - 1;
+  }
+
+  luna_lines_checkpoint_t *checkpoint = &kv_A(self->checkpoints, lo);
+  int line = checkpoint->line;
+  int at = checkpoint->pc;
+
+  for (int i = checkpoint->offset; i < kv_size(self->deltas);) {
+    uint8_t b = kv_A(self->deltas, i++);
+    int dpc = b >> 4;
+    int dline = (int8_t) (b << 4) >> 4;
+
+    // escaped
+    if (!b) {
+      dpc = kv_A(self->deltas, i++);
+      dline = (int8_t) kv_A(self->deltas, i++);
+    }
+
+    if ((at += dpc) > pc) break;
+    line += dline;
+  }
+
+  return line;
+}
+
+/*
+ * Return the size of the table in bytes.
+ */
+
+size_t
+luna_lines_size(luna_lines_t *self) {
+  return kv_size(self->deltas)
+    + kv_size(self->checkpoints) * sizeof(luna_lines_checkpoint_t);
+}
+
+/*
+ * Free line table `self`.
+ */
+
+void
+luna_lines_free(luna_lines_t *self) {
+  kv_destroy(self->deltas);
+  kv_destroy(self->checkpoints);
+}
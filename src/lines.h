@@ -0,0 +1,66 @@
+
+//
+// lines.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_LINES_H
+#define LUNA_LINES_H
+
+#include <stdint.h>
+#include "kvec.h"
+
+/*
+ * Entries between checkpoints.
+ */
+
+#define LUNA_LINES_SPAN 64
+
+/*
+ * Decoder state at the start of a span.
+ */
+
+typedef struct {
+  int pc;
+  int line;
+  int offset;
+} luna_lines_checkpoint_t;
+
+/*
+ * Line table mapping pcs to source lines, recording the pc
+ * and line deltas from the previous entry. Entries fit a single
+ * byte, the pc delta in the high nibble and the signed line
+ * delta in the low one, or are escaped by a zero byte followed
+ * by an unsigned pc delta byte and a signed line delta byte,
+ * larger deltas spanning several entries. A checkpoint every
+ * LUNA_LINES_SPAN entries allows lookups to binary search
+ * before decoding.
+ */
+
+typedef struct {
+  kvec_t(uint8_t) deltas;
+  kvec_t(luna_lines_checkpoint_t) checkpoints;
+  int nentries;
+  int pc;
+  int line;
+} luna_lines_t;
+
+// protos
+
+void
+luna_lines_init(luna_lines_t *self);
+
+void
+luna_lines_add(luna_lines_t *self, int pc, int line);
+
+int
+luna_lines_lookup(luna_lines_t *self, int pc);
+
+size_t
+luna_lines_size(luna_lines_t *self);
+
+void
+luna_lines_free(luna_lines_t *self);
+
+#endif /* LUNA_LINES_H */
@@ -19,7 +19,12 @@
 #include "utils.h"
 #include "prettyprint.h"
 #include "codegen.h"
+#include "dce.h"
+#include "infer.h"
 #include "vm.h"
+#include "runtime.h"
+#include "disasm.h"
+#include "emit.h"
 
 // --ast
 
@@ -29,6 +34,34 @@ static int ast = 0;
 
 static int tokens = 0;
 
+// --dce-stats
+
+static int dce_stats = 0;
+
+// --gc-stats
+
+static int gc_stats = 0;
+
+// --gc-concurrent
+
+static int gc_concurrent = 0;
+
+// --gc-budget
+
+static long gc_budget = 0;
+
+// --emit-c
+
+static int emit_c = 0;
+
+// --profile-out
+
+static const char *profile_out = NULL;
+
+// --profile-in
+
+static const char *profile_in = NULL;
+
 /*
  * Output usage information.
  */
@@ -42,6 +75,13 @@ usage() {
     "\n"
     "\n    -A, --ast       output ast to stdout"
     "\n    -T, --tokens    output tokens to stdout"
+    "\n    --dce-stats     output dead code elimination stats"
+    "\n    --gc-stats      output garbage collection stats"
+    "\n    --gc-budget <bytes>   bytes marked per gc step, 0 for all at once"
+    "\n    --gc-concurrent mark on a collector thread"
+    "\n    --emit-c        output the program as C to stdout"
+    "\n    --profile-out <file>  record an execution profile to <file>"
+    "\n    --profile-in <file>   optimize for the profile in <file>"
     "\n    -h, --help      output help information"
     "\n    -V, --version   output luna version"
     "\n"
@@ -50,6 +90,9 @@ usage() {
     "\n    $ luna < some.luna"
     "\n    $ luna some.luna"
     "\n    $ luna some"
+    "\n    $ luna --emit-c some.luna > some.c"
+    "\n    $ luna --profile-out some.prof some.luna"
+    "\n    $ luna --profile-in some.prof some.luna"
     "\n    $ luna"
     "\n"
     "\n"
@@ -99,6 +142,19 @@ repl() {
   exit(0);
 }
 
+/*
+ * Return the `what` following flag `args[*i]`.
+ */
+
+static const char *
+flag_arg(const char **args, int *i, int len, const char *what) {
+  if (*i + 1 == len) {
+    fprintf(stderr, "%s requires %s\n", args[*i], what);
+    exit(1);
+  }
+  return args[++*i];
+}
+
 /*
  * Parse arguments.
  */
@@ -119,6 +175,28 @@ parse_args(int *argc, const char **argv) {
     } else if (!strcmp("-T", arg) || !strcmp("--tokens", arg)) {
       tokens = 1;
       --*argc; ++argv;
+    } else if (!strcmp("--dce-stats", arg)) {
+      dce_stats = 1;
+      --*argc; ++argv;
+    } else if (!strcmp("--gc-stats", arg)) {
+      gc_stats = 1;
+      --*argc; ++argv;
+    } else if (!strcmp("--gc-concurrent", arg)) {
+      gc_concurrent = 1;
+      --*argc; ++argv;
+    } else if (!strcmp("--gc-budget", arg)) {
+      gc_budget = atol(flag_arg(args, &i, len, "a size"));
+      if (!gc_budget) gc_budget = -1;
+      *argc -= 2; argv += 2;
+    } else if (!strcmp("--emit-c", arg)) {
+      emit_c = 1;
+      --*argc; ++argv;
+    } else if (!strcmp("--profile-out", arg)) {
+      profile_out = flag_arg(args, &i, len, "a file");
+      *argc -= 2; argv += 2;
+    } else if (!strcmp("--profile-in", arg)) {
+      profile_in = flag_arg(args, &i, len, "a file");
+      *argc -= 2; argv += 2;
     } else if ('-' == arg[0]) {
       fprintf(stderr, "unknown flag %s\n", arg);
       exit(1);
@@ -158,14 +236,81 @@ eval(char *source, const char *path) {
   }
 
   // --ast
-  luna_set_prettyprint_func(printf);
-  luna_prettyprint((luna_node_t *) root);
+  if (!emit_c) {
+    luna_set_prettyprint_func(printf);
+    luna_prettyprint((luna_node_t *) root);
+  }
+
+  // eliminate dead code
+  luna_dce_stats_t stats = { 0, 0 };
+  luna_dce((luna_node_t *) root, &stats);
+  if (dce_stats) {
+    printf("dce: eliminated %d statements (%d nodes)\n", stats.stmts, stats.nodes);
+  }
+
+  // infer types
+  luna_infer((luna_node_t *) root);
+
+  // --profile-in
+  luna_gen_options_t options = {
+    .instrument = !!profile_out,
+    .budget = gc_budget,
+    .concurrent = gc_concurrent
+  };
+  if (profile_in) {
+    options.profile = luna_profile_new();
+    if (!luna_profile_load(options.profile, profile_in)) {
+      fprintf(stderr, "error reading profile %s\n", profile_in);
+      return 1;
+    }
+  }
 
   // evaluate
-  luna_vm_t *vm = luna_gen((luna_node_t *) root);
-  luna_object_t *obj = luna_eval(vm);
-  luna_object_inspect(obj);
-  luna_object_free(obj);
+  luna_vm_t *vm = luna_gen_with((luna_node_t *) root, &options);
+  if (options.profile) luna_profile_free(options.profile);
+  if (vm->err) {
+    luna_report_gen_error(vm, lex.filename);
+    luna_vm_free(vm);
+    return 1;
+  }
+
+  // --emit-c
+  if (emit_c) {
+    luna_emit_c(vm, stdout);
+    luna_vm_free(vm);
+    return 0;
+  }
+
+  luna_dump(vm);
+  printf("\n");
+  luna_value_inspect(luna_result(luna_eval(vm)));
+
+  // --gc-stats
+  if (gc_stats) {
+    luna_gc_stats_t *gc = &vm->gc.stats;
+    printf("gc: %d scavenges, %d collections, %zu bytes promoted\n",
+      gc->scavenges, gc->collections, gc->promoted);
+    printf("gc: %zu of %zu bytes reclaimed, %zu live\n",
+      gc->reclaimed, gc->allocated, vm->gc.live);
+    printf("gc: %d marking steps, %.3fms paused, %.3fms longest pause\n",
+      gc->steps, gc->pause * 1e3, gc->max_pause * 1e3);
+    printf("gc: p50 pause < %gus, p99 pause < %gus\n",
+      luna_gc_percentile(gc, 0.5) * 1e6, luna_gc_percentile(gc, 0.99) * 1e6);
+    for (int i = 0; i < LUNA_GC_BUCKETS; ++i) {
+      if (gc->pauses[i]) printf("gc:   < %8uus  %u\n", 1u << i, gc->pauses[i]);
+    }
+  }
+
+  // --profile-out, merged with a previous run
+  if (profile_out) {
+    luna_profile_load(vm->profile, profile_out);
+    if (!luna_profile_save(vm->profile, profile_out)) {
+      fprintf(stderr, "error writing profile %s:\n\n  %s\n\n", profile_out, strerror(errno));
+      luna_vm_free(vm);
+      return 1;
+    }
+  }
+
   luna_vm_free(vm);
   
   return 0;
@@ -7,7 +7,10 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "object.h"
+#include "array.h"
+#include "slab.h"
 #include "internal.h"
 
 /*
@@ -15,92 +18,139 @@
  */
 
 void
-luna_object_inspect(luna_object_t *self) {
-  switch (self->type) {
+luna_value_inspect(luna_value_t self) {
+  switch (luna_value_type(self)) {
     case LUNA_TYPE_FLOAT:
-      printf("%2f\n", self->value.as_float);
+      printf("%2f\n", luna_as_float(self));
       break;
     case LUNA_TYPE_INT:
-      printf("%d\n", self->value.as_int);
+      printf("%d\n", luna_as_int(self));
       break;
 	case LUNA_TYPE_BOOL:
-	  printf("%s\n", self->value.as_int ? "true" : "false");
+	  printf("%s\n", luna_as_int(self) ? "true" : "false");
+	  break;
+	case LUNA_TYPE_NULL:
+	  printf("nil\n");
 	  break;
 	case LUNA_TYPE_STRING:
-	  printf("%s\n", (char *)self->value.as_pointer);
+	  printf("%s\n", (char *) luna_as_pointer(self));
 	  break;
+    case LUNA_TYPE_RECORD:
+      printf("<%s>\n", luna_record_layout((luna_record_t *) luna_as_pointer(self))->name);
+      break;
+    case LUNA_TYPE_ARRAY: {
+      luna_array_t *arr = luna_as_pointer(self);
+      if (arr->layout) printf("<%s[%d]>\n", arr->layout->name, arr->length);
+      else printf("<array[%d]>\n", arr->length);
+      break;
+    }
     default:
       assert(0 && "unhandled");
   }
 }
 
 /*
- * Allocate an initialize a new object of the given `type`.
+ * Return the string value of the interned copy of `val`.
  */
 
-static luna_object_t *
-alloc_object(luna_object type) {
-  luna_object_t *self = malloc(sizeof(luna_object_t));
-  if (unlikely(!self)) return NULL;
-  self->type = type;
-  return self;
+luna_value_t
+luna_string_new(const char *val) {
+  const char *str = luna_intern(val);
+  if (unlikely(!str)) return LUNA_VALUE_NIL;
+  return luna_value_pointer(LUNA_TYPE_STRING, str);
 }
 
 /*
- * Allocate a new int object with the given `val`.
+ * Initialize `self` as an empty object of the `root`
+ * shape with `capacity` slots.
  */
 
-luna_object_t *
-luna_int_new(int val) {
-  luna_object_t *self = alloc_object(LUNA_TYPE_INT);
-  if (unlikely(!self)) return NULL;
-  self->value.as_int = val;
-  return self;
+void
+luna_object_init(luna_object_t *self, luna_shape_t *root, int capacity) {
+  self->shape = root;
+  self->dict = NULL;
+  self->capacity = capacity;
+  for (int i = 0; i < capacity; ++i) self->slots[i] = LUNA_VALUE_NIL;
 }
 
 /*
- * Allocate a new float object with the given `val`.
+ * Field interned `key` of `self` looked up by its shape,
+ * caching the slot, or in its dictionary.
  */
 
-luna_object_t *
-luna_float_new(float val) {
-  luna_object_t *self = alloc_object(LUNA_TYPE_FLOAT);
-  if (unlikely(!self)) return NULL;
-  self->value.as_float = val;
-  return self;
+luna_value_t
+luna_object_lookup(luna_object_t *self, const char *key, luna_cache_t *cache) {
+  luna_shape_t *shape = self->shape;
+  luna_assert_interned(key);
+  if (!shape) return luna_hash_get(self->dict, key);
+
+  int slot = luna_shape_lookup(shape, key);
+  cache->shape = cache->next = shape;
+  cache->slot = slot;
+  return slot < 0 ? LUNA_VALUE_NIL : self->slots[slot];
 }
 
 /*
- * Allocate a new bool object with the given `val`.
+ * Field interned `key` of `self` to store to, transitioning
+ * it to the shape adding the key unless present and caching
+ * the slot. Objects out of slots turn into dictionaries.
  */
 
-luna_object_t *
-luna_bool_new(bool val) {
-  luna_object_t *self = alloc_object(LUNA_TYPE_BOOL);
-  if (unlikely(!self)) return NULL;
-  self->value.as_int = val;
-  return self;
+luna_value_t *
+luna_object_insert(luna_object_t *self, const char *key, luna_cache_t *cache) {
+  luna_shape_t *shape = self->shape;
+  int ret;
+  luna_assert_interned(key);
+
+  if (shape) {
+    luna_shape_t *next = shape;
+    int slot = luna_shape_lookup(shape, key);
+
+    // added
+    if (slot < 0 && (next = luna_shape_add(shape, key)) && next->nslots <= self->capacity) {
+      slot = shape->nslots;
+    }
+
+    if (slot > -1) {
+      cache->shape = shape;
+      cache->next = next;
+      cache->slot = slot;
+      self->shape = next;
+      return &self->slots[slot];
+    }
+
+    luna_object_dictionary(self);
+  }
+
+  khiter_t k = kh_put(value, self->dict, key, &ret);
+  if (ret) kh_value(self->dict, k) = LUNA_VALUE_NIL;
+  return &kh_value(self->dict, k);
 }
 
 /*
- * Allocate a new string object with the given `val`.
+ * Turn shaped object `self` into a dictionary of its
+ * fields. The slots are left as they were, the
+ * dictionary is published once complete.
  */
 
-luna_object_t *
-luna_string_new(const char *val) {
-  luna_object_t *self = alloc_object(LUNA_TYPE_STRING);
-  if (unlikely(!self)) return NULL;
-  self->value.as_pointer = strdup(val);
-  return self;
+void
+luna_object_dictionary(luna_object_t *self) {
+  luna_hash_t *dict = luna_hash_new();
+  for (luna_shape_t *shape = self->shape; shape->parent; shape = shape->parent) {
+    luna_hash_set(dict, shape->key, self->slots[shape->nslots - 1]);
+  }
+  __atomic_store_n(&self->dict, dict, __ATOMIC_RELEASE);
+  self->shape = NULL;
 }
 
+/*
+ * Remove field interned `key` of `self`, turning it
+ * into a dictionary.
+ */
+
 void
-luna_object_free(luna_object_t *self) {
-  switch(self->type) {
-	case LUNA_TYPE_STRING:
-      free(self->value.as_pointer);
-	  break;
-    default: break;
-  }
-  free(self);
+luna_object_remove(luna_object_t *self, const char *key) {
+  luna_assert_interned(key);
+  if (self->shape) luna_object_dictionary(self);
+  luna_hash_remove(self->dict, key);
 }
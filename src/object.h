@@ -8,14 +8,16 @@
 #ifndef LUNA_OBJECT_H
 #define LUNA_OBJECT_H
 
+#include "value.h"
 #include "hash.h"
+#include "shape.h"
 #include <stdbool.h>
 
 /*
- * Check if `val` is the given type.
+ * Check if `val` is the given boxed type.
  */
 
-#define luna_object_is(val, t) ((val)->type == LUNA_TYPE_##t)
+#define luna_object_is(val, t) ((val) >> 47 == LUNA_VALUE_TAG(LUNA_TYPE_##t) >> 47)
 
 /*
  * Specific type macros.
@@ -24,62 +26,107 @@
 #define luna_is_node(val) luna_object_is(val, NODE)
 #define luna_is_array(val) luna_object_is(val, ARRAY)
 #define luna_is_object(val) luna_object_is(val, OBJECT)
+#define luna_is_record(val) luna_object_is(val, RECORD)
 #define luna_is_string(val) luna_object_is(val, STRING)
-#define luna_is_float(val) luna_object_is(val, FLOAT)
+#define luna_is_float(val) (!luna_value_boxed(val))
 #define luna_is_int(val) luna_object_is(val, INT)
 #define luna_is_bool(val) luna_object_is(val, BOOL)
-#define luna_is_null(val) luna_object_is(val, NULL)
+#define luna_is_null(val) ((val) == LUNA_VALUE_NIL)
 
 /*
- * Luna value types.
+ * Inline slots reserved beyond the keys of a
+ * literal, for those added to it later.
  */
 
-typedef enum {
-  LUNA_TYPE_NULL,
-  LUNA_TYPE_NODE,
-  LUNA_TYPE_BOOL,
-  LUNA_TYPE_INT,
-  LUNA_TYPE_FLOAT,
-  LUNA_TYPE_STRING,
-  LUNA_TYPE_OBJECT,
-  LUNA_TYPE_ARRAY,
-  LUNA_TYPE_LIST
-} luna_object;
+#define LUNA_OBJECT_SLACK 4
 
 /*
  * Luna object.
  *
- * A simple tagged union forming
- * the basis of a Luna values.
+ * Fields are stored in `capacity` inline slots laid out by
+ * `shape`. Objects given more keys than fit, or removing
+ * one, turn into a dictionary: `shape` is NULL and the
+ * fields live in `dict` instead. Keys must be interned.
  */
 
-struct luna_object_struct {
-  luna_object type;
-  union {
-    void *as_pointer;
-    int as_int;
-    float as_float;
-  } value;
-};
+typedef struct {
+  luna_shape_t *shape;
+  luna_hash_t *dict;
+  uint32_t capacity;
+  luna_value_t slots[];
+} luna_object_t;
+
+/*
+ * Inline cache of a field access, objects of `shape` hold
+ * the key at `slot`, or lack it when -1. Stores adding the
+ * key leave them `next`, otherwise `next` is `shape`.
+ */
+
+typedef struct {
+  luna_shape_t *shape;
+  luna_shape_t *next;
+  int slot;
+} luna_cache_t;
+
+/*
+ * Size of an object with `capacity` slots.
+ */
+
+#define luna_object_size(capacity) \
+  (sizeof(luna_object_t) + (capacity) * sizeof(luna_value_t))
 
 // protos
 
 void
-luna_object_inspect(luna_object_t *self);
+luna_value_inspect(luna_value_t self);
 
-luna_object_t *
-luna_int_new(int val);
+luna_value_t
+luna_string_new(const char *val);
 
-luna_object_t *
-luna_float_new(float val);
+void
+luna_object_init(luna_object_t *self, luna_shape_t *root, int capacity);
 
-luna_object_t *
-luna_bool_new(bool val);
+luna_value_t
+luna_object_lookup(luna_object_t *self, const char *key, luna_cache_t *cache);
 
-luna_object_t *
-luna_string_new(const char *val);
+luna_value_t *
+luna_object_insert(luna_object_t *self, const char *key, luna_cache_t *cache);
 
 void
-luna_object_free(luna_object_t *self);
+luna_object_dictionary(luna_object_t *self);
+
+void
+luna_object_remove(luna_object_t *self, const char *key);
+
+/*
+ * Field `key` of `self`, a guarded load of the
+ * slot cached when its shape is that of `cache`.
+ */
+
+static inline luna_value_t
+luna_object_get(luna_object_t *self, const char *key, luna_cache_t *cache) {
+  luna_shape_t *shape = self->shape;
+  if (shape == cache->shape && shape) {
+    return cache->slot < 0 ? LUNA_VALUE_NIL : self->slots[cache->slot];
+  }
+  return luna_object_lookup(self, key, cache);
+}
+
+/*
+ * Field `key` of `self` to store to, added as nil unless
+ * present. Cached stores check the shape and that the
+ * slot fits, and transition the object in one go.
+ */
+
+static inline luna_value_t *
+luna_object_put(luna_object_t *self, const char *key, luna_cache_t *cache) {
+  luna_shape_t *shape = self->shape;
+  int slot = cache->slot;
+  if (shape == cache->shape && shape && slot >= 0 && slot < self->capacity) {
+    self->shape = cache->next;
+    return &self->slots[slot];
+  }
+  return luna_object_insert(self, key, cache);
+}
 
 #endif /* LUNA_OBJECT_H */
@@ -15,18 +15,71 @@
 #define LUNA_OP_LIST \
   o(HALT, "halt") \
   o(JMP, "jmp") \
+  o(CALL, "call") \
+  o(DISPATCH, "dispatch") \
+  o(GUARD, "guard") \
+  o(FEEDBACK, "feedback") \
+  o(COUNT, "count") \
+  o(RETURN, "return") \
+  o(ARGC, "argc") \
+  o(CLOSURE, "closure") \
+  o(APPLY, "apply") \
+  o(BOX, "box") \
+  o(GETCELL, "getcell") \
+  o(SETCELL, "setcell") \
+  o(NEWOBJECT, "newobject") \
+  o(GETFIELD, "getfield") \
+  o(SETFIELD, "setfield") \
+  o(NEWRECORD, "newrecord") \
+  o(CHECK, "check") \
+  o(GETI, "geti") \
+  o(GETF, "getf") \
+  o(GETV, "getv") \
+  o(SETI, "seti") \
+  o(SETF, "setf") \
+  o(SETV, "setv") \
+  o(NEWARRAY, "newarray") \
+  o(CHECKARRAY, "checkarray") \
+  o(GETINDEX, "getindex") \
+  o(SETINDEX, "setindex") \
+  o(GETCI, "getci") \
+  o(GETCF, "getcf") \
+  o(GETCV, "getcv") \
+  o(SETCI, "setci") \
+  o(SETCF, "setcf") \
+  o(SETCV, "setcv") \
+  o(NEWLIST, "newlist") \
+  o(APPEND, "append") \
   o(LOADK, "loadk") \
   o(LOADB, "loadb") \
+  o(LOADNIL, "loadnil") \
   o(MOVE, "move") \
   o(EQ, "eq") \
   o(LT, "lt") \
   o(LTE, "lte") \
+  o(LTI, "lti") \
+  o(LTEI, "ltei") \
+  o(LTF, "ltf") \
+  o(LTEF, "ltef") \
+  o(TEST, "test") \
+  o(TESTSET, "testset") \
+  o(NOT, "not") \
   o(ADD, "add") \
   o(SUB, "sub") \
   o(DIV, "div") \
   o(MUL, "mul") \
   o(MOD, "mod") \
   o(POW, "pow") \
+  o(ADDI, "addi") \
+  o(SUBI, "subi") \
+  o(DIVI, "divi") \
+  o(MULI, "muli") \
+  o(MODI, "modi") \
+  o(ADDF, "addf") \
+  o(SUBF, "subf") \
+  o(DIVF, "divf") \
+  o(MULF, "mulf") \
+  o(MODF, "modf") \
   o(NEGATE, "negate") \
   o(BIT_SHL, "bshl") \
   o(BIT_SHR, "bshr") \
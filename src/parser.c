@@ -6,6 +6,8 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include "prettyprint.h"
 #include "parser.h"
@@ -70,12 +72,20 @@
 
 #define lineno self->lex->lineno
 
+/*
+ * Number `node` in parse order, giving profiles an id
+ * that is stable across runs of the same source.
+ */
+
+#define number(node) ((node)->base.id = ++self->nodes)
+
 // forward declarations
 
 static luna_block_node_t *block(luna_parser_t *self);
 static luna_node_t *expr(luna_parser_t *self);
 static luna_node_t *call_expr(luna_parser_t *self, luna_node_t *left);
 static luna_node_t *not_expr(luna_parser_t *self);
+static luna_node_t *function_expr(luna_parser_t *self);
 
 /*
  * Initialize with the given lexer.
@@ -88,6 +98,7 @@ luna_parser_init(luna_parser_t *self, luna_lexer_t *lex) {
   self->ctx = NULL;
   self->err = NULL;
   self->in_args = 0;
+  self->nodes = 0;
 }
 
 /*
@@ -190,7 +201,7 @@ hash_expr(luna_parser_t *self) {
 }
 
 /*
- * id
+ * id ('[' ']')?
  */
 
 static luna_node_t *
@@ -198,10 +209,19 @@ type_expr(luna_parser_t *self) {
   debug("type_expr");
   if (!is(ID)) return NULL;
 
-  luna_node_t *ret = (luna_node_t *) luna_id_node_new(self->tok->value.as_string, lineno);
+  const char *name = self->tok->value.as_string;
+  int line = lineno;
   next;
 
-  return ret;
+  // array of id
+  if (accept(LBRACK)) {
+    if (!accept(RBRACK)) return error("missing closing ']'");
+    char *buf = malloc(strlen(name) + 3);
+    sprintf(buf, "%s[]", name);
+    name = buf;
+  }
+
+  return (luna_node_t *) luna_id_node_new(name, line);
 }
 
 /*
@@ -253,6 +273,7 @@ decl_expr(luna_parser_t *self, bool need_type) {
  * | string
  * | array
  * | hash
+ * | function_expr
  * | paren_expr
  */
 
@@ -278,6 +299,8 @@ primary_expr(luna_parser_t *self) {
       return array_expr(self);
     case LUNA_TOKEN_LBRACE:
       return hash_expr(self);
+    case LUNA_TOKEN_COLON:
+      return function_expr(self);
   }
   if (ret) {
     next;
@@ -584,6 +607,7 @@ logical_or_expr(luna_parser_t *self) {
   if (accept(OP_FORK)) {
     luna_id_node_t *id = luna_id_node_new("fork", line);
     luna_call_node_t *call = luna_call_node_new((luna_node_t *) id, line);
+    number(call);
     luna_vec_push(call->args->vec, luna_node(node));
     node = (luna_node_t *) call;
   }
@@ -611,7 +635,7 @@ function_params(luna_parser_t *self) {
     context("function param");
 
     // ('=' expr)?
-    luna_object_t *param;
+    luna_value_t param;
     if (accept(OP_ASSIGN)) {
       luna_node_t *val = expr(self);
       if (!val) return NULL;
@@ -638,17 +662,27 @@ static luna_node_t *
 function_expr(luna_parser_t *self) {
   luna_block_node_t *body;
   luna_vec_t *params;
+  int line = lineno;
   debug("function_expr");
 
   // ':'
   if (accept(COLON)) {
-    // params?
-    if (!(params = function_params(self))) return NULL;
+    // params? on the same line
+    if (lineno > line) {
+      params = luna_vec_new();
+    } else if (!(params = function_params(self))) {
+      return NULL;
+    }
     context("function");
 
+    // semicolon might have been inserted here
+    accept(SEMICOLON);
+
     // block
     if (body = block(self)) {
-      //return (luna_node_t *) luna_function_node_new(body, params);
+      luna_function_node_t *fn = luna_function_node_new(NULL, NULL, body, params, line);
+      number(fn);
+      return (luna_node_t *) fn;
     }
   }
 
@@ -695,7 +729,7 @@ slot_access_expr(luna_parser_t *self, luna_node_t *left) {
     if (is(LPAREN)) {
       luna_call_node_t *call;
       luna_vec_t *args_vec;
-      luna_object_t *prev = NULL;
+      luna_value_t prev = LUNA_VALUE_NIL;
 
       call = (luna_call_node_t *) call_expr(self, id);
       if (luna_vec_length(call->args->vec) > 0) {
@@ -756,7 +790,7 @@ call_args(luna_parser_t *self) {
         
         luna_node_t *val = expr(self);
         const char *str = ((luna_id_node_t *) node)->val;
-        luna_hash_set(args->hash, (char *) str, luna_node(val));
+        luna_hash_set(args->hash, str, luna_node(val));
       } else {
         luna_vec_push(args->vec, luna_node(node));
       }
@@ -792,6 +826,7 @@ call_expr(luna_parser_t *self, luna_node_t *left) {
   if (accept(LPAREN)) {
     context("function call");
     call = luna_call_node_new(left, line);
+    number(call);
 
     // args? ')'
     if (!is(RPAREN)) {
@@ -1009,7 +1044,9 @@ function_stmt(luna_parser_t *self) {
 
   // block
   if (body = block(self)) {
-    return (luna_node_t *) luna_function_node_new(name, type, body, params, line);
+    luna_function_node_t *fn = luna_function_node_new(name, type, body, params, line);
+    number(fn);
+    return (luna_node_t *) fn;
   }
 
   return NULL;
@@ -1049,6 +1086,7 @@ if_stmt(luna_parser_t *self) {
   }
 
   luna_if_node_t *node = luna_if_node_new(negate, cond, body, line);
+  number(node);
 
   // 'else'
   loop:
@@ -1066,7 +1104,9 @@ if_stmt(luna_parser_t *self) {
 
       context("else if statement");
       if (!(body = block(self))) return NULL;
-      luna_vec_push(node->else_ifs, luna_node((luna_node_t *) luna_if_node_new(0, cond, body, line)));
+      luna_if_node_t *else_if = luna_if_node_new(0, cond, body, line);
+      number(else_if);
+      luna_vec_push(node->else_ifs, luna_node((luna_node_t *) else_if));
       goto loop;
     // 'else'
     } else {
@@ -19,6 +19,7 @@ typedef struct {
   char *ctx;
   char *err;
   int in_args;
+  int nodes;
   luna_token_t *tok;
   luna_lexer_t *lex;
 } luna_parser_t;
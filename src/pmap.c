@@ -0,0 +1,455 @@
+
+//
+// pmap.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <string.h>
+#include "pmap.h"
+#include "intern.h"
+#include "slab.h"
+#include "internal.h"
+
+/*
+ * Children of `node`, stored after its pairs.
+ */
+
+#define CHILDREN(node) ((luna_pmap_node_t **) ((node)->entries + (node)->ndata))
+
+/*
+ * Bit of `hash` at the level of `shift`.
+ */
+
+#define BIT(hash, shift) ((uint32_t) 1 << ((hash) >> (shift) & 31))
+
+/*
+ * Index of `bit` among those set in `map`.
+ */
+
+#define INDEX(map, bit) __builtin_popcount((map) & ((bit) - 1))
+
+/*
+ * Check if the level of `shift` only holds colliding hashes.
+ */
+
+#define COLLIDING(shift) ((shift) >= 32)
+
+/*
+ * Size of a node of `ndata` pairs and `nnodes` children.
+ */
+
+static size_t
+size(int ndata, int nnodes) {
+  return sizeof(luna_pmap_node_t)
+    + ndata * sizeof(luna_pmap_entry_t)
+    + nnodes * sizeof(luna_pmap_node_t *);
+}
+
+/*
+ * Allocate a node of `ndata` pairs and `nnodes` children.
+ */
+
+static luna_pmap_node_t *
+alloc(uint32_t datamap, uint32_t nodemap, int ndata, int nnodes) {
+  luna_pmap_node_t *node = luna_slab_alloc(size(ndata, nnodes));
+  node->refs = 1;
+  node->datamap = datamap;
+  node->nodemap = nodemap;
+  node->ndata = ndata;
+  node->nnodes = nnodes;
+  return node;
+}
+
+/*
+ * Reference `node`.
+ */
+
+static luna_pmap_node_t *
+retain(luna_pmap_node_t *node) {
+  __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+  return node;
+}
+
+/*
+ * Drop a reference to `node`, freeing
+ * it and its children with the last.
+ */
+
+static void
+release(luna_pmap_node_t *node) {
+  if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL)) return;
+  luna_pmap_node_t **children = CHILDREN(node);
+  for (int i = 0; i < node->nnodes; ++i) release(children[i]);
+  luna_slab_free(node, size(node->ndata, node->nnodes));
+}
+
+/*
+ * Copy `n` children of `from` to `to`, referencing them.
+ */
+
+static void
+share(luna_pmap_node_t **to, luna_pmap_node_t **from, int n) {
+  for (int i = 0; i < n; ++i) to[i] = retain(from[i]);
+}
+
+/*
+ * Node of the level of `shift` holding pairs `a` and `b`.
+ */
+
+static luna_pmap_node_t *
+pair(luna_pmap_entry_t *a, luna_pmap_entry_t *b, int shift) {
+  if (COLLIDING(shift)) {
+    luna_pmap_node_t *node = alloc(0, 0, 2, 0);
+    node->entries[0] = *a;
+    node->entries[1] = *b;
+    return node;
+  }
+
+  uint32_t x = BIT(a->hash, shift);
+  uint32_t y = BIT(b->hash, shift);
+
+  // same bit, one level down
+  if (x == y) {
+    luna_pmap_node_t *node = alloc(0, x, 0, 1);
+    CHILDREN(node)[0] = pair(a, b, shift + LUNA_PMAP_BITS);
+    return node;
+  }
+
+  luna_pmap_node_t *node = alloc(x | y, 0, 2, 0);
+  node->entries[x < y ? 0 : 1] = *a;
+  node->entries[x < y ? 1 : 0] = *b;
+  return node;
+}
+
+/*
+ * Copy of `node` of the level of `shift` with pair
+ * `entry` stored, setting `added` unless replacing
+ * that of its key.
+ */
+
+static luna_pmap_node_t *
+set(luna_pmap_node_t *node, luna_pmap_entry_t *entry, int shift, int *added) {
+  luna_pmap_node_t **children = CHILDREN(node);
+
+  // colliding hashes
+  if (COLLIDING(shift)) {
+    int i = 0;
+    while (i < node->ndata && node->entries[i].key != entry->key) ++i;
+    *added = i == node->ndata;
+    luna_pmap_node_t *copy = alloc(0, 0, node->ndata + *added, 0);
+    memcpy(copy->entries, node->entries, node->ndata * sizeof(luna_pmap_entry_t));
+    copy->entries[i] = *entry;
+    return copy;
+  }
+
+  uint32_t bit = BIT(entry->hash, shift);
+
+  // pair of this level
+  if (node->datamap & bit) {
+    int i = INDEX(node->datamap, bit);
+    luna_pmap_entry_t *other = &node->entries[i];
+
+    // replaced
+    if (other->key == entry->key) {
+      *added = 0;
+      luna_pmap_node_t *copy = alloc(node->datamap, node->nodemap, node->ndata, node->nnodes);
+      memcpy(copy->entries, node->entries, node->ndata * sizeof(luna_pmap_entry_t));
+      copy->entries[i] = *entry;
+      share(CHILDREN(copy), children, node->nnodes);
+      return copy;
+    }
+
+    // pushed down with the other pair
+    *added = 1;
+    int j = INDEX(node->nodemap, bit);
+    luna_pmap_node_t *copy = alloc(node->datamap ^ bit, node->nodemap | bit, node->ndata - 1, node->nnodes + 1);
+    memcpy(copy->entries, node->entries, i * sizeof(luna_pmap_entry_t));
+    memcpy(copy->entries + i, node->entries + i + 1, (node->ndata - i - 1) * sizeof(luna_pmap_entry_t));
+    luna_pmap_node_t **to = CHILDREN(copy);
+    share(to, children, j);
+    to[j] = pair(other, entry, shift + LUNA_PMAP_BITS);
+    share(to + j + 1, children + j, node->nnodes - j);
+    return copy;
+  }
+
+  // child of this level
+  if (node->nodemap & bit) {
+    int j = INDEX(node->nodemap, bit);
+    luna_pmap_node_t *copy = alloc(node->datamap, node->nodemap, node->ndata, node->nnodes);
+    memcpy(copy->entries, node->entries, node->ndata * sizeof(luna_pmap_entry_t));
+    luna_pmap_node_t **to = CHILDREN(copy);
+    share(to, children, node->nnodes);
+    release(to[j]);
+    to[j] = set(children[j], entry, shift + LUNA_PMAP_BITS, added);
+    return copy;
+  }
+
+  // new pair
+  *added = 1;
+  int i = INDEX(node->datamap, bit);
+  luna_pmap_node_t *copy = alloc(node->datamap | bit, node->nodemap, node->ndata + 1, node->nnodes);
+  memcpy(copy->entries, node->entries, i * sizeof(luna_pmap_entry_t));
+  copy->entries[i] = *entry;
+  memcpy(copy->entries + i + 1, node->entries + i, (node->ndata - i) * sizeof(luna_pmap_entry_t));
+  share(CHILDREN(copy), children, node->nnodes);
+  return copy;
+}
+
+/*
+ * Check if `node` holds a single pair and no children,
+ * which its parent then holds in its place.
+ */
+
+static inline int
+single(luna_pmap_node_t *node) {
+  return 1 == node->ndata && !node->nnodes;
+}
+
+/*
+ * Copy of `node` of the level of `shift` without the pair
+ * of `key` of `hash`, NULL once empty. The node itself
+ * is referenced again and `removed` left unset when
+ * it holds no such pair.
+ */
+
+static luna_pmap_node_t *
+drop(luna_pmap_node_t *node, const char *key, uint32_t hash, int shift, int *removed) {
+  luna_pmap_node_t **children = CHILDREN(node);
+
+  // colliding hashes
+  if (COLLIDING(shift)) {
+    int i = 0;
+    while (i < node->ndata && node->entries[i].key != key) ++i;
+    if (i == node->ndata) return retain(node);
+    *removed = 1;
+    if (1 == node->ndata) return NULL;
+    luna_pmap_node_t *copy = alloc(0, 0, node->ndata - 1, 0);
+    memcpy(copy->entries, node->entries, i * sizeof(luna_pmap_entry_t));
+    memcpy(copy->entries + i, node->entries + i + 1, (node->ndata - i - 1) * sizeof(luna_pmap_entry_t));
+    return copy;
+  }
+
+  uint32_t bit = BIT(hash, shift);
+
+  // pair of this level
+  if (node->datamap & bit) {
+    int i = INDEX(node->datamap, bit);
+    if (node->entries[i].key != key) return retain(node);
+    *removed = 1;
+    if (1 == node->ndata && !node->nnodes) return NULL;
+    luna_pmap_node_t *copy = alloc(node->datamap ^ bit, node->nodemap, node->ndata - 1, node->nnodes);
+    memcpy(copy->entries, node->entries, i * sizeof(luna_pmap_entry_t));
+    memcpy(copy->entries + i, node->entries + i + 1, (node->ndata - i - 1) * sizeof(luna_pmap_entry_t));
+    share(CHILDREN(copy), children, node->nnodes);
+    return copy;
+  }
+
+  if (!(node->nodemap & bit)) return retain(node);
+
+  // child of this level
+  int j = INDEX(node->nodemap, bit);
+  luna_pmap_node_t *child = drop(children[j], key, hash, shift + LUNA_PMAP_BITS, removed);
+  if (child == children[j]) {
+    release(child);
+    return retain(node);
+  }
+
+  // the child's last pair moves up to this level
+  if (!child || single(child)) {
+    if (!child && !node->ndata && 1 == node->nnodes) return NULL;
+    int add = !!child;
+    int i = INDEX(node->datamap, bit);
+    luna_pmap_node_t *copy = alloc(node->datamap | (add ? bit : 0), node->nodemap ^ bit, node->ndata + add, node->nnodes - 1);
+    memcpy(copy->entries, node->entries, i * sizeof(luna_pmap_entry_t));
+    if (add) copy->entries[i] = child->entries[0];
+    memcpy(copy->entries + i + add, node->entries + i, (node->ndata - i) * sizeof(luna_pmap_entry_t));
+    luna_pmap_node_t **to = CHILDREN(copy);
+    share(to, children, j);
+    share(to + j, children + j + 1, node->nnodes - j - 1);
+    if (child) release(child);
+    return copy;
+  }
+
+  luna_pmap_node_t *copy = alloc(node->datamap, node->nodemap, node->ndata, node->nnodes);
+  memcpy(copy->entries, node->entries, node->ndata * sizeof(luna_pmap_entry_t));
+  luna_pmap_node_t **to = CHILDREN(copy);
+  share(to, children, node->nnodes);
+  release(to[j]);
+  to[j] = child;
+  return copy;
+}
+
+/*
+ * Allocate a map of `size` pairs rooted at `root`.
+ */
+
+static luna_pmap_t *
+map(luna_pmap_node_t *root, size_t size) {
+  luna_pmap_t *self = luna_slab_alloc(sizeof(luna_pmap_t));
+  if (unlikely(!self)) return NULL;
+  self->refs = 1;
+  self->size = size;
+  self->root = root;
+  return self;
+}
+
+/*
+ * Alloc an empty map.
+ */
+
+luna_pmap_t *
+luna_pmap_new() {
+  return map(NULL, 0);
+}
+
+/*
+ * Reference `self`, sharing it with
+ * whoever is handed the reference.
+ */
+
+luna_pmap_t *
+luna_pmap_retain(luna_pmap_t *self) {
+  __atomic_add_fetch(&self->refs, 1, __ATOMIC_RELAXED);
+  return self;
+}
+
+/*
+ * Drop a reference to `self`, freeing it with the
+ * last along with the nodes no other map shares.
+ */
+
+void
+luna_pmap_release(luna_pmap_t *self) {
+  if (__atomic_sub_fetch(&self->refs, 1, __ATOMIC_ACQ_REL)) return;
+  if (self->root) release(self->root);
+  luna_slab_free(self, sizeof(luna_pmap_t));
+}
+
+/*
+ * Return the pair of `key` in `self`, or NULL.
+ */
+
+static luna_pmap_entry_t *
+lookup(luna_pmap_t *self, const char *key) {
+  luna_pmap_node_t *node = self->root;
+  uint32_t hash = luna_string_hash(key);
+  int shift = 0;
+
+  while (node) {
+    if (COLLIDING(shift)) {
+      for (int i = 0; i < node->ndata; ++i) {
+        if (node->entries[i].key == key) return &node->entries[i];
+      }
+      return NULL;
+    }
+
+    uint32_t bit = BIT(hash, shift);
+    if (node->datamap & bit) {
+      luna_pmap_entry_t *entry = &node->entries[INDEX(node->datamap, bit)];
+      return entry->key == key ? entry : NULL;
+    }
+    if (!(node->nodemap & bit)) return NULL;
+    node = CHILDREN(node)[INDEX(node->nodemap, bit)];
+    shift += LUNA_PMAP_BITS;
+  }
+
+  return NULL;
+}
+
+/*
+ * Return the value of interned `key` in `self`, or nil.
+ */
+
+luna_value_t
+luna_pmap_get(luna_pmap_t *self, const char *key) {
+  luna_assert_interned(key);
+  luna_pmap_entry_t *entry = lookup(self, key);
+  return entry ? entry->val : LUNA_VALUE_NIL;
+}
+
+/*
+ * Check if `self` has interned `key`.
+ */
+
+int
+luna_pmap_has(luna_pmap_t *self, const char *key) {
+  luna_assert_interned(key);
+  return !!lookup(self, key);
+}
+
+/*
+ * Return a map of the pairs of `self` with interned
+ * `key` set to `val`, `self` left untouched.
+ */
+
+luna_pmap_t *
+luna_pmap_set(luna_pmap_t *self, const char *key, luna_value_t val) {
+  luna_assert_interned(key);
+  luna_pmap_entry_t entry = { key, luna_string_hash(key), val };
+
+  if (!self->root) {
+    luna_pmap_node_t *root = alloc(BIT(entry.hash, 0), 0, 1, 0);
+    root->entries[0] = entry;
+    return map(root, 1);
+  }
+
+  int added = 0;
+  luna_pmap_node_t *root = set(self->root, &entry, 0, &added);
+  return map(root, self->size + added);
+}
+
+/*
+ * Return a map of the pairs of `self` without interned
+ * `key`, `self` left untouched.
+ */
+
+luna_pmap_t *
+luna_pmap_remove(luna_pmap_t *self, const char *key) {
+  luna_assert_interned(key);
+  if (!self->root) return map(NULL, 0);
+  int removed = 0;
+  luna_pmap_node_t *root = drop(self->root, key, luna_string_hash(key), 0, &removed);
+  return map(root, self->size - removed);
+}
+
+/*
+ * Initialize `self` to iterate `map`.
+ */
+
+void
+luna_pmap_cursor_init(luna_pmap_cursor_t *self, luna_pmap_t *map) {
+  self->depth = map->root ? 0 : -1;
+  self->nodes[0] = map->root;
+  self->entry[0] = self->child[0] = 0;
+}
+
+/*
+ * Advance `self` to the next pair, populating
+ * `slot` and `val`, or return 0 when done.
+ */
+
+int
+luna_pmap_next(luna_pmap_cursor_t *self, const char **slot, luna_value_t *val) {
+  while (self->depth >= 0) {
+    int d = self->depth;
+    luna_pmap_node_t *node = self->nodes[d];
+
+    if (self->entry[d] < node->ndata) {
+      luna_pmap_entry_t *entry = &node->entries[self->entry[d]++];
+      *slot = entry->key;
+      *val = entry->val;
+      return 1;
+    }
+
+    if (self->child[d] < node->nnodes) {
+      self->nodes[++self->depth] = CHILDREN(node)[self->child[d]++];
+      self->entry[d + 1] = self->child[d + 1] = 0;
+      continue;
+    }
+
+    --self->depth;
+  }
+
+  return 0;
+}
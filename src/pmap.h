@@ -0,0 +1,135 @@
+
+//
+// pmap.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_PMAP_H
+#define LUNA_PMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "value.h"
+
+/*
+ * Bits of the hash consumed by each level.
+ */
+
+#define LUNA_PMAP_BITS 5
+
+/*
+ * Levels of a map, the last one holding
+ * the keys whose hashes collide.
+ */
+
+#define LUNA_PMAP_DEPTH (32 / LUNA_PMAP_BITS + 2)
+
+/*
+ * Key / value pair with the hash of its key.
+ */
+
+typedef struct {
+  const char *key;
+  uint32_t hash;
+  luna_value_t val;
+} luna_pmap_entry_t;
+
+/*
+ * Node of a hash array mapped trie, holding the pairs
+ * whose hash bits at its level are set in `datamap`,
+ * and `nodemap` those with a child node of their own,
+ * stored after the pairs. Nodes past the last level
+ * hold pairs of colliding hashes, with no bitmaps.
+ * Nodes are immutable and shared between the maps
+ * referencing them, until `refs` drops to zero.
+ */
+
+typedef struct luna_pmap_node {
+  int refs;
+  uint32_t datamap;
+  uint32_t nodemap;
+  int ndata;
+  int nnodes;
+  luna_pmap_entry_t entries[];
+} luna_pmap_node_t;
+
+/*
+ * Persistent map of string keys to values.
+ *
+ * Updates return a new map, copying only the nodes on
+ * the path to the key, so that keeping or handing out
+ * a version of a map costs a reference, and readers
+ * on other threads need no locking. Keys must be interned,
+ * they are hashed by their cached hash and compared by
+ * pointer, see luna_assert_interned().
+ */
+
+typedef struct {
+  int refs;
+  size_t size;
+  luna_pmap_node_t *root;
+} luna_pmap_t;
+
+/*
+ * Iteration state of a map.
+ */
+
+typedef struct {
+  luna_pmap_node_t *nodes[LUNA_PMAP_DEPTH];
+  int entry[LUNA_PMAP_DEPTH];
+  int child[LUNA_PMAP_DEPTH];
+  int depth;
+} luna_pmap_cursor_t;
+
+/*
+ * Map size.
+ */
+
+#define luna_pmap_size(self) ((self)->size)
+
+/*
+ * Iterate map slots and values, populating
+ * `slot` and `val`.
+ */
+
+#define luna_pmap_each(self, block) { \
+    const char *slot; \
+    luna_value_t val; \
+    luna_pmap_cursor_t cursor; \
+    luna_pmap_cursor_init(&cursor, self); \
+    while (luna_pmap_next(&cursor, &slot, &val)) { \
+      block; \
+    } \
+  }
+
+// protos
+
+luna_pmap_t *
+luna_pmap_new();
+
+luna_pmap_t *
+luna_pmap_retain(luna_pmap_t *self);
+
+void
+luna_pmap_release(luna_pmap_t *self);
+
+luna_value_t
+luna_pmap_get(luna_pmap_t *self, const char *key);
+
+int
+luna_pmap_has(luna_pmap_t *self, const char *key);
+
+luna_pmap_t *
+luna_pmap_set(luna_pmap_t *self, const char *key, luna_value_t val);
+
+luna_pmap_t *
+luna_pmap_remove(luna_pmap_t *self, const char *key);
+
+void
+luna_pmap_cursor_init(luna_pmap_cursor_t *self, luna_pmap_t *map);
+
+int
+luna_pmap_next(luna_pmap_cursor_t *self, const char **slot, luna_value_t *val);
+
+#endif /* LUNA_PMAP_H */
@@ -112,7 +112,7 @@ visit_block(luna_visitor_t *self, luna_block_node_t *node) {
   luna_vec_each(node->stmts, {
     if (i) print_func("\n");
     INDENT;
-    visit((luna_node_t *) val->value.as_pointer);
+    visit((luna_node_t *) luna_as_pointer(val));
     if (!indents) print_func("\n");
   });
 }
@@ -155,7 +155,7 @@ visit_decl(luna_visitor_t *self, luna_decl_node_t *node) {
   luna_vec_each(node->vec, {
     print_func("\n");
     INDENT;
-    visit((luna_node_t *) val->value.as_pointer);
+    visit((luna_node_t *) luna_as_pointer(val));
   });
 
   if (node->type) {
@@ -179,7 +179,7 @@ visit_let(luna_visitor_t *self, luna_let_node_t *node) {
   indents++;
 
   luna_vec_each(node->vec, {
-    luna_binary_op_node_t *bin = (luna_binary_op_node_t *) val->value.as_pointer;
+    luna_binary_op_node_t *bin = (luna_binary_op_node_t *) luna_as_pointer(val);
 
     print_func("\n");
     INDENT;
@@ -252,7 +252,7 @@ visit_array(luna_visitor_t *self, luna_array_node_t *node) {
   ++indents;
   luna_vec_each(node->vals, {
     INDENT;
-    visit((luna_node_t *) val->value.as_pointer);
+    visit((luna_node_t *) luna_as_pointer(val));
     if (i != len - 1) print_func("\n");
   });
   --indents;
@@ -269,9 +269,9 @@ visit_hash(luna_visitor_t *self, luna_hash_node_t *node) {
   ++indents;
   luna_vec_each(node->pairs, {
     INDENT;
-    visit(((luna_hash_pair_node_t *)val->value.as_pointer)->key);
+    visit(((luna_hash_pair_node_t *)luna_as_pointer(val))->key);
     print_func(": ");
-    visit(((luna_hash_pair_node_t *)val->value.as_pointer)->val);
+    visit(((luna_hash_pair_node_t *)luna_as_pointer(val))->val);
     print_func("\n");
   });
   --indents;
@@ -326,13 +326,13 @@ visit_call(luna_visitor_t *self, luna_call_node_t * node) {
     print_func("\n");
     INDENT;
     luna_vec_each(node->args->vec, {
-      visit((luna_node_t *) val->value.as_pointer);
+      visit((luna_node_t *) luna_as_pointer(val));
       if (i != len - 1) print_func(" ");
     });
 
     luna_hash_each(node->args->hash, {
       print_func(" %s: ", slot);
-      visit((luna_node_t *) val->value.as_pointer);
+      visit((luna_node_t *) luna_as_pointer(val));
     });
   }
   --indents;
@@ -345,7 +345,11 @@ visit_call(luna_visitor_t *self, luna_call_node_t * node) {
 
 static void
 visit_function(luna_visitor_t *self, luna_function_node_t * node) {
-  print_func("(function %s -> ", node->name);
+  if (node->name) {
+    print_func("(function %s -> ", node->name);
+  } else {
+    print_func("(function -> ");
+  }
   ++indents;
 
   if (node->type) {
@@ -355,7 +359,7 @@ visit_function(luna_visitor_t *self, luna_function_node_t * node) {
   luna_vec_each(node->params, {
     print_func("\n");
     INDENT;
-    visit((luna_node_t *) val->value.as_pointer);
+    visit((luna_node_t *) luna_as_pointer(val));
   });
   --indents;
   print_func("\n");
@@ -376,7 +380,7 @@ visit_type(luna_visitor_t *self, luna_type_node_t *node) {
   luna_vec_each(node->fields, {
     print_func("\n");
     INDENT;
-    visit((luna_node_t *) val->value.as_pointer);
+    visit((luna_node_t *) luna_as_pointer(val));
   });
   --indents;
   print_func(")");
@@ -432,7 +436,7 @@ visit_if(luna_visitor_t *self, luna_if_node_t *node) {
 
   // else ifs
   luna_vec_each(node->else_ifs, {
-    luna_if_node_t *else_if = (luna_if_node_t *) val->value.as_pointer;
+    luna_if_node_t *else_if = (luna_if_node_t *) luna_as_pointer(val);
     print_func("\n");
     INDENT;
     print_func("(else if ");
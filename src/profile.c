@@ -0,0 +1,191 @@
+
+//
+// profile.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "profile.h"
+
+/*
+ * File magic, followed by the format version.
+ */
+
+#define MAGIC "LUNP"
+#define VERSION 1
+
+/*
+ * Allocate a new profile.
+ */
+
+luna_profile_t *
+luna_profile_new() {
+  luna_profile_t *self = malloc(sizeof(luna_profile_t));
+  if (!self) return NULL;
+  self->counts = kh_init(counts);
+  return self;
+}
+
+/*
+ * Add `n` to the counter of `key`.
+ */
+
+void
+luna_profile_add(luna_profile_t *self, uint64_t key, uint64_t n) {
+  int ret;
+  khiter_t k = kh_put(counts, self->counts, key, &ret);
+  if (ret) kh_value(self->counts, k) = 0;
+  kh_value(self->counts, k) += n;
+}
+
+/*
+ * Return the counter of `key`.
+ */
+
+uint64_t
+luna_profile_count(luna_profile_t *self, uint64_t key) {
+  khiter_t k = kh_get(counts, self->counts, key);
+  return k == kh_end(self->counts) ? 0 : kh_value(self->counts, k);
+}
+
+/*
+ * Return the hottest counter of `kind` for node `id`, populating
+ * `extra` with its extra bits and `total` with the sum of them all.
+ */
+
+uint64_t
+luna_profile_dominant(luna_profile_t *self, int kind, int id, uint32_t *extra, uint64_t *total) {
+  uint64_t prefix = LUNA_PROFILE_KEY(kind, id, 0);
+  uint64_t max = 0;
+  *total = 0;
+
+  for (khiter_t k = kh_begin(self->counts); k != kh_end(self->counts); ++k) {
+    if (!kh_exist(self->counts, k)) continue;
+    uint64_t key = kh_key(self->counts, k);
+    uint64_t n = kh_value(self->counts, k);
+    if ((key & ~(uint64_t) 0xffffffff) != prefix) continue;
+    *total += n;
+    if (n > max) max = n, *extra = (uint32_t) key;
+  }
+
+  return max;
+}
+
+/*
+ * Write `n` as a varint, seven bits at a time.
+ */
+
+static void
+write_varint(FILE *out, uint64_t n) {
+  while (n >= 0x80) {
+    fputc((int) (n & 0x7f) | 0x80, out);
+    n >>= 7;
+  }
+  fputc((int) n, out);
+}
+
+/*
+ * Read a varint into `n`, returning 0 on a truncated file.
+ */
+
+static int
+read_varint(FILE *in, uint64_t *n) {
+  int c, shift = 0;
+  *n = 0;
+  do {
+    if (EOF == (c = fgetc(in)) || shift > 63) return 0;
+    *n |= (uint64_t) (c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return 1;
+}
+
+/*
+ * Compare keys for qsort().
+ */
+
+static int
+compare(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * Save `self` to `path`. Counters are written sorted by key, each
+ * key as a varint delta from the previous one followed by its
+ * count, so neighbouring counters of a node cost a few bytes.
+ * Returns 0 on failure.
+ */
+
+int
+luna_profile_save(luna_profile_t *self, const char *path) {
+  FILE *out = fopen(path, "wb");
+  if (!out) return 0;
+
+  int n = 0;
+  uint64_t *keys = malloc((kh_size(self->counts) + 1) * sizeof(uint64_t));
+  for (khiter_t k = kh_begin(self->counts); k != kh_end(self->counts); ++k) {
+    if (kh_exist(self->counts, k)) keys[n++] = kh_key(self->counts, k);
+  }
+  qsort(keys, n, sizeof(uint64_t), compare);
+
+  fputs(MAGIC, out);
+  fputc(VERSION, out);
+  write_varint(out, n);
+
+  uint64_t prev = 0;
+  for (int i = 0; i < n; ++i) {
+    write_varint(out, keys[i] - prev);
+    write_varint(out, luna_profile_count(self, keys[i]));
+    prev = keys[i];
+  }
+
+  free(keys);
+  return 0 == fclose(out);
+}
+
+/*
+ * Load the profile at `path`, adding its counters to those
+ * of `self` so that several runs may be merged. Returns 0
+ * when it cannot be read or is not a profile.
+ */
+
+int
+luna_profile_load(luna_profile_t *self, const char *path) {
+  char magic[sizeof(MAGIC)] = { 0 };
+  uint64_t n, key = 0;
+  FILE *in = fopen(path, "rb");
+  if (!in) return 0;
+
+  if (1 != fread(magic, sizeof(MAGIC) - 1, 1, in)
+    || strcmp(MAGIC, magic)
+    || VERSION != fgetc(in)
+    || !read_varint(in, &n)) goto error;
+
+  for (uint64_t i = 0; i < n; ++i) {
+    uint64_t delta, count;
+    if (!read_varint(in, &delta) || !read_varint(in, &count)) goto error;
+    luna_profile_add(self, key += delta, count);
+  }
+
+  fclose(in);
+  return 1;
+
+error:
+  fclose(in);
+  return 0;
+}
+
+/*
+ * Free the profile.
+ */
+
+void
+luna_profile_free(luna_profile_t *self) {
+  kh_destroy(counts, self->counts);
+  free(self);
+}
@@ -0,0 +1,92 @@
+
+//
+// profile.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_PROFILE_H
+#define LUNA_PROFILE_H
+
+#include <stdint.h>
+#include "khash.h"
+
+/*
+ * Kinds of profile counters.
+ *
+ *   ENTRY   calls of the function
+ *   BRANCH  evaluations of the condition of an `if`
+ *   TAKEN   entries into the block of an `if`
+ *   SITE    calls of a polymorphic site with a type tuple
+ */
+
+#define LUNA_PROFILE_ENTRY 1
+#define LUNA_PROFILE_BRANCH 2
+#define LUNA_PROFILE_TAKEN 3
+#define LUNA_PROFILE_SITE 4
+
+/*
+ * Key of the counter of `kind` for the node numbered `id`
+ * by the parser, `extra` holding the type tuple of sites.
+ *
+ *   8      24       32
+ * +-------------------+
+ * | kind | id | extra |
+ * +-------------------+
+ */
+
+#define LUNA_PROFILE_KEY(kind, id, extra) \
+  ( (uint64_t) (kind) << 56 \
+  | (uint64_t) ((id) & 0xffffff) << 32 \
+  | (uint32_t) (extra) )
+
+/*
+ * Arguments of the widest type tuple fitting
+ * a key, sites passing more are not profiled.
+ */
+
+#define LUNA_PROFILE_ARGS 7
+
+/*
+ * Count at which a node is considered hot.
+ */
+
+#define LUNA_PROFILE_HOT 64
+
+// counts by key
+
+KHASH_MAP_INIT_INT64(counts, uint64_t);
+
+/*
+ * Execution profile, persisted between runs so that
+ * codegen may optimize for the behaviour observed.
+ */
+
+typedef struct {
+  khash_t(counts) *counts;
+} luna_profile_t;
+
+// protos
+
+luna_profile_t *
+luna_profile_new();
+
+void
+luna_profile_add(luna_profile_t *self, uint64_t key, uint64_t n);
+
+uint64_t
+luna_profile_count(luna_profile_t *self, uint64_t key);
+
+uint64_t
+luna_profile_dominant(luna_profile_t *self, int kind, int id, uint32_t *extra, uint64_t *total);
+
+int
+luna_profile_save(luna_profile_t *self, const char *path);
+
+int
+luna_profile_load(luna_profile_t *self, const char *path);
+
+void
+luna_profile_free(luna_profile_t *self);
+
+#endif /* LUNA_PROFILE_H */
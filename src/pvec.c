@@ -0,0 +1,235 @@
+
+//
+// pvec.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <string.h>
+#include "pvec.h"
+#include "slab.h"
+#include "internal.h"
+
+/*
+ * Slot of index `i` at the level of `shift`.
+ */
+
+#define SLOT(i, shift) ((i) >> (shift) & (LUNA_PVEC_WIDTH - 1))
+
+/*
+ * Allocate an empty node.
+ */
+
+static luna_pvec_node_t *
+alloc() {
+  luna_pvec_node_t *node = luna_slab_alloc(sizeof(luna_pvec_node_t));
+  node->refs = 1;
+  memset(&node->slots, 0, sizeof(node->slots));
+  return node;
+}
+
+/*
+ * Reference `node`.
+ */
+
+static luna_pvec_node_t *
+retain(luna_pvec_node_t *node) {
+  __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+  return node;
+}
+
+/*
+ * Drop a reference to `node` of the level of `shift`,
+ * freeing it and its children with the last.
+ */
+
+static void
+release(luna_pvec_node_t *node, int shift) {
+  if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL)) return;
+  if (shift) {
+    for (int i = 0; i < LUNA_PVEC_WIDTH; ++i) {
+      if (node->slots.children[i]) release(node->slots.children[i], shift - LUNA_PVEC_BITS);
+    }
+  }
+  luna_slab_free(node, sizeof(luna_pvec_node_t));
+}
+
+/*
+ * Copy of `node` of the level of `shift`, or an
+ * empty node when NULL, referencing its children.
+ */
+
+static luna_pvec_node_t *
+copy(luna_pvec_node_t *node, int shift) {
+  luna_pvec_node_t *self = alloc();
+  if (!node) return self;
+  self->slots = node->slots;
+  if (shift) {
+    for (int i = 0; i < LUNA_PVEC_WIDTH; ++i) {
+      if (self->slots.children[i]) retain(self->slots.children[i]);
+    }
+  }
+  return self;
+}
+
+/*
+ * Copy of `node` of the level of `shift` with `val`
+ * stored at index `i`, creating the missing nodes.
+ */
+
+static luna_pvec_node_t *
+assoc(luna_pvec_node_t *node, int shift, size_t i, luna_value_t val) {
+  luna_pvec_node_t *self = copy(node, shift);
+  if (!shift) {
+    self->slots.vals[SLOT(i, 0)] = val;
+    return self;
+  }
+
+  luna_pvec_node_t **child = &self->slots.children[SLOT(i, shift)];
+  luna_pvec_node_t *prev = *child;
+  *child = assoc(prev, shift - LUNA_PVEC_BITS, i, val);
+  if (prev) release(prev, shift - LUNA_PVEC_BITS);
+  return self;
+}
+
+/*
+ * Copy of `node` of the level of `shift` without index
+ * `i`, its last, or NULL once empty.
+ */
+
+static luna_pvec_node_t *
+dissoc(luna_pvec_node_t *node, int shift, size_t i) {
+  int slot = SLOT(i, shift);
+  if (!slot && !(i & ((1 << shift) - 1))) return NULL;
+
+  luna_pvec_node_t *self = copy(node, shift);
+  if (!shift) {
+    self->slots.vals[slot] = LUNA_VALUE_NIL;
+    return self;
+  }
+
+  luna_pvec_node_t **child = &self->slots.children[slot];
+  luna_pvec_node_t *prev = *child;
+  *child = dissoc(prev, shift - LUNA_PVEC_BITS, i);
+  release(prev, shift - LUNA_PVEC_BITS);
+  return self;
+}
+
+/*
+ * Allocate a vector of `length` values rooted at `root`.
+ */
+
+static luna_pvec_t *
+vector(luna_pvec_node_t *root, int shift, size_t length) {
+  luna_pvec_t *self = luna_slab_alloc(sizeof(luna_pvec_t));
+  if (unlikely(!self)) return NULL;
+  self->refs = 1;
+  self->shift = shift;
+  self->length = length;
+  self->root = root;
+  return self;
+}
+
+/*
+ * Alloc an empty vector.
+ */
+
+luna_pvec_t *
+luna_pvec_new() {
+  return vector(NULL, 0, 0);
+}
+
+/*
+ * Reference `self`, sharing it with
+ * whoever is handed the reference.
+ */
+
+luna_pvec_t *
+luna_pvec_retain(luna_pvec_t *self) {
+  __atomic_add_fetch(&self->refs, 1, __ATOMIC_RELAXED);
+  return self;
+}
+
+/*
+ * Drop a reference to `self`, freeing it with the
+ * last along with the nodes no other vector shares.
+ */
+
+void
+luna_pvec_release(luna_pvec_t *self) {
+  if (__atomic_sub_fetch(&self->refs, 1, __ATOMIC_ACQ_REL)) return;
+  if (self->root) release(self->root, self->shift);
+  luna_slab_free(self, sizeof(luna_pvec_t));
+}
+
+/*
+ * Return the value at `i`, nil when out of bounds.
+ */
+
+luna_value_t
+luna_pvec_at(luna_pvec_t *self, int i) {
+  if (i < 0 || i >= self->length) return LUNA_VALUE_NIL;
+  luna_pvec_node_t *node = self->root;
+  for (int shift = self->shift; shift; shift -= LUNA_PVEC_BITS) {
+    node = node->slots.children[SLOT(i, shift)];
+  }
+  return node->slots.vals[SLOT(i, 0)];
+}
+
+/*
+ * Return a vector of the values of `self` with that at
+ * `i` replaced by `val`, `self` itself referenced
+ * again when out of bounds.
+ */
+
+luna_pvec_t *
+luna_pvec_set(luna_pvec_t *self, int i, luna_value_t val) {
+  if (i < 0 || i >= self->length) return luna_pvec_retain(self);
+  return vector(assoc(self->root, self->shift, i, val), self->shift, self->length);
+}
+
+/*
+ * Return a vector of the values of `self` followed
+ * by `val`, `self` left untouched.
+ */
+
+luna_pvec_t *
+luna_pvec_push(luna_pvec_t *self, luna_value_t val) {
+  size_t i = self->length;
+  int shift = self->shift;
+
+  // full, the root becomes the first child of a new one
+  if (self->root && i == (size_t) 1 << (shift + LUNA_PVEC_BITS)) {
+    luna_pvec_node_t *root = alloc();
+    root->slots.children[0] = retain(self->root);
+    shift += LUNA_PVEC_BITS;
+    luna_pvec_node_t *pushed = assoc(root, shift, i, val);
+    release(root, shift);
+    return vector(pushed, shift, i + 1);
+  }
+
+  return vector(assoc(self->root, shift, i, val), shift, i + 1);
+}
+
+/*
+ * Return a vector of the values of `self` but
+ * its last, `self` left untouched.
+ */
+
+luna_pvec_t *
+luna_pvec_pop(luna_pvec_t *self) {
+  if (self->length <= 1) return vector(NULL, 0, 0);
+  size_t i = self->length - 1;
+  int shift = self->shift;
+  luna_pvec_node_t *root = dissoc(self->root, shift, i);
+
+  // a root left with a single child is replaced by it
+  if (shift && !root->slots.children[1]) {
+    luna_pvec_node_t *child = retain(root->slots.children[0]);
+    release(root, shift);
+    root = child;
+    shift -= LUNA_PVEC_BITS;
+  }
+
+  return vector(root, shift, i);
+}
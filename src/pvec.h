@@ -0,0 +1,102 @@
+
+//
+// pvec.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_PVEC_H
+#define LUNA_PVEC_H
+
+#include <stddef.h>
+#include "value.h"
+
+/*
+ * Bits of the index consumed by each level.
+ */
+
+#define LUNA_PVEC_BITS 5
+
+/*
+ * Slots of each node.
+ */
+
+#define LUNA_PVEC_WIDTH (1 << LUNA_PVEC_BITS)
+
+/*
+ * Node of a radix balanced tree. Branches hold the
+ * children of each LUNA_PVEC_WIDTH wide range of
+ * indices, NULL past the last, and leaves the
+ * values. Nodes are immutable and shared between
+ * the vectors referencing them, until `refs`
+ * drops to zero.
+ */
+
+typedef struct luna_pvec_node {
+  int refs;
+  union {
+    struct luna_pvec_node *children[LUNA_PVEC_WIDTH];
+    luna_value_t vals[LUNA_PVEC_WIDTH];
+  } slots;
+} luna_pvec_node_t;
+
+/*
+ * Persistent vector of `length` values, in a tree
+ * whose root indexes bits `shift` and up.
+ *
+ * Updates return a new vector, copying only the nodes
+ * on the path to the index, so that keeping or handing
+ * out a version of a vector costs a reference, and
+ * readers on other threads need no locking.
+ */
+
+typedef struct {
+  int refs;
+  int shift;
+  size_t length;
+  luna_pvec_node_t *root;
+} luna_pvec_t;
+
+/*
+ * Return the vector length.
+ */
+
+#define luna_pvec_length(self) ((self)->length)
+
+/*
+ * Iterate the vector, populating `i` and `val`.
+ */
+
+#define luna_pvec_each(self, block) { \
+    luna_value_t val; \
+    int len = luna_pvec_length(self); \
+    for (int i = 0; i < len; ++i) { \
+      val = luna_pvec_at(self, i); \
+      block; \
+    } \
+  }
+
+// protos
+
+luna_pvec_t *
+luna_pvec_new();
+
+luna_pvec_t *
+luna_pvec_retain(luna_pvec_t *self);
+
+void
+luna_pvec_release(luna_pvec_t *self);
+
+luna_value_t
+luna_pvec_at(luna_pvec_t *self, int i);
+
+luna_pvec_t *
+luna_pvec_set(luna_pvec_t *self, int i, luna_value_t val);
+
+luna_pvec_t *
+luna_pvec_push(luna_pvec_t *self, luna_value_t val);
+
+luna_pvec_t *
+luna_pvec_pop(luna_pvec_t *self);
+
+#endif /* LUNA_PVEC_H */
@@ -0,0 +1,75 @@
+
+//
+// record.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <string.h>
+#include "record.h"
+
+/*
+ * Initialize record `self` of `layout`, its unboxed
+ * fields zero and its values nil.
+ */
+
+void
+luna_record_init(luna_record_t *self, luna_layout_t *layout) {
+  self->layout = layout;
+  memset(self->data, 0, layout->size);
+  for (int i = 0; i < layout->nfields; ++i) {
+    luna_field_t *field = &layout->fields[i];
+    if (LUNA_FIELD_VALUE == field->kind) {
+      LUNA_RECORD_FIELD(self, luna_value_t, field->offset) = LUNA_VALUE_NIL;
+    }
+  }
+}
+
+/*
+ * Return field `name` of `self`, or NULL.
+ */
+
+luna_field_t *
+luna_layout_field(luna_layout_t *self, const char *name) {
+  for (int i = 0; i < self->nfields; ++i) {
+    if (0 == strcmp(name, self->fields[i].name)) return &self->fields[i];
+  }
+  return NULL;
+}
+
+/*
+ * Boxed value of `field` of `self`.
+ */
+
+luna_value_t
+luna_record_get(luna_record_t *self, luna_field_t *field) {
+  luna_value_t rec = luna_value_pointer(LUNA_TYPE_RECORD, self);
+  switch (field->kind) {
+    case LUNA_FIELD_INT: return luna_record_geti(rec, field->offset);
+    case LUNA_FIELD_FLOAT: return luna_record_getf(rec, field->offset);
+    default: return luna_record_getv(rec, field->offset);
+  }
+}
+
+/*
+ * Store `val` converted to unboxed `field` of `self` and
+ * return NULL. The location of value fields is returned
+ * instead, for the caller to store through its write
+ * barrier.
+ */
+
+luna_value_t *
+luna_record_set(luna_record_t *self, luna_field_t *field, luna_value_t val) {
+  if (luna_record_viewed(self)) return luna_view_store(self, field->offset, val);
+  luna_value_t rec = luna_value_pointer(LUNA_TYPE_RECORD, self);
+  switch (field->kind) {
+    case LUNA_FIELD_INT:
+      luna_record_seti(rec, field->offset, val);
+      return NULL;
+    case LUNA_FIELD_FLOAT:
+      luna_record_setf(rec, field->offset, val);
+      return NULL;
+    default:
+      return &LUNA_RECORD_FIELD(self, luna_value_t, field->offset);
+  }
+}
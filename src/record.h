@@ -0,0 +1,209 @@
+
+//
+// record.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_RECORD_H
+#define LUNA_RECORD_H
+
+#include "object.h"
+
+/*
+ * Storage of a record field, ints and floats are
+ * unboxed, any other type is a value.
+ */
+
+typedef enum {
+  LUNA_FIELD_INT,
+  LUNA_FIELD_FLOAT,
+  LUNA_FIELD_VALUE
+} luna_field_kind;
+
+/*
+ * Layout, defined below.
+ */
+
+typedef struct luna_layout luna_layout_t;
+
+/*
+ * Record field `name` stored at byte `offset`. Value
+ * fields declared of a record type hold records of
+ * `layout` or nil.
+ */
+
+typedef struct {
+  const char *name;
+  luna_field_kind kind;
+  luna_layout_t *layout;
+  int offset;
+} luna_field_t;
+
+/*
+ * Fixed layout of the records of a `type` declaration,
+ * its fields laid out in order as a C compiler would,
+ * each aligned to its size. Records are `size`
+ * bytes past their header.
+ */
+
+struct luna_layout {
+  const char *name;
+  int size;
+  int nfields;
+  luna_field_t *fields;
+};
+
+/*
+ * Luna record. Views of the elements of columnar arrays
+ * are records too, told apart by the low bit of `layout`,
+ * their fields stored in the columns of the array.
+ */
+
+typedef struct {
+  luna_layout_t *layout;
+  char data[];
+} luna_record_t;
+
+/*
+ * Layout bit of views.
+ */
+
+#define LUNA_RECORD_VIEW 1
+
+/*
+ * Check if record `self` is a view.
+ */
+
+#define luna_record_viewed(self) ((uintptr_t) (self)->layout & LUNA_RECORD_VIEW)
+
+/*
+ * Layout of record `self`.
+ */
+
+#define luna_record_layout(self) \
+  ((luna_layout_t *) ((uintptr_t) (self)->layout & ~(uintptr_t) LUNA_RECORD_VIEW))
+
+/*
+ * Size of a record of `layout`.
+ */
+
+#define luna_record_size(layout) (sizeof(luna_record_t) + (layout)->size)
+
+/*
+ * Field of type `t` at `offset` of record `self`.
+ */
+
+#define LUNA_RECORD_FIELD(self, t, offset) (*(t *) ((self)->data + (offset)))
+
+// protos
+
+void
+luna_record_init(luna_record_t *self, luna_layout_t *layout);
+
+luna_field_t *
+luna_layout_field(luna_layout_t *self, const char *name);
+
+luna_value_t
+luna_record_get(luna_record_t *self, luna_field_t *field);
+
+luna_value_t *
+luna_record_set(luna_record_t *self, luna_field_t *field, luna_value_t val);
+
+luna_value_t
+luna_view_load(luna_record_t *self, int offset);
+
+luna_value_t *
+luna_view_store(luna_record_t *self, int offset, luna_value_t val);
+
+/*
+ * Check `val` is a record of `layout`, returning nil otherwise.
+ */
+
+static inline luna_value_t
+luna_record_check(luna_value_t val, luna_layout_t *layout) {
+  if (!luna_is_record(val)) return LUNA_VALUE_NIL;
+  return luna_record_layout((luna_record_t *) luna_as_pointer(val)) == layout ? val : LUNA_VALUE_NIL;
+}
+
+/*
+ * Numeric `val` converted for an int field, 0 otherwise.
+ */
+
+static inline int32_t
+luna_record_int(luna_value_t val) {
+  if (luna_is_int(val)) return luna_as_int(val);
+  return luna_is_float(val) ? (int32_t) luna_as_double(val) : 0;
+}
+
+/*
+ * Numeric `val` converted for a float field, 0 otherwise.
+ */
+
+static inline double
+luna_record_float(luna_value_t val) {
+  if (luna_is_int(val)) return luna_as_int(val);
+  return luna_is_float(val) ? luna_as_double(val) : 0;
+}
+
+/*
+ * Loads at `offset` of `rec`, a record of the layout the
+ * offset was taken from, or nil of which every field
+ * reads as its zero value.
+ */
+
+static inline luna_value_t
+luna_record_geti(luna_value_t rec, int offset) {
+  luna_record_t *self = luna_as_pointer(rec);
+  if (self && luna_record_viewed(self)) return luna_view_load(self, offset);
+  return luna_value_int(self ? LUNA_RECORD_FIELD(self, int32_t, offset) : 0);
+}
+
+static inline luna_value_t
+luna_record_getf(luna_value_t rec, int offset) {
+  luna_record_t *self = luna_as_pointer(rec);
+  if (self && luna_record_viewed(self)) return luna_view_load(self, offset);
+  return luna_value_float(self ? LUNA_RECORD_FIELD(self, double, offset) : 0);
+}
+
+static inline luna_value_t
+luna_record_getv(luna_value_t rec, int offset) {
+  luna_record_t *self = luna_as_pointer(rec);
+  if (!self) return LUNA_VALUE_NIL;
+  if (luna_record_viewed(self)) return luna_view_load(self, offset);
+  return __atomic_load_n(&LUNA_RECORD_FIELD(self, luna_value_t, offset), __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Stores to the unboxed fields at `offset` of `rec`,
+ * ignored when nil.
+ */
+
+static inline void
+luna_record_seti(luna_value_t rec, int offset, luna_value_t val) {
+  luna_record_t *self = luna_as_pointer(rec);
+  if (self && luna_record_viewed(self)) luna_view_store(self, offset, val);
+  else if (self) LUNA_RECORD_FIELD(self, int32_t, offset) = luna_record_int(val);
+}
+
+static inline void
+luna_record_setf(luna_value_t rec, int offset, luna_value_t val) {
+  luna_record_t *self = luna_as_pointer(rec);
+  if (self && luna_record_viewed(self)) luna_view_store(self, offset, val);
+  else if (self) LUNA_RECORD_FIELD(self, double, offset) = luna_record_float(val);
+}
+
+/*
+ * Location of the value field at `offset` of `rec`,
+ * or NULL when nil.
+ */
+
+static inline luna_value_t *
+luna_record_slot(luna_value_t rec, int offset) {
+  luna_record_t *self = luna_as_pointer(rec);
+  if (!self) return NULL;
+  if (luna_record_viewed(self)) return luna_view_store(self, offset, LUNA_VALUE_NIL);
+  return &LUNA_RECORD_FIELD(self, luna_value_t, offset);
+}
+
+#endif /* LUNA_RECORD_H */
@@ -0,0 +1,389 @@
+
+//
+// runtime.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "runtime.h"
+#include "gc.h"
+#include "slab.h"
+#include "internal.h"
+#include "kvec.h"
+
+/*
+ * Header of an object allocated by compiled programs,
+ * `size` bytes including itself.
+ */
+
+typedef struct luna_native_object {
+  struct luna_native_object *next;
+  uint32_t size;
+  uint8_t type;
+  uint8_t marked;
+} luna_native_object_t;
+
+/*
+ * Header of object `ptr`.
+ */
+
+#define HEADER(ptr) ((luna_native_object_t *) (ptr) - 1)
+
+/*
+ * Heap of compiled programs, its objects swept once `live`
+ * bytes exceed `threshold`, sized as that of the vm.
+ */
+
+static struct {
+  luna_native_object_t *objects;
+  size_t live;
+  size_t threshold;
+  kvec_t(luna_native_object_t *) gray;
+} heap = { NULL, 0, LUNA_GC_THRESHOLD };
+
+luna_native_frame_t *luna_native_frames;
+
+/*
+ * Root of the shapes of objects.
+ */
+
+static luna_shape_t *shapes;
+
+/*
+ * Return `val` when it has a printed form, otherwise nil.
+ */
+
+luna_value_t
+luna_result(luna_value_t val) {
+  switch (luna_value_type(val)) {
+    case LUNA_TYPE_INT:
+    case LUNA_TYPE_FLOAT:
+    case LUNA_TYPE_BOOL:
+    case LUNA_TYPE_STRING:
+      return val;
+  }
+  return LUNA_VALUE_NIL;
+}
+
+/*
+ * Mark the unmarked objects of the `n` values of
+ * `vals` gray, static closures are left alone.
+ */
+
+static void
+mark(luna_value_t *vals, int n) {
+  for (int i = 0; i < n; ++i) {
+    if (!luna_gc_collected(vals[i])) continue;
+    void *ptr = luna_as_pointer(vals[i]);
+    if (LUNA_TYPE_FUNCTION == luna_value_type(vals[i])
+      && LUNA_NATIVE_SHARED == ((luna_native_closure_t *) ptr)->nupvalues) continue;
+
+    luna_native_object_t *obj = HEADER(ptr);
+    if (obj->marked) continue;
+    obj->marked = 1;
+    kv_push(luna_native_object_t *, heap.gray, obj);
+  }
+}
+
+/*
+ * Mark the references of gray object `obj`.
+ */
+
+static void
+blacken(luna_native_object_t *obj) {
+  switch (obj->type) {
+    case LUNA_TYPE_FUNCTION: {
+      luna_native_closure_t *closure = (luna_native_closure_t *) (obj + 1);
+      mark(closure->upvalues, closure->nupvalues);
+      break;
+    }
+    case LUNA_TYPE_CELL:
+      mark((luna_value_t *) (obj + 1), 1);
+      break;
+    case LUNA_TYPE_OBJECT: {
+      luna_object_t *object = (luna_object_t *) (obj + 1);
+      if (object->dict) {
+        luna_hash_each_val(object->dict, mark(&val, 1));
+      } else {
+        mark(object->slots, object->capacity);
+      }
+      break;
+    }
+    case LUNA_TYPE_RECORD: {
+      luna_record_t *rec = (luna_record_t *) (obj + 1);
+      if (luna_record_viewed(rec)) {
+        mark(&((luna_view_t *) rec)->array, 1);
+        break;
+      }
+      luna_layout_t *layout = rec->layout;
+      for (int i = 0; i < layout->nfields; ++i) {
+        luna_field_t *field = &layout->fields[i];
+        if (LUNA_FIELD_VALUE != field->kind) continue;
+        mark(&LUNA_RECORD_FIELD(rec, luna_value_t, field->offset), 1);
+      }
+      break;
+    }
+    case LUNA_TYPE_ARRAY: {
+      luna_array_t *arr = (luna_array_t *) (obj + 1);
+      if (!arr->layout) {
+        if (LUNA_ARRAY_VALUES == arr->kind) mark(arr->columns[0], arr->length);
+        break;
+      }
+      for (int i = 0; i < arr->layout->nfields; ++i) {
+        if (LUNA_FIELD_VALUE != arr->layout->fields[i].kind) continue;
+        mark(LUNA_ARRAY_COLUMN(arr, luna_value_t, i), arr->length);
+      }
+      break;
+    }
+  }
+}
+
+/*
+ * Mark everything reachable from the registers of the
+ * frames, then free the rest. The next collection is
+ * due once the heap grows by LUNA_GC_GROWTH.
+ */
+
+static void
+collect() {
+  for (luna_native_frame_t *frame = luna_native_frames; frame; frame = frame->prev) {
+    mark(frame->regs, 32);
+  }
+  while (kv_size(heap.gray)) blacken(kv_pop(heap.gray));
+
+  luna_native_object_t **link = &heap.objects;
+  while (*link) {
+    luna_native_object_t *obj = *link;
+    if (obj->marked) {
+      obj->marked = 0;
+      link = &obj->next;
+      continue;
+    }
+
+    *link = obj->next;
+    heap.live -= obj->size;
+    switch (obj->type) {
+      case LUNA_TYPE_OBJECT:
+        luna_hash_destroy(((luna_object_t *) (obj + 1))->dict);
+        break;
+      case LUNA_TYPE_ARRAY:
+        luna_array_destroy((luna_array_t *) (obj + 1));
+        break;
+    }
+    luna_slab_free(obj, obj->size);
+  }
+
+  heap.threshold = heap.live * LUNA_GC_GROWTH;
+  if (heap.threshold < LUNA_GC_THRESHOLD) heap.threshold = LUNA_GC_THRESHOLD;
+}
+
+/*
+ * Allocate a `size` byte object of `type`, collecting
+ * first when due or out of memory, NULL when still
+ * out of memory. The object must be stored to a
+ * register before the next allocation.
+ */
+
+static void *
+allocate(luna_object type, size_t size) {
+  size += sizeof(luna_native_object_t);
+  if (heap.live + size > heap.threshold) collect();
+
+  luna_native_object_t *obj = luna_slab_alloc(size);
+  if (unlikely(!obj)) {
+    collect();
+    if (!(obj = luna_slab_alloc(size))) return NULL;
+  }
+
+  obj->next = heap.objects;
+  obj->size = size;
+  obj->type = type;
+  obj->marked = 0;
+  heap.objects = obj;
+  heap.live += size;
+  return obj + 1;
+}
+
+/*
+ * Allocate a closure of `fn` with room for `nupvalues`
+ * captures, nil until stored.
+ */
+
+luna_native_closure_t *
+luna_native_closure(luna_function_t *fn, int nupvalues) {
+  luna_native_closure_t *self = allocate(LUNA_TYPE_FUNCTION, sizeof(luna_native_closure_t) + nupvalues * sizeof(luna_value_t));
+  if (unlikely(!self)) return NULL;
+  self->fn = fn;
+  self->nupvalues = nupvalues;
+  for (int i = 0; i < nupvalues; ++i) self->upvalues[i] = LUNA_VALUE_NIL;
+  return self;
+}
+
+/*
+ * Move `val` into a cell of its own.
+ */
+
+void
+luna_native_box(luna_value_t *val) {
+  luna_value_t *cell = allocate(LUNA_TYPE_CELL, sizeof(luna_value_t));
+  if (unlikely(!cell)) return;
+  *cell = *val;
+  *val = luna_value_pointer(LUNA_TYPE_CELL, cell);
+}
+
+/*
+ * Call closure `callee` with the `nargs` arguments following
+ * it, nil when it is not a function or does not accept them.
+ */
+
+luna_value_t
+luna_native_apply(luna_value_t *callee, int nargs) {
+  if (LUNA_TYPE_FUNCTION != luna_value_type(*callee)) return LUNA_VALUE_NIL;
+  luna_native_closure_t *closure = (luna_native_closure_t *) luna_as_pointer(*callee);
+  luna_function_t *fn = closure->fn;
+  if (!luna_accepts(fn->params, fn->nparams, fn->nrequired, callee + 1, nargs)) return LUNA_VALUE_NIL;
+  return fn->call(callee + 1, nargs, closure->upvalues);
+}
+
+/*
+ * Allocate an empty object with `capacity` slots.
+ */
+
+luna_value_t
+luna_native_object(int capacity) {
+  if (!shapes) shapes = luna_shape_new();
+  luna_object_t *self = allocate(LUNA_TYPE_OBJECT, luna_object_size(capacity));
+  if (unlikely(!self)) return LUNA_VALUE_NIL;
+  luna_object_init(self, shapes, capacity);
+  return luna_value_pointer(LUNA_TYPE_OBJECT, self);
+}
+
+/*
+ * Allocate a record of `layout`.
+ */
+
+luna_value_t
+luna_native_record(luna_layout_t *layout) {
+  luna_record_t *self = allocate(LUNA_TYPE_RECORD, luna_record_size(layout));
+  if (unlikely(!self)) return LUNA_VALUE_NIL;
+  luna_record_init(self, layout);
+  return luna_value_pointer(LUNA_TYPE_RECORD, self);
+}
+
+/*
+ * Allocate a columnar array of `length` records of `layout`.
+ */
+
+luna_value_t
+luna_native_array(luna_layout_t *layout, luna_value_t length) {
+  int n = luna_record_int(length);
+  luna_array_t *self = allocate(LUNA_TYPE_ARRAY, luna_array_size(layout));
+  if (unlikely(!self)) return LUNA_VALUE_NIL;
+  luna_array_init(self, layout, n < 0 ? 0 : n);
+  return luna_value_pointer(LUNA_TYPE_ARRAY, self);
+}
+
+/*
+ * Allocate an empty packed array with room
+ * for `capacity` elements.
+ */
+
+luna_value_t
+luna_native_list(int capacity) {
+  luna_array_t *self = allocate(LUNA_TYPE_ARRAY, LUNA_ARRAY_PACKED_SIZE);
+  if (unlikely(!self)) return LUNA_VALUE_NIL;
+  luna_array_init_packed(self, capacity);
+  return luna_value_pointer(LUNA_TYPE_ARRAY, self);
+}
+
+/*
+ * Append `val` to packed array `arr`.
+ */
+
+void
+luna_native_append(luna_value_t arr, luna_value_t val) {
+  luna_array_t *self = luna_as_pointer(arr);
+  luna_value_t *ptr = luna_array_put(self, self->length, val);
+  if (ptr) *ptr = val;
+}
+
+/*
+ * Element `index` of `arr`, a view for columnar arrays,
+ * nil unless an array or when out of range.
+ */
+
+luna_value_t
+luna_native_index(luna_value_t arr, luna_value_t index) {
+  int i = luna_is_array(arr) ? luna_array_index(arr, index) : -1;
+  if (i < 0) return LUNA_VALUE_NIL;
+  luna_array_t *array = luna_as_pointer(arr);
+  if (!array->layout) return luna_array_at(array, i);
+  luna_view_t *self = allocate(LUNA_TYPE_RECORD, sizeof(luna_view_t));
+  if (unlikely(!self)) return LUNA_VALUE_NIL;
+  luna_view_init(self, arr, i);
+  return luna_value_pointer(LUNA_TYPE_RECORD, self);
+}
+
+/*
+ * Store `val` to element `index` of `arr`, appended to
+ * packed arrays at their length. Columnar ones store
+ * it a field at a time, clearing the element unless a
+ * record of their layout.
+ */
+
+void
+luna_native_put(luna_value_t arr, luna_value_t index, luna_value_t val) {
+  if (!luna_is_array(arr)) return;
+  luna_array_t *self = luna_as_pointer(arr);
+  if (!self->layout) {
+    int i = luna_array_end(arr, index);
+    luna_value_t *ptr = i < 0 ? NULL : luna_array_put(self, i, val);
+    if (ptr) *ptr = val;
+    return;
+  }
+
+  int i = luna_array_index(arr, index);
+  if (i < 0) return;
+  for (int j = 0; j < self->layout->nfields; ++j) {
+    luna_value_t field = luna_array_element(self, j, val);
+    luna_value_t *ptr = luna_array_store(self, j, i, field);
+    if (ptr) *ptr = field;
+  }
+}
+
+/*
+ * Field `key` of `obj` through `cache`, looked up by
+ * name in records and arrays, nil when none of them.
+ */
+
+luna_value_t
+luna_native_get(luna_value_t obj, const char *key, luna_cache_t *cache) {
+  if (luna_is_record(obj)) {
+    luna_record_t *rec = luna_as_pointer(obj);
+    luna_field_t *field = luna_layout_field(luna_record_layout(rec), key);
+    return field ? luna_record_get(rec, field) : LUNA_VALUE_NIL;
+  }
+  if (luna_is_array(obj)) return luna_array_get(luna_as_pointer(obj), key);
+  if (!luna_is_object(obj)) return LUNA_VALUE_NIL;
+  return luna_object_get(luna_as_pointer(obj), key, cache);
+}
+
+/*
+ * Store `val` to field `key` of `obj` through `cache`,
+ * looked up by name in records, unless it is neither.
+ */
+
+void
+luna_native_set(luna_value_t obj, const char *key, luna_cache_t *cache, luna_value_t val) {
+  if (luna_is_record(obj)) {
+    luna_record_t *rec = luna_as_pointer(obj);
+    luna_field_t *field = luna_layout_field(luna_record_layout(rec), key);
+    luna_value_t *ptr = field ? luna_record_set(rec, field, val) : NULL;
+    if (ptr) *ptr = val;
+    return;
+  }
+  if (!luna_is_object(obj)) return;
+  *luna_object_put(luna_as_pointer(obj), key, cache) = val;
+}
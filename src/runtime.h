@@ -0,0 +1,318 @@
+
+//
+// runtime.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_RUNTIME_H
+#define LUNA_RUNTIME_H
+
+#include <math.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include "object.h"
+#include "array.h"
+
+/*
+ * Value operations shared by the vm and the C backend, so that
+ * compiled programs behave exactly as interpreted ones.
+ */
+
+/*
+ * Store int `val` in `r`.
+ */
+
+#define LUNA_INT(r, val) ((r) = luna_value_int(val))
+
+/*
+ * Store float `val` in `r`.
+ */
+
+#define LUNA_FLOAT(r, val) ((r) = luna_value_float(val))
+
+/*
+ * Store bool `val` in `r`.
+ */
+
+#define LUNA_BOOL(r, val) ((r) = luna_value_bool(val))
+
+/*
+ * Store nil in `r`.
+ */
+
+#define LUNA_NIL(r) ((r) = LUNA_VALUE_NIL)
+
+/*
+ * Check if `val` is an int or float.
+ */
+
+#define luna_numeric(val) (luna_is_int(val) || luna_is_float(val))
+
+/*
+ * Numeric `val` as a float.
+ */
+
+#define luna_num(val) (luna_is_int(val) ? (float) luna_as_int(val) : luna_as_float(val))
+
+/*
+ * Numeric `val` as an int.
+ */
+
+#define luna_integer(val) (luna_is_int(val) ? luna_as_int(val) : (int) luna_as_float(val))
+
+/*
+ * Int `val` widened to wrap on overflow.
+ */
+
+#define luna_as_wrapping(val) ((uint32_t) luna_as_int(val))
+
+/*
+ * Generic arithmetic `op` of `b` and `c` into `dst`, checking
+ * their tags and promoting ints mixed with floats. Ints wrap
+ * on overflow, division is luna_div().
+ */
+
+#define LUNA_ARITH(dst, b, c, op) { \
+  luna_value_t _b = (b), _c = (c); \
+  if (luna_is_int(_b) && luna_is_int(_c)) LUNA_INT(dst, luna_as_wrapping(_b) op luna_as_wrapping(_c)); \
+  else if (luna_numeric(_b) && luna_numeric(_c)) LUNA_FLOAT(dst, luna_num(_b) op luna_num(_c)); \
+  else LUNA_NIL(dst); \
+}
+
+/*
+ * Generic bitwise `op` of `b` and `c` into `dst`.
+ */
+
+#define LUNA_BITWISE(dst, b, c, op) { \
+  luna_value_t _b = (b), _c = (c); \
+  if (luna_numeric(_b) && luna_numeric(_c)) LUNA_INT(dst, luna_integer(_b) op luna_integer(_c)); \
+  else LUNA_NIL(dst); \
+}
+
+/*
+ * Generic comparison `op` of `b` and `c`.
+ */
+
+#define LUNA_COMPARE(b, c, op) \
+  (luna_is_int(b) && luna_is_int(c) \
+    ? luna_as_int(b) op luna_as_int(c) \
+    : luna_numeric(b) && luna_numeric(c) && luna_num(b) op luna_num(c))
+
+/*
+ * Generic division of `b` and `c`. The quotient of ints is a
+ * float when it is no int, dividing by zero or INT_MIN by -1.
+ */
+
+static inline luna_value_t
+luna_div(luna_value_t b, luna_value_t c) {
+  if (luna_is_int(b) && luna_is_int(c)) {
+    int x = luna_as_int(b), y = luna_as_int(c);
+    if (!y || (INT_MIN == x && -1 == y)) return luna_value_float((float) x / y);
+    return luna_value_int(x / y);
+  }
+  if (luna_numeric(b) && luna_numeric(c)) return luna_value_float(luna_num(b) / luna_num(c));
+  return LUNA_VALUE_NIL;
+}
+
+/*
+ * Generic modulo of `b` and `c`. Ints modulo zero
+ * are a float, NaN, and modulo -1 zero.
+ */
+
+static inline luna_value_t
+luna_mod(luna_value_t b, luna_value_t c) {
+  if (luna_is_int(b) && luna_is_int(c)) {
+    int x = luna_as_int(b), y = luna_as_int(c);
+    if (!y) return luna_value_float(NAN);
+    return luna_value_int(-1 == y ? 0 : x % y);
+  }
+  if (luna_numeric(b) && luna_numeric(c)) return luna_value_float(fmodf(luna_num(b), luna_num(c)));
+  return LUNA_VALUE_NIL;
+}
+
+/*
+ * Generic power of `b` and `c`, a float
+ * for ints when out of their range.
+ */
+
+static inline luna_value_t
+luna_pow(luna_value_t b, luna_value_t c) {
+  if (luna_is_int(b) && luna_is_int(c)) {
+    double p = pow(luna_as_int(b), luna_as_int(c));
+    if (!(p >= INT_MIN && p <= INT_MAX)) return luna_value_float(p);
+    return luna_value_int((int) p);
+  }
+  if (luna_numeric(b) && luna_numeric(c)) return luna_value_float(powf(luna_num(b), luna_num(c)));
+  return LUNA_VALUE_NIL;
+}
+
+/*
+ * Generic negation of `b`.
+ */
+
+static inline luna_value_t
+luna_negate(luna_value_t b) {
+  if (luna_is_int(b)) return luna_value_int(-luna_as_wrapping(b));
+  if (luna_is_float(b)) return luna_value_float(-luna_as_float(b));
+  return LUNA_VALUE_NIL;
+}
+
+/*
+ * Truthiness of `val`, nil, false and zero are falsy.
+ */
+
+static inline int
+luna_truthy(luna_value_t val) {
+  switch (luna_value_type(val)) {
+    case LUNA_TYPE_NULL:
+      return 0;
+    case LUNA_TYPE_BOOL:
+    case LUNA_TYPE_INT:
+      return 0 != luna_as_int(val);
+    case LUNA_TYPE_FLOAT:
+      return 0 != luna_as_float(val);
+    default:
+      return 1;
+  }
+}
+
+/*
+ * Check if `a` equals `b`.
+ */
+
+static inline int
+luna_equal(luna_value_t a, luna_value_t b) {
+  if (luna_is_int(a) && luna_is_int(b)) return a == b;
+  if (luna_numeric(a) && luna_numeric(b)) return luna_num(a) == luna_num(b);
+  if (luna_is_record(a) && luna_is_record(b) && luna_view_same(luna_as_pointer(a), luna_as_pointer(b))) return 1;
+  return a == b;
+}
+
+/*
+ * Check if the tags of `args` match `params`, of
+ * which the first `nrequired` may not be omitted.
+ */
+
+static inline int
+luna_accepts(luna_object *params, int nparams, int nrequired, luna_value_t *args, int nargs) {
+  if (nargs > nparams || nargs < nrequired) return 0;
+  for (int i = 0; i < nargs; ++i) {
+    if (LUNA_TYPE_ANY != params[i] && params[i] != luna_value_type(args[i])) return 0;
+  }
+  return 1;
+}
+
+/*
+ * Pack the argument count and the tags of `args` into a
+ * type tuple, four bits each.
+ */
+
+static inline uint64_t
+luna_tuple(luna_value_t *args, int nargs) {
+  uint64_t key = nargs;
+  for (int i = 0; i < nargs; ++i) {
+    key |= (uint64_t) luna_value_type(args[i]) << (4 * (i + 1));
+  }
+  return key;
+}
+
+/*
+ * Compiled function, called with its arguments
+ * and the captures of its closure.
+ */
+
+typedef struct {
+  luna_value_t (*call)(luna_value_t *args, int nargs, luna_value_t *upvalues);
+  int nparams;
+  int nrequired;
+  luna_object *params;
+} luna_function_t;
+
+/*
+ * Closure of a compiled function and its `nupvalues`
+ * captures. Functions capturing nothing share a static
+ * closure instead, of LUNA_NATIVE_SHARED captures,
+ * which is never collected.
+ */
+
+typedef struct {
+  luna_function_t *fn;
+  int nupvalues;
+  luna_value_t upvalues[];
+} luna_native_closure_t;
+
+#define LUNA_NATIVE_SHARED (-1)
+
+/*
+ * Registers of a running compiled function, linked to
+ * those of its caller. The frames are the roots of
+ * the collector of compiled programs.
+ */
+
+typedef struct luna_native_frame {
+  struct luna_native_frame *prev;
+  luna_value_t *regs;
+} luna_native_frame_t;
+
+/*
+ * Innermost frame.
+ */
+
+extern luna_native_frame_t *luna_native_frames;
+
+/*
+ * Push the frame of registers `r`, which must be
+ * initialized, and pop it returning `val`.
+ */
+
+#define LUNA_NATIVE_ENTER(r) \
+  luna_native_frame_t frame = { luna_native_frames, r }; \
+  luna_native_frames = &frame
+
+#define LUNA_NATIVE_RETURN(val) \
+  do { luna_native_frames = frame.prev; return (val); } while (0)
+
+// protos
+
+luna_value_t
+luna_result(luna_value_t val);
+
+luna_native_closure_t *
+luna_native_closure(luna_function_t *fn, int nupvalues);
+
+void
+luna_native_box(luna_value_t *val);
+
+luna_value_t
+luna_native_apply(luna_value_t *callee, int nargs);
+
+luna_value_t
+luna_native_object(int capacity);
+
+luna_value_t
+luna_native_record(luna_layout_t *layout);
+
+luna_value_t
+luna_native_array(luna_layout_t *layout, luna_value_t length);
+
+luna_value_t
+luna_native_list(int capacity);
+
+void
+luna_native_append(luna_value_t arr, luna_value_t val);
+
+luna_value_t
+luna_native_index(luna_value_t arr, luna_value_t index);
+
+void
+luna_native_put(luna_value_t arr, luna_value_t index, luna_value_t val);
+
+luna_value_t
+luna_native_get(luna_value_t obj, const char *key, luna_cache_t *cache);
+
+void
+luna_native_set(luna_value_t obj, const char *key, luna_cache_t *cache, luna_value_t val);
+
+#endif /* LUNA_RUNTIME_H */
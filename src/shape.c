@@ -0,0 +1,81 @@
+
+//
+// shape.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdlib.h>
+#include "shape.h"
+#include "internal.h"
+
+/*
+ * Allocate a shape adding `key` to `parent`.
+ */
+
+static luna_shape_t *
+shape_new(luna_shape_t *parent, const char *key) {
+  luna_shape_t *self = malloc(sizeof(luna_shape_t));
+  if (unlikely(!self)) return NULL;
+  self->parent = parent;
+  self->key = key;
+  self->nslots = parent ? parent->nslots + 1 : 0;
+  self->transitions = NULL;
+  return self;
+}
+
+/*
+ * Allocate the empty root shape.
+ */
+
+luna_shape_t *
+luna_shape_new() {
+  return shape_new(NULL, NULL);
+}
+
+/*
+ * Return the slot of interned `key`, or -1.
+ */
+
+int
+luna_shape_lookup(luna_shape_t *self, const char *key) {
+  luna_assert_interned(key);
+  for (; self->parent; self = self->parent) {
+    if (key == self->key) return self->nslots - 1;
+  }
+  return -1;
+}
+
+/*
+ * Return the shape adding `key` to `self`, creating the
+ * transition on first use, or NULL once it would exceed
+ * LUNA_SHAPE_SLOTS. `key` must be interned.
+ */
+
+luna_shape_t *
+luna_shape_add(luna_shape_t *self, const char *key) {
+  int ret;
+  luna_assert_interned(key);
+  if (self->nslots >= LUNA_SHAPE_SLOTS) return NULL;
+  if (!self->transitions) self->transitions = kh_init(transitions);
+
+  khiter_t k = kh_put(transitions, self->transitions, key, &ret);
+  if (ret) kh_value(self->transitions, k) = shape_new(self, key);
+  return kh_value(self->transitions, k);
+}
+
+/*
+ * Free shape `self` and those transitioned to from it.
+ */
+
+void
+luna_shape_free(luna_shape_t *self) {
+  if (!self) return;
+  if (self->transitions) {
+    for (khiter_t k = kh_begin(self->transitions); k != kh_end(self->transitions); ++k) {
+      if (kh_exist(self->transitions, k)) luna_shape_free(kh_value(self->transitions, k));
+    }
+    kh_destroy(transitions, self->transitions);
+  }
+  free(self);
+}
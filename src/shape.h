@@ -0,0 +1,56 @@
+
+//
+// shape.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_SHAPE_H
+#define LUNA_SHAPE_H
+
+#include "khash.h"
+#include "intern.h"
+
+/*
+ * Most slots of a shaped object, objects given
+ * more keys turn into dictionaries.
+ */
+
+#define LUNA_SHAPE_SLOTS 32
+
+// child shape by key
+
+KHASH_MAP_INIT_INTERNED(transitions, struct luna_shape *);
+
+/*
+ * Hidden class, the keys of an object and the slot each
+ * is stored at. Shapes form a tree rooted at the empty
+ * shape, adding a key transitions to the child for it,
+ * so objects given the same keys in the same order
+ * share a shape. The key added last is at slot
+ * `nslots` - 1, those before it are the parent's.
+ * Keys must be interned, they are compared by pointer.
+ */
+
+typedef struct luna_shape {
+  struct luna_shape *parent;
+  const char *key;
+  int nslots;
+  khash_t(transitions) *transitions;
+} luna_shape_t;
+
+// protos
+
+luna_shape_t *
+luna_shape_new();
+
+int
+luna_shape_lookup(luna_shape_t *self, const char *key);
+
+luna_shape_t *
+luna_shape_add(luna_shape_t *self, const char *key);
+
+void
+luna_shape_free(luna_shape_t *self);
+
+#endif /* LUNA_SHAPE_H */
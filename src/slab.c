@@ -0,0 +1,146 @@
+
+//
+// slab.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdlib.h>
+#include "slab.h"
+#include "internal.h"
+
+/*
+ * Block sizes of each class.
+ */
+
+static const size_t sizes[LUNA_SLAB_CLASSES] = {
+  16, 32, 48, 64, 96, 128, 192, 256
+};
+
+/*
+ * Class of each 16 byte step up to LUNA_SLAB_MAX.
+ */
+
+static const unsigned char classes[LUNA_SLAB_MAX / 16 + 1] = {
+  0, 0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7
+};
+
+/*
+ * Free block, linked through its first word.
+ */
+
+typedef struct block {
+  struct block *next;
+} block_t;
+
+/*
+ * Free lists of the current thread. A block freed on
+ * another thread than it was allocated on simply joins
+ * that thread's list, pages are never handed back.
+ */
+
+static __thread block_t *free_lists[LUNA_SLAB_CLASSES];
+
+/*
+ * Live bytes per class, shared by all threads.
+ */
+
+static size_t live[LUNA_SLAB_CLASSES + 1];
+
+/*
+ * Carve a fresh page into blocks of `class`,
+ * returning the first and listing the rest.
+ */
+
+static void *
+refill(int class) {
+  size_t size = sizes[class];
+  char *page = malloc(LUNA_SLAB_PAGE);
+  if (unlikely(!page)) return NULL;
+
+  size_t n = LUNA_SLAB_PAGE / size;
+  for (size_t i = n - 1; i > 0; --i) {
+    block_t *block = (block_t *) (page + i * size);
+    block->next = free_lists[class];
+    free_lists[class] = block;
+  }
+
+  return page;
+}
+
+/*
+ * Size class of `size`, -1 when too large.
+ */
+
+int
+luna_slab_class(size_t size) {
+  if (size > LUNA_SLAB_MAX) return -1;
+  return classes[(size + 15) / 16];
+}
+
+/*
+ * Block size of `class`.
+ */
+
+size_t
+luna_slab_size(int class) {
+  return sizes[class];
+}
+
+/*
+ * Live bytes of `class`, or of large
+ * allocations for LUNA_SLAB_LARGE.
+ */
+
+size_t
+luna_slab_live(int class) {
+  return __atomic_load_n(&live[class], __ATOMIC_RELAXED);
+}
+
+/*
+ * Allocate `size` bytes, from the free list of its
+ * class when small enough.
+ */
+
+void *
+luna_slab_alloc(size_t size) {
+  int class = luna_slab_class(size);
+
+  if (class < 0) {
+    void *ptr = malloc(size);
+    if (likely(ptr != NULL)) __atomic_add_fetch(&live[LUNA_SLAB_LARGE], size, __ATOMIC_RELAXED);
+    return ptr;
+  }
+
+  block_t *block = free_lists[class];
+  if (likely(block != NULL)) {
+    free_lists[class] = block->next;
+  } else if (unlikely(!(block = refill(class)))) {
+    return NULL;
+  }
+
+  __atomic_add_fetch(&live[class], sizes[class], __ATOMIC_RELAXED);
+  return block;
+}
+
+/*
+ * Free `ptr` of `size` bytes, the size it was
+ * allocated with.
+ */
+
+void
+luna_slab_free(void *ptr, size_t size) {
+  if (!ptr) return;
+  int class = luna_slab_class(size);
+
+  if (class < 0) {
+    __atomic_sub_fetch(&live[LUNA_SLAB_LARGE], size, __ATOMIC_RELAXED);
+    free(ptr);
+    return;
+  }
+
+  block_t *block = ptr;
+  block->next = free_lists[class];
+  free_lists[class] = block;
+  __atomic_sub_fetch(&live[class], sizes[class], __ATOMIC_RELAXED);
+}
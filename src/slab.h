@@ -0,0 +1,56 @@
+
+//
+// slab.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_SLAB_H
+#define LUNA_SLAB_H
+
+#include <stddef.h>
+
+/*
+ * Number of size classes.
+ */
+
+#define LUNA_SLAB_CLASSES 8
+
+/*
+ * Largest size served from a slab, anything
+ * larger goes straight to malloc().
+ */
+
+#define LUNA_SLAB_MAX 256
+
+/*
+ * Bytes carved into blocks each time a
+ * size class runs out.
+ */
+
+#define LUNA_SLAB_PAGE (64 * 1024)
+
+/*
+ * Counter index of allocations too large for a slab.
+ */
+
+#define LUNA_SLAB_LARGE LUNA_SLAB_CLASSES
+
+// protos
+
+void *
+luna_slab_alloc(size_t size);
+
+void
+luna_slab_free(void *ptr, size_t size);
+
+int
+luna_slab_class(size_t size);
+
+size_t
+luna_slab_size(int class);
+
+size_t
+luna_slab_live(int class);
+
+#endif /* LUNA_SLAB_H */
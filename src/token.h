@@ -106,7 +106,7 @@ typedef struct {
   int len;
   luna_token type;
   struct {
-    char *as_string;
+    const char *as_string;
     float as_float;
     int as_int;
   } value;
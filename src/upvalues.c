@@ -0,0 +1,563 @@
+
+//
+// upvalues.c
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#include <stdint.h>
+#include "upvalues.h"
+#include "vec.h"
+#include "visitor.h"
+#include "internal.h"
+
+/*
+ * Local of a function body, with the positions it is
+ * assigned at, and those of the closures capturing it.
+ */
+
+typedef struct {
+  const char *name;
+  int mutated;
+  int cell;
+  kvec_t(int) assigns;
+  kvec_t(int) captures;
+} local_t;
+
+// locals by name
+
+KHASH_MAP_INIT_STR(names, local_t *);
+
+/*
+ * Positions spanned by a loop.
+ */
+
+typedef struct {
+  int start;
+  int end;
+} loop_t;
+
+/*
+ * Function body being analyzed. Anonymous functions
+ * see the locals of the bodies enclosing them, named
+ * functions are global and start a fresh chain.
+ */
+
+typedef struct frame {
+  struct frame *parent;
+  luna_node_t *node;
+  khash_t(names) *locals;
+  kvec_t(loop_t) loops;
+  int created;
+} frame_t;
+
+/*
+ * Capture stored in a closure, its cell flag
+ * known once its owner is analyzed.
+ */
+
+typedef struct {
+  luna_node_t *fn;
+  int index;
+  local_t *local;
+} pending_t;
+
+/*
+ * Analysis state, positions number the references,
+ * assignments, loops and closures in program order.
+ */
+
+typedef struct {
+  luna_upvalues_t *upvalues;
+  frame_t *frame;
+  int pos;
+  kvec_t(local_t *) locals;
+  kvec_t(pending_t) pending;
+} analysis_t;
+
+/*
+ * Node of the given `val`.
+ */
+
+#define NODE(val) ((luna_node_t *) luna_as_pointer(val))
+
+/*
+ * Analysis state of the visitor.
+ */
+
+#define STATE ((analysis_t *) self->data)
+
+/*
+ * Key of `node`.
+ */
+
+#define KEY(node) ((khint64_t) (uintptr_t) (node))
+
+/*
+ * Return the local `name` visible from `frame`, or NULL.
+ */
+
+static local_t *
+resolve(frame_t *frame, const char *name) {
+  for (; frame; frame = frame->parent) {
+    khiter_t k = kh_get(names, frame->locals, name);
+    if (k != kh_end(frame->locals)) return kh_value(frame->locals, k);
+  }
+  return NULL;
+}
+
+/*
+ * Add local `name` to the current frame unless visible already.
+ */
+
+static void
+add(analysis_t *state, const char *name) {
+  int ret;
+  if (resolve(state->frame, name)) return;
+
+  local_t *local = malloc(sizeof(local_t));
+  local->name = name;
+  local->mutated = 0;
+  local->cell = 0;
+  kv_init(local->assigns);
+  kv_init(local->captures);
+  kv_push(local_t *, state->locals, local);
+
+  khiter_t k = kh_put(names, state->frame->locals, name, &ret);
+  kh_value(state->frame->locals, k) = local;
+}
+
+/*
+ * Collect the locals assigned by a body, those of
+ * nested functions excluded.
+ */
+
+static void
+collect_block(luna_visitor_t *self, luna_block_node_t *node) {
+  luna_vec_each(node->stmts, visit(NODE(val)));
+}
+
+static void
+collect_if(luna_visitor_t *self, luna_if_node_t *node) {
+  visit(node->expr);
+  visit((luna_node_t *) node->block);
+  luna_vec_each(node->else_ifs, visit(NODE(val)));
+  if (node->else_block) visit((luna_node_t *) node->else_block);
+}
+
+static void
+collect_while(luna_visitor_t *self, luna_while_node_t *node) {
+  visit(node->expr);
+  visit((luna_node_t *) node->block);
+}
+
+static void
+collect_let(luna_visitor_t *self, luna_let_node_t *node) {
+  luna_vec_each(node->vec, {
+    luna_binary_op_node_t *bin = (luna_binary_op_node_t *) NODE(val);
+    if (bin->right) visit(bin->right);
+    luna_vec_each(((luna_decl_node_t *) bin->left)->vec, {
+      add(STATE, ((luna_id_node_t *) NODE(val))->val);
+    });
+  });
+}
+
+static void
+collect_unary_op(luna_visitor_t *self, luna_unary_op_node_t *node) {
+  int mutates = LUNA_TOKEN_OP_INCR == node->op || LUNA_TOKEN_OP_DECR == node->op;
+  if (mutates && LUNA_NODE_ID == node->expr->type) {
+    add(STATE, ((luna_id_node_t *) node->expr)->val);
+  } else {
+    visit(node->expr);
+  }
+}
+
+static void
+collect_binary_op(luna_visitor_t *self, luna_binary_op_node_t *node) {
+  switch (node->op) {
+    case LUNA_TOKEN_OP_ASSIGN:
+    case LUNA_TOKEN_OP_PLUS_ASSIGN:
+    case LUNA_TOKEN_OP_MINUS_ASSIGN:
+    case LUNA_TOKEN_OP_MUL_ASSIGN:
+    case LUNA_TOKEN_OP_DIV_ASSIGN:
+    case LUNA_TOKEN_OP_AND_ASSIGN:
+    case LUNA_TOKEN_OP_OR_ASSIGN:
+      if (LUNA_NODE_ID == node->left->type) {
+        visit(node->right);
+        add(STATE, ((luna_id_node_t *) node->left)->val);
+        return;
+      }
+  }
+
+  visit(node->left);
+  if (node->right) visit(node->right);
+}
+
+static void
+collect_call(luna_visitor_t *self, luna_call_node_t *node) {
+  visit(node->expr);
+  luna_vec_each(node->args->vec, visit(NODE(val)));
+  luna_hash_each_val(node->args->hash, visit(NODE(val)));
+}
+
+static void
+collect_array(luna_visitor_t *self, luna_array_node_t *node) {
+  luna_vec_each(node->vals, visit(NODE(val)));
+}
+
+static void
+collect_hash(luna_visitor_t *self, luna_hash_node_t *node) {
+  luna_vec_each(node->pairs, visit(((luna_hash_pair_node_t *) NODE(val))->val));
+}
+
+static void
+collect_slot(luna_visitor_t *self, luna_slot_node_t *node) {
+  visit(node->left);
+}
+
+static void
+collect_subscript(luna_visitor_t *self, luna_subscript_node_t *node) {
+  visit(node->left);
+  visit(node->right);
+}
+
+static void
+collect_return(luna_visitor_t *self, luna_return_node_t *node) {
+  if (node->expr) visit(node->expr);
+}
+
+/*
+ * Enter a frame for body `node` of function `fn`, if any,
+ * defining its parameters and the locals it assigns.
+ */
+
+static void
+enter(analysis_t *state, luna_node_t *node, luna_function_node_t *fn, frame_t *parent) {
+  frame_t *frame = malloc(sizeof(frame_t));
+  frame->parent = parent;
+  frame->node = fn ? (luna_node_t *) fn : node;
+  frame->locals = kh_init(names);
+  frame->created = state->pos++;
+  kv_init(frame->loops);
+  state->frame = frame;
+
+  // parameters shadow enclosing locals
+  if (fn) {
+    frame->parent = NULL;
+    luna_vec_each(fn->params, {
+      luna_node_t *param = NODE(val);
+      if (LUNA_NODE_BINARY_OP == param->type) param = ((luna_binary_op_node_t *) param)->left;
+      luna_vec_each(((luna_decl_node_t *) param)->vec, {
+        add(state, ((luna_id_node_t *) NODE(val))->val);
+      });
+    });
+    frame->parent = parent;
+  }
+
+  luna_visitor_t visitor = {
+    .data = (void *) state,
+    .visit_if = collect_if,
+    .visit_let = collect_let,
+    .visit_slot = collect_slot,
+    .visit_call = collect_call,
+    .visit_hash = collect_hash,
+    .visit_array = collect_array,
+    .visit_while = collect_while,
+    .visit_block = collect_block,
+    .visit_return = collect_return,
+    .visit_unary_op = collect_unary_op,
+    .visit_binary_op = collect_binary_op,
+    .visit_subscript = collect_subscript
+  };
+
+  luna_visit(&visitor, fn ? (luna_node_t *) fn->block : node);
+}
+
+/*
+ * Check if captured `local` of `frame` must be shared: it is
+ * assigned by a closure, after being captured, or within a
+ * loop which also captures it, as a later iteration would
+ * assign it after the capture of an earlier one.
+ */
+
+static int
+shared(frame_t *frame, local_t *local) {
+  if (local->mutated) return 1;
+  for (int i = 0; i < kv_size(local->assigns); ++i) {
+    int a = kv_A(local->assigns, i);
+    for (int j = 0; j < kv_size(local->captures); ++j) {
+      int c = kv_A(local->captures, j);
+      if (a > c) return 1;
+      for (int k = 0; k < kv_size(frame->loops); ++k) {
+        loop_t loop = kv_A(frame->loops, k);
+        if (loop.start < a && a < loop.end && loop.start < c && c < loop.end) return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Leave the current frame, deciding which
+ * of its captured locals live in cells.
+ */
+
+static void
+leave(analysis_t *state) {
+  frame_t *frame = state->frame;
+  int ret;
+
+  for (khiter_t k = kh_begin(frame->locals); k != kh_end(frame->locals); ++k) {
+    if (!kh_exist(frame->locals, k)) continue;
+    local_t *local = kh_value(frame->locals, k);
+    if (!kv_size(local->captures) || !(local->cell = shared(frame, local))) continue;
+
+    khiter_t c = kh_put(captures, state->upvalues->cells, KEY(frame->node), &ret);
+    if (ret) kv_init(kh_value(state->upvalues->cells, c));
+    luna_capture_t cell = { .name = local->name, .cell = 1 };
+    kv_push(luna_capture_t, kh_value(state->upvalues->cells, c), cell);
+  }
+
+  state->frame = frame->parent;
+  kh_destroy(names, frame->locals);
+  kv_destroy(frame->loops);
+  free(frame);
+}
+
+/*
+ * Add `local` to the captures of the closure of `frame`.
+ */
+
+static void
+capture(analysis_t *state, frame_t *frame, local_t *local) {
+  int ret;
+
+  for (int i = 0; i < kv_size(state->pending); ++i) {
+    pending_t *p = &kv_A(state->pending, i);
+    if (p->fn == frame->node && p->local == local) return;
+  }
+
+  khiter_t k = kh_put(captures, state->upvalues->captures, KEY(frame->node), &ret);
+  luna_captures_t *captures = &kh_value(state->upvalues->captures, k);
+  if (ret) kv_init(*captures);
+
+  luna_capture_t c = { .name = local->name, .cell = 0 };
+  pending_t p = { .fn = frame->node, .index = kv_size(*captures), .local = local };
+  kv_push(luna_capture_t, *captures, c);
+  kv_push(pending_t, state->pending, p);
+}
+
+/*
+ * Reference local `name`, assigning it when `write` is set. Locals
+ * of enclosing bodies are captured by every closure in between.
+ */
+
+static void
+reference(analysis_t *state, const char *name, int write) {
+  frame_t *child = NULL;
+
+  for (frame_t *frame = state->frame; frame; child = frame, frame = frame->parent) {
+    khiter_t k = kh_get(names, frame->locals, name);
+    if (k == kh_end(frame->locals)) continue;
+    local_t *local = kh_value(frame->locals, k);
+
+    // own
+    if (!child) {
+      if (write) kv_push(int, local->assigns, state->pos++);
+      return;
+    }
+
+    if (write) local->mutated = 1;
+    kv_push(int, local->captures, child->created);
+    for (frame_t *f = state->frame; f != frame; f = f->parent) {
+      capture(state, f, local);
+    }
+    return;
+  }
+}
+
+/*
+ * Walk the references of a body.
+ */
+
+static void
+walk_block(luna_visitor_t *self, luna_block_node_t *node) {
+  luna_vec_each(node->stmts, visit(NODE(val)));
+}
+
+static void
+walk_id(luna_visitor_t *self, luna_id_node_t *node) {
+  reference(STATE, node->val, 0);
+}
+
+static void
+walk_if(luna_visitor_t *self, luna_if_node_t *node) {
+  visit(node->expr);
+  visit((luna_node_t *) node->block);
+  luna_vec_each(node->else_ifs, visit(NODE(val)));
+  if (node->else_block) visit((luna_node_t *) node->else_block);
+}
+
+static void
+walk_while(luna_visitor_t *self, luna_while_node_t *node) {
+  loop_t loop;
+  loop.start = STATE->pos++;
+  visit(node->expr);
+  visit((luna_node_t *) node->block);
+  loop.end = STATE->pos++;
+  kv_push(loop_t, STATE->frame->loops, loop);
+}
+
+static void
+walk_let(luna_visitor_t *self, luna_let_node_t *node) {
+  luna_vec_each(node->vec, {
+    luna_binary_op_node_t *bin = (luna_binary_op_node_t *) NODE(val);
+    if (bin->right) visit(bin->right);
+    luna_vec_each(((luna_decl_node_t *) bin->left)->vec, {
+      reference(STATE, ((luna_id_node_t *) NODE(val))->val, 1);
+    });
+  });
+}
+
+static void
+walk_unary_op(luna_visitor_t *self, luna_unary_op_node_t *node) {
+  int mutates = LUNA_TOKEN_OP_INCR == node->op || LUNA_TOKEN_OP_DECR == node->op;
+  if (mutates && LUNA_NODE_ID == node->expr->type) {
+    reference(STATE, ((luna_id_node_t *) node->expr)->val, 1);
+  } else {
+    visit(node->expr);
+  }
+}
+
+static void
+walk_binary_op(luna_visitor_t *self, luna_binary_op_node_t *node) {
+  switch (node->op) {
+    case LUNA_TOKEN_OP_ASSIGN:
+    case LUNA_TOKEN_OP_PLUS_ASSIGN:
+    case LUNA_TOKEN_OP_MINUS_ASSIGN:
+    case LUNA_TOKEN_OP_MUL_ASSIGN:
+    case LUNA_TOKEN_OP_DIV_ASSIGN:
+    case LUNA_TOKEN_OP_AND_ASSIGN:
+    case LUNA_TOKEN_OP_OR_ASSIGN:
+      if (LUNA_NODE_ID == node->left->type) {
+        visit(node->right);
+        reference(STATE, ((luna_id_node_t *) node->left)->val, 1);
+        return;
+      }
+  }
+
+  visit(node->left);
+  if (node->right) visit(node->right);
+}
+
+static void
+walk_function(luna_visitor_t *self, luna_function_node_t *node) {
+  frame_t *outer = STATE->frame;
+  enter(STATE, NULL, node, node->name ? NULL : outer);
+
+  luna_vec_each(node->params, {
+    luna_node_t *param = NODE(val);
+    if (LUNA_NODE_BINARY_OP == param->type) visit(((luna_binary_op_node_t *) param)->right);
+  });
+  visit((luna_node_t *) node->block);
+
+  leave(STATE);
+  STATE->frame = outer;
+}
+
+/*
+ * Analyze the closures of `node`.
+ */
+
+luna_upvalues_t *
+luna_upvalues_new(luna_node_t *node) {
+  luna_upvalues_t *self = malloc(sizeof(luna_upvalues_t));
+  if (unlikely(!self)) return NULL;
+  self->captures = kh_init(captures);
+  self->cells = kh_init(captures);
+
+  analysis_t state = {
+    .upvalues = self,
+    .frame = NULL,
+    .pos = 0
+  };
+  kv_init(state.locals);
+  kv_init(state.pending);
+
+  luna_visitor_t visitor = {
+    .data = (void *) &state,
+    .visit_if = walk_if,
+    .visit_id = walk_id,
+    .visit_let = walk_let,
+    .visit_slot = collect_slot,
+    .visit_call = collect_call,
+    .visit_hash = collect_hash,
+    .visit_array = collect_array,
+    .visit_while = walk_while,
+    .visit_block = walk_block,
+    .visit_return = collect_return,
+    .visit_function = walk_function,
+    .visit_unary_op = walk_unary_op,
+    .visit_binary_op = walk_binary_op,
+    .visit_subscript = collect_subscript
+  };
+
+  enter(&state, node, NULL, NULL);
+  luna_visit(&visitor, node);
+  leave(&state);
+
+  // cells are known once their owners are left
+  for (int i = 0; i < kv_size(state.pending); ++i) {
+    pending_t p = kv_A(state.pending, i);
+    kv_A(*luna_upvalues_captures(self, p.fn), p.index).cell = p.local->cell;
+  }
+
+  for (int i = 0; i < kv_size(state.locals); ++i) {
+    local_t *local = kv_A(state.locals, i);
+    kv_destroy(local->assigns);
+    kv_destroy(local->captures);
+    free(local);
+  }
+
+  kv_destroy(state.locals);
+  kv_destroy(state.pending);
+  return self;
+}
+
+/*
+ * Return the locals captured by anonymous function `fn`, or NULL.
+ */
+
+luna_captures_t *
+luna_upvalues_captures(luna_upvalues_t *self, void *fn) {
+  khiter_t k = kh_get(captures, self->captures, KEY(fn));
+  return k == kh_end(self->captures) ? NULL : &kh_value(self->captures, k);
+}
+
+/*
+ * Return the locals of `body`, a function or the
+ * program, living in cells, or NULL.
+ */
+
+luna_captures_t *
+luna_upvalues_cells(luna_upvalues_t *self, void *body) {
+  khiter_t k = kh_get(captures, self->cells, KEY(body));
+  return k == kh_end(self->cells) ? NULL : &kh_value(self->cells, k);
+}
+
+/*
+ * Free the analysis.
+ */
+
+void
+luna_upvalues_free(luna_upvalues_t *self) {
+  for (khiter_t k = kh_begin(self->captures); k != kh_end(self->captures); ++k) {
+    if (kh_exist(self->captures, k)) kv_destroy(kh_value(self->captures, k));
+  }
+  for (khiter_t k = kh_begin(self->cells); k != kh_end(self->cells); ++k) {
+    if (kh_exist(self->cells, k)) kv_destroy(kh_value(self->cells, k));
+  }
+  kh_destroy(captures, self->captures);
+  kh_destroy(captures, self->cells);
+  free(self);
+}
@@ -0,0 +1,55 @@
+
+//
+// upvalues.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_UPVALUES_H
+#define LUNA_UPVALUES_H
+
+#include "ast.h"
+#include "khash.h"
+
+/*
+ * Local captured by a closure, shared through
+ * a heap cell when mutated after capture.
+ */
+
+typedef struct {
+  const char *name;
+  int cell;
+} luna_capture_t;
+
+typedef kvec_t(luna_capture_t) luna_captures_t;
+
+// captures by node
+
+KHASH_MAP_INIT_INT64(captures, luna_captures_t);
+
+/*
+ * Upvalue analysis, the locals captured by each anonymous
+ * function in the order they are stored in its closure, and
+ * the locals of each body living in cells.
+ */
+
+typedef struct {
+  khash_t(captures) *captures;
+  khash_t(captures) *cells;
+} luna_upvalues_t;
+
+// protos
+
+luna_upvalues_t *
+luna_upvalues_new(luna_node_t *node);
+
+luna_captures_t *
+luna_upvalues_captures(luna_upvalues_t *self, void *fn);
+
+luna_captures_t *
+luna_upvalues_cells(luna_upvalues_t *self, void *body);
+
+void
+luna_upvalues_free(luna_upvalues_t *self);
+
+#endif /* LUNA_UPVALUES_H */
@@ -0,0 +1,158 @@
+
+//
+// value.h
+//
+// Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
+//
+
+#ifndef LUNA_VALUE_H
+#define LUNA_VALUE_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Luna value types.
+ */
+
+typedef enum {
+  LUNA_TYPE_NULL,
+  LUNA_TYPE_NODE,
+  LUNA_TYPE_BOOL,
+  LUNA_TYPE_INT,
+  LUNA_TYPE_FLOAT,
+  LUNA_TYPE_STRING,
+  LUNA_TYPE_OBJECT,
+  LUNA_TYPE_ARRAY,
+  LUNA_TYPE_LIST,
+  LUNA_TYPE_FUNCTION,
+  LUNA_TYPE_CELL,
+  LUNA_TYPE_RECORD,
+  LUNA_TYPE_ANY
+} luna_object;
+
+/*
+ * Luna value.
+ *
+ * NaN-boxed into 64 bits. Floats are stored as doubles,
+ * every other type in the payload of a negative quiet
+ * NaN, its type in the four bits below the mantissa's
+ * quiet bit. NaNs produced by arithmetic are
+ * canonicalized to a positive one.
+ *
+ *   13      4      47
+ * +----------------------+
+ * | 1fff | type+1 | bits |
+ * +----------------------+
+ *
+ * Ints and bools occupy the low 32 bits, pointers the
+ * low 47, which user space addresses fit in.
+ */
+
+typedef uint64_t luna_value_t;
+
+/*
+ * Bits set in every boxed value.
+ */
+
+#define LUNA_VALUE_BOXED 0xfff8000000000000ull
+
+/*
+ * Boxed bits of `type`.
+ */
+
+#define LUNA_VALUE_TAG(type) (LUNA_VALUE_BOXED | (uint64_t) ((type) + 1) << 47)
+
+/*
+ * Payload bits.
+ */
+
+#define LUNA_VALUE_PAYLOAD 0x00007fffffffffffull
+
+/*
+ * Canonical NaN.
+ */
+
+#define LUNA_VALUE_NAN 0x7ff8000000000000ull
+
+/*
+ * nil.
+ */
+
+#define LUNA_VALUE_NIL LUNA_VALUE_TAG(LUNA_TYPE_NULL)
+
+/*
+ * Box int `n`.
+ */
+
+#define luna_value_int(n) (LUNA_VALUE_TAG(LUNA_TYPE_INT) | (uint32_t) (n))
+
+/*
+ * Box bool `b`.
+ */
+
+#define luna_value_bool(b) (LUNA_VALUE_TAG(LUNA_TYPE_BOOL) | !!(b))
+
+/*
+ * Box pointer `ptr` of the given `type`.
+ */
+
+#define luna_value_pointer(type, ptr) (LUNA_VALUE_TAG(type) | (uintptr_t) (ptr))
+
+/*
+ * Unbox the int or bool `val`.
+ */
+
+#define luna_as_int(val) ((int32_t) (uint32_t) (val))
+
+/*
+ * Unbox the pointer `val`, NULL for nil.
+ */
+
+#define luna_as_pointer(val) ((void *) (uintptr_t) ((val) & LUNA_VALUE_PAYLOAD))
+
+/*
+ * Check if `val` is boxed, otherwise it is a float.
+ */
+
+#define luna_value_boxed(val) (((val) & LUNA_VALUE_BOXED) == LUNA_VALUE_BOXED)
+
+/*
+ * Box float `f`.
+ */
+
+static inline luna_value_t
+luna_value_float(double f) {
+  luna_value_t val;
+  if (f != f) return LUNA_VALUE_NAN;
+  memcpy(&val, &f, sizeof(double));
+  return val;
+}
+
+/*
+ * Unbox the float `val`.
+ */
+
+static inline double
+luna_as_double(luna_value_t val) {
+  double f;
+  memcpy(&f, &val, sizeof(double));
+  return f;
+}
+
+/*
+ * Unbox the float `val` at the language's single precision.
+ */
+
+#define luna_as_float(val) ((float) luna_as_double(val))
+
+/*
+ * Type of `val`.
+ */
+
+#define luna_value_type(val) \
+  (luna_value_boxed(val) \
+    ? (luna_object) (((val) >> 47 & 0xf) - 1) \
+    : LUNA_TYPE_FLOAT)
+
+#endif /* LUNA_VALUE_H */
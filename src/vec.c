@@ -5,7 +5,10 @@
 // Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
 //
 
+#include <stdlib.h>
+#include <string.h>
 #include "vec.h"
+#include "slab.h"
 #include "internal.h"
 
 /*
@@ -14,8 +17,44 @@
 
 luna_vec_t *
 luna_vec_new() {
-  luna_vec_t *self = malloc(sizeof(luna_vec_t));
+  luna_vec_t *self = luna_slab_alloc(sizeof(luna_vec_t));
   if (unlikely(!self)) return NULL;
   luna_vec_init(self);
   return self;
-}
\ No newline at end of file
+}
+
+/*
+ * Double the capacity of the array, spilling
+ * its inline elements to the heap.
+ */
+
+void
+luna_vec_grow(luna_vec_t *self) {
+  size_t m = self->m << 1;
+  if (self->a == self->slots) {
+    self->a = malloc(m * sizeof(luna_value_t));
+    memcpy(self->a, self->slots, self->n * sizeof(luna_value_t));
+  } else {
+    self->a = realloc(self->a, m * sizeof(luna_value_t));
+  }
+  self->m = m;
+}
+
+/*
+ * Free the elements' storage of the array.
+ */
+
+void
+luna_vec_destroy(luna_vec_t *self) {
+  if (self->a != self->slots) free(self->a);
+}
+
+/*
+ * Free the array and its elements' storage.
+ */
+
+void
+luna_vec_free(luna_vec_t *self) {
+  luna_vec_destroy(self);
+  luna_slab_free(self, sizeof(luna_vec_t));
+}
@@ -12,16 +12,31 @@
 #include "kvec.h"
 
 /*
- * Luna array.
+ * Elements stored inline before spilling to the heap.
  */
 
-typedef kvec_t(luna_object_t *) luna_vec_t;
+#define LUNA_VEC_INLINE 3
+
+/*
+ * Luna array, laid out as a kvec whose first
+ * LUNA_VEC_INLINE elements are stored in `slots`,
+ * so the short vectors of most nodes never
+ * allocate. Arrays must not be moved once
+ * initialized.
+ */
+
+typedef struct {
+  size_t n, m;
+  luna_value_t *a;
+  luna_value_t slots[LUNA_VEC_INLINE];
+} luna_vec_t;
 
 /*
  * Initialize an array.
  */
 
-#define luna_vec_init(self) kv_init(*self)
+#define luna_vec_init(self) \
+  ((self)->n = 0, (self)->m = LUNA_VEC_INLINE, (self)->a = (self)->slots)
 
 /*
  * Return the array length.
@@ -34,32 +49,32 @@ typedef kvec_t(luna_object_t *) luna_vec_t;
  */
 
 #define luna_vec_push(self, obj) \
-  kv_push(luna_object_t *, *self, obj)
+  luna_vec_append(self, obj)
 
 /*
- * Pop an object out of the array.
+ * Pop a value out of the array, nil when empty.
  */
 
 #define luna_vec_pop(self) \
   (luna_vec_length(self) \
     ? kv_pop(*self) \
-    : NULL)
+    : LUNA_VALUE_NIL)
 
 /*
- * Return the object at `i`.
+ * Return the value at `i`, nil when out of bounds.
  */
 
 #define luna_vec_at(self, i) \
   (((i) >= 0 && (i) < luna_vec_length(self)) \
     ? kv_A(*self, (i)) \
-    : NULL)
+    : LUNA_VALUE_NIL)
 
 /*
  * Iterate the array, populating `i` and `val`.
  */
 
 #define luna_vec_each(self, block) { \
-    luna_object_t *val; \
+    luna_value_t val; \
     int len = luna_vec_length(self); \
     for (int i = 0; i < len; ++i) { \
       val = luna_vec_at(self, i); \
@@ -72,4 +87,23 @@ typedef kvec_t(luna_object_t *) luna_vec_t;
 luna_vec_t *
 luna_vec_new();
 
+void
+luna_vec_grow(luna_vec_t *self);
+
+void
+luna_vec_destroy(luna_vec_t *self);
+
+void
+luna_vec_free(luna_vec_t *self);
+
+/*
+ * Append `obj` to the array, growing it when full.
+ */
+
+static inline void
+luna_vec_append(luna_vec_t *self, luna_value_t obj) {
+  if (self->n == self->m) luna_vec_grow(self);
+  self->a[self->n++] = obj;
+}
+
 #endif /* LUNA_VEC_H */
\ No newline at end of file
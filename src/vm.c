@@ -5,97 +5,986 @@
 // Copyright (c) 2013 TJ Holowaychuk <tj@vision-media.ca>
 //
 
+#include <string.h>
+#include <time.h>
 #include "vm.h"
-#include "disasm.h"
 #include "object.h"
+#include "runtime.h"
+#include "array.h"
 #include "opcodes.h"
 #include "internal.h"
 
-luna_object_t *
-luna_eval(luna_vm_t *vm) {
-  luna_dump(vm);
-  printf("\n");
-  luna_instruction_t *ip = vm->main->ip;
+/*
+ * Generic arithmetic `op` on RK(B) and RK(C), checking
+ * their tags and promoting ints mixed with floats.
+ */
+
+#define ARITH(op) LUNA_ARITH(R(A(i)), RK(B(i)), RK(C(i)), op)
+
+/*
+ * Generic bitwise `op` on RK(B) and RK(C).
+ */
+
+#define BITWISE(op) LUNA_BITWISE(R(A(i)), RK(B(i)), RK(C(i)), op)
+
+/*
+ * Generic comparison `op` of RK(B) and RK(C), skipping
+ * the next instruction unless the result equals A.
+ */
+
+#define COMPARE(op) if (LUNA_COMPARE(RK(B(i)), RK(C(i)), op) != A(i)) ip++
+
+/*
+ * Typed int and float operations, the operand
+ * types were proven by inference so no tags are checked.
+ * Ints wrap on overflow, and are only divided by
+ * constants other than 0 and -1.
+ */
+
+#define ARITH_INT(op) LUNA_INT(R(A(i)), luna_as_wrapping(RK(B(i))) op luna_as_wrapping(RK(C(i))))
+#define DIVIDE_INT(op) LUNA_INT(R(A(i)), luna_as_int(RK(B(i))) op luna_as_int(RK(C(i))))
+#define ARITH_FLOAT(op) LUNA_FLOAT(R(A(i)), luna_as_float(RK(B(i))) op luna_as_float(RK(C(i))))
+#define COMPARE_INT(op) if ((luna_as_int(RK(B(i))) op luna_as_int(RK(C(i)))) != A(i)) ip++
+#define COMPARE_FLOAT(op) if ((luna_as_float(RK(B(i))) op luna_as_float(RK(C(i)))) != A(i)) ip++
+
+/*
+ * Check if the tags of `args` match the parameters of `fn`.
+ */
+
+static int
+accepts(luna_activation_t *fn, luna_value_t *args, int nargs) {
+  return luna_accepts(fn->params, fn->nparams, fn->nrequired, args, nargs);
+}
+
+/*
+ * Allocate a new activation record.
+ */
+
+luna_activation_t *
+luna_activation_new() {
+  luna_activation_t *self = malloc(sizeof(luna_activation_t));
+  if (unlikely(!self)) return NULL;
+  self->ncode = 0;
+  self->nconstants = 0;
+  self->nparams = 0;
+  self->nrequired = 0;
+  self->params = NULL;
+  self->nupvalues = 0;
+  self->closure = NULL;
+  self->caches = NULL;
+  luna_lines_init(&self->lines);
+  self->constants = malloc((256 - 32) * sizeof(luna_value_t)); // TODO: vec
+  self->mcode = 64;
+  self->ip = self->code = malloc(self->mcode * sizeof(luna_instruction_t));
+  return self;
+}
+
+/*
+ * Free activation record `self`.
+ */
+
+static void
+activation_free(luna_activation_t *self) {
+  free(self->params);
+  free(self->closure);
+  free(self->caches);
+  luna_lines_free(&self->lines);
+  free(self->constants);
+  free(self->code);
+  free(self);
+}
+
+/*
+ * Number of typed parameters of `fn`.
+ */
+
+static int
+specificity(luna_activation_t *fn) {
+  int typed = 0;
+  for (int i = 0; i < fn->nparams; ++i) {
+    if (LUNA_TYPE_ANY != fn->params[i]) ++typed;
+  }
+  return typed;
+}
+
+/*
+ * Check if `a` and `b` have the same signature.
+ */
+
+static int
+same_signature(luna_activation_t *a, luna_activation_t *b) {
+  if (a->nparams != b->nparams) return 0;
+  for (int i = 0; i < a->nparams; ++i) {
+    if (a->params[i] != b->params[i]) return 0;
+  }
+  return 1;
+}
+
+/*
+ * Add a generic function to `vm`, returning its index.
+ */
+
+int
+luna_generic_new(luna_vm_t *vm) {
+  luna_generic_t generic;
+  kv_init(generic.overloads);
+  generic.table = kh_init(tuples);
+  generic.generation = 0;
+  kv_push(luna_generic_t, vm->generics, generic);
+  return kv_size(vm->generics) - 1;
+}
+
+/*
+ * Define function `index` as an overload of `generic`, replacing
+ * one of the same signature. It precedes those less specific, and
+ * those as specific defined before it, matching the order overloads
+ * are resolved in at compile time.
+ */
+
+void
+luna_generic_define(luna_vm_t *vm, int generic, int index) {
+  luna_generic_t *self = &kv_A(vm->generics, generic);
+  luna_activation_t *fn = kv_A(vm->functions, index);
+  int n = 0;
+
+  // shadowed
+  for (int i = 0; i < kv_size(self->overloads); ++i) {
+    int other = kv_A(self->overloads, i);
+    if (same_signature(fn, kv_A(vm->functions, other))) continue;
+    kv_A(self->overloads, n++) = other;
+  }
+  self->overloads.n = n;
+
+  int j = 0;
+  while (j < n && specificity(kv_A(vm->functions, kv_A(self->overloads, j))) > specificity(fn)) ++j;
+  kv_push(int, self->overloads, index);
+  memmove(&kv_A(self->overloads, j + 1), &kv_A(self->overloads, j), (n - j) * sizeof(int));
+  kv_A(self->overloads, j) = index;
+
+  // invalidate
+  kh_clear(tuples, self->table);
+  self->generation++;
+}
+
+/*
+ * Add a polymorphic call site of `generic` passing
+ * `nargs` arguments to `vm`, returning its index.
+ */
+
+int
+luna_site_new(luna_vm_t *vm, int generic, int nargs) {
+  luna_site_t site = {
+    .generic = generic,
+    .nargs = nargs,
+    .key = 0,
+    .selected = -1,
+    .generation = -1
+  };
+  kv_push(luna_site_t, vm->sites, site);
+  return kv_size(vm->sites) - 1;
+}
+
+/*
+ * Select the first overload of `generic` accepting `args`, or -1.
+ */
+
+static int
+scan(luna_vm_t *vm, luna_generic_t *generic, luna_value_t *args, int nargs) {
+  for (int i = 0; i < kv_size(generic->overloads); ++i) {
+    int index = kv_A(generic->overloads, i);
+    if (accepts(kv_A(vm->functions, index), args, nargs)) return index;
+  }
+  return -1;
+}
+
+/*
+ * Return the index of the function `site` selects for
+ * `args`, or -1. The site's cached selection is used when
+ * its type tuple repeats, falling back to the generic's
+ * dispatch table, and only scanning the overloads on a
+ * miss of both.
+ */
+
+int
+luna_select(luna_vm_t *vm, luna_site_t *site, luna_value_t *args) {
+  luna_generic_t *generic = &kv_A(vm->generics, site->generic);
+  int ret;
+
+  if (site->nargs > LUNA_DISPATCH_KEY_ARGS) {
+    return scan(vm, generic, args, site->nargs);
+  }
+
+  uint64_t key = luna_tuple(args, site->nargs);
+  if (key == site->key && generic->generation == site->generation) {
+    return site->selected;
+  }
+
+  khiter_t k = kh_put(tuples, generic->table, key, &ret);
+  if (ret) kh_value(generic->table, k) = scan(vm, generic, args, site->nargs);
+
+  site->key = key;
+  site->generation = generic->generation;
+  return site->selected = kh_value(generic->table, k);
+}
+
+/*
+ * Seconds elapsed since some fixed point.
+ */
+
+static double
+now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Apply `fn` to the roots of `vm`, the registers
+ * of each frame and the constant pools.
+ */
+
+static void
+roots(luna_vm_t *vm, void (*fn)(luna_gc_t *, luna_value_t *, int)) {
+  for (luna_frame_t *frame = vm->frame; frame; frame = frame->prev) {
+    fn(&vm->gc, frame->registers, 32);
+  }
+
+  fn(&vm->gc, vm->main->constants, vm->main->nconstants);
+  for (int i = 0; i < kv_size(vm->functions); ++i) {
+    luna_activation_t *act = kv_A(vm->functions, i);
+    fn(&vm->gc, act->constants, act->nconstants);
+  }
+}
+
+/*
+ * Promote the nursery objects reachable from the roots.
+ */
+
+static void
+scavenge(luna_vm_t *vm) {
+  roots(vm, luna_gc_evacuate);
+  luna_gc_scavenge(&vm->gc);
+}
+
+/*
+ * Start marking the old generation from the roots.
+ */
+
+static void
+begin(luna_vm_t *vm) {
+  vm->gc.marking = 1;
+  roots(vm, luna_gc_mark);
+}
+
+/*
+ * Finish marking, promoting the nursery and rescanning
+ * the roots for values stored to registers without a
+ * barrier, then sweep and return the bytes reclaimed.
+ */
+
+static size_t
+finish(luna_vm_t *vm) {
+  luna_gc_t *gc = &vm->gc;
+  if (gc->top != gc->nursery) scavenge(vm);
+  roots(vm, luna_gc_mark);
+  luna_gc_trace(gc);
+  gc->stats.collections++;
+  return luna_gc_sweep(gc);
+}
+
+/*
+ * Advance a concurrent collection, started when due from the
+ * roots just after a scavenge, then remarked once the
+ * collector is done marking, and its garbage freed
+ * once swept. Return whether it was advanced.
+ */
+
+static int
+concurrent(luna_vm_t *vm, size_t size) {
+  luna_gc_t *gc = &vm->gc;
+  switch (luna_gc_poll(gc)) {
+    case LUNA_GC_IDLE:
+      if (!luna_gc_due(gc, size)) return 0;
+      begin(vm);
+      luna_gc_start(gc);
+      return 1;
+    case LUNA_GC_MARKED:
+      if (gc->top != gc->nursery) scavenge(vm);
+      luna_gc_remark(gc);
+      return 1;
+    case LUNA_GC_SWEPT:
+      luna_gc_reclaim(gc);
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/*
+ * Scavenge, then advance the marking of the old generation
+ * by a step, starting when due and finishing once no gray
+ * objects are left. Steps trace at least twice the bytes
+ * just promoted so that marking outpaces the old
+ * generation. Without a budget it is marked at once.
+ * Return whether anything was scavenged or marked.
+ */
+
+static int
+collect(luna_vm_t *vm, size_t size) {
+  luna_gc_t *gc = &vm->gc;
+  size_t promoted = gc->stats.promoted;
+  if (gc->nursery) scavenge(vm);
+  promoted = gc->stats.promoted - promoted;
+
+  if (gc->collector) return concurrent(vm, size) || gc->nursery;
+
+  if (gc->marking) {
+    size_t budget = gc->budget;
+    if (budget < promoted * LUNA_GC_GROWTH) budget = promoted * LUNA_GC_GROWTH;
+    gc->stats.steps++;
+    if (luna_gc_step(gc, budget)) finish(vm);
+    return 1;
+  }
+
+  if (luna_gc_due(gc, size)) {
+    begin(vm);
+    if (!gc->budget) finish(vm);
+    return 1;
+  }
+
+  return !!gc->nursery;
+}
+
+/*
+ * Promote the nursery objects reachable from the
+ * roots to the old generation.
+ */
+
+void
+luna_vm_scavenge(luna_vm_t *vm) {
+  double start = now();
+  scavenge(vm);
+  luna_gc_pause(&vm->gc.stats, now() - start);
+}
+
+/*
+ * Collect the closures and cells unreachable from the
+ * roots, finishing any marking under way, and return
+ * the old bytes reclaimed.
+ */
+
+size_t
+luna_vm_collect(luna_vm_t *vm) {
+  luna_gc_t *gc = &vm->gc;
+  double start = now();
+
+  // settle a concurrent collection under way first
+  if (gc->collector) {
+    luna_gc_phase phase = luna_gc_wait(gc);
+    if (LUNA_GC_MARKED == phase) {
+      if (gc->top != gc->nursery) scavenge(vm);
+      luna_gc_remark(gc);
+      phase = luna_gc_wait(gc);
+    }
+    if (LUNA_GC_SWEPT == phase) luna_gc_reclaim(gc);
+  }
+
+  if (gc->top != gc->nursery) scavenge(vm);
+  if (!gc->marking) begin(vm);
+  size_t reclaimed = finish(vm);
+  luna_gc_pause(&vm->gc.stats, now() - start);
+  return reclaimed;
+}
+
+/*
+ * Allocate a `size` byte object of `type` owned by `vm`,
+ * collecting when the nursery is full, each pause that
+ * scavenged or marked recorded. Without a nursery every
+ * allocation gets here, and is only timed once there
+ * may be work. The object is unreachable until
+ * stored to a register.
+ */
+
+static void *
+allocate(luna_vm_t *vm, luna_object type, size_t size) {
+  luna_gc_t *gc = &vm->gc;
+  void *ptr = luna_gc_alloc(gc, type, size);
+  if (likely(ptr != NULL)) return ptr;
+
+  if (gc->nursery || gc->marking || gc->collector || luna_gc_due(gc, size)) {
+    double start = now();
+    if (collect(vm, size)) luna_gc_pause(&gc->stats, now() - start);
+  }
+  if ((ptr = luna_gc_alloc(gc, type, size))) return ptr;
+
+  // too large for the nursery, its fields are yet to be stored
+  ptr = luna_gc_tenure(gc, type, size);
+  if (gc->nursery) luna_gc_remember(gc, ptr);
+  return ptr;
+}
+
+/*
+ * Store `val` to field `key` of `obj` through `cache`,
+ * registering objects turned into dictionaries
+ * as owning memory outside the heap.
+ */
+
+static inline void
+store(luna_vm_t *vm, luna_object_t *obj, const char *key, luna_cache_t *cache, luna_value_t val) {
+  luna_hash_t *dict = obj->dict;
+  luna_value_t *field = luna_object_put(obj, key, cache);
+  if (unlikely(obj->dict != dict)) luna_gc_own(&vm->gc, obj);
+  luna_gc_barrier(&vm->gc, obj, field, val);
+  __atomic_store_n(field, val, __ATOMIC_RELEASE);
+}
+
+/*
+ * Store `val` to value field `ptr` of record or array `obj`.
+ */
+
+static inline void
+put(luna_vm_t *vm, void *obj, luna_value_t *ptr, luna_value_t val) {
+  luna_gc_barrier(&vm->gc, obj, ptr, val);
+  __atomic_store_n(ptr, val, __ATOMIC_RELEASE);
+}
+
+/*
+ * Store `val` to element `index` of `arr` a field at a
+ * time, clearing it unless a record of its layout.
+ */
+
+static void
+put_element(luna_vm_t *vm, luna_array_t *arr, int index, luna_value_t val) {
+  for (int j = 0; j < arr->layout->nfields; ++j) {
+    luna_value_t field = luna_array_element(arr, j, val);
+    luna_value_t *ptr = luna_array_store(arr, j, index, field);
+    if (ptr) put(vm, arr, ptr, field);
+  }
+}
+
+/*
+ * Store `val` to element `index` of packed `arr`.
+ */
+
+static inline void
+put_packed(luna_vm_t *vm, luna_array_t *arr, int index, luna_value_t val) {
+  luna_value_t *ptr = luna_array_put(arr, index, val);
+  if (ptr) put(vm, arr, ptr, val);
+}
+
+/*
+ * Execute `fn` with `nargs` arguments in `args`,
+ * and the captures of its closure in `upvalues`.
+ */
+
+static luna_value_t
+execute(luna_vm_t *vm, luna_activation_t *fn, luna_value_t *upvalues, luna_value_t *args, int nargs) {
+  luna_instruction_t *ip = fn->ip;
   luna_instruction_t i;
-  int registers[32] = {0};
+  luna_value_t registers[32];
+  for (int j = 0; j < 32; ++j) registers[j] = LUNA_VALUE_NIL;
+  if (nargs) memcpy(registers, args, nargs * sizeof(luna_value_t));
+  if (fn->nupvalues) memcpy(registers + fn->nparams, upvalues, fn->nupvalues * sizeof(luna_value_t));
+  luna_frame_t frame = { registers, vm->frame };
+  vm->frame = &frame;
 
   for (;;) {
     switch (OP(i = *ip++)) {
       // LOADK
       case LUNA_OP_LOADK:
-        printf("loadk %d\n", K(B(i)));
-        R((A(i))) = K(B(i));
+        R(A(i)) = K(B(i));
         break;
 
       // LOADB
       case LUNA_OP_LOADB:
-        printf("loadb %d %d %d\n", A(i), K(B(i)), C(i));
-        R(A(i)) = K(B(i));
+        LUNA_BOOL(R(A(i)), B(i));
         if (C(i)) ip++;
         break;
 
+      // LOADNIL
+      case LUNA_OP_LOADNIL:
+        LUNA_NIL(R(A(i)));
+        break;
+
+      // MOVE
+      case LUNA_OP_MOVE:
+        R(A(i)) = R(B(i));
+        break;
+
       // ADD
       case LUNA_OP_ADD:
-        R(A(i)) = RK(B(i)) + RK(C(i));
+        ARITH(+);
         break;
 
       // SUB
       case LUNA_OP_SUB:
-        R(A(i)) = RK(B(i)) - RK(C(i));
+        ARITH(-);
         break;
 
       // DIV
       case LUNA_OP_DIV:
-        R(A(i)) = RK(B(i)) / RK(C(i));
+        R(A(i)) = luna_div(RK(B(i)), RK(C(i)));
         break;
 
       // MUL
       case LUNA_OP_MUL:
-        R(A(i)) = RK(B(i)) * RK(C(i));
+        ARITH(*);
         break;
 
       // MOD
       case LUNA_OP_MOD:
-        R(A(i)) = RK(B(i)) % RK(C(i));
+        R(A(i)) = luna_mod(RK(B(i)), RK(C(i)));
+        break;
+
+      // POW
+      case LUNA_OP_POW:
+        R(A(i)) = luna_pow(RK(B(i)), RK(C(i)));
+        break;
+
+      // ADDI
+      case LUNA_OP_ADDI:
+        ARITH_INT(+);
+        break;
+
+      // SUBI
+      case LUNA_OP_SUBI:
+        ARITH_INT(-);
+        break;
+
+      // DIVI
+      case LUNA_OP_DIVI:
+        DIVIDE_INT(/);
+        break;
+
+      // MULI
+      case LUNA_OP_MULI:
+        ARITH_INT(*);
+        break;
+
+      // MODI
+      case LUNA_OP_MODI:
+        DIVIDE_INT(%);
+        break;
+
+      // ADDF
+      case LUNA_OP_ADDF:
+        ARITH_FLOAT(+);
+        break;
+
+      // SUBF
+      case LUNA_OP_SUBF:
+        ARITH_FLOAT(-);
+        break;
+
+      // DIVF
+      case LUNA_OP_DIVF:
+        ARITH_FLOAT(/);
+        break;
+
+      // MULF
+      case LUNA_OP_MULF:
+        ARITH_FLOAT(*);
+        break;
+
+      // MODF
+      case LUNA_OP_MODF:
+        LUNA_FLOAT(R(A(i)), fmodf(luna_as_float(RK(B(i))), luna_as_float(RK(C(i)))));
         break;
 
       // NEGATE
       case LUNA_OP_NEGATE:
-        R(A(i)) = -R(B(i));
+        R(A(i)) = luna_negate(R(B(i)));
+        break;
+
+      // NOT
+      case LUNA_OP_NOT:
+        LUNA_BOOL(R(A(i)), !luna_truthy(R(B(i))));
+        break;
+
+      // BIT_SHL
+      case LUNA_OP_BIT_SHL:
+        BITWISE(<<);
+        break;
+
+      // BIT_SHR
+      case LUNA_OP_BIT_SHR:
+        BITWISE(>>);
+        break;
+
+      // BIT_AND
+      case LUNA_OP_BIT_AND:
+        BITWISE(&);
+        break;
+
+      // BIT_OR
+      case LUNA_OP_BIT_OR:
+        BITWISE(|);
+        break;
+
+      // BIT_XOR
+      case LUNA_OP_BIT_XOR:
+        BITWISE(^);
+        break;
+
+      // EQ
+      case LUNA_OP_EQ:
+        if (luna_equal(RK(B(i)), RK(C(i))) != A(i)) ip++;
         break;
 
       // LT
       case LUNA_OP_LT:
-        printf("lt %d %d\n", RK(B(i)), RK(C(i)));
-        if (RK(B(i)) < RK(C(i))) ip++;
+        COMPARE(<);
         break;
 
       // LTE
       case LUNA_OP_LTE:
-        printf("lte %d %d\n", RK(B(i)), RK(C(i)));
-        if (RK(B(i)) <= RK(C(i))) ip++;
+        COMPARE(<=);
+        break;
+
+      // LTI
+      case LUNA_OP_LTI:
+        COMPARE_INT(<);
+        break;
+
+      // LTEI
+      case LUNA_OP_LTEI:
+        COMPARE_INT(<=);
+        break;
+
+      // LTF
+      case LUNA_OP_LTF:
+        COMPARE_FLOAT(<);
+        break;
+
+      // LTEF
+      case LUNA_OP_LTEF:
+        COMPARE_FLOAT(<=);
+        break;
+
+      // TEST
+      case LUNA_OP_TEST:
+        if (luna_truthy(R(A(i))) != C(i)) ip++;
+        break;
+
+      // TESTSET
+      case LUNA_OP_TESTSET:
+        if (luna_truthy(R(B(i))) == C(i)) {
+          R(A(i)) = R(B(i));
+        } else {
+          ip++;
+        }
         break;
 
       // JMP
       case LUNA_OP_JMP:
-        printf("jmp %d\n", B(i));
-        ip += B(i);
+        ip += SBX(i);
+        break;
+
+      // CALL
+      case LUNA_OP_CALL:
+        R(A(i)) = execute(vm, kv_A(vm->functions, B(i)), NULL, &R(A(i) + 1), C(i));
+        break;
+
+      // DISPATCH
+      case LUNA_OP_DISPATCH: {
+        luna_site_t *site = &kv_A(vm->sites, BX(i));
+        int index = luna_select(vm, site, &R(A(i) + 1));
+        if (index < 0) {
+          LUNA_NIL(R(A(i)));
+        } else {
+          R(A(i)) = execute(vm, kv_A(vm->functions, index), NULL, &R(A(i) + 1), site->nargs);
+        }
+        break;
+      }
+
+      // GUARD
+      case LUNA_OP_GUARD:
+        if ((uint32_t) luna_tuple(&R(A(i) + 1), C(i)) == (uint32_t) luna_as_int(K(B(i)))) ip++;
+        break;
+
+      // FEEDBACK, the probe's type tuple holds the argument count
+      case LUNA_OP_FEEDBACK: {
+        uint64_t probe = kv_A(vm->probes, BX(i));
+        luna_profile_add(vm->profile, probe | luna_tuple(&R(A(i) + 1), probe & 0xf), 1);
+        break;
+      }
+
+      // COUNT
+      case LUNA_OP_COUNT:
+        luna_profile_add(vm->profile, kv_A(vm->probes, BX(i)), 1);
+        break;
+
+      // ARGC
+      case LUNA_OP_ARGC:
+        if (nargs <= B(i)) ip++;
+        break;
+
+      // CLOSURE
+      case LUNA_OP_CLOSURE: {
+        luna_activation_t *callee = kv_A(vm->functions, BX(i));
+        luna_closure_t *closure = callee->closure;
+
+        // captures follow as moves from their registers
+        if (!closure) {
+          closure = allocate(vm, LUNA_TYPE_FUNCTION, sizeof(luna_closure_t) + callee->nupvalues * sizeof(luna_value_t));
+          closure->fn = callee;
+          for (int j = 0; j < callee->nupvalues; ++j) {
+            closure->upvalues[j] = R(B(ip[j]));
+          }
+          ip += callee->nupvalues;
+        }
+
+        R(A(i)) = luna_value_pointer(LUNA_TYPE_FUNCTION, closure);
+        break;
+      }
+
+      // APPLY
+      case LUNA_OP_APPLY: {
+        luna_value_t callee = R(A(i));
+        if (LUNA_TYPE_FUNCTION == luna_value_type(callee)) {
+          luna_closure_t *closure = (luna_closure_t *) luna_as_pointer(callee);
+          if (accepts(closure->fn, &R(A(i) + 1), C(i))) {
+            R(A(i)) = execute(vm, closure->fn, closure->upvalues, &R(A(i) + 1), C(i));
+            break;
+          }
+        }
+        LUNA_NIL(R(A(i)));
+        break;
+      }
+
+      // BOX
+      case LUNA_OP_BOX: {
+        luna_value_t *cell = allocate(vm, LUNA_TYPE_CELL, sizeof(luna_value_t));
+        *cell = R(A(i));
+        R(A(i)) = luna_value_pointer(LUNA_TYPE_CELL, cell);
+        break;
+      }
+
+      // GETCELL
+      case LUNA_OP_GETCELL:
+        R(A(i)) = *(luna_value_t *) luna_as_pointer(R(B(i)));
+        break;
+
+      // SETCELL
+      case LUNA_OP_SETCELL: {
+        luna_value_t *cell = luna_as_pointer(R(A(i)));
+        luna_gc_barrier(&vm->gc, cell, cell, R(B(i)));
+        __atomic_store_n(cell, R(B(i)), __ATOMIC_RELEASE);
+        break;
+      }
+
+      // NEWOBJECT
+      case LUNA_OP_NEWOBJECT: {
+        luna_object_t *obj = allocate(vm, LUNA_TYPE_OBJECT, luna_object_size(B(i)));
+        luna_object_init(obj, vm->shapes, B(i));
+        R(A(i)) = luna_value_pointer(LUNA_TYPE_OBJECT, obj);
+        break;
+      }
+
+      // GETFIELD
+      case LUNA_OP_GETFIELD: {
+        luna_value_t obj = R(B(i));
+        if (luna_is_object(obj)) {
+          R(A(i)) = luna_object_get(luna_as_pointer(obj), luna_as_pointer(K(C(i))), LOAD_CACHE(C(i)));
+        } else if (luna_is_record(obj)) {
+          luna_record_t *rec = luna_as_pointer(obj);
+          luna_field_t *field = luna_layout_field(luna_record_layout(rec), luna_as_pointer(K(C(i))));
+          R(A(i)) = field ? luna_record_get(rec, field) : LUNA_VALUE_NIL;
+        } else if (luna_is_array(obj)) {
+          R(A(i)) = luna_array_get(luna_as_pointer(obj), luna_as_pointer(K(C(i))));
+        } else {
+          LUNA_NIL(R(A(i)));
+        }
+        break;
+      }
+
+      // SETFIELD
+      case LUNA_OP_SETFIELD: {
+        luna_value_t obj = R(A(i));
+        if (luna_is_object(obj)) {
+          store(vm, luna_as_pointer(obj), luna_as_pointer(K(B(i))), STORE_CACHE(B(i)), RK(C(i)));
+        } else if (luna_is_record(obj)) {
+          luna_record_t *rec = luna_as_pointer(obj);
+          luna_field_t *field = luna_layout_field(luna_record_layout(rec), luna_as_pointer(K(B(i))));
+          luna_value_t *ptr = field ? luna_record_set(rec, field, RK(C(i))) : NULL;
+          if (ptr) put(vm, luna_record_owner(rec), ptr, RK(C(i)));
+        }
         break;
+      }
 
-      // HALT
+      // NEWRECORD
+      case LUNA_OP_NEWRECORD: {
+        luna_layout_t *layout = kv_A(vm->layouts->defs, B(i));
+        luna_record_t *rec = allocate(vm, LUNA_TYPE_RECORD, luna_record_size(layout));
+        luna_record_init(rec, layout);
+        R(A(i)) = luna_value_pointer(LUNA_TYPE_RECORD, rec);
+        break;
+      }
+
+      // CHECK
+      case LUNA_OP_CHECK:
+        R(A(i)) = luna_record_check(R(A(i)), kv_A(vm->layouts->defs, B(i)));
+        break;
+
+      // GETI
+      case LUNA_OP_GETI:
+        R(A(i)) = luna_record_geti(R(B(i)), C(i));
+        break;
+
+      // GETF
+      case LUNA_OP_GETF:
+        R(A(i)) = luna_record_getf(R(B(i)), C(i));
+        break;
+
+      // GETV
+      case LUNA_OP_GETV:
+        R(A(i)) = luna_record_getv(R(B(i)), C(i));
+        break;
+
+      // SETI
+      case LUNA_OP_SETI:
+        luna_record_seti(R(A(i)), B(i), RK(C(i)));
+        break;
+
+      // SETF
+      case LUNA_OP_SETF:
+        luna_record_setf(R(A(i)), B(i), RK(C(i)));
+        break;
+
+      // SETV
+      case LUNA_OP_SETV: {
+        luna_value_t *field = luna_record_slot(R(A(i)), B(i));
+        if (field) put(vm, luna_record_owner(luna_as_pointer(R(A(i)))), field, RK(C(i)));
+        break;
+      }
+
+      // NEWARRAY
+      case LUNA_OP_NEWARRAY: {
+        luna_layout_t *layout = kv_A(vm->layouts->defs, B(i));
+        int length = luna_record_int(RK(C(i)));
+        luna_array_t *arr = allocate(vm, LUNA_TYPE_ARRAY, luna_array_size(layout));
+        luna_array_init(arr, layout, length < 0 ? 0 : length);
+        luna_gc_own(&vm->gc, arr);
+        R(A(i)) = luna_value_pointer(LUNA_TYPE_ARRAY, arr);
+        break;
+      }
+
+      // CHECKARRAY
+      case LUNA_OP_CHECKARRAY:
+        R(A(i)) = luna_array_check(R(A(i)), kv_A(vm->layouts->defs, B(i)));
+        break;
+
+      // GETINDEX, the array is read again once the view is allocated
+      case LUNA_OP_GETINDEX: {
+        int index = luna_is_array(R(B(i))) ? luna_array_index(R(B(i)), RK(C(i))) : -1;
+        if (index < 0) {
+          LUNA_NIL(R(A(i)));
+          break;
+        }
+        luna_array_t *arr = luna_as_pointer(R(B(i)));
+        if (!arr->layout) {
+          R(A(i)) = luna_array_at(arr, index);
+          break;
+        }
+        luna_view_t *view = allocate(vm, LUNA_TYPE_RECORD, sizeof(luna_view_t));
+        luna_view_init(view, R(B(i)), index);
+        R(A(i)) = luna_value_pointer(LUNA_TYPE_RECORD, view);
+        break;
+      }
+
+      // SETINDEX
+      case LUNA_OP_SETINDEX: {
+        luna_value_t arr = R(A(i));
+        if (!luna_is_array(arr)) break;
+        if (!((luna_array_t *) luna_as_pointer(arr))->layout) {
+          int index = luna_array_end(arr, RK(B(i)));
+          if (index > -1) put_packed(vm, luna_as_pointer(arr), index, RK(C(i)));
+          break;
+        }
+        int index = luna_array_index(arr, RK(B(i)));
+        if (index > -1) put_element(vm, luna_as_pointer(arr), index, RK(C(i)));
+        break;
+      }
+
+      // GETCI
+      case LUNA_OP_GETCI:
+        R(A(i)) = luna_array_geti(R(B(i)), C(i), R(B(i) + 1));
+        break;
+
+      // GETCF
+      case LUNA_OP_GETCF:
+        R(A(i)) = luna_array_getf(R(B(i)), C(i), R(B(i) + 1));
+        break;
+
+      // GETCV
+      case LUNA_OP_GETCV:
+        R(A(i)) = luna_array_getv(R(B(i)), C(i), R(B(i) + 1));
+        break;
+
+      // SETCI
+      case LUNA_OP_SETCI:
+        luna_array_seti(R(A(i)), B(i), R(A(i) + 1), RK(C(i)));
+        break;
+
+      // SETCF
+      case LUNA_OP_SETCF:
+        luna_array_setf(R(A(i)), B(i), R(A(i) + 1), RK(C(i)));
+        break;
+
+      // SETCV
+      case LUNA_OP_SETCV: {
+        luna_value_t *field = luna_array_slot(R(A(i)), B(i), R(A(i) + 1));
+        if (field) put(vm, luna_as_pointer(R(A(i))), field, RK(C(i)));
+        break;
+      }
+
+      // NEWLIST
+      case LUNA_OP_NEWLIST: {
+        luna_array_t *arr = allocate(vm, LUNA_TYPE_ARRAY, LUNA_ARRAY_PACKED_SIZE);
+        luna_array_init_packed(arr, B(i));
+        luna_gc_own(&vm->gc, arr);
+        R(A(i)) = luna_value_pointer(LUNA_TYPE_ARRAY, arr);
+        break;
+      }
+
+      // APPEND
+      case LUNA_OP_APPEND: {
+        luna_array_t *arr = luna_as_pointer(R(A(i)));
+        put_packed(vm, arr, arr->length, RK(B(i)));
+        break;
+      }
+
+      // RETURN, HALT
+      case LUNA_OP_RETURN:
       case LUNA_OP_HALT:
-        goto end;
+        vm->frame = frame.prev;
+        return R(A(i));
     }
   }
+}
 
-end:
-  return luna_int_new(R(0));
+luna_value_t
+luna_eval(luna_vm_t *vm) {
+  return execute(vm, vm->main, NULL, NULL, 0);
 }
 
 void
 luna_vm_free(luna_vm_t *vm) {
-  free(vm->main->constants);
-  free(vm->main->code);
-  free(vm->main);
+  activation_free(vm->main);
+  for (int i = 0; i < kv_size(vm->functions); ++i) {
+    activation_free(kv_A(vm->functions, i));
+  }
+  for (int i = 0; i < kv_size(vm->generics); ++i) {
+    kv_destroy(kv_A(vm->generics, i).overloads);
+    kh_destroy(tuples, kv_A(vm->generics, i).table);
+  }
+  luna_gc_free(&vm->gc);
+  luna_shape_free(vm->shapes);
+  luna_layouts_free(vm->layouts);
+  kv_destroy(vm->functions);
+  kv_destroy(vm->generics);
+  kv_destroy(vm->sites);
+  kv_destroy(vm->probes);
+  if (vm->profile) luna_profile_free(vm->profile);
   free(vm);
-}
\ No newline at end of file
+}
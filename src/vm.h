@@ -10,6 +10,12 @@
 
 #include <stdint.h>
 #include "ast.h"
+#include "khash.h"
+#include "lines.h"
+#include "profile.h"
+#include "gc.h"
+#include "object.h"
+#include "layouts.h"
 
 /*
  * Instruction.
@@ -18,23 +24,113 @@
 typedef uint32_t luna_instruction_t;
 
 /*
- * Luna activation record.
+ * Closure, defined below.
+ */
+
+typedef struct luna_closure luna_closure_t;
+
+/*
+ * Luna activation record. Functions accessing fields
+ * have the inline caches of their keys in `caches`.
+ * The `ncode` instructions of `code` are grown to
+ * `mcode` as they are generated.
  */
 
 typedef struct {
   luna_instruction_t *ip;
   luna_instruction_t *code; // TODO: pointer to single malloc()?
+  int ncode;
+  int mcode;
   int nconstants;
-  int *constants;
+  luna_value_t *constants;
+  int nparams;
+  int nrequired;
+  luna_object *params;
+  int nupvalues;
+  luna_closure_t *closure;
+  luna_cache_t *caches;
+  luna_lines_t lines;
 } luna_activation_t;
 
+/*
+ * Flat closure, the captured values or cells of `fn` copied
+ * into registers following its parameters when invoked.
+ * Functions capturing nothing share a single closure.
+ */
+
+struct luna_closure {
+  luna_activation_t *fn;
+  luna_value_t upvalues[];
+};
+
+/*
+ * Maximum number of arguments packed into a dispatch key,
+ * calls passing more are resolved without caching.
+ */
+
+#define LUNA_DISPATCH_KEY_ARGS 15
+
+/*
+ * Selected function index by packed argument type tuple.
+ */
+
+KHASH_MAP_INIT_INT64(tuples, int);
+
+/*
+ * Generic function, the overloads of a name as indices into
+ * the vm's functions, most specific first, and the dispatch
+ * table of those selected so far. Defining an overload
+ * clears the table and bumps its generation.
+ */
+
+typedef struct {
+  kvec_t(int) overloads;
+  khash_t(tuples) *table;
+  int generation;
+} luna_generic_t;
+
+/*
+ * Polymorphic call site, caching the function last
+ * selected along with the type tuple and generation
+ * of the generic it was selected from.
+ */
+
+typedef struct {
+  int generic;
+  int nargs;
+  uint64_t key;
+  int selected;
+  int generation;
+} luna_site_t;
+
+/*
+ * Call frame, the registers of an executing
+ * function and those of its caller.
+ */
+
+typedef struct luna_frame {
+  luna_value_t *registers;
+  struct luna_frame *prev;
+} luna_frame_t;
+
 /*
  * Luna VM.
  */
 
 typedef struct {
   luna_activation_t *main;
+  kvec_t(luna_activation_t *) functions;
+  kvec_t(luna_generic_t) generics;
+  kvec_t(luna_site_t) sites;
+  luna_gc_t gc; // closures, cells, objects and records allocated at runtime
+  luna_shape_t *shapes; // root of the shapes of objects
+  luna_layouts_t *layouts; // of records, by NEWRECORD index
+  luna_frame_t *frame;
+  kvec_t(uint64_t) probes; // profile keys of instrumented code
+  luna_profile_t *profile;
   luna_instruction_t *jump;
+  const char *err; // compile error, the vm is not run
+  int lineno;
 } luna_vm_t;
 
 /*
@@ -62,6 +158,30 @@ typedef struct {
   | (a) << 16 \
   | (b) << 8 )
 
+/*
+ *   8    8    16
+ * +----------------+
+ * | op | a |   bx  |
+ * +----------------+
+ */
+
+#define ABx(op, a, bx) \
+  ( LUNA_OP_##op << 24 \
+  | (a) << 16 \
+  | (bx) )
+
+/*
+ * Signed bx, biased so that it fits 16 bits.
+ */
+
+#define AsBx(op, a, sbx) ABx(op, a, (sbx) + LUNA_MAX_SBX)
+
+/*
+ * Maximum jump offset.
+ */
+
+#define LUNA_MAX_SBX 0x7fff
+
 /*
  * Opcode.
  */
@@ -86,6 +206,18 @@ typedef struct {
 
 #define C(i) ((i) & 0xff)
 
+/*
+ * Operand Bx.
+ */
+
+#define BX(i) ((i) & 0xffff)
+
+/*
+ * Operand sBx.
+ */
+
+#define SBX(i) ((int) BX(i) - LUNA_MAX_SBX)
+
 /*
  * Register n.
  */
@@ -96,7 +228,7 @@ typedef struct {
  * Constant n.
  */
 
-#define K(n) vm->main->constants[(n) - 32]
+#define K(n) fn->constants[(n) - 32]
 
 /*
  * Register or constant.
@@ -104,13 +236,42 @@ typedef struct {
 
 // TODO: MSB
 #define RK(n) \
-   ((n) < 32 ? R(n) : K(n))
+   (*((n) < 32 ? &R(n) : &K(n)))
+
+/*
+ * Inline caches of the loads and stores of field K(n),
+ * those of stores following those of loads.
+ */
+
+#define LOAD_CACHE(n) (&fn->caches[(n) - 32])
+#define STORE_CACHE(n) (&fn->caches[(n) - 32 + 256 - 32])
 
 // protoypes
 
-luna_object_t *
+luna_activation_t *
+luna_activation_new();
+
+int
+luna_generic_new(luna_vm_t *vm);
+
+void
+luna_generic_define(luna_vm_t *vm, int generic, int index);
+
+int
+luna_site_new(luna_vm_t *vm, int generic, int nargs);
+
+int
+luna_select(luna_vm_t *vm, luna_site_t *site, luna_value_t *args);
+
+luna_value_t
 luna_eval(luna_vm_t *vm);
 
+void
+luna_vm_scavenge(luna_vm_t *vm);
+
+size_t
+luna_vm_collect(luna_vm_t *vm);
+
 void
 luna_vm_free(luna_vm_t *vm);
 
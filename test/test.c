@@ -1,19 +1,34 @@
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <assert.h>
 #include <time.h>
+#include <math.h>
+#include <limits.h>
+#include <pthread.h>
 #include "utils.h"
 #include "errors.h"
 #include "lexer.h"
 #include "prettyprint.h"
 #include "parser.h"
 #include "khash.h"
-#include "state.h"
+#include "intern.h"
 #include "object.h"
+#include "slab.h"
 #include "hash.h"
+#include "pmap.h"
+#include "pvec.h"
 #include "vec.h"
+#include "array.h"
+#include "dce.h"
+#include "infer.h"
+#include "escape.h"
+#include "cse.h"
+#include "codegen.h"
+#include "opcodes.h"
+#include "emit.h"
 
 
 // print func for prettyprint
@@ -35,12 +50,26 @@ bprintf(const char *format, ...) {
 
 static void
 test_value_is() {
-  luna_object_t one = { .type = LUNA_TYPE_INT, .value.as_int = 1 };
-  assert(luna_is_int(&one));
-  assert(!luna_is_string(&one));
-
-  luna_object_t two = { .type = LUNA_TYPE_NULL };
-  assert(luna_is_null(&two));
+  luna_value_t one = luna_value_int(1);
+  assert(luna_is_int(one));
+  assert(!luna_is_string(one));
+  assert(!luna_is_float(one));
+
+  luna_value_t two = LUNA_VALUE_NIL;
+  assert(luna_is_null(two));
+
+  luna_value_t half = luna_value_float(0.5);
+  assert(luna_is_float(half));
+  assert(0.5 == luna_as_float(half));
+  assert(LUNA_TYPE_FLOAT == luna_value_type(luna_value_float(0.0 / 0.0)));
+
+  luna_value_t neg = luna_value_int(-7);
+  assert(LUNA_TYPE_INT == luna_value_type(neg));
+  assert(-7 == luna_as_int(neg));
+
+  luna_value_t ptr = luna_value_pointer(LUNA_TYPE_STRING, &two);
+  assert(luna_is_string(ptr));
+  assert(&two == luna_as_pointer(ptr));
 }
 
 /*
@@ -52,19 +81,19 @@ test_array_length() {
   luna_vec_t arr;
   luna_vec_init(&arr);
 
-  luna_object_t one = { .type = LUNA_TYPE_INT, .value.as_int = 1 };
-  luna_object_t two = { .type = LUNA_TYPE_INT, .value.as_int = 2 };
-  luna_object_t three = { .type = LUNA_TYPE_INT, .value.as_int = 3 };
+  luna_value_t one = luna_value_int(1);
+  luna_value_t two = luna_value_int(2);
+  luna_value_t three = luna_value_int(3);
 
   assert(0 == luna_vec_length(&arr));
 
-  luna_vec_push(&arr, &one);
+  luna_vec_push(&arr, one);
   assert(1 == luna_vec_length(&arr));
 
-  luna_vec_push(&arr, &two);
+  luna_vec_push(&arr, two);
   assert(2 == luna_vec_length(&arr));
 
-  luna_vec_push(&arr, &three);
+  luna_vec_push(&arr, three);
   assert(3 == luna_vec_length(&arr));
 }
 
@@ -77,32 +106,32 @@ test_array_push() {
   luna_vec_t arr;
   luna_vec_init(&arr);
 
-  luna_object_t one = { .type = LUNA_TYPE_INT, .value.as_int = 1 };
-  luna_object_t two = { .type = LUNA_TYPE_INT, .value.as_int = 2 };
-  luna_object_t three = { .type = LUNA_TYPE_INT, .value.as_int = 3 };
+  luna_value_t one = luna_value_int(1);
+  luna_value_t two = luna_value_int(2);
+  luna_value_t three = luna_value_int(3);
 
   assert(0 == luna_vec_length(&arr));
 
-  luna_vec_push(&arr, &one);
-  assert(1 == luna_vec_pop(&arr)->value.as_int);
-
-  luna_vec_push(&arr, &one);
-  luna_vec_push(&arr, &one);
-  assert(1 == luna_vec_pop(&arr)->value.as_int);
-  assert(1 == luna_vec_pop(&arr)->value.as_int);
-
-  luna_vec_push(&arr, &one);
-  luna_vec_push(&arr, &two);
-  luna_vec_push(&arr, &three);
-  assert(3 == luna_vec_pop(&arr)->value.as_int);
-  assert(2 == luna_vec_pop(&arr)->value.as_int);
-  assert(1 == luna_vec_pop(&arr)->value.as_int);
-
-  assert(NULL == luna_vec_pop(&arr));
-  assert(NULL == luna_vec_pop(&arr));
-  assert(NULL == luna_vec_pop(&arr));
-  luna_vec_push(&arr, &one);
-  assert(1 == luna_vec_pop(&arr)->value.as_int);
+  luna_vec_push(&arr, one);
+  assert(1 == luna_as_int(luna_vec_pop(&arr)));
+
+  luna_vec_push(&arr, one);
+  luna_vec_push(&arr, one);
+  assert(1 == luna_as_int(luna_vec_pop(&arr)));
+  assert(1 == luna_as_int(luna_vec_pop(&arr)));
+
+  luna_vec_push(&arr, one);
+  luna_vec_push(&arr, two);
+  luna_vec_push(&arr, three);
+  assert(3 == luna_as_int(luna_vec_pop(&arr)));
+  assert(2 == luna_as_int(luna_vec_pop(&arr)));
+  assert(1 == luna_as_int(luna_vec_pop(&arr)));
+
+  assert(luna_is_null(luna_vec_pop(&arr)));
+  assert(luna_is_null(luna_vec_pop(&arr)));
+  assert(luna_is_null(luna_vec_pop(&arr)));
+  luna_vec_push(&arr, one);
+  assert(1 == luna_as_int(luna_vec_pop(&arr)));
 }
 
 /*
@@ -114,21 +143,21 @@ test_array_at() {
   luna_vec_t arr;
   luna_vec_init(&arr);
 
-  luna_object_t one = { .type = LUNA_TYPE_INT, .value.as_int = 1 };
-  luna_object_t two = { .type = LUNA_TYPE_INT, .value.as_int = 2 };
-  luna_object_t three = { .type = LUNA_TYPE_INT, .value.as_int = 3 };
+  luna_value_t one = luna_value_int(1);
+  luna_value_t two = luna_value_int(2);
+  luna_value_t three = luna_value_int(3);
 
-  luna_vec_push(&arr, &one);
-  luna_vec_push(&arr, &two);
-  luna_vec_push(&arr, &three);
+  luna_vec_push(&arr, one);
+  luna_vec_push(&arr, two);
+  luna_vec_push(&arr, three);
 
-  assert(1 == luna_vec_at(&arr, 0)->value.as_int);
-  assert(2 == luna_vec_at(&arr, 1)->value.as_int);
-  assert(3 == luna_vec_at(&arr, 2)->value.as_int);
+  assert(1 == luna_as_int(luna_vec_at(&arr, 0)));
+  assert(2 == luna_as_int(luna_vec_at(&arr, 1)));
+  assert(3 == luna_as_int(luna_vec_at(&arr, 2)));
 
-  assert(NULL == luna_vec_at(&arr, -1123));
-  assert(NULL == luna_vec_at(&arr, 5));
-  assert(NULL == luna_vec_at(&arr, 1231231));
+  assert(luna_is_null(luna_vec_at(&arr, -1123)));
+  assert(luna_is_null(luna_vec_at(&arr, 5)));
+  assert(luna_is_null(luna_vec_at(&arr, 1231231)));
 }
 
 /*
@@ -140,50 +169,118 @@ test_array_iteration() {
   luna_vec_t arr;
   luna_vec_init(&arr);
 
-  luna_object_t one = { .type = LUNA_TYPE_INT, .value.as_int = 1 };
-  luna_object_t two = { .type = LUNA_TYPE_INT, .value.as_int = 2 };
-  luna_object_t three = { .type = LUNA_TYPE_INT, .value.as_int = 3 };
+  luna_value_t one = luna_value_int(1);
+  luna_value_t two = luna_value_int(2);
+  luna_value_t three = luna_value_int(3);
 
-  luna_vec_push(&arr, &one);
-  luna_vec_push(&arr, &two);
-  luna_vec_push(&arr, &three);
+  luna_vec_push(&arr, one);
+  luna_vec_push(&arr, two);
+  luna_vec_push(&arr, three);
 
   int vals[3];
   int k = 0;
 
-  luna_vec_each(&arr, { vals[k++] = val->value.as_int; });
+  luna_vec_each(&arr, { vals[k++] = luna_as_int(val); });
   assert(1 == vals[0]);
   assert(2 == vals[1]);
   assert(3 == vals[2]);
 }
 
+/*
+ * Test arrays spilling their inline elements.
+ */
+
+static void
+test_array_spill() {
+  luna_vec_t arr;
+  luna_vec_init(&arr);
+
+  for (int i = 0; i < LUNA_VEC_INLINE; ++i) {
+    luna_vec_push(&arr, luna_value_int(i));
+  }
+  assert(arr.a == arr.slots);
+
+  for (int i = LUNA_VEC_INLINE; i < 100; ++i) {
+    luna_vec_push(&arr, luna_value_int(i));
+  }
+  assert(arr.a != arr.slots);
+  assert(100 == luna_vec_length(&arr));
+  luna_vec_each(&arr, assert(i == luna_as_int(val)));
+  luna_vec_destroy(&arr);
+}
+
+/*
+ * Test luna_array_put() element kinds.
+ */
+
+static void
+test_array_kinds() {
+  luna_array_t *arr = malloc(LUNA_ARRAY_PACKED_SIZE);
+  luna_array_init_packed(arr, 1);
+
+  // empty arrays take the kind of their first element
+  assert(!luna_array_put(arr, 0, luna_value_float(0.5)));
+  assert(LUNA_ARRAY_FLOATS == arr->kind && 1 == arr->length);
+  assert(!luna_array_put(arr, 1, luna_value_float(1.5)));
+  assert(2 == arr->length && 2 == arr->capacity);
+  assert(1.5 == luna_as_float(luna_array_at(arr, 1)));
+
+  // others turn into arrays of values
+  luna_value_t *ptr = luna_array_put(arr, 0, luna_value_int(3));
+  assert(ptr && LUNA_ARRAY_VALUES == arr->kind);
+  *ptr = luna_value_int(3);
+  assert(3 == luna_as_int(luna_array_at(arr, 0)));
+  assert(1.5 == luna_as_float(luna_array_at(arr, 1)));
+  luna_array_destroy(arr);
+
+  // bools a bit each
+  luna_array_init_packed(arr, 0);
+  for (int i = 0; i < 20; ++i) {
+    assert(!luna_array_put(arr, i, luna_value_bool(i % 3 == 0)));
+  }
+  assert(LUNA_ARRAY_BOOLS == arr->kind && 20 == arr->length);
+  assert(!luna_array_put(arr, 9, luna_value_bool(0)));
+  assert(luna_as_int(luna_array_at(arr, 18)));
+  assert(!luna_as_int(luna_array_at(arr, 9)));
+  assert(!luna_as_int(luna_array_at(arr, 10)));
+  luna_array_destroy(arr);
+
+  // ints
+  luna_array_init_packed(arr, 2);
+  assert(!luna_array_put(arr, 0, luna_value_int(-7)));
+  assert(LUNA_ARRAY_INTS == arr->kind);
+  assert(-7 == luna_as_int(luna_array_at(arr, 0)));
+  luna_array_destroy(arr);
+  free(arr);
+}
+
 /*
  * Test luna_hash_set().
  */
 
 static void
 test_hash_set() {
-  luna_object_t one = { .type = LUNA_TYPE_INT, .value.as_int = 1 };
-  luna_object_t two = { .type = LUNA_TYPE_INT, .value.as_int = 2 };
-  luna_object_t three = { .type = LUNA_TYPE_INT, .value.as_int = 3 };
+  luna_value_t one = luna_value_int(1);
+  luna_value_t two = luna_value_int(2);
+  luna_value_t three = luna_value_int(3);
 
   luna_hash_t *obj = luna_hash_new();
 
   assert(0 == luna_hash_size(obj));
 
-  luna_hash_set(obj, "one", &one);
+  luna_hash_set(obj, luna_intern("one"), one);
   assert(1 == luna_hash_size(obj));
 
-  luna_hash_set(obj, "two", &two);
+  luna_hash_set(obj, luna_intern("two"), two);
   assert(2 == luna_hash_size(obj));
 
-  luna_hash_set(obj, "three", &three);
+  luna_hash_set(obj, luna_intern("three"), three);
   assert(3 == luna_hash_size(obj));
 
-  assert(&one == luna_hash_get(obj, "one"));
-  assert(&two == luna_hash_get(obj, "two"));
-  assert(&three == luna_hash_get(obj, "three"));
-  assert(NULL == luna_hash_get(obj, "four"));
+  assert(one == luna_hash_get(obj, luna_intern("one")));
+  assert(two == luna_hash_get(obj, luna_intern("two")));
+  assert(three == luna_hash_get(obj, luna_intern("three")));
+  assert(luna_is_null(luna_hash_get(obj, luna_intern("four"))));
 
   luna_hash_destroy(obj);
 }
@@ -194,14 +291,14 @@ test_hash_set() {
 
 static void
 test_hash_has() {
-  luna_object_t one = { .type = LUNA_TYPE_INT, .value.as_int = 1 };
+  luna_value_t one = luna_value_int(1);
 
   luna_hash_t *obj = luna_hash_new();
 
-  luna_hash_set(obj, "one", &one);
+  luna_hash_set(obj, luna_intern("one"), one);
 
-  assert(1 == luna_hash_has(obj, "one"));
-  assert(0 == luna_hash_has(obj, "foo"));
+  assert(1 == luna_hash_has(obj, luna_intern("one")));
+  assert(0 == luna_hash_has(obj, luna_intern("foo")));
 
   luna_hash_destroy(obj);
 }
@@ -212,21 +309,21 @@ test_hash_has() {
 
 static void
 test_hash_remove() {
-  luna_object_t one = { .type = LUNA_TYPE_INT, .value.as_int = 1 };
+  luna_value_t one = luna_value_int(1);
 
   luna_hash_t *obj = luna_hash_new();
 
-  luna_hash_set(obj, "one", &one);
-  assert(&one == luna_hash_get(obj, "one"));
+  luna_hash_set(obj, luna_intern("one"), one);
+  assert(one == luna_hash_get(obj, luna_intern("one")));
 
-  luna_hash_remove(obj, "one");
-  assert(NULL == luna_hash_get(obj, "one"));
+  luna_hash_remove(obj, luna_intern("one"));
+  assert(luna_is_null(luna_hash_get(obj, luna_intern("one"))));
 
-  luna_hash_set(obj, "one", &one);
-  assert(&one == luna_hash_get(obj, "one"));
+  luna_hash_set(obj, luna_intern("one"), one);
+  assert(one == luna_hash_get(obj, luna_intern("one")));
 
-  luna_hash_remove(obj, "one");
-  assert(NULL == luna_hash_get(obj, "one"));
+  luna_hash_remove(obj, luna_intern("one"));
+  assert(luna_is_null(luna_hash_get(obj, luna_intern("one"))));
 
   luna_hash_destroy(obj);
 }
@@ -250,19 +347,19 @@ valid_slot(const char *slot) {
 
 static void
 test_hash_iteration() {
-  luna_object_t one = { .type = LUNA_TYPE_INT, .value.as_int = 1 };
-  luna_object_t two = { .type = LUNA_TYPE_INT, .value.as_int = 2 };
-  luna_object_t three = { .type = LUNA_TYPE_INT, .value.as_int = 3 };
+  luna_value_t one = luna_value_int(1);
+  luna_value_t two = luna_value_int(2);
+  luna_value_t three = luna_value_int(3);
 
   luna_hash_t *obj = luna_hash_new();
 
   assert(0 == luna_hash_size(obj));
 
-  luna_hash_set(obj, "one", &one);
-  luna_hash_set(obj, "two", &two);
-  luna_hash_set(obj, "three", &three);
-  luna_hash_set(obj, "four", &three);
-  luna_hash_set(obj, "five", &three);
+  luna_hash_set(obj, luna_intern("one"), one);
+  luna_hash_set(obj, luna_intern("two"), two);
+  luna_hash_set(obj, luna_intern("three"), three);
+  luna_hash_set(obj, luna_intern("four"), three);
+  luna_hash_set(obj, luna_intern("five"), three);
 
   const char *slots[luna_hash_size(obj)];
   int i = 0;
@@ -288,30 +385,438 @@ test_hash_iteration() {
 
 static void
 test_hash_mixins() {
-  luna_object_t type = { .type = LUNA_TYPE_INT, .value.as_int = 1 };
+  luna_value_t type = luna_value_int(1);
   luna_vec_t arr;
   luna_vec_init(&arr);
 }
 
+/*
+ * Live bytes of all slab classes.
+ */
+
+static size_t
+slab_live() {
+  size_t n = 0;
+  for (int i = 0; i <= LUNA_SLAB_CLASSES; ++i) n += luna_slab_live(i);
+  return n;
+}
+
+/*
+ * Keys of the persistent map tests.
+ */
+
+static const char *pmap_keys[2000];
+
+static void
+init_pmap_keys() {
+  char buf[8];
+  for (int i = 0; i < 2000; ++i) {
+    snprintf(buf, sizeof(buf), "k%d", i);
+    pmap_keys[i] = luna_intern(buf);
+  }
+}
+
+/*
+ * Test luna_pmap_set().
+ */
+
+static void
+test_pmap_set() {
+  init_pmap_keys();
+  luna_pmap_t *map = luna_pmap_new();
+  luna_pmap_t *versions[2000];
+
+  for (int i = 0; i < 2000; ++i) {
+    luna_pmap_t *next = luna_pmap_set(map, pmap_keys[i], luna_value_int(i));
+    versions[i] = map;
+    map = next;
+  }
+
+  // earlier versions are untouched
+  assert(2000 == luna_pmap_size(map));
+  assert(500 == luna_pmap_size(versions[500]));
+  assert(!luna_pmap_has(versions[500], luna_intern("k500")));
+  assert(499 == luna_as_int(luna_pmap_get(versions[500], luna_intern("k499"))));
+  for (int i = 0; i < 2000; ++i) {
+    assert(i == luna_as_int(luna_pmap_get(map, pmap_keys[i])));
+  }
+
+  // replaced, copying the path to the key only
+  size_t before = slab_live();
+  luna_pmap_t *other = luna_pmap_set(map, luna_intern("k7"), luna_value_int(70));
+  assert(slab_live() - before < 4096);
+  assert(2000 == luna_pmap_size(other));
+  assert(70 == luna_as_int(luna_pmap_get(other, luna_intern("k7"))));
+  assert(7 == luna_as_int(luna_pmap_get(map, luna_intern("k7"))));
+  assert(luna_is_null(luna_pmap_get(other, luna_intern("nope"))));
+
+  int n = 0, sum = 0;
+  luna_pmap_each(other, {
+    ++n;
+    sum += luna_as_int(val);
+    assert(luna_as_int(val) == (0 == strcmp("k7", slot) ? 70 : atoi(slot + 1)));
+  });
+  assert(2000 == n && 1999 * 1000 + 63 == sum);
+
+  for (int i = 0; i < 2000; ++i) luna_pmap_release(versions[i]);
+  luna_pmap_release(other);
+  luna_pmap_release(map);
+}
+
+/*
+ * Test luna_pmap_remove().
+ */
+
+static void
+test_pmap_remove() {
+  init_pmap_keys();
+  size_t before = slab_live();
+
+  luna_pmap_t *map = luna_pmap_new();
+  for (int i = 0; i < 2000; ++i) {
+    luna_pmap_t *next = luna_pmap_set(map, pmap_keys[i], luna_value_int(i));
+    luna_pmap_release(map);
+    map = next;
+  }
+
+  luna_pmap_t *full = luna_pmap_retain(map);
+  for (int i = 0; i < 2000; i += 2) {
+    luna_pmap_t *next = luna_pmap_remove(map, pmap_keys[i]);
+    luna_pmap_release(map);
+    map = next;
+  }
+
+  assert(1000 == luna_pmap_size(map));
+  assert(2000 == luna_pmap_size(full));
+  for (int i = 0; i < 2000; ++i) {
+    assert(luna_pmap_has(map, pmap_keys[i]) == i % 2);
+    assert(luna_pmap_has(full, pmap_keys[i]));
+  }
+
+  // absent keys
+  luna_pmap_t *same = luna_pmap_remove(map, luna_intern("k0"));
+  assert(1000 == luna_pmap_size(same) && same->root == map->root);
+  luna_pmap_release(same);
+
+  for (int i = 1; i < 2000; i += 2) {
+    luna_pmap_t *next = luna_pmap_remove(map, pmap_keys[i]);
+    luna_pmap_release(map);
+    map = next;
+  }
+  assert(0 == luna_pmap_size(map) && !map->root);
+
+  luna_pmap_release(map);
+  luna_pmap_release(full);
+  assert(before == slab_live());
+}
+
+/*
+ * Test colliding hashes in persistent maps.
+ */
+
+static void
+test_pmap_collisions() {
+  const char *keys[] = {
+    luna_intern("AaAa"), luna_intern("AaBB"), luna_intern("BBAa"), luna_intern("BBBB")
+  };
+  assert(luna_string_hash(keys[0]) == luna_string_hash(keys[3]));
+
+  luna_pmap_t *map = luna_pmap_new();
+  for (int i = 0; i < 4; ++i) {
+    luna_pmap_t *next = luna_pmap_set(map, keys[i], luna_value_int(i));
+    luna_pmap_release(map);
+    map = next;
+  }
+
+  assert(4 == luna_pmap_size(map));
+  for (int i = 0; i < 4; ++i) assert(i == luna_as_int(luna_pmap_get(map, keys[i])));
+
+  luna_pmap_t *less = luna_pmap_remove(map, luna_intern("AaBB"));
+  assert(3 == luna_pmap_size(less));
+  assert(!luna_pmap_has(less, luna_intern("AaBB")) && luna_pmap_has(map, luna_intern("AaBB")));
+  assert(3 == luna_as_int(luna_pmap_get(less, luna_intern("BBBB"))));
+
+  luna_pmap_release(less);
+  luna_pmap_release(map);
+}
+
+/*
+ * Test luna_pvec_push() and luna_pvec_set().
+ */
+
+static void
+test_pvec_push() {
+  luna_pvec_t *vec = luna_pvec_new();
+  luna_pvec_t *versions[1100];
+
+  for (int i = 0; i < 1100; ++i) {
+    versions[i] = vec;
+    vec = luna_pvec_push(vec, luna_value_int(i));
+  }
+
+  assert(1100 == luna_pvec_length(vec));
+  assert(10 == vec->shift);
+  assert(33 == luna_pvec_length(versions[33]));
+  assert(luna_is_null(luna_pvec_at(versions[33], 33)));
+  luna_pvec_each(vec, assert(i == luna_as_int(val)));
+
+  luna_pvec_t *other = luna_pvec_set(vec, 1050, luna_value_int(-1));
+  assert(-1 == luna_as_int(luna_pvec_at(other, 1050)));
+  assert(1050 == luna_as_int(luna_pvec_at(vec, 1050)));
+  assert(vec->root->slots.children[0] == other->root->slots.children[0]);
+  assert(luna_is_null(luna_pvec_at(other, 1100)));
+
+  for (int i = 0; i < 1100; ++i) luna_pvec_release(versions[i]);
+  luna_pvec_release(other);
+  luna_pvec_release(vec);
+}
+
+/*
+ * Test luna_pvec_pop().
+ */
+
+static void
+test_pvec_pop() {
+  size_t before = slab_live();
+
+  luna_pvec_t *vec = luna_pvec_new();
+  for (int i = 0; i < 1100; ++i) {
+    luna_pvec_t *next = luna_pvec_push(vec, luna_value_int(i));
+    luna_pvec_release(vec);
+    vec = next;
+  }
+
+  luna_pvec_t *full = luna_pvec_retain(vec);
+  while (luna_pvec_length(vec) > 32) {
+    luna_pvec_t *next = luna_pvec_pop(vec);
+    luna_pvec_release(vec);
+    vec = next;
+  }
+
+  assert(0 == vec->shift && 32 == luna_pvec_length(vec));
+  luna_pvec_each(vec, assert(i == luna_as_int(val)));
+  assert(1099 == luna_as_int(luna_pvec_at(full, 1099)));
+
+  luna_pvec_t *more = luna_pvec_push(vec, luna_value_int(7));
+  assert(7 == luna_as_int(luna_pvec_at(more, 32)));
+  assert(31 == luna_as_int(luna_pvec_at(more, 31)));
+
+  luna_pvec_release(more);
+  luna_pvec_release(vec);
+  luna_pvec_release(full);
+  assert(before == slab_live());
+}
+
+/*
+ * Versions of a map derived and dropped on a thread.
+ */
+
+static void *
+derive(void *data) {
+  luna_pmap_t *map = data;
+  for (int i = 0; i < 200; ++i) {
+    luna_pmap_t *next = luna_pmap_set(map, pmap_keys[i], luna_value_int(-i));
+    assert(i == luna_as_int(luna_pmap_get(map, pmap_keys[i])));
+    assert(-i == luna_as_int(luna_pmap_get(next, pmap_keys[i])));
+    luna_pmap_release(next);
+  }
+  luna_pmap_release(map);
+  return NULL;
+}
+
+/*
+ * Test sharing persistent maps between threads.
+ */
+
+static void
+test_pmap_threads() {
+  init_pmap_keys();
+  luna_pmap_t *map = luna_pmap_new();
+  for (int i = 0; i < 2000; ++i) {
+    luna_pmap_t *next = luna_pmap_set(map, pmap_keys[i], luna_value_int(i));
+    luna_pmap_release(map);
+    map = next;
+  }
+
+  pthread_t threads[4];
+  for (int i = 0; i < 4; ++i) {
+    pthread_create(&threads[i], NULL, derive, luna_pmap_retain(map));
+  }
+  for (int i = 0; i < 4; ++i) pthread_join(threads[i], NULL);
+
+  assert(1 == map->refs);
+  assert(0 == luna_as_int(luna_pmap_get(map, luna_intern("k0"))));
+  luna_pmap_release(map);
+}
+
 /*
  * Test strings.
  */
 
 static void
 test_string() {
-  luna_state_t state;
-  luna_state_init(&state);
+  const char *str = luna_intern("foo bar baz");
+  assert(0 == strcmp("foo bar baz", str));
+  assert(11 == luna_string_len(str));
+  assert(kh_str_hash_func("foo bar baz") == luna_string_hash(str));
+
+  char buf[] = "foo bar baz";
+  assert(str == luna_intern(buf));
+  assert(str != luna_intern("foo bar"));
+  assert(luna_intern("foo bar") == luna_intern_len(buf, 7));
+
+  // interned
+  assert(luna_interned(str));
+  assert(!luna_interned(buf));
+  assert(!luna_interned("not interned"));
+
+  // embedded NUL
+  const char *nul = luna_intern_len("a\0b", 3);
+  assert(3 == luna_string_len(nul));
+  assert(nul != luna_intern("a"));
+  assert(nul == luna_intern_len("a\0b", 3));
+
+  // grows past the initial buckets
+  const char *keys[2000];
+  for (int i = 0; i < 2000; ++i) {
+    snprintf(buf, sizeof(buf), "s%d", i);
+    keys[i] = luna_intern(buf);
+  }
+  for (int i = 0; i < 2000; ++i) {
+    snprintf(buf, sizeof(buf), "s%d", i);
+    assert(keys[i] == luna_intern(buf));
+  }
+}
+
+/*
+ * Intern `arg`'s strings from a thread.
+ */
+
+static void *
+intern_strings(void *arg) {
+  const char **keys = arg;
+  char buf[16];
+  for (int i = 0; i < 1000; ++i) {
+    snprintf(buf, sizeof(buf), "t%d", i);
+    keys[i] = luna_intern(buf);
+  }
+  return NULL;
+}
+
+/*
+ * Test interning from several threads.
+ */
+
+static void
+test_string_threads() {
+  const char *keys[4][1000];
+  pthread_t threads[4];
+  for (int i = 0; i < 4; ++i) pthread_create(&threads[i], NULL, intern_strings, keys[i]);
+  for (int i = 0; i < 4; ++i) pthread_join(threads[i], NULL);
+
+  for (int i = 0; i < 1000; ++i) {
+    assert(keys[0][i] == keys[1][i]);
+    assert(keys[0][i] == keys[2][i]);
+    assert(keys[0][i] == keys[3][i]);
+  }
+}
+
+/*
+ * Test identifiers and strings are interned by the lexer.
+ */
+
+static void
+test_string_lexer() {
+  char source[] = "foo 'foo' foo";
+  luna_lexer_t lex;
+  luna_lexer_init(&lex, source, "test");
+
+  assert(luna_scan(&lex));
+  const char *id = lex.tok.value.as_string;
+  assert(luna_scan(&lex));
+  const char *str = lex.tok.value.as_string;
+  assert(luna_scan(&lex));
+
+  assert(id == luna_intern("foo"));
+  assert(str == id);
+  assert(lex.tok.value.as_string == id);
+}
+
+/*
+ * Test slab size classes.
+ */
+
+static void
+test_slab_class() {
+  assert(0 == luna_slab_class(0));
+  assert(0 == luna_slab_class(1));
+  assert(0 == luna_slab_class(16));
+  assert(1 == luna_slab_class(17));
+  assert(4 == luna_slab_class(80));
+  assert(LUNA_SLAB_CLASSES - 1 == luna_slab_class(LUNA_SLAB_MAX));
+  assert(-1 == luna_slab_class(LUNA_SLAB_MAX + 1));
+
+  for (size_t n = 1; n <= LUNA_SLAB_MAX; ++n) {
+    assert(luna_slab_size(luna_slab_class(n)) >= n);
+  }
+}
 
-  luna_string_t *str = luna_string(&state, "foo bar baz");
-  assert(0 == strcmp("foo bar baz", str->val));
+/*
+ * Test slab allocation.
+ */
 
-  str = luna_string(&state, "foo bar baz");
-  assert(0 == strcmp("foo bar baz", str->val));
+static void
+test_slab_alloc() {
+  int class = luna_slab_class(24);
+  size_t before = luna_slab_live(class);
+
+  void *a = luna_slab_alloc(24);
+  void *b = luna_slab_alloc(24);
+  assert(a && b && a != b);
+  assert(before + 2 * luna_slab_size(class) == luna_slab_live(class));
+
+  // freed blocks are reused first
+  luna_slab_free(b, 24);
+  assert(b == luna_slab_alloc(24));
+
+  luna_slab_free(a, 24);
+  luna_slab_free(b, 24);
+  assert(before == luna_slab_live(class));
+
+  size_t large = luna_slab_live(LUNA_SLAB_LARGE);
+  void *c = luna_slab_alloc(LUNA_SLAB_MAX + 1);
+  assert(large + LUNA_SLAB_MAX + 1 == luna_slab_live(LUNA_SLAB_LARGE));
+  luna_slab_free(c, LUNA_SLAB_MAX + 1);
+  assert(large == luna_slab_live(LUNA_SLAB_LARGE));
+}
 
-  for (int i = 0; i < 200; ++i) str = luna_string(&state, "foo");
-  assert(0 == strcmp("foo", str->val));
+/*
+ * Test slab backed values and containers.
+ */
 
-  assert(2 == kh_size(state.strs));
+static void
+test_slab_values() {
+  int class = luna_slab_class(sizeof("foo bar"));
+  size_t before = luna_slab_live(class);
+
+  luna_value_t str = luna_string_new("foo bar");
+  assert(0 == strcmp("foo bar", luna_as_pointer(str)));
+  assert(luna_intern("foo bar") == luna_as_pointer(str));
+  assert(before == luna_slab_live(class));
+
+  class = luna_slab_class(sizeof(luna_vec_t));
+  before = luna_slab_live(class);
+  luna_vec_t *vec = luna_vec_new();
+  luna_vec_push(vec, luna_value_int(1));
+  luna_vec_free(vec);
+  assert(before == luna_slab_live(class));
+
+  class = luna_slab_class(sizeof(luna_hash_t));
+  before = luna_slab_live(class);
+  luna_hash_t *hash = luna_hash_new();
+  luna_hash_set(hash, luna_intern("one"), luna_value_int(1));
+  luna_hash_destroy(hash);
+  assert(before == luna_slab_live(class));
 }
 
 /*
@@ -376,63 +881,1855 @@ test_use() {
 }
 
 /*
- * Test the given `fn`.
+ * Test dead code elimination.
  */
 
-#define test(fn) \
-  printf("    \e[92m✓ \e[90m%s\e[0m\n", #fn); \
-  test_##fn();
+static void
+_test_dce(const char *source_path, const char *out_path) {
+  luna_lexer_t lexer;
+  luna_parser_t parser;
+  luna_block_node_t *root;
+  luna_dce_stats_t stats = { 0, 0 };
+
+  char *source = file_read(source_path);
+  assert(source != NULL);
+  char *expected = file_read(out_path);
+  assert(expected != NULL);
+
+  luna_lexer_init(&lexer, source, source_path);
+  luna_parser_init(&parser, &lexer);
+
+  if (!(root = luna_parse(&parser))) {
+    luna_report_error(&parser);
+    exit(1);
+  }
+
+  luna_dce((luna_node_t *) root, &stats);
+  assert(stats.stmts > 0);
+
+  char buf[1024] = {0};
+  print_buf = buf;
+  luna_set_prettyprint_func(bprintf);
+  luna_prettyprint((luna_node_t *) root);
+
+  assert(strcmp(expected, print_buf) == 0);
+}
+
+static void
+test_dce_return() {
+  _test_dce("test/dce/return.luna", "test/dce/return.out");
+}
+
+static void
+test_dce_if() {
+  _test_dce("test/dce/if.luna", "test/dce/if.out");
+}
+
+static void
+test_dce_let() {
+  _test_dce("test/dce/let.luna", "test/dce/let.out");
+}
 
 /*
- * Test suite title.
+ * Parse and generate code for `source`.
  */
 
-#define suite(title) \
-  printf("\n  \e[36m%s\e[0m\n", title)
+static luna_vm_t *
+gen_with(const char *source, luna_gen_options_t *options) {
+  luna_lexer_t lexer;
+  luna_parser_t parser;
+  luna_block_node_t *root;
+
+  // the lexer scans in place
+  char *buf = strdup(source);
+  luna_lexer_init(&lexer, buf, "test");
+  luna_parser_init(&parser, &lexer);
+
+  if (!(root = luna_parse(&parser))) {
+    luna_report_error(&parser);
+    exit(1);
+  }
+
+  luna_infer((luna_node_t *) root);
+  luna_vm_t *vm = luna_gen_with((luna_node_t *) root, options);
+  free(buf);
+  return vm;
+}
 
 /*
- * Report sizeof.
+ * Generate code for `source`.
  */
 
-#define size(type) \
-  printf("\n  \e[90m%s: %ld bytes\e[0m\n", #type, sizeof(type));
+static luna_vm_t *
+gen(const char *source) {
+  luna_gen_options_t options = { .threads = 0 };
+  return gen_with(source, &options);
+}
 
 /*
- * Run all test suites.
+ * Evaluate `source` returning the int result.
  */
 
-int
-main(int argc, const char **argv){
-  clock_t start = clock();
+static int
+eval(const char *source) {
+  luna_vm_t *vm = gen(source);
+  int val = luna_as_int(luna_eval(vm));
+  luna_vm_free(vm);
+  return val;
+}
 
-  size(luna_object_t);
+/*
+ * Count `op` instructions of `vm`.
+ */
 
-  suite("value");
-  test(value_is);
+static int
+ops(luna_vm_t *vm, luna_op_t op) {
+  int n = 0;
+  for (int j = -1; j < (int) kv_size(vm->functions); ++j) {
+    luna_activation_t *fn = j < 0 ? vm->main : kv_A(vm->functions, j);
+    for (int i = 0; i < fn->ncode; ++i) {
+      if (op == OP(fn->code[i])) ++n;
+    }
+  }
+  return n;
+}
 
-  suite("array");
-  test(array_length);
-  test(array_push);
-  test(array_at);
-  test(array_iteration);
+/*
+ * Count `op` instructions generated for `source`.
+ */
 
-  suite("hash");
-  test(hash_set);
-  test(hash_has);
-  test(hash_remove);
-  test(hash_iteration);
-  test(hash_mixins);
+static int
+count_op(const char *source, luna_op_t op) {
+  luna_vm_t *vm = gen(source);
+  int n = ops(vm, op);
+  luna_vm_free(vm);
+  return n;
+}
 
-  suite("string");
-  test(string);
+static void
+test_codegen_arithmetic() {
+  assert(7 == eval("1 + 2 * 3"));
+  assert(-4 == eval("-3 + ~0"));
+  assert(15 == eval("x = 5\ny = 0\nwhile x > 0\n  y += x\n  x -= 1\nend\ny"));
+}
 
-  suite("parser");
-  test(assign);
-  test(assign_chain);
-  test(subscript);
-  test(declaration);
-  test(return);
-  test(use);
+static void
+test_codegen_logical() {
+  assert(1 == eval("a = 1\nb = 2\na < b && b < 3"));
+  assert(0 == eval("a = 1\nb = 2\na < b && b > 3"));
+  assert(4 == eval("a = 0\na || 4"));
+  assert(0 == eval("a = 0\na && 4"));
+  assert(1 == eval("not 0"));
+  assert(0 == eval("not (1 < 2)"));
+}
+
+static void
+test_codegen_short_circuit() {
+  assert(0 == eval("a = 0\n0 && (a = 1)\na"));
+  assert(0 == eval("a = 0\n1 || (a = 1)\na"));
+  assert(1 == eval("a = 0\n1 && (a = 1)\na"));
+  assert(7 == eval("a = 3\na &&= 7\na"));
+  assert(0 == eval("a = 0\na &&= 7\na"));
+  assert(9 == eval("a = 0\na ||= 9\na"));
+  assert(3 == eval("a = 3\na ||= 9\na"));
+}
+
+static void
+test_codegen_branch() {
+  const char *source = "a = 1\nb = 2\nc = 0\nif a < b && !(b < a) || c\n  c = 1\nend\nc";
+  assert(1 == eval(source));
+  assert(0 == count_op(source, LUNA_OP_LOADB));
+  assert(0 == count_op(source, LUNA_OP_NOT));
+  assert(42 == eval("a = 2\nif a > 5\n  a = 1\nelse if a > 1\n  a = 42\nelse\n  a = 3\nend\na"));
+  assert(5 == eval("x = 0\nunless x\n  x = 5\nend\nx"));
+}
+
+static void
+test_codegen_large() {
+  const char *stmt = "n = n + 1\n";
+  size_t len = strlen(stmt);
+  char *buf = malloc(20000 * len + 16);
+  char *p = buf + sprintf(buf, "n = 0\n");
+  for (int i = 0; i < 20000; ++i, p += len) memcpy(p, stmt, len);
+  strcpy(p, "n");
+
+  luna_vm_t *vm = gen(buf);
+  assert(vm->main->ncode > 20000 && vm->main->ncode <= vm->main->mcode);
+  assert(20000 == luna_as_int(luna_eval(vm)));
+  luna_vm_free(vm);
+  free(buf);
+}
+
+static void
+test_codegen_limits() {
+  char buf[8192];
+  char *p = buf;
+  for (int i = 0; i < 40; ++i) p += sprintf(p, "a%d = %d\n", i, i);
+  strcpy(p, "a0");
+  luna_vm_t *vm = gen(buf);
+  assert(vm->err && 0 == strcmp("too many variables", vm->err));
+  assert(33 == vm->lineno);
+  luna_vm_free(vm);
+
+  p = buf + sprintf(buf, "n = 0\n");
+  for (int i = 0; i < 300; ++i) p += sprintf(p, "n = n + %d\n", i + 1000);
+  strcpy(p, "n");
+  vm = gen(buf);
+  assert(vm->err && 0 == strcmp("too many constants", vm->err));
+  luna_vm_free(vm);
+
+  vm = gen("a = 1\nb = 2\na + b");
+  assert(!vm->err);
+  luna_vm_free(vm);
+}
+
+/*
+ * Infer `source`, returning the type of its last statement.
+ */
+
+static luna_object
+infer(const char *source) {
+  luna_lexer_t lexer;
+  luna_parser_t parser;
+  luna_block_node_t *root;
+
+  char *buf = strdup(source);
+  luna_lexer_init(&lexer, buf, "test");
+  luna_parser_init(&parser, &lexer);
+
+  if (!(root = luna_parse(&parser))) {
+    luna_report_error(&parser);
+    exit(1);
+  }
+
+  luna_infer((luna_node_t *) root);
+  luna_value_t last = luna_vec_at(root->stmts, luna_vec_length(root->stmts) - 1);
+  free(buf);
+  return ((luna_node_t *) luna_as_pointer(last))->inferred;
+}
+
+static void
+test_infer_literals() {
+  assert(LUNA_TYPE_INT == infer("1 + 2 * 3"));
+  assert(LUNA_TYPE_FLOAT == infer("1 + 2.5"));
+  assert(LUNA_TYPE_BOOL == infer("1 < 2"));
+  assert(LUNA_TYPE_BOOL == infer("!1"));
+  assert(LUNA_TYPE_INT == infer("1.5 ^ 3"));
+  assert(LUNA_TYPE_STRING == infer("'foo'"));
+  assert(LUNA_TYPE_NULL == infer("nil"));
+}
+
+static void
+test_infer_locals() {
+  assert(LUNA_TYPE_INT == infer("a = 1\nb = a\nb"));
+  assert(LUNA_TYPE_FLOAT == infer("let a:float = 1.5\na * 2.0"));
+  assert(LUNA_TYPE_ANY == infer("a = 1\na = 2.5\na"));
+  assert(LUNA_TYPE_ANY == infer("let a\na = 1\na"));
+  assert(LUNA_TYPE_NULL == infer("b = a\na = 1\nb"));
+  assert(LUNA_TYPE_ANY == infer("a = 1\na + 'foo'"));
+}
+
+static void
+test_infer_loops() {
+  assert(LUNA_TYPE_INT == infer("x = 1\nwhile x < 10\n  x += 1\nend\nx"));
+  assert(LUNA_TYPE_ANY == infer("x = 1\ny = 0\nwhile x < 10\n  y = x\n  x = x + 0.5\nend\ny"));
+}
+
+static void
+test_codegen_typed() {
+  assert(1 == count_op("a = 1\nb = 2\na + b", LUNA_OP_ADDI));
+  assert(0 == count_op("a = 1\nb = 2\na + b", LUNA_OP_ADD));
+  assert(1 == count_op("a = 1.5\nb = 2.0\na * b", LUNA_OP_MULF));
+  assert(1 == count_op("a = 1\nb = 2.0\na * b", LUNA_OP_MUL));
+  assert(1 == count_op("a = 1\na = 2.5\na - 1", LUNA_OP_SUB));
+  assert(2 == count_op("x = 0\nwhile x < 10\n  x++\nend\nx", LUNA_OP_LTI) + count_op("x = 0\nwhile x < 10\n  x++\nend\nx", LUNA_OP_ADDI));
+  assert(10 == eval("x = 0\nwhile x < 10\n  x++\nend\nx"));
+  assert(7 == eval("a = 17\nb = 10\na % b"));
+
+  luna_vm_t *vm = gen("a = 1.5\nb = a * 2\nb + 0.25");
+  luna_value_t val = luna_eval(vm);
+  assert(luna_is_float(val));
+  assert(3.25 == luna_as_float(val));
+  luna_vm_free(vm);
+}
+
+static void
+test_codegen_division() {
+  // by constants other than 0 and -1, typed
+  assert(1 == count_op("a = 7\na / 2", LUNA_OP_DIVI));
+  assert(1 == count_op("a = 7\na % 2", LUNA_OP_MODI));
+  assert(3 == eval("a = 7\na / 2"));
+  assert(0 == count_op("a = 7\nb = 2\na / b", LUNA_OP_DIVI));
+  assert(3 == eval("a = 7\nb = 2\na / b"));
+  assert(1 == count_op("a = 7\nb = 2\nc = a / b\nc + 1", LUNA_OP_ADD));
+
+  // int quotients that are no ints are floats
+  luna_vm_t *vm = gen("a = 1\nb = 0\na / b");
+  luna_value_t val = luna_eval(vm);
+  assert(luna_is_float(val) && isinf(luna_as_float(val)));
+  luna_vm_free(vm);
+
+  vm = gen("a = 7\nb = 0\na % b");
+  val = luna_eval(vm);
+  assert(luna_is_float(val) && isnan(luna_as_float(val)));
+  luna_vm_free(vm);
+
+  vm = gen("a = 0 - 2147483647 - 1\nb = 0 - 1\na / b");
+  val = luna_eval(vm);
+  assert(luna_is_float(val) && 2147483648.0 == luna_as_float(val));
+  luna_vm_free(vm);
+
+  assert(0 == eval("a = 0 - 2147483647 - 1\nb = 0 - 1\na % b"));
+  assert(1 == eval("a = 1\nb = 0\nc = a / b\n2 / 0 == c"));
+
+  // ints wrap
+  assert(INT_MIN == eval("a = 2147483647\na + 1"));
+  assert(INT_MIN == eval("a = 2147483647\nb = 1\nc = a\nc = b\na + c"));
+  assert(-2 == eval("a = 2147483647\na * 2"));
+  assert(INT_MIN == eval("a = 0 - 2147483647 - 1\n-a"));
+}
+
+static void
+test_dispatch_static() {
+  const char *call = "def f(a:int)\n  return a + 1\nend\nf(2)";
+  assert(1 == count_op(call, LUNA_OP_CALL));
+  assert(0 == count_op(call, LUNA_OP_DISPATCH));
+  assert(3 == eval(call));
+
+  const char *overloads =
+    "def f(a:int)\n  return 1\nend\n"
+    "def f(a:float)\n  return 2\nend\n"
+    "def f(a)\n  return 3\nend\n";
+  char buf[512];
+  snprintf(buf, sizeof(buf), "%sf(1) * 100 + f(1.5) * 10 + f(\"s\")", overloads);
+  assert(3 == count_op(buf, LUNA_OP_CALL));
+  assert(0 == count_op(buf, LUNA_OP_DISPATCH));
+  assert(123 == eval(buf));
+}
+
+static void
+test_dispatch_dynamic() {
+  const char *source =
+    "def f(a:int)\n  return 1\nend\n"
+    "def f(a)\n  return 2\nend\n"
+    "def g(a)\n  return f(a)\nend\n"
+    "g(1) * 10 + g(1.5)";
+  assert(1 == count_op(source, LUNA_OP_DISPATCH));
+  assert(12 == eval(source));
+  assert(0 == eval("def f(a:int)\n  return 1\nend\ndef g(a)\n  return f(a)\nend\ng(1.5)"));
+}
+
+static void
+test_dispatch_cache() {
+  luna_vm_t *vm = gen(
+    "def f(a:int)\n  return 1\nend\n"
+    "def f(a)\n  return 2\nend\n"
+    "def g(a)\n  return f(a)\nend\n"
+    "g(1) + g(1.5) + g(2) + g(true)");
+  assert(6 == luna_as_int(luna_eval(vm)));
+
+  // one entry per type tuple seen
+  assert(2 == kv_size(vm->generics));
+  luna_generic_t *f = &kv_A(vm->generics, 0);
+  assert(2 == kv_size(f->overloads));
+  assert(0 == kv_A(f->overloads, 0));
+  assert(3 == kh_size(f->table));
+
+  luna_site_t *site = &kv_A(vm->sites, 0);
+  assert(f->generation == site->generation);
+
+  // redefining invalidates
+  luna_generic_define(vm, 0, 0);
+  assert(0 == kh_size(f->table));
+  assert(f->generation != site->generation);
+
+  luna_value_t args[] = { luna_value_int(5) };
+  assert(0 == luna_select(vm, site, args));
+  assert(1 == kh_size(f->table));
+  assert(f->generation == site->generation);
+
+  luna_vm_free(vm);
+}
+
+static void
+test_dispatch_defaults() {
+  assert(11 == eval("def f(a:int, b:int = 10)\n  return a + b\nend\nf(1)"));
+  assert(3 == eval("def f(a:int, b:int = 10)\n  return a + b\nend\nf(1, 2)"));
+  assert(0 == count_op("def f(a:int, b:int = 10)\n  return a + b\nend\nf()", LUNA_OP_CALL));
+}
+
+static void
+test_infer_returns() {
+  assert(LUNA_TYPE_INT == infer("def f(a:int)\n  return a * 2\nend\nf(1)"));
+  assert(LUNA_TYPE_FLOAT == infer("def f(a:float)\n  return a\nend\nf(1.5)"));
+  assert(LUNA_TYPE_ANY == infer("def f(a)\n  if a\n    return 1\n  end\nend\nf(1)"));
+  assert(1 == count_op("def f(a:int)\n  return a\nend\nf(1) + 1", LUNA_OP_ADDI));
+}
+
+/*
+ * Check if aggregate `name` in `source` is scalar-replaced.
+ */
+
+static int
+scalar(const char *source, const char *name) {
+  luna_lexer_t lexer;
+  luna_parser_t parser;
+  luna_block_node_t *root;
+
+  char *buf = strdup(source);
+  luna_lexer_init(&lexer, buf, "test");
+  luna_parser_init(&parser, &lexer);
+
+  if (!(root = luna_parse(&parser))) {
+    luna_report_error(&parser);
+    exit(1);
+  }
+
+  khash_t(scalars) *scalars = luna_escape((luna_node_t *) root);
+  int ret = kh_get(scalars, scalars, name) != kh_end(scalars);
+  kh_destroy(scalars, scalars);
+  free(buf);
+  return ret;
+}
+
+static void
+test_escape_local() {
+  assert(scalar("v = {x: 1, y: 2}\nv.x + v.y", "v"));
+  assert(scalar("v = [1, 2]\nv[0] = v[1]\nv[0]", "v"));
+  assert(scalar("let v = {'x': 1}\nv['x'] += 1", "v"));
+  assert(scalar("while 1\n  v = {x: 1}\n  v.x++\nend", "v"));
+}
+
+static void
+test_escape_escaping() {
+  assert(!scalar("v = {x: 1}\nv", "v"));
+  assert(!scalar("v = {x: 1}\nw = v", "v"));
+  assert(!scalar("v = {x: 1}\nfoo(v)", "v"));
+  assert(!scalar("v = {x: 1}\nv.foo()", "v"));
+  assert(!scalar("v = {x: 1}\nreturn v", "v"));
+  assert(!scalar("v = {x: 1}\nv.z", "v"));
+  assert(!scalar("v = [1]\nv[i]", "v"));
+  assert(!scalar("v = [1]\nv[1]", "v"));
+  assert(!scalar("v = {x: 1}\nv = {x: 2}", "v"));
+  assert(!scalar("w = (v = {x: 1})", "v"));
+  assert(!scalar("v.x\nv = {x: 1}", "v"));
+  assert(!scalar("v = {x: 1}\ndef f()\n  v.x\nend", "v"));
+}
+
+/*
+ * Return the role in value numbering of the value
+ * assigned by statement `n` of `source`.
+ */
+
+static luna_cse_role
+numbered(const char *source, int n) {
+  luna_lexer_t lexer;
+  luna_parser_t parser;
+  luna_block_node_t *root;
+  int value;
+
+  char *buf = strdup(source);
+  luna_lexer_init(&lexer, buf, "test");
+  luna_parser_init(&parser, &lexer);
+
+  if (!(root = luna_parse(&parser))) {
+    luna_report_error(&parser);
+    exit(1);
+  }
+
+  luna_cse_t *cse = luna_cse((luna_node_t *) root, NULL);
+  luna_node_t *stmt = (luna_node_t *) luna_as_pointer(luna_vec_at(root->stmts, n));
+  assert(LUNA_NODE_BINARY_OP == stmt->type);
+  luna_cse_role role = luna_cse_lookup(cse, ((luna_binary_op_node_t *) stmt)->right, &value);
+  luna_cse_free(cse);
+  free(buf);
+  return role;
+}
+
+static void
+test_cse_binary() {
+  assert(LUNA_CSE_SAVE == numbered("c = a * b\nd = a * b", 0));
+  assert(LUNA_CSE_REUSE == numbered("c = a * b\nd = a * b", 1));
+  assert(LUNA_CSE_REUSE == numbered("c = a * b\nd = b * a", 1));
+  assert(LUNA_CSE_NONE == numbered("c = a - b\nd = b - a", 1));
+  assert(LUNA_CSE_REUSE == numbered("c = (a + 1) * b\nd = -c\ne = b * (a + 1)", 2));
+  assert(LUNA_CSE_NONE == numbered("c = a * b\na = 2\nd = a * b", 2));
+  assert(LUNA_CSE_NONE == numbered("c = a * b\nb++\nd = a * b", 2));
+  assert(LUNA_CSE_NONE == numbered("c = a < b\nd = a < b", 1));
+}
+
+static void
+test_cse_slot() {
+  assert(LUNA_CSE_SAVE == numbered("c = a.x * b.x\nd = a.x * b.x", 0));
+  assert(LUNA_CSE_REUSE == numbered("c = a.x * b.x\nd = a.x * b.x", 1));
+  assert(LUNA_CSE_REUSE == numbered("c = a.x\nd = a['x']", 1));
+  assert(LUNA_CSE_NONE == numbered("c = a.x * b.x\na.x = 4\nd = a.x * b.x", 2));
+  assert(LUNA_CSE_NONE == numbered("c = a.x * b.x\nb.y = 4\nd = a.x * b.x", 2));
+  assert(LUNA_CSE_NONE == numbered("c = a.x * b.x\nfoo()\nd = a.x * b.x", 2));
+  assert(LUNA_CSE_REUSE == numbered("c = a * b + a.x\nfoo()\nd = a * b", 2));
+  assert(LUNA_CSE_NONE == numbered("c = a[i]\nd = a[i]", 1));
+}
+
+static void
+test_cse_branches() {
+  assert(LUNA_CSE_REUSE == numbered("if c\n  d = a * b\nelse\n  e = a * b\nend\nf = a * b", 1));
+  assert(LUNA_CSE_NONE == numbered("if c\n  d = a * b\nend\nf = a * b", 1));
+  assert(LUNA_CSE_NONE == numbered("d = a * b\nif c\n  a = 1\nend\nf = a * b", 2));
+  assert(LUNA_CSE_REUSE == numbered("d = a * b\nif c\n  return 1\nend\nf = a * b", 2));
+  assert(LUNA_CSE_NONE == numbered("d = a * b\nwhile c\n  a++\nend\nf = a * b", 2));
+  assert(LUNA_CSE_REUSE == numbered("d = a * b\nwhile c\n  e++\nend\nf = a * b", 2));
+}
+
+static void
+test_cse_codegen() {
+  const char *source = "a = 3\nb = 4\nc = a * b + 1\nd = a * b + 2\nd - c";
+  assert(1 == eval(source));
+  assert(1 == count_op(source, LUNA_OP_MULI));
+  assert(24 == eval("a = 3\nb = 4\nif a < b\n  c = a * b\nelse\n  c = 0\nend\nc + a * b"));
+  assert(16 == eval("a = 3\nb = 4\nc = a * b\na = 4\nc + a + b - a * b + 12"));
+  assert(2 == count_op("a = 3\nb = 4\nc = a * b\na = 4\nc + a * b", LUNA_OP_MULI));
+  assert(28 == eval("a = 3\nb = 4\nc = 0\nwhile c < 20\n  c += a * b\nend\nc + a * b - 8"));
+  assert(12 == eval("def f(a, b)\n  c = a * b\n  return c * 2 - a * b\nend\nf(3, 4)"));
+}
+
+static void
+test_lines_lookup() {
+  luna_lines_t lines;
+  luna_lines_init(&lines);
+  assert(0 == luna_lines_lookup(&lines, 0));
+
+  luna_lines_add(&lines, 0, 1);
+  luna_lines_add(&lines, 3, 2);
+  luna_lines_add(&lines, 3, 2);
+  luna_lines_add(&lines, 5, 1);
+  luna_lines_add(&lines, 600, 300);
+  luna_lines_add(&lines, 601, 4);
+  assert(1 == luna_lines_lookup(&lines, 0));
+  assert(1 == luna_lines_lookup(&lines, 2));
+  assert(2 == luna_lines_lookup(&lines, 3));
+  assert(2 == luna_lines_lookup(&lines, 4));
+  assert(1 == luna_lines_lookup(&lines, 599));
+  assert(300 == luna_lines_lookup(&lines, 600));
+  assert(4 == luna_lines_lookup(&lines, 601));
+  assert(4 == luna_lines_lookup(&lines, 1000));
+
+  // across checkpoints
+  for (int i = 0; i < 1000; ++i) luna_lines_add(&lines, 700 + i * 3, 10 + i);
+  for (int i = 0; i < 1000; ++i) {
+    assert(10 + i == luna_lines_lookup(&lines, 700 + i * 3));
+    assert(10 + i == luna_lines_lookup(&lines, 702 + i * 3));
+  }
+  assert(2000 > luna_lines_size(&lines));
+  luna_lines_free(&lines);
+}
+
+static void
+test_lines_codegen() {
+  luna_vm_t *vm = gen("a = 1\nb = 2\n\nc = a * b + a\nwhile c < 10\n  c += 1\nend\nc");
+  luna_activation_t *fn = vm->main;
+  assert(1 == luna_lines_lookup(&fn->lines, 0));
+  assert(2 == luna_lines_lookup(&fn->lines, 1));
+  for (int i = 0; i < fn->ncode; ++i) {
+    int line = luna_lines_lookup(&fn->lines, i);
+    switch (OP(fn->code[i])) {
+      case LUNA_OP_MULI: assert(4 == line); break;
+      case LUNA_OP_LTI: assert(5 == line); break;
+      case LUNA_OP_ADDI: assert(4 == line || 6 == line); break;
+    }
+  }
+  luna_vm_free(vm);
+
+  // under a byte per instruction
+  char source[8192];
+  size_t len = 0;
+  for (int i = 0; i < 200; ++i) {
+    len += snprintf(source + len, sizeof(source) - len, "x%d = %d * %d + %d\n", i % 8, i, i + 1, i + 2);
+  }
+  vm = gen(source);
+  assert(luna_lines_size(&vm->main->lines) < vm->main->ncode);
+  luna_vm_free(vm);
+}
+
+/*
+ * Assert activations `a` and `b` are identical.
+ */
+
+static void
+same_activation(luna_activation_t *a, luna_activation_t *b) {
+  assert(a->ncode == b->ncode);
+  assert(0 == memcmp(a->code, b->code, a->ncode * sizeof(luna_instruction_t)));
+  assert(a->nconstants == b->nconstants);
+  assert(0 == memcmp(a->constants, b->constants, a->nconstants * sizeof(luna_value_t)));
+}
+
+static void
+test_codegen_threads() {
+  luna_lexer_t lexer;
+  luna_parser_t parser;
+  luna_block_node_t *root;
+
+  char *buf = strdup(
+    "def f(a:int)\n  return a + 1\nend\n"
+    "def f(a)\n  return 2.5\nend\n"
+    "def g(a)\n  add = :b\n    return f(a) + f(b)\n  end\n  return add(3)\nend\n"
+    "def h(a, b = 2)\n  return g(a) * b\nend\n"
+    "n = 0\ninc = :\n  n += h(1)\nend\ninc()\ninc()\nn");
+  luna_lexer_init(&lexer, buf, "test");
+  luna_parser_init(&parser, &lexer);
+  assert(root = luna_parse(&parser));
+  luna_infer((luna_node_t *) root);
+
+  luna_vm_t *a = luna_gen_threads((luna_node_t *) root, 1);
+  luna_vm_t *b = luna_gen_threads((luna_node_t *) root, 4);
+
+  // linked in the same order
+  same_activation(a->main, b->main);
+  assert(kv_size(a->functions) == kv_size(b->functions));
+  for (int i = 0; i < kv_size(a->functions); ++i) {
+    same_activation(kv_A(a->functions, i), kv_A(b->functions, i));
+  }
+  assert(kv_size(a->sites) == kv_size(b->sites));
+
+  luna_value_t val = luna_eval(b);
+  assert(luna_is_int(val) && 24 == luna_as_int(val));
+
+  luna_vm_free(a);
+  luna_vm_free(b);
+  free(buf);
+}
+
+static void
+test_codegen_string() {
+  luna_vm_t *vm = gen("a = 'foo'\nb = 'foo'\nc = {foo: a}\nc.foo");
+  assert(0 == ops(vm, LUNA_OP_LOADNIL));
+  assert(1 == vm->main->nconstants);
+  assert(luna_string_new("foo") == vm->main->constants[0]);
+  assert(luna_intern("foo") == luna_as_pointer(luna_eval(vm)));
+  luna_vm_free(vm);
+
+  assert(1 == eval("a = 'foo'\nb = 'foo'\na == b"));
+  assert(0 == eval("a = 'foo'\nb = 'bar'\na == b"));
+}
+
+static void
+test_codegen_scalar() {
+  assert(7 == eval("v = {x: 3, y: 4}\nv.x + v.y"));
+  assert(4 == eval("a = [1, 2, 3]\na[0] + a[2]"));
+  assert(8 == eval("v = {x: 1}\nv.x = 5\nv.x += 2\nv.x++\nv.x"));
+  assert(5 == eval("v = {'x': 2, y: 3}\nv['x'] + v.y"));
+  assert(0 == count_op("v = {x: 3, y: 4}\nv.x * v.y", LUNA_OP_LOADNIL));
+}
+
+static void
+test_closure_capture() {
+  assert(15 == eval("n = 10\nadd = :x\n  return x + n\nend\nadd(5)"));
+  assert(0 == count_op("n = 10\nadd = :x\n  return x + n\nend\nadd(5)", LUNA_OP_BOX));
+  assert(1 == count_op("n = 10\nadd = :x\n  return x + n\nend\nadd(5)", LUNA_OP_CLOSURE));
+  assert(1 == count_op("n = 10\nadd = :x\n  return x + n\nend\nadd(5)", LUNA_OP_APPLY));
+}
+
+static void
+test_closure_cells() {
+  // mutated by the closure
+  const char *counter = "count = 0\ninc = :\n  count++\nend\ninc()\ninc()\ncount";
+  assert(2 == eval(counter));
+  assert(1 == count_op(counter, LUNA_OP_BOX));
+
+  // assigned after capture
+  assert(2 == eval("n = 1\nf = :\n  return n\nend\nn = 2\nf()"));
+
+  // captured within a loop
+  assert(1 == count_op("i = 0\nwhile i < 3\n  f = :\n    return i\n  end\n  i++\nend", LUNA_OP_BOX));
+}
+
+static void
+test_closure_values() {
+  assert(120 == eval("fact = :k\n  if k < 2\n    return 1\n  end\n  return k * fact(k - 1)\nend\nfact(5)"));
+  assert(7 == eval("def apply(f, x)\n  return f(x)\nend\napply(:x:int\n  return x + 2\nend, 5)"));
+  assert(0 == eval("f = :x:int\n  return x\nend\nf(1.5)"));
+  assert(0 == eval("f = 1\nf(2)"));
+}
+
+static void
+test_object_shapes() {
+  luna_shape_t *root = luna_shape_new();
+  luna_shape_t *x = luna_shape_add(root, luna_intern("x"));
+  luna_shape_t *xy = luna_shape_add(x, luna_intern("y"));
+  assert(x == luna_shape_add(root, luna_intern("x")));
+  assert(xy == luna_shape_add(x, luna_intern("y")));
+  assert(xy != luna_shape_add(luna_shape_add(root, luna_intern("y")), luna_intern("x")));
+  assert(0 == luna_shape_lookup(xy, luna_intern("x")));
+  assert(1 == luna_shape_lookup(xy, luna_intern("y")));
+  assert(-1 == luna_shape_lookup(xy, luna_intern("z")));
+  assert(-1 == luna_shape_lookup(root, luna_intern("x")));
+  luna_shape_free(root);
+}
+
+static void
+test_object_cache() {
+  luna_shape_t *root = luna_shape_new();
+  luna_object_t *a = malloc(luna_object_size(4));
+  luna_object_t *b = malloc(luna_object_size(4));
+  luna_object_init(a, root, 4);
+  luna_object_init(b, root, 4);
+
+  luna_cache_t set = { 0 }, get = { 0 }, miss = { 0 };
+  *luna_object_put(a, luna_intern("x"), &set) = luna_value_int(1);
+  *luna_object_put(b, luna_intern("x"), &set) = luna_value_int(2);
+  assert(a->shape == b->shape && set.next == a->shape && 0 == set.slot);
+
+  assert(1 == luna_as_int(luna_object_get(a, luna_intern("x"), &get)));
+  assert(get.shape == a->shape);
+  assert(2 == luna_as_int(luna_object_get(b, luna_intern("x"), &get)));
+  assert(luna_is_null(luna_object_get(a, luna_intern("y"), &miss)));
+  assert(-1 == miss.slot);
+
+  // shared shape, less room
+  luna_object_t *c = malloc(luna_object_size(1));
+  luna_object_init(c, root, 1);
+  luna_cache_t add = { 0 };
+  *luna_object_put(a, luna_intern("y"), &add) = luna_value_int(3);
+  *luna_object_put(c, luna_intern("x"), &set) = luna_value_int(4);
+  *luna_object_put(c, luna_intern("y"), &add) = luna_value_int(5);
+  assert(!c->shape && c->dict);
+  assert(5 == luna_as_int(luna_object_get(c, luna_intern("y"), &miss)));
+  assert(3 == luna_as_int(luna_object_get(a, luna_intern("y"), &miss)));
+
+  free(a);
+  free(b);
+  luna_hash_destroy(c->dict);
+  free(c);
+  luna_shape_free(root);
+}
+
+static void
+test_object_dictionary() {
+  const char *keys[LUNA_SHAPE_SLOTS + 1];
+  char buf[4];
+  luna_shape_t *root = luna_shape_new();
+  luna_object_t *obj = malloc(luna_object_size(LUNA_SHAPE_SLOTS));
+  luna_object_init(obj, root, LUNA_SHAPE_SLOTS);
+  luna_cache_t cache = { 0 };
+
+  for (int i = 0; i <= LUNA_SHAPE_SLOTS; ++i) {
+    snprintf(buf, sizeof(buf), "k%d", i);
+    keys[i] = luna_intern(buf);
+    *luna_object_put(obj, keys[i], &cache) = luna_value_int(i);
+    assert(i < LUNA_SHAPE_SLOTS ? !obj->dict : !obj->shape);
+  }
+
+  for (int i = 0; i <= LUNA_SHAPE_SLOTS; ++i) {
+    assert(i == luna_as_int(luna_object_get(obj, keys[i], &cache)));
+  }
+
+  luna_object_remove(obj, keys[3]);
+  assert(luna_is_null(luna_object_get(obj, keys[3], &cache)));
+  assert(4 == luna_as_int(luna_object_get(obj, keys[4], &cache)));
+
+  luna_hash_destroy(obj->dict);
+  free(obj);
+  luna_shape_free(root);
+}
+
+static void
+test_object_codegen() {
+  const char *source =
+    "def len2(v)\n  return v.x * v.x + v.y * v.y\nend\n"
+    "p = {x: 3, y: 4}\n"
+    "q = p\n"
+    "q.x = 6\n"
+    "p.z = 1\n"
+    "p['z'] += 2\n"
+    "q.z++\n"
+    "len2(p) + p.z + q['x']";
+  assert(62 == eval(source));
+  assert(1 == count_op(source, LUNA_OP_NEWOBJECT));
+  assert(0 < count_op(source, LUNA_OP_GETFIELD));
+
+  // more keys than slots
+  char buf[4096] = "def id(o)\n  return o\nend\no = id({})\n";
+  size_t len = strlen(buf);
+  for (int i = 0; i < 40; ++i) {
+    len += snprintf(buf + len, sizeof(buf) - len, "o.k%d = %d\n", i, i);
+  }
+  snprintf(buf + len, sizeof(buf) - len, "o.k3 + o.k39");
+  assert(42 == eval(buf));
+}
+
+static void
+test_array_literals() {
+  const char *source =
+    "def sum(a:array)\n"
+    "  s = 0\n  i = 0\n"
+    "  while i < a.length\n    s += a[i]\n    i++\n  end\n"
+    "  return s\n"
+    "end\n"
+    "def id(o)\n  return o\nend\n"
+    "ints = id([1, 2, 3])\n"
+    "ints[3] = 4\n"
+    "ints[9] = 5\n"
+    "e = id([])\n"
+    "e[0] = 0.5\n"
+    "bools = id([true, false])\n"
+    "bools[1] = true\n"
+    "n = 0\n"
+    "if bools[1]\n  n = 1\nend\n"
+    "sum(ints) + sum(e) + sum([1, 2.5]) + n";
+  luna_vm_t *vm = gen(source);
+  luna_value_t val = luna_eval(vm);
+  assert(luna_is_float(val) && 15 == luna_as_float(val));
+  assert(4 == ops(vm, LUNA_OP_NEWLIST));
+  luna_vm_free(vm);
+
+  // elements out of range and subscripts of other values are nil
+  assert(1 == eval("def id(o)\n  return o\nend\na = id([1])\nn = 0\nif a[1] == nil\n  n = 1\nend\nn"));
+  assert(2 == eval("def id(o)\n  return o\nend\nid([1, [2, 3]])[1][0]"));
+}
+
+static void
+test_record_layout() {
+  luna_vm_t *vm = gen("type rec_t\n  a:int\n  b:float\n  c, d:int\n  e:string\nend\n");
+  luna_layout_t *rec = luna_layouts_get(vm->layouts, "rec_t");
+  assert(rec && 5 == rec->nfields);
+  assert(0 == rec->fields[0].offset && LUNA_FIELD_INT == rec->fields[0].kind);
+  assert(8 == rec->fields[1].offset && LUNA_FIELD_FLOAT == rec->fields[1].kind);
+  assert(16 == rec->fields[2].offset && 20 == rec->fields[3].offset);
+  assert(24 == rec->fields[4].offset && LUNA_FIELD_VALUE == rec->fields[4].kind);
+  assert(32 == rec->size);
+  assert(!luna_layouts_get(vm->layouts, "int"));
+  luna_vm_free(vm);
+}
+
+static void
+test_record_codegen() {
+  const char *source =
+    "type vec_t\n  x:int\n  y:int\nend\n"
+    "def dot(a:vec_t, b:vec_t)\n  return a.x * b.x + a.y * b.y\nend\n"
+    "v = vec_t(1, 2)\n"
+    "w = vec_t(y: 4, x: 3)\n"
+    "v.x += 1\n"
+    "w['y']++\n"
+    "dot(v, w)";
+  assert(16 == eval(source));
+  assert(2 == count_op(source, LUNA_OP_NEWRECORD));
+  assert(2 == count_op(source, LUNA_OP_CHECK));
+  assert(0 < count_op(source, LUNA_OP_GETI));
+  assert(0 == count_op(source, LUNA_OP_GETFIELD));
+  assert(0 == count_op(source, LUNA_OP_SETFIELD));
+
+  // unboxed floats, converted when stored to ints
+  assert(7 == eval("type p_t\n  x:float\n  n:int\nend\np = p_t(1.5)\np.n = p.x * 2 + 4\np.n"));
+  assert(0 == eval("type p_t\n  x:float\n  n:int\nend\np_t(1.5).n"));
+}
+
+static void
+test_record_checks() {
+  const char *types = "type a_t\n  x:int\nend\ntype b_t\n  x:int\nend\n";
+  char buf[512];
+
+  // dispatch checks the tag, the function the layout
+  snprintf(buf, sizeof(buf), "%sdef f(a:a_t)\n  return a.x + 1\nend\nf(a_t(5))", types);
+  assert(6 == eval(buf));
+  snprintf(buf, sizeof(buf), "%sdef f(a:a_t)\n  return a.x + 1\nend\nf(b_t(5))", types);
+  assert(1 == eval(buf));
+  snprintf(buf, sizeof(buf), "%sdef f(a:a_t)\n  return 1\nend\ndef f(a)\n  return 2\nend\nf(5)", types);
+  assert(2 == eval(buf));
+
+  // declared locals
+  snprintf(buf, sizeof(buf), "%slet v:a_t = b_t(5)\nv.x", types);
+  assert(0 == eval(buf));
+  snprintf(buf, sizeof(buf), "%slet v:a_t = a_t(5)\nv = a_t(6)\nv.x", types);
+  assert(6 == eval(buf));
+  assert(0 == count_op(buf, LUNA_OP_CHECK));
+
+  // nested records
+  snprintf(buf, sizeof(buf),
+    "%stype line_t\n  p:a_t\n  q:a_t\nend\n"
+    "l = line_t(a_t(3), b_t(4))\n"
+    "n = l.p.x + l.q.x\n"
+    "l.q = a_t(5)\n"
+    "n + l.p.x + l.q.x", types);
+  assert(11 == eval(buf));
+  assert(0 < count_op(buf, LUNA_OP_GETV));
+  assert(0 == count_op(buf, LUNA_OP_GETFIELD));
+}
+
+static void
+test_record_dynamic() {
+  const char *source =
+    "type vec_t\n  x:int\n  y:float\nend\n"
+    "def get(r)\n  return r.x + r['y']\nend\n"
+    "def set(r)\n  r.y = 7\n  r.z = 1\nend\n"
+    "v = vec_t(1, 2)\n"
+    "set(v)\n"
+    "get(v)";
+  luna_vm_t *vm = gen(source);
+  luna_value_t val = luna_eval(vm);
+  assert(luna_is_float(val) && 8 == luna_as_float(val));
+  assert(0 < ops(vm, LUNA_OP_GETFIELD));
+  luna_vm_free(vm);
+
+  // fields of other values are nil
+  vm = gen("type vec_t\n  x:int\nend\ndef get(r)\n  return r.x\nend\nget(3)");
+  assert(luna_is_null(luna_eval(vm)));
+  luna_vm_free(vm);
+}
+
+static void
+test_record_arrays() {
+  const char *types = "type p_t\n  x:int\n  y:float\n  next:p_t\nend\n";
+  char buf[1024];
+
+  // columns read and written a field at a time
+  snprintf(buf, sizeof(buf),
+    "%sdef sum(ps:p_t[])\n"
+    "  s = 0\n  i = 0\n"
+    "  while i < ps.length\n    s += ps[i].x + ps[i].y\n    i++\n  end\n"
+    "  return s\n"
+    "end\n"
+    "ps = p_t[5]\n"
+    "i = 0\n"
+    "while i < 5\n  ps[i].x = i * 2\n  ps[i].y = 0.5\n  i++\nend\n"
+    "sum(ps)", types);
+  luna_vm_t *vm = gen(buf);
+  luna_value_t val = luna_eval(vm);
+  assert(luna_is_float(val) && 22.5 == luna_as_float(val));
+  assert(1 == ops(vm, LUNA_OP_NEWARRAY));
+  assert(1 == ops(vm, LUNA_OP_CHECKARRAY));
+  assert(0 < ops(vm, LUNA_OP_GETCI) && 0 < ops(vm, LUNA_OP_SETCF));
+  assert(0 == ops(vm, LUNA_OP_GETINDEX));
+  luna_vm_free(vm);
+
+  // elements out of range read as zero values
+  snprintf(buf, sizeof(buf), "%sps = p_t[2]\nps[5].x = 3\nps[5].x + ps[-1].x + ps[1].x", types);
+  assert(0 == eval(buf));
+  snprintf(buf, sizeof(buf), "%sp_t[3].length", types);
+  assert(3 == eval(buf));
+}
+
+static void
+test_record_views() {
+  const char *types = "type p_t\n  x:int\n  y:float\n  next:p_t\nend\n";
+  char buf[1024];
+
+  // views write through to the columns
+  snprintf(buf, sizeof(buf),
+    "%sdef f(p:p_t)\n  return p.x\nend\n"
+    "ps = p_t[3]\n"
+    "p = ps[1]\n"
+    "p.x = 4\n"
+    "p.x += 1\n"
+    "ps[0].next = ps[1]\n"
+    "ps[2] = p_t(7, 1.5)\n"
+    "same = 0\n"
+    "if ps[1] == p\n  same = 1\nend\n"
+    "f(ps[1]) + ps[0].next.x + f(ps[2]) + same", types);
+  assert(18 == eval(buf));
+  assert(0 < count_op(buf, LUNA_OP_GETINDEX));
+  assert(1 == count_op(buf, LUNA_OP_SETINDEX));
+
+  // storing nil or another record zeroes the element
+  snprintf(buf, sizeof(buf), "%stype q_t\n  x:int\nend\nps = p_t[1]\nps[0].x = 3\nps[0] = q_t(4)\nps[0].x", types);
+  assert(0 == eval(buf));
+}
+
+static void
+test_record_arrays_dynamic() {
+  const char *source =
+    "type p_t\n  x:int\n  y:float\nend\n"
+    "def get(a, i)\n  return a[i].x + a[i]['y'] + a.length\nend\n"
+    "def set(a)\n  a[1].y = 2\n  a[1] = a[1]\nend\n"
+    "ps = p_t[2]\n"
+    "ps[1].x = 1\n"
+    "set(ps)\n"
+    "get(ps, 1)";
+  luna_vm_t *vm = gen(source);
+  luna_value_t val = luna_eval(vm);
+  assert(luna_is_float(val) && 5 == luna_as_float(val));
+  luna_vm_free(vm);
+
+  // subscripts of other values are nil
+  assert(1 == eval("type p_t\n  x:int\nend\ndef get(a)\n  return a[0]\nend\nn = 0\nif get(1) == nil\n  n = 1\nend\nn"));
+}
+
+/*
+ * Test gc marking and sweeping.
+ */
+
+static void
+test_gc_sweep() {
+  luna_gc_t gc;
+  luna_gc_init(&gc, 0, 0, 0);
+  assert(NULL == luna_gc_alloc(&gc, LUNA_TYPE_CELL, sizeof(luna_value_t)));
+
+  // a -> b, c unreachable
+  luna_value_t *a = luna_gc_tenure(&gc, LUNA_TYPE_CELL, sizeof(luna_value_t));
+  luna_value_t *b = luna_gc_tenure(&gc, LUNA_TYPE_CELL, sizeof(luna_value_t));
+  luna_value_t *c = luna_gc_tenure(&gc, LUNA_TYPE_CELL, sizeof(luna_value_t));
+  *a = luna_value_pointer(LUNA_TYPE_CELL, b);
+  *b = luna_value_int(1);
+  *c = luna_value_pointer(LUNA_TYPE_CELL, a);
+  size_t size = gc.live / 3;
+
+  luna_value_t root = luna_value_pointer(LUNA_TYPE_CELL, a);
+  luna_gc_mark(&gc, &root, 1);
+  luna_gc_trace(&gc);
+  assert(size == luna_gc_sweep(&gc));
+  assert(2 * size == gc.live);
+  assert(1 == luna_as_int(*b));
+
+  // marks are cleared by the sweep
+  assert(2 * size == luna_gc_sweep(&gc));
+  assert(0 == gc.live);
+  assert(NULL == gc.objects);
+  luna_gc_free(&gc);
+}
+
+/*
+ * Test promotion of nursery objects.
+ */
+
+static void
+test_gc_scavenge() {
+  luna_gc_t gc;
+  luna_gc_init(&gc, 1024, 0, 0);
+
+  // young a -> young b, young c unreachable
+  luna_value_t *a = luna_gc_alloc(&gc, LUNA_TYPE_CELL, sizeof(luna_value_t));
+  luna_value_t *b = luna_gc_alloc(&gc, LUNA_TYPE_CELL, sizeof(luna_value_t));
+  luna_value_t *c = luna_gc_alloc(&gc, LUNA_TYPE_CELL, sizeof(luna_value_t));
+  assert(luna_gc_young(&gc, a) && luna_gc_young(&gc, c));
+  *a = luna_value_pointer(LUNA_TYPE_CELL, b);
+  *b = luna_value_int(1);
+  *c = luna_value_int(2);
+
+  // both roots are forwarded to a single copy
+  luna_value_t roots[] = {
+    luna_value_pointer(LUNA_TYPE_CELL, a),
+    luna_value_pointer(LUNA_TYPE_CELL, a),
+    luna_value_int(3)
+  };
+  luna_gc_evacuate(&gc, roots, 3);
+  luna_gc_scavenge(&gc);
+  assert(gc.top == gc.nursery);
+  assert(roots[0] == roots[1]);
+  assert(luna_value_int(3) == roots[2]);
+
+  luna_value_t *old = luna_as_pointer(roots[0]);
+  assert(!luna_gc_young(&gc, old));
+  assert(!luna_gc_young(&gc, luna_as_pointer(*old)));
+  assert(1 == luna_as_int(*(luna_value_t *) luna_as_pointer(*old)));
+  assert(gc.live == gc.stats.promoted);
+
+  // old a -> young d, remembered by the barrier
+  luna_value_t *d = luna_gc_alloc(&gc, LUNA_TYPE_CELL, sizeof(luna_value_t));
+  *d = luna_value_int(4);
+  luna_value_t val = luna_value_pointer(LUNA_TYPE_CELL, d);
+  luna_gc_barrier(&gc, old, old, val);
+  *old = val;
+  assert(1 == kv_size(gc.remembered));
+
+  luna_gc_scavenge(&gc);
+  assert(0 == kv_size(gc.remembered));
+  assert(!luna_gc_young(&gc, luna_as_pointer(*old)));
+  assert(4 == luna_as_int(*(luna_value_t *) luna_as_pointer(*old)));
+  luna_gc_free(&gc);
+}
+
+/*
+ * Test incremental marking and its barrier.
+ */
+
+static void
+test_gc_incremental() {
+  luna_gc_t gc;
+  luna_gc_init(&gc, 0, 1, 0);
+
+  // a -> b, c unreachable
+  luna_value_t *a = luna_gc_tenure(&gc, LUNA_TYPE_CELL, sizeof(luna_value_t));
+  luna_value_t *b = luna_gc_tenure(&gc, LUNA_TYPE_CELL, sizeof(luna_value_t));
+  luna_value_t *c = luna_gc_tenure(&gc, LUNA_TYPE_CELL, sizeof(luna_value_t));
+  *a = luna_value_pointer(LUNA_TYPE_CELL, b);
+  *b = luna_value_int(1);
+  *c = luna_value_int(2);
+  size_t size = gc.live / 3;
+
+  // a is black and b gray after a step
+  gc.marking = 1;
+  luna_value_t root = luna_value_pointer(LUNA_TYPE_CELL, a);
+  luna_gc_mark(&gc, &root, 1);
+  assert(!luna_gc_step(&gc, gc.budget));
+
+  // a -> c, shaded by the barrier, b survives as floating garbage
+  luna_value_t val = luna_value_pointer(LUNA_TYPE_CELL, c);
+  luna_gc_barrier(&gc, a, a, val);
+  *a = val;
+  while (!luna_gc_step(&gc, gc.budget)) ;
+  assert(0 == luna_gc_sweep(&gc));
+  assert(!gc.marking);
+  assert(2 == luna_as_int(*c));
+
+  // b is reclaimed by the next cycle
+  gc.marking = 1;
+  luna_gc_mark(&gc, &root, 1);
+  luna_gc_trace(&gc);
+  assert(size == luna_gc_sweep(&gc));
+  luna_gc_free(&gc);
+}
+
+/*
+ * Test the pause histogram.
+ */
+
+static void
+test_gc_pauses() {
+  luna_gc_stats_t stats;
+  memset(&stats, 0, sizeof(stats));
+  assert(0 == luna_gc_percentile(&stats, 0.99));
+
+  for (int i = 0; i < 98; ++i) luna_gc_pause(&stats, 0.5e-6);
+  luna_gc_pause(&stats, 3e-6);
+  luna_gc_pause(&stats, 1e-3);
+  assert(98 == stats.pauses[0]);
+  assert(1 == stats.pauses[2]);
+  assert(1 == stats.pauses[10]);
+  assert(1e-3 == stats.max_pause);
+  assert(1e-6 == luna_gc_percentile(&stats, 0.5));
+  assert(4e-6 == luna_gc_percentile(&stats, 0.99));
+  assert(1024e-6 == luna_gc_percentile(&stats, 1));
+
+  // without a nursery, allocations collecting nothing are no pauses
+  luna_gen_options_t options = { .nursery = -1, .budget = -1 };
+  luna_vm_t *vm = gen_with("i = 0\nwhile i < 100\n  f = :\n    return i\n  end\n  i++\nend\ni", &options);
+  assert(100 == luna_as_int(luna_eval(vm)));
+  unsigned pauses = 0;
+  for (int i = 0; i < LUNA_GC_BUCKETS; ++i) pauses += vm->gc.stats.pauses[i];
+  assert(pauses == vm->gc.stats.collections);
+  luna_vm_free(vm);
+}
+
+/*
+ * Test marking interleaved with a growing heap.
+ */
+
+static void
+test_gc_steps() {
+  const char *source =
+    "def link(p)\n  return :\n    return p\n  end\nend\n"
+    "prev = 0\n"
+    "i = 0\n"
+    "while i < 100000\n"
+    "  prev = link(prev)\n"
+    "  i++\n"
+    "end\n"
+    "while prev\n"
+    "  prev = prev()\n"
+    "  i--\n"
+    "end\n"
+    "i";
+
+  luna_gen_options_t options = { .budget = 1024 };
+  luna_vm_t *vm = gen_with(source, &options);
+  assert(0 == luna_as_int(luna_eval(vm)));
+  assert(vm->gc.stats.steps > 0);
+  assert(vm->gc.stats.collections > 0);
+  luna_vm_free(vm);
+
+  // all at once
+  options.budget = -1;
+  vm = gen_with(source, &options);
+  assert(0 == luna_as_int(luna_eval(vm)));
+  assert(0 == vm->gc.stats.steps);
+  assert(vm->gc.stats.collections > 0);
+  luna_vm_free(vm);
+}
+
+/*
+ * Test concurrent marking against several coroutines
+ * pushing, popping and trading linked lists through
+ * a shared cell, with nurseries of varying size.
+ */
+
+static void
+test_gc_concurrent() {
+  const char *source =
+    "def link(v, next)\n"
+    "  return :k\n"
+    "    if k == 0\n"
+    "      return v\n"
+    "    end\n"
+    "    return next\n"
+    "  end\n"
+    "end\n"
+    "def total(l)\n"
+    "  s = 0\n"
+    "  while l\n"
+    "    s = s + l(0)\n"
+    "    l = l(1)\n"
+    "  end\n"
+    "  return s\n"
+    "end\n"
+    "shared = 0\n"
+    "swap = :h\n"
+    "  tmp = shared\n"
+    "  shared = h\n"
+    "  return tmp\n"
+    "end\n"
+    "def spawn(id, swap)\n"
+    "  head = 0\n"
+    "  n = 0\n"
+    "  return :\n"
+    "    n++\n"
+    "    head = link(n % 97 + id, head)\n"
+    "    if n % 7 == 0\n"
+    "      head = swap(head)\n"
+    "    end\n"
+    "    if n % 13 == 0\n"
+    "      head = head(1)\n"
+    "    end\n"
+    "    return head\n"
+    "  end\n"
+    "end\n"
+    "a = spawn(1, swap)\n"
+    "b = spawn(2, swap)\n"
+    "c = spawn(3, swap)\n"
+    "d = spawn(4, swap)\n"
+    "i = 0\n"
+    "while i < 20000\n"
+    "  a()\n"
+    "  b()\n"
+    "  c()\n"
+    "  d()\n"
+    "  i++\n"
+    "end\n"
+    "total(a()) + total(b()) + total(c()) + total(d()) + total(swap(0))";
+
+  luna_gen_options_t options = { .budget = -1 };
+  luna_vm_t *vm = gen_with(source, &options);
+  int expected = luna_as_int(luna_eval(vm));
+  luna_vm_free(vm);
+
+  long nurseries[] = { 512, 4096, 0, -1 };
+  for (int i = 0; i < 4; ++i) {
+    luna_gen_options_t options = { .nursery = nurseries[i], .concurrent = 1 };
+    vm = gen_with(source, &options);
+    assert(expected == luna_as_int(luna_eval(vm)));
+    assert(vm->gc.stats.collections > 0);
+
+    // settles the collection under way
+    luna_vm_collect(vm);
+    assert(!vm->gc.marking);
+    luna_vm_free(vm);
+  }
+}
+
+/*
+ * Test old cells assigned young closures while running.
+ */
+
+static void
+test_gc_barrier() {
+  const char *source =
+    "k = 7\n"
+    "f = :\n  return 0\nend\n"
+    "g = :\n  return f()\nend\n"
+    "i = 0\n"
+    "while i < 50000\n"
+    "  h = :\n    return i\n  end\n"
+    "  if i == 20000\n    f = :\n      return k\n    end\n  end\n"
+    "  i++\n"
+    "end\n"
+    "g()";
+
+  luna_vm_t *vm = gen(source);
+  assert(7 == luna_as_int(luna_eval(vm)));
+  assert(vm->gc.stats.scavenges > 1);
+  luna_vm_free(vm);
+}
+
+/*
+ * Test objects holding young values and
+ * turned into dictionaries while running.
+ */
+
+static void
+test_gc_objects() {
+  const char *source =
+    "def id(o)\n  return o\nend\n"
+    "root = id({head: 0, n: 0})\n"
+    "i = 0\n"
+    "while i < 20000\n"
+    "  if i % 100 == 0\n"
+    "    root.head = 0\n"
+    "  end\n"
+    "  node = id({v: i % 10, next: root.head})\n"
+    "  if i % 50 == 0\n"
+    "    node.a = 1\n    node.b = 2\n    node.c = 3\n    node.d = 4\n    node.e = 5\n"
+    "  end\n"
+    "  root.head = node\n"
+    "  root.n++\n"
+    "  i++\n"
+    "end\n"
+    "s = 0\n"
+    "l = root.head\n"
+    "while l\n"
+    "  s = s + l.v\n"
+    "  if l.e\n    s = s + l.e\n  end\n"
+    "  l = l.next\n"
+    "end\n"
+    "s + root.n";
+
+  luna_gen_options_t options = { .budget = -1 };
+  luna_vm_t *vm = gen_with(source, &options);
+  int expected = luna_as_int(luna_eval(vm));
+  assert(20000 + 450 + 10 == expected);
+  luna_vm_free(vm);
+
+  long nurseries[] = { 512, 4096, 0 };
+  for (int i = 0; i < 3; ++i) {
+    for (int concurrent = 0; concurrent < 2; ++concurrent) {
+      luna_gen_options_t options = { .nursery = nurseries[i], .concurrent = concurrent };
+      vm = gen_with(source, &options);
+      assert(expected == luna_as_int(luna_eval(vm)));
+      assert(vm->gc.stats.collections + vm->gc.stats.scavenges > 0);
+      luna_vm_free(vm);
+    }
+  }
+}
+
+static void
+test_gc_records() {
+  const char *source =
+    "type box_t\n  n:int\nend\n"
+    "type node_t\n  v:int\n  next:node_t\n  data:any\nend\n"
+    "def sum(l:node_t)\n"
+    "  s = 0\n"
+    "  while l\n    s = s + l.v + l.data.n\n    l = l.next\n  end\n"
+    "  return s\n"
+    "end\n"
+    "head = nil\n"
+    "i = 0\n"
+    "while i < 20000\n"
+    "  if i % 100 == 0\n"
+    "    head = nil\n"
+    "  end\n"
+    "  head = node_t(i % 10, head, box_t(i % 3))\n"
+    "  if i % 7 == 0\n"
+    "    head.next.data = box_t(1)\n"
+    "  end\n"
+    "  i++\n"
+    "end\n"
+    "sum(head)";
+
+  luna_gen_options_t options = { .budget = -1 };
+  luna_vm_t *vm = gen_with(source, &options);
+  assert(550 == luna_as_int(luna_eval(vm)));
+  luna_vm_free(vm);
+
+  long nurseries[] = { 512, 4096, 0 };
+  for (int i = 0; i < 3; ++i) {
+    for (int concurrent = 0; concurrent < 2; ++concurrent) {
+      luna_gen_options_t options = { .nursery = nurseries[i], .concurrent = concurrent };
+      vm = gen_with(source, &options);
+      assert(550 == luna_as_int(luna_eval(vm)));
+      assert(vm->gc.stats.collections + vm->gc.stats.scavenges > 0);
+      luna_vm_free(vm);
+    }
+  }
+}
+
+static void
+test_gc_arrays() {
+  const char *source =
+    "type box_t\n  n:int\nend\n"
+    "type node_t\n  v:int\n  data:box_t\n  next:node_t\nend\n"
+    "nodes = node_t[50]\n"
+    "i = 0\n"
+    "while i < 20000\n"
+    "  k = i % 50\n"
+    "  nodes[k].v = i % 10\n"
+    "  nodes[k].data = box_t(i % 3)\n"
+    "  nodes[k].next = nodes[(k + 1) % 50]\n"
+    "  if i % 7 == 0\n"
+    "    tmp = node_t[4]\n"
+    "    tmp[0].data = box_t(1)\n"
+    "    tmp[0].next = nodes[(k + 1) % 50]\n"
+    "    nodes[k] = tmp[0]\n"
+    "  end\n"
+    "  i++\n"
+    "end\n"
+    "s = 0\n"
+    "n = nodes[0]\n"
+    "while i > 19950\n"
+    "  s = s + n.v + n.data.n\n"
+    "  n = n.next\n"
+    "  i--\n"
+    "end\n"
+    "s";
+
+  luna_gen_options_t options = { .budget = -1 };
+  luna_vm_t *vm = gen_with(source, &options);
+  assert(239 == luna_as_int(luna_eval(vm)));
+  luna_vm_free(vm);
+
+  long nurseries[] = { 512, 4096, 0 };
+  for (int i = 0; i < 3; ++i) {
+    for (int concurrent = 0; concurrent < 2; ++concurrent) {
+      luna_gen_options_t options = { .nursery = nurseries[i], .concurrent = concurrent };
+      vm = gen_with(source, &options);
+      assert(239 == luna_as_int(luna_eval(vm)));
+      assert(vm->gc.stats.collections + vm->gc.stats.scavenges > 0);
+      luna_vm_free(vm);
+    }
+  }
+}
+
+static void
+test_gc_lists() {
+  const char *source =
+    "type box_t\n  n:int\nend\n"
+    "def id(o)\n  return o\nend\n"
+    "keep = id([])\n"
+    "i = 0\n"
+    "while i < 20000\n"
+    "  tmp = id([box_t(1), i, [box_t(2)]])\n"
+    "  if i % 40 == 0\n"
+    "    keep[keep.length] = tmp\n"
+    "  end\n"
+    "  i++\n"
+    "end\n"
+    "s = 0\n"
+    "i = 0\n"
+    "while i < keep.length\n"
+    "  s = s + keep[i][0].n + keep[i][2][0].n\n"
+    "  i++\n"
+    "end\n"
+    "s";
+
+  luna_gen_options_t options = { .budget = -1 };
+  luna_vm_t *vm = gen_with(source, &options);
+  assert(1500 == luna_as_int(luna_eval(vm)));
+  luna_vm_free(vm);
+
+  long nurseries[] = { 512, 4096, 0 };
+  for (int i = 0; i < 3; ++i) {
+    for (int concurrent = 0; concurrent < 2; ++concurrent) {
+      luna_gen_options_t options = { .nursery = nurseries[i], .concurrent = concurrent };
+      vm = gen_with(source, &options);
+      assert(1500 == luna_as_int(luna_eval(vm)));
+      assert(vm->gc.stats.collections + vm->gc.stats.scavenges > 0);
+      luna_vm_free(vm);
+    }
+  }
+}
+
+/*
+ * Test collection of closures and cells while running.
+ */
+
+static void
+test_gc_collect() {
+  const char *source =
+    "i = 0\n"
+    "keep = :\n  return 0\nend\n"
+    "while i < 50000\n"
+    "  n = i\n"
+    "  f = :\n    return n + 1\n  end\n"
+    "  if i == 10\n    keep = f\n  end\n"
+    "  i++\n"
+    "end\n"
+    "keep()";
+
+  luna_vm_t *vm = gen(source);
+  assert(50000 == luna_as_int(luna_eval(vm)));
+  assert(vm->gc.stats.scavenges > 0);
+  assert(vm->gc.stats.reclaimed > 0);
+  assert(vm->gc.live <= vm->gc.threshold);
+  assert(NULL == vm->frame);
+
+  // nothing is reachable once returned
+  luna_vm_collect(vm);
+  assert(0 == vm->gc.live);
+  luna_vm_free(vm);
+}
+
+static void
+test_profile_file() {
+  luna_profile_t *profile = luna_profile_new();
+  luna_profile_add(profile, LUNA_PROFILE_KEY(LUNA_PROFILE_ENTRY, 1, 0), 3);
+  luna_profile_add(profile, LUNA_PROFILE_KEY(LUNA_PROFILE_SITE, 2, 0x331), 300);
+  luna_profile_add(profile, LUNA_PROFILE_KEY(LUNA_PROFILE_SITE, 2, 0x441), 7);
+  luna_profile_add(profile, LUNA_PROFILE_KEY(LUNA_PROFILE_ENTRY, 1, 0), 2);
+  assert(5 == luna_profile_count(profile, LUNA_PROFILE_KEY(LUNA_PROFILE_ENTRY, 1, 0)));
+  assert(0 == luna_profile_count(profile, LUNA_PROFILE_KEY(LUNA_PROFILE_ENTRY, 2, 0)));
+  assert(luna_profile_save(profile, "/tmp/luna-test.prof"));
+
+  // loaded twice, merging the counts
+  luna_profile_t *loaded = luna_profile_new();
+  assert(luna_profile_load(loaded, "/tmp/luna-test.prof"));
+  assert(luna_profile_load(loaded, "/tmp/luna-test.prof"));
+  assert(10 == luna_profile_count(loaded, LUNA_PROFILE_KEY(LUNA_PROFILE_ENTRY, 1, 0)));
+
+  uint32_t tuple;
+  uint64_t total;
+  assert(600 == luna_profile_dominant(loaded, LUNA_PROFILE_SITE, 2, &tuple, &total));
+  assert(0x331 == tuple && 614 == total);
+
+  // not a profile
+  FILE *file = fopen("/tmp/luna-test.prof", "w");
+  fputs("luna", file);
+  fclose(file);
+  assert(!luna_profile_load(loaded, "/tmp/luna-test.prof"));
+
+  remove("/tmp/luna-test.prof");
+  luna_profile_free(profile);
+  luna_profile_free(loaded);
+}
+
+/*
+ * Source with a polymorphic site called with ints, an if
+ * mostly taking its else branch and a small hot function.
+ */
+
+static const char *profiled_source =
+  "def area(w:int, h:int)\n  return w * h\nend\n"
+  "def area(w:float, h:float)\n  return w * h\nend\n"
+  "def square(x)\n  return area(x, x)\nend\n"
+  "def twice(x:int)\n  return x + x\nend\n"
+  "i = 0\nsum = 0\nwhile i < 100\n"
+  "  if i == 7\n    sum = sum + 1000\n  else\n    sum = sum + square(i) + twice(i)\n  end\n"
+  "  i = i + 1\nend\nsum";
+
+/*
+ * Run `source` instrumented, returning its profile.
+ */
+
+static luna_profile_t *
+record(const char *source) {
+  luna_gen_options_t options = { .instrument = 1 };
+  luna_vm_t *vm = gen_with(source, &options);
+  luna_eval(vm);
+  luna_profile_t *profile = vm->profile;
+  vm->profile = NULL;
+  luna_vm_free(vm);
+  return profile;
+}
+
+static void
+test_profile_instrument() {
+  luna_profile_t *profile = record(profiled_source);
+
+  // numbered once parsed: area, area, area(x, x), square, twice, if
+  assert(99 == luna_profile_count(profile, LUNA_PROFILE_KEY(LUNA_PROFILE_ENTRY, 1, 0)));
+  assert(0 == luna_profile_count(profile, LUNA_PROFILE_KEY(LUNA_PROFILE_ENTRY, 2, 0)));
+  assert(99 == luna_profile_count(profile, LUNA_PROFILE_KEY(LUNA_PROFILE_ENTRY, 4, 0)));
+  assert(99 == luna_profile_count(profile, LUNA_PROFILE_KEY(LUNA_PROFILE_ENTRY, 5, 0)));
+  assert(100 == luna_profile_count(profile, LUNA_PROFILE_KEY(LUNA_PROFILE_BRANCH, 6, 0)));
+  assert(1 == luna_profile_count(profile, LUNA_PROFILE_KEY(LUNA_PROFILE_TAKEN, 6, 0)));
+
+  // area(x, x) with two ints
+  uint32_t tuple;
+  uint64_t total;
+  uint32_t ints = 2 | LUNA_TYPE_INT << 4 | LUNA_TYPE_INT << 8;
+  assert(99 == luna_profile_dominant(profile, LUNA_PROFILE_SITE, 3, &tuple, &total));
+  assert(ints == tuple && 99 == total);
+
+  // uninstrumented code is unchanged
+  assert(0 == count_op(profiled_source, LUNA_OP_COUNT));
+  assert(0 == count_op(profiled_source, LUNA_OP_FEEDBACK));
+  luna_profile_free(profile);
+}
+
+static void
+test_profile_optimize() {
+  luna_profile_t *profile = record(profiled_source);
+  luna_gen_options_t options = { .profile = profile };
+  luna_vm_t *plain = gen(profiled_source);
+  luna_vm_t *vm = gen_with(profiled_source, &options);
+
+  // guarded and inlined
+  assert(1 == ops(vm, LUNA_OP_GUARD));
+  assert(1 == ops(vm, LUNA_OP_DISPATCH));
+  assert(ops(vm, LUNA_OP_CALL) < ops(plain, LUNA_OP_CALL));
+
+  // the hot else block follows the condition
+  luna_activation_t *main = vm->main;
+  int pc = 0;
+  while (LUNA_OP_EQ != OP(main->code[pc])) ++pc;
+  assert(LUNA_OP_JMP == OP(main->code[pc + 1]));
+  assert(LUNA_OP_MOVE == OP(main->code[pc + 2]) || LUNA_OP_CALL == OP(main->code[pc + 2]));
+
+  luna_value_t a = luna_eval(plain);
+  luna_value_t b = luna_eval(vm);
+  assert(luna_is_int(b) && a == b);
+  luna_vm_free(plain);
+  luna_vm_free(vm);
+
+  // other tuples take the dispatch
+  char source[1024];
+  snprintf(source, sizeof(source), "%s\nsquare(1.5) + sum", profiled_source);
+  vm = gen_with(source, &options);
+  a = luna_eval(vm);
+  assert(luna_is_float(a) && 339189.25 == luna_as_float(a));
+  luna_vm_free(vm);
+  luna_profile_free(profile);
+}
+
+/*
+ * Compile `source` to C, build it with the system compiler
+ * and return what it prints, or NULL when no compiler is found.
+ */
+
+static char *
+native(const char *source) {
+  static char out[64];
+  if (system("cc --version > /dev/null 2>&1")) return NULL;
+
+  luna_vm_t *vm = gen(source);
+  FILE *file = fopen("/tmp/luna-test.c", "w");
+  assert(file);
+  luna_emit_c(vm, file);
+  fclose(file);
+  luna_vm_free(vm);
+
+  assert(0 == system("cc -std=c99 -D_POSIX_C_SOURCE=200809L -I src -I deps /tmp/luna-test.c src/runtime.c src/object.c src/record.c src/array.c src/shape.c src/hash.c src/intern.c src/slab.c -lm -lpthread -o /tmp/luna-test"));
+  FILE *proc = popen("/tmp/luna-test", "r");
+  assert(fgets(out, sizeof(out), proc));
+  pclose(proc);
+  remove("/tmp/luna-test.c");
+  remove("/tmp/luna-test");
+  return out;
+}
+
+static void
+test_emit_c() {
+  char *out = native(
+    "def f(a:int)\n  return a * 2\nend\n"
+    "def f(a)\n  return 0.5\nend\n"
+    "def g(a, b = 1)\n  return f(a) + b\nend\n"
+    "n = 0\ninc = :x\n  n += x\nend\n"
+    "i = 0\nwhile i < 10\n  inc(g(i))\n  i++\nend\n"
+    "n + g(1.5) + 2 ** 3 % 5");
+  if (!out) return;
+  assert(0 == strcmp("104.500000\n", out));
+
+  out = native(
+    "def id(o)\n  return o\nend\n"
+    "p = id({x: 3, y: 4})\n"
+    "p.z = p.x * p.y\n"
+    "p['x'] += 1\n"
+    "p.x + p.z");
+  assert(0 == strcmp("16\n", out));
+
+  out = native(
+    "type vec_t\n  x:int\n  y:float\n  next:vec_t\nend\n"
+    "def id(o)\n  return o\nend\n"
+    "v = vec_t(1, 2.5)\n"
+    "v.next = vec_t(3)\n"
+    "w = id(v)\n"
+    "v.x + v.y + v.next.x + w.next.y + w['x']");
+  assert(0 == strcmp("7.500000\n", out));
+
+  out = native(
+    "type vec_t\n  x:int\n  y:float\n  next:vec_t\nend\n"
+    "def id(o)\n  return o\nend\n"
+    "vs = vec_t[3]\n"
+    "vs[0].x = 2\n"
+    "vs[1] = vec_t(3, 0.5)\n"
+    "vs[2].next = vs[1]\n"
+    "ws = id(vs)\n"
+    "vs[0].x + vs[1].y + vs[2].next.x + ws[0].x + ws.length");
+  assert(0 == strcmp("10.500000\n", out));
+
+  out = native(
+    "def id(o)\n  return o\nend\n"
+    "a = id([1, 2])\n"
+    "a[2] = 3\n"
+    "b = id([a, 0.5, true])\n"
+    "b[0][0] + b[0][2] + b[1] + b.length");
+  assert(0 == strcmp("7.500000\n", out));
+
+  out = native(
+    "def f(s:string)\n  return s\nend\n"
+    "f('say \"hi\"')");
+  assert(0 == strcmp("say \"hi\"\n", out));
+
+  // collected, a few of the objects retained
+  out = native(
+    "n = 0\ni = 0\nkeep = {x: 0}\n"
+    "while i < 300000\n"
+    "  o = {x: i, y: keep}\n"
+    "  if i % 1000 == 0\n    keep = o\n  end\n"
+    "  inc = :d\n    n += d\n  end\n"
+    "  inc(o.x % 3)\n"
+    "  i++\n"
+    "end\n"
+    "n + keep.x + keep.y.x");
+  assert(0 == strcmp("897000\n", out));
+}
+
+/*
+ * Test the given `fn`.
+ */
+
+#define test(fn) \
+  printf("    \e[92m✓ \e[90m%s\e[0m\n", #fn); \
+  test_##fn();
+
+/*
+ * Test suite title.
+ */
+
+#define suite(title) \
+  printf("\n  \e[36m%s\e[0m\n", title)
+
+/*
+ * Report sizeof.
+ */
+
+#define size(type) \
+  printf("\n  \e[90m%s: %ld bytes\e[0m\n", #type, sizeof(type));
+
+/*
+ * Run all test suites.
+ */
+
+int
+main(int argc, const char **argv){
+  clock_t start = clock();
+
+  size(luna_value_t);
+
+  suite("value");
+  test(value_is);
+
+  suite("array");
+  test(array_length);
+  test(array_push);
+  test(array_at);
+  test(array_iteration);
+  test(array_spill);
+  test(array_kinds);
+  test(array_literals);
+
+  suite("hash");
+  test(hash_set);
+  test(hash_has);
+  test(hash_remove);
+  test(hash_iteration);
+  test(hash_mixins);
+
+  suite("persistent");
+  test(pmap_set);
+  test(pmap_remove);
+  test(pmap_collisions);
+  test(pmap_threads);
+  test(pvec_push);
+  test(pvec_pop);
+
+  suite("string");
+  test(string);
+  test(string_threads);
+  test(string_lexer);
+
+  suite("slab");
+  test(slab_class);
+  test(slab_alloc);
+  test(slab_values);
+
+  suite("parser");
+  test(assign);
+  test(assign_chain);
+  test(subscript);
+  test(declaration);
+  test(return);
+  test(use);
+
+  suite("dce");
+  test(dce_return);
+  test(dce_if);
+  test(dce_let);
+
+  suite("codegen");
+  test(codegen_arithmetic);
+  test(codegen_logical);
+  test(codegen_short_circuit);
+  test(codegen_branch);
+  test(codegen_typed);
+  test(codegen_string);
+  test(codegen_division);
+  test(codegen_scalar);
+  test(codegen_threads);
+  test(codegen_large);
+  test(codegen_limits);
+
+  suite("object");
+  test(object_shapes);
+  test(object_cache);
+  test(object_dictionary);
+  test(object_codegen);
+
+  suite("record");
+  test(record_layout);
+  test(record_codegen);
+  test(record_checks);
+  test(record_dynamic);
+  test(record_arrays);
+  test(record_views);
+  test(record_arrays_dynamic);
+
+  suite("dispatch");
+  test(dispatch_static);
+  test(dispatch_dynamic);
+  test(dispatch_cache);
+  test(dispatch_defaults);
+
+  suite("emit");
+  test(emit_c);
+
+  suite("profile");
+  test(profile_file);
+  test(profile_instrument);
+  test(profile_optimize);
+
+  suite("lines");
+  test(lines_lookup);
+  test(lines_codegen);
+
+  suite("closure");
+  test(closure_capture);
+  test(closure_cells);
+  test(closure_values);
+
+  suite("gc");
+  test(gc_sweep);
+  test(gc_scavenge);
+  test(gc_barrier);
+  test(gc_incremental);
+  test(gc_pauses);
+  test(gc_steps);
+  test(gc_concurrent);
+  test(gc_objects);
+  test(gc_records);
+  test(gc_arrays);
+  test(gc_lists);
+  test(gc_collect);
+
+  suite("escape");
+  test(escape_local);
+  test(escape_escaping);
+
+  suite("cse");
+  test(cse_binary);
+  test(cse_slot);
+  test(cse_branches);
+  test(cse_codegen);
+
+  suite("infer");
+  test(infer_literals);
+  test(infer_locals);
+  test(infer_loops);
+  test(infer_returns);
 
   printf("\n");
   printf("  \e[90mcompleted in \e[32m%.5fs\e[0m\n", (float) (clock() - start) / CLOCKS_PER_SEC);